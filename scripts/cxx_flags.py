@@ -0,0 +1,8 @@
+# C++-only flags for every env (extra_scripts in platformio.ini).
+# build_flags also reach the core's C sources, where GCC warns that these
+# are valid for C++ only.
+Import("env")
+
+# C++20 for the coroutines in src/coro.h; GCC 10 needs -fcoroutines on top.
+# Runs after the platform's builder, so this -std comes after the core's.
+env.Append(CXXFLAGS=["-std=gnu++20", "-fcoroutines"])
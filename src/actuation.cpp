@@ -0,0 +1,123 @@
+#include "actuation.h"
+#include "config.h"
+#include <bluefruit.h>
+#include <nrf_gpio.h>
+
+struct ActHw {
+  uint8_t pin;
+  NRF_TIMER_Type* timer;
+  IRQn_Type irq;
+};
+
+// Not const: keeps the table in RAM next to the hot path instead of in flash
+static ActHw hw[ACT_CHANNELS] = {
+  { LOCK_PIN,   NRF_TIMER3, TIMER3_IRQn },
+  { UNLOCK_PIN, NRF_TIMER4, TIMER4_IRQn },
+};
+
+// One flag per channel so the timer ISR never read-modify-writes shared bits
+static volatile bool busy[ACT_CHANNELS];
+static volatile bool released[ACT_CHANNELS];
+static bool led_enabled = true;
+
+void actuationBegin() {
+  for (uint8_t ch = 0; ch < ACT_CHANNELS; ch++) {
+    const ActHw& h = hw[ch];
+    uint8_t gpiote_ch = ACT_GPIOTE_CH_BASE + ch;
+    uint8_t ppi_ch = ACT_PPI_CH_BASE + ch;
+
+    // Low before output, so there is never a glitch on the optocoupler
+    digitalWrite(h.pin, LOW);
+    pinMode(h.pin, OUTPUT);
+
+    NRF_GPIOTE->CONFIG[gpiote_ch] =
+        (GPIOTE_CONFIG_MODE_Task << GPIOTE_CONFIG_MODE_Pos) |
+        (h.pin << GPIOTE_CONFIG_PSEL_Pos) |
+        (GPIOTE_CONFIG_POLARITY_None << GPIOTE_CONFIG_POLARITY_Pos) |
+        (GPIOTE_CONFIG_OUTINIT_Low << GPIOTE_CONFIG_OUTINIT_Pos);
+
+    // 1MHz one-shot: compare clears and stops the timer
+    h.timer->TASKS_STOP = 1;
+    h.timer->MODE = TIMER_MODE_MODE_Timer;
+    h.timer->BITMODE = TIMER_BITMODE_BITMODE_32Bit;
+    h.timer->PRESCALER = 4;
+    h.timer->CC[0] = PULSE_MS * 1000UL;
+    h.timer->SHORTS = TIMER_SHORTS_COMPARE0_CLEAR_Msk | TIMER_SHORTS_COMPARE0_STOP_Msk;
+    h.timer->INTENSET = TIMER_INTENSET_COMPARE0_Msk;
+    NVIC_SetPriority(h.irq, ACT_IRQ_PRIO);
+    NVIC_EnableIRQ(h.irq);
+
+    // Pulse end: TIMER COMPARE0 -> PPI -> GPIOTE CLR
+    sd_ppi_channel_assign(ppi_ch, &h.timer->EVENTS_COMPARE[0], &NRF_GPIOTE->TASKS_CLR[gpiote_ch]);
+    sd_ppi_channel_enable_set(1UL << ppi_ch);
+  }
+}
+
+// Called from the BLE task, the dongle SWI and pin interrupts alike: the
+// check and the claim can't be split by another caller
+HOT_PATH bool actuationFire(ActChannel ch) {
+  UBaseType_t saved = taskENTER_CRITICAL_FROM_ISR();   // task or interrupt
+  bool taken = busy[ch];
+  busy[ch] = true;
+  taskEXIT_CRITICAL_FROM_ISR(saved);
+  if (taken) return false;
+
+  const ActHw& h = hw[ch];
+  if (led_enabled) nrf_gpio_pin_set(STATUS_LED);
+  h.timer->TASKS_CLEAR = 1;
+  NRF_GPIOTE->TASKS_SET[ACT_GPIOTE_CH_BASE + ch] = 1;
+  h.timer->TASKS_START = 1;
+  return true;
+}
+
+// Inlined into the RAM-resident handlers below; nothing here calls into flash
+static inline __attribute__((always_inline)) void pulseEnded(uint8_t ch) {
+  hw[ch].timer->EVENTS_COMPARE[0] = 0;
+  (void)hw[ch].timer->EVENTS_COMPARE[0];  // make sure the clear lands before return
+
+  busy[ch] = false;
+  released[ch] = true;
+  bool any = false;
+  for (uint8_t i = 0; i < ACT_CHANNELS; i++) any = any || busy[i];
+  if (!any) nrf_gpio_pin_clear(STATUS_LED);
+}
+
+extern "C" HOT_PATH void TIMER3_IRQHandler(void) { pulseEnded(ACT_LOCK); }
+extern "C" HOT_PATH void TIMER4_IRQHandler(void) { pulseEnded(ACT_UNLOCK); }
+
+uint8_t actuationPoll() {
+  uint8_t mask = 0;
+  for (uint8_t ch = 0; ch < ACT_CHANNELS; ch++) {
+    if (released[ch]) {
+      released[ch] = false;
+      mask |= 1 << ch;
+    }
+  }
+  return mask;
+}
+
+void actuationSetLed(bool on) {
+  led_enabled = on;
+}
+
+bool actuationBusy() {
+  for (uint8_t ch = 0; ch < ACT_CHANNELS; ch++) {
+    if (busy[ch]) return true;
+  }
+  return false;
+}
+
+void actuationParkAll() {
+  for (uint8_t ch = 0; ch < ACT_CHANNELS; ch++) {
+    busy[ch] = true;                        // actuationFire() refuses from now on
+    hw[ch].timer->TASKS_STOP = 1;
+    NRF_GPIOTE->TASKS_CLR[ACT_GPIOTE_CH_BASE + ch] = 1;
+  }
+  led_enabled = false;
+  nrf_gpio_pin_clear(STATUS_LED);
+}
+
+// The LED comes back with the governor's next level, if that has it
+void actuationResume() {
+  for (uint8_t ch = 0; ch < ACT_CHANNELS; ch++) busy[ch] = false;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <Arduino.h>
+#include "perf.h"
+
+// Hardware-timed button pulses. Arming sets the pin through GPIOTE and starts
+// a TIMER; the TIMER's compare event ends the pulse through PPI, so pulse
+// width doesn't depend on what the CPU is doing.
+enum ActChannel : uint8_t {
+  ACT_LOCK = 0,
+  ACT_UNLOCK = 1,
+  ACT_CHANNELS
+};
+
+#define ACT_GPIOTE_CH_BASE 6    // GPIOTE channels 6-7 (attachInterrupt() allocates from 0)
+#define ACT_PPI_CH_BASE    10   // PPI channels 10-11 (0-16 are free under S140)
+#define ACT_IRQ_PRIO       3    // application priority, above the BLE task
+
+void actuationBegin();                      // after Bluefruit.begin() (uses sd_ppi_*)
+HOT_PATH bool actuationFire(ActChannel ch); // false if that channel is already pressed
+uint8_t actuationPoll();                    // bitmask of channels released since last call
+bool actuationBusy();
+void actuationSetLed(bool on);              // status LED during presses (energy governor)
+void actuationParkAll();                    // power failure: outputs and LED low, no more presses
+void actuationResume();                     // ... until this, once the warning is handled
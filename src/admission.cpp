@@ -0,0 +1,176 @@
+#include "admission.h"
+#include "config_store.h"
+#include "journal.h"
+#include <bluefruit.h>
+#include <InternalFileSystem.h>
+#include <utility/bonding.h>
+
+using namespace Adafruit_LittleFS_Namespace;
+
+struct AdmitState {
+  bool       active;
+  bool       paired_now;    // pairing ran on this link (vs. reusing a bond)
+  bool       evicting;
+  AdmitClass cls;
+  uint32_t   connected_ms;
+};
+
+struct AdmitStats {
+  uint32_t evict_deadline;      // never secured in time
+  uint32_t evict_refused;       // tried to pair with the window closed
+  uint32_t evict_preempted;     // made room for a bonded phone
+  uint32_t evict_unauth;        // secured without a PIN
+  uint32_t slot_ms[ADMIT_CLASSES];
+  uint32_t slot_evicted_ms;     // included in slot_ms[ADMIT_PENDING] as well
+};
+
+static AdmitState links[ADMIT_CONN_HANDLES];
+static AdmitStats stats;
+static uint32_t window_opened_ms = 0;
+static bool have_bonds = false;
+
+static const char* const class_names[ADMIT_CLASSES] = { "unauth", "bonded", "new" };
+
+static bool bondsStored() {
+  File dir(BOND_DIR_PRPH, FILE_O_READ, InternalFS);
+  if (!dir) return false;
+  File f = dir.openNextFile(FILE_O_READ);
+  bool any = (bool) f;
+  if (f) f.close();
+  dir.close();
+  return any;
+}
+
+static void evict(uint16_t conn_handle, uint32_t& counter, const char* why) {
+  AdmitState& link = links[conn_handle];
+  if (link.evicting) return;
+  link.evicting = true;
+  counter++;
+  journalLog(JR_EVICT, conn_handle);
+  Serial.print("Evicting connection ");
+  Serial.print(conn_handle);
+  Serial.print(": ");
+  Serial.println(why);
+  Bluefruit.disconnect(conn_handle);
+}
+
+void admissionBegin() {
+  if (config.admit_deadline_s == 0) config.admit_deadline_s = ADMIT_DEADLINE_DEFAULT;
+  have_bonds = bondsStored();
+  window_opened_ms = millis();
+}
+
+void admissionOpenPairingWindow() {
+  window_opened_ms = millis();
+  Serial.println("Pairing window open");
+}
+
+bool admissionPairingWindowOpen() {
+  return !have_bonds || millis() - window_opened_ms < ADMIT_PAIRING_WINDOW_S * 1000UL;
+}
+
+void admissionConnect(uint16_t conn_handle) {
+  if (conn_handle >= ADMIT_CONN_HANDLES) return;
+  AdmitState& link = links[conn_handle];
+  link = AdmitState();
+  link.active = true;
+  link.cls = ADMIT_PENDING;
+  link.connected_ms = millis();
+  // adv_policy.cpp keeps advertising while the other slot is free
+}
+
+bool admissionAllowPairing(uint16_t conn_handle) {
+  if (conn_handle >= ADMIT_CONN_HANDLES) return false;
+  if (!admissionPairingWindowOpen()) return false;
+  links[conn_handle].paired_now = true;
+  return true;
+}
+
+void admissionRefusePairing(uint16_t conn_handle) {
+  if (conn_handle >= ADMIT_CONN_HANDLES || !links[conn_handle].active) return;
+  evict(conn_handle, stats.evict_refused, "pairing window closed");
+}
+
+// Just Works (no passkey callback, sec_mode.lv 2) still leaves a bond
+// behind; it must neither hold a slot nor fill the bond storage
+static void refuseUnauthenticated(uint16_t conn_handle) {
+  BLEConnection* conn = Bluefruit.Connection(conn_handle);
+  bond_keys_t keys;
+  if (conn && conn->loadKeys(&keys)) bond_remove_key(BLE_GAP_ROLE_PERIPH, &keys.peer_id.id_addr_info);
+  evict(conn_handle, stats.evict_unauth, "secured without a PIN");
+}
+
+void admissionSecured(uint16_t conn_handle, uint8_t sec_level) {
+  if (conn_handle >= ADMIT_CONN_HANDLES) return;
+  AdmitState& link = links[conn_handle];
+  if (!link.active) return;         // gone before loop() got to it
+  if (sec_level < ADMIT_MIN_SEC_LEVEL) {
+    refuseUnauthenticated(conn_handle);     // stays ADMIT_PENDING
+    return;
+  }
+  link.cls = link.paired_now ? ADMIT_NEW_PAIR : ADMIT_BONDED;
+  journalLog(JR_SECURED, conn_handle, link.cls);
+
+  if (link.paired_now) {
+    have_bonds = true;
+    return;
+  }
+
+  // The owner is here: drop anyone still waiting to authenticate
+  for (uint16_t h = 0; h < ADMIT_CONN_HANDLES; h++) {
+    if (h != conn_handle && links[h].active && links[h].cls == ADMIT_PENDING) {
+      evict(h, stats.evict_preempted, "preempted by bonded phone");
+    }
+  }
+}
+
+bool admissionOwnerConnected() {
+  for (uint16_t h = 0; h < ADMIT_CONN_HANDLES; h++) {
+    if (links[h].active && !links[h].evicting && links[h].cls != ADMIT_PENDING) return true;
+  }
+  return false;
+}
+
+void admissionDisconnect(uint16_t conn_handle) {
+  if (conn_handle >= ADMIT_CONN_HANDLES) return;
+  AdmitState& link = links[conn_handle];
+  if (!link.active) return;
+
+  uint32_t held_ms = millis() - link.connected_ms;
+  stats.slot_ms[link.cls] += held_ms;
+  if (link.evicting) stats.slot_evicted_ms += held_ms;
+  link.active = false;
+}
+
+void admissionPoll() {
+  uint32_t now = millis();
+  for (uint16_t h = 0; h < ADMIT_CONN_HANDLES; h++) {
+    AdmitState& link = links[h];
+    if (!link.active || link.cls != ADMIT_PENDING) continue;
+    if (now - link.connected_ms >= config.admit_deadline_s * 1000UL) {
+      evict(h, stats.evict_deadline, "not secured before deadline");
+    }
+  }
+}
+
+void admissionPrintStats(Print& out) {
+  out.print("evict deadline=");  out.print(stats.evict_deadline);
+  out.print(" refused=");        out.print(stats.evict_refused);
+  out.print(" preempted=");      out.print(stats.evict_preempted);
+  out.print(" no PIN=");         out.println(stats.evict_unauth);
+
+  // Slot time of links that have ended, by how they ended up
+  out.print("slot s");
+  for (uint8_t i = 0; i < ADMIT_CLASSES; i++) {
+    out.print(" ");
+    out.print(class_names[i]);
+    out.print("=");
+    out.print(stats.slot_ms[i] / 1000);
+  }
+  out.print(" (evicted=");
+  out.print(stats.slot_evicted_ms / 1000);
+  out.println(")");
+
+  out.print("pairing window ");
+  out.println(admissionPairingWindowOpen() ? "open" : "closed");
+}
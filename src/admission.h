@@ -0,0 +1,39 @@
+#pragma once
+
+#include <Arduino.h>
+#include "hid_remote.h"
+
+// Connection admission. Every link gets config.admit_deadline_s to reach
+// secured_callback() as a bonded phone, or as a new pairing made while the
+// pairing window is open, both at ADMIT_MIN_SEC_LEVEL. Anything else is
+// disconnected so it can't sit on a connection slot; a link encrypted
+// without a PIN (Just Works) is dropped and its bond removed. A second
+// peripheral slot lets a bonded phone get in past a stranger, and a bonded
+// phone that secures preempts unadmitted links.
+#define ADMIT_MAX_PRPH          2
+#define ADMIT_CONN_HANDLES      (ADMIT_MAX_PRPH + HID_MAX_CENTRAL)   // handles are numbered across both roles
+#define ADMIT_PAIRING_WINDOW_S  120   // after boot or 'pair'; always open with no bonds
+#define ADMIT_DEADLINE_DEFAULT  30    // seconds - long enough to type a PIN
+#define ADMIT_MIN_SEC_LEVEL     3     // sec_mode.lv: encrypted with MITM (PIN)
+#define BOND_DIR_PRPH           "/adafruit/bond_prph"   // where Bluefruit keeps peripheral bonds
+#define BOND_DIR_CNTR           "/adafruit/bond_cntr"   // ... and central ones (HID remote)
+
+enum AdmitClass : uint8_t {
+  ADMIT_PENDING,      // connected, not (yet) secured
+  ADMIT_BONDED,       // secured with an existing bond
+  ADMIT_NEW_PAIR,     // paired during the pairing window
+  ADMIT_CLASSES
+};
+
+void admissionBegin();
+void admissionConnect(uint16_t conn_handle);
+bool admissionAllowPairing(uint16_t conn_handle);     // BLE task: decision only
+void admissionRefusePairing(uint16_t conn_handle);    // loop(): drops the link
+void admissionSecured(uint16_t conn_handle, uint8_t sec_level);
+void admissionDisconnect(uint16_t conn_handle);
+void admissionPoll();
+bool admissionOwnerConnected();     // a bonded or newly paired phone is linked
+
+void admissionOpenPairingWindow();
+bool admissionPairingWindowOpen();
+void admissionPrintStats(Print& out);
@@ -0,0 +1,67 @@
+#pragma once
+
+// Advertising channel mask decision. Plain C++ with <stdint.h> only, like
+// journal_records.h, so the same code builds on a host and can be fed
+// recorded survey numbers there.
+//
+// Input per survey: for each primary channel, the share of RSSI samples
+// above the busy threshold (channel_survey.cpp). A channel in use is
+// dropped when it is clearly busy and clearly worse than the best one; a
+// dropped channel comes back once it reads quiet, or after
+// ADV_CH_REPROBE_S regardless, for a trial until the next survey. The
+// least busy channel is never dropped, and without a fresh survey every
+// channel is used.
+
+#include <stdint.h>
+
+#define ADV_CHANNELS        3          // 37, 38, 39
+#define ADV_CH_ALL          0x07       // bit i: channel 37 + i advertised on
+#define ADV_CH_BAD_PCT      30         // busy share that makes a channel worth dropping...
+#define ADV_CH_MARGIN_PCT   15         // ...when it is this much busier than the best one
+#define ADV_CH_GOOD_PCT     15         // a dropped channel at or below this comes back
+#define ADV_CH_REPROBE_S    3600       // a dropped channel comes back after this anyway
+
+struct AdvChannelState {
+  uint8_t  mask;                       // ADV_CH_ALL at start
+  uint32_t dropped_s[ADV_CHANNELS];    // when each was dropped
+};
+
+static inline void advChannelInit(AdvChannelState* st) {
+  st->mask = ADV_CH_ALL;
+  for (uint8_t i = 0; i < ADV_CHANNELS; i++) st->dropped_s[i] = 0;
+}
+
+// Returns the new mask (also in st->mask): never 0, always holds the least
+// busy channel. fresh = false (no recent survey) means all channels.
+static inline uint8_t advChannelDecide(AdvChannelState* st, const uint8_t busy_pct[ADV_CHANNELS],
+                                       bool fresh, uint32_t now_s) {
+  if (!fresh) {
+    st->mask = ADV_CH_ALL;
+    return st->mask;
+  }
+
+  uint8_t best = 0;
+  for (uint8_t i = 1; i < ADV_CHANNELS; i++) {
+    if (busy_pct[i] < busy_pct[best]) best = i;
+  }
+
+  uint8_t mask = 0;
+  for (uint8_t i = 0; i < ADV_CHANNELS; i++) {
+    uint8_t bit = 1 << i;
+    bool bad = busy_pct[i] >= ADV_CH_BAD_PCT && busy_pct[i] >= busy_pct[best] + ADV_CH_MARGIN_PCT;
+
+    if (i == best) {
+      mask |= bit;
+    }
+    else if (st->mask & bit) {
+      if (bad) st->dropped_s[i] = now_s;
+      else mask |= bit;
+    }
+    else if (busy_pct[i] <= ADV_CH_GOOD_PCT || now_s - st->dropped_s[i] >= ADV_CH_REPROBE_S) {
+      mask |= bit;
+    }
+  }
+
+  st->mask = mask;
+  return mask;
+}
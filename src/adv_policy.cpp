@@ -0,0 +1,242 @@
+/*
+ * Connection-aware advertising
+ *
+ * The SoftDevice stops advertising when a phone connects; Bluefruit's
+ * restartOnDisconnect() and admission.cpp used to bring it straight back,
+ * so the board advertised at the fast tier next to a live link (2-3 mA).
+ * Here loop() decides from the connection state what should be on air and
+ * restarts advertising only when that changes.
+ *
+ * Advertising events per hour are counted per state from the interval in
+ * use (fast tier for the first ADV_FAST_TIMEOUT_S, then slow). The
+ * SoftDevice adds 0-10 ms of random delay to each event, so these are
+ * nominal counts, slightly high.
+ *
+ * Channel mask (channel_survey.cpp): Bluefruit always configures all three
+ * channels. With a reduced mask, loop() stops the advertising set right
+ * after Bluefruit started it and configures it again with the mask, the
+ * same data buffers and the time left in the fast tier. Bluefruit's own
+ * fast->slow restart brings all channels back, so the mask is applied
+ * again for the slow tier. Discovery: connects out of connectable
+ * advertising, and how long they took from the start, counted apart for
+ * all channels and a reduced mask.
+ */
+
+#include "adv_policy.h"
+#include "admission.h"
+#include "config_store.h"
+#include "hid_remote.h"
+#include <bluefruit.h>
+
+enum AdvMode : uint8_t { ADV_OFF, ADV_CONNECTABLE, ADV_PRESENCE };
+
+struct AdvStats {
+  uint32_t state_ms[ADV_STATES];
+  uint64_t milli_events[ADV_STATES];    // 1/1000 advertising events
+  uint64_t milli_packets[ADV_CHANNELS]; // ... per channel in the mask (modeled, not counted)
+  uint64_t milli_connectable[2];        // connectable events, [all channels, reduced mask]
+  uint32_t discoveries[2];              // connects out of those
+  uint32_t discovery_ms[2];             // advertising start -> connect, summed
+  uint32_t restarts;
+  uint32_t masked;                      // masked restarts
+  uint32_t mask_failed;
+};
+
+static AdvStats stats;
+static AdvMode mode = ADV_OFF;
+static AdvState state = ADV_STATE_IDLE;
+static uint16_t interval_fast = 32;
+static uint16_t interval_slow = 244;
+static bool intervals_changed = false;
+static uint32_t started_ms = 0;
+static uint32_t accounted_ms = 0;
+static uint8_t channel_mask = ADV_CH_ALL;   // wanted
+static uint8_t applied_mask = ADV_CH_ALL;   // on air
+static bool masked_fast = false;            // applied in the fast tier
+static bool mask_refused = false;           // SoftDevice said no; not again until the mask changes
+static uint8_t links_seen = 0;
+
+static const char* const state_names[ADV_STATES] = { "idle", "open", "closed" };
+
+static AdvState currentState() {
+  uint8_t links = Bluefruit.connected() - hidRemoteLinks();
+  if (links == 0) return ADV_STATE_IDLE;
+  if (links >= ADMIT_MAX_PRPH) return ADV_STATE_CLOSED;
+  if (admissionOwnerConnected() && !admissionPairingWindowOpen()) return ADV_STATE_CLOSED;
+  return ADV_STATE_OPEN;
+}
+
+static uint16_t currentInterval(uint32_t now) {
+  if (mode == ADV_PRESENCE) return ADV_PRESENCE_INTERVAL;
+  return now - started_ms < ADV_FAST_TIMEOUT_S * 1000UL ? interval_fast : interval_slow;
+}
+
+static void account(uint32_t now) {
+  uint32_t dt = now - accounted_ms;
+  accounted_ms = now;
+  stats.state_ms[state] += dt;
+  if (mode != ADV_OFF && Bluefruit.Advertising.isRunning()) {
+    uint64_t milli = (uint64_t) dt * 1600 / currentInterval(now);
+    stats.milli_events[state] += milli;
+    for (uint8_t ch = 0; ch < ADV_CHANNELS; ch++) {
+      if (applied_mask & (1 << ch)) stats.milli_packets[ch] += milli;
+    }
+    if (mode == ADV_CONNECTABLE) stats.milli_connectable[applied_mask != ADV_CH_ALL] += milli;
+  }
+}
+
+static void apply(AdvMode next) {
+  Bluefruit.Advertising.stop();
+  mode = next;
+  if (mode == ADV_OFF) return;
+
+  if (mode == ADV_PRESENCE) {
+    Bluefruit.Advertising.setType(BLE_GAP_ADV_TYPE_NONCONNECTABLE_NONSCANNABLE_UNDIRECTED);
+    Bluefruit.Advertising.setInterval(ADV_PRESENCE_INTERVAL, ADV_PRESENCE_INTERVAL);
+  }
+  else {
+    Bluefruit.Advertising.setType(BLE_GAP_ADV_TYPE_CONNECTABLE_SCANNABLE_UNDIRECTED);
+    Bluefruit.Advertising.setInterval(interval_fast, interval_slow);
+  }
+  Bluefruit.Advertising.start(0);
+  started_ms = millis();
+  applied_mask = ADV_CH_ALL;
+  stats.restarts++;
+}
+
+static void applyMask(uint32_t now) {
+  uint32_t fast_left_ms = 0;
+  if (mode == ADV_CONNECTABLE && now - started_ms < ADV_FAST_TIMEOUT_S * 1000UL) {
+    fast_left_ms = ADV_FAST_TIMEOUT_S * 1000UL - (now - started_ms);
+  }
+
+  ble_gap_adv_params_t params;
+  memset(&params, 0, sizeof(params));
+  params.properties.type = mode == ADV_PRESENCE ? BLE_GAP_ADV_TYPE_NONCONNECTABLE_NONSCANNABLE_UNDIRECTED
+                                                : BLE_GAP_ADV_TYPE_CONNECTABLE_SCANNABLE_UNDIRECTED;
+  params.interval = currentInterval(now);
+  params.duration = fast_left_ms / 10;       // 10 ms units, 0 = until stopped
+  params.filter_policy = BLE_GAP_ADV_FP_ANY;
+  params.primary_phy = BLE_GAP_PHY_1MBPS;
+  for (uint8_t ch = 0; ch < ADV_CHANNELS; ch++) {
+    if (!(channel_mask & (1 << ch))) params.channel_mask[4] |= 1 << (5 + ch);    // bit 37 + ch
+  }
+
+  // Bluefruit's buffers: the set stays configured with them anyway
+  ble_gap_adv_data_t data;
+  memset(&data, 0, sizeof(data));
+  data.adv_data.p_data = Bluefruit.Advertising.getData();
+  data.adv_data.len = Bluefruit.Advertising.count();
+  if (mode == ADV_CONNECTABLE) {
+    data.scan_rsp_data.p_data = Bluefruit.ScanResponse.getData();
+    data.scan_rsp_data.len = Bluefruit.ScanResponse.count();
+  }
+
+  uint8_t handle = ADV_SET_HANDLE;
+  sd_ble_gap_adv_stop(handle);
+  if (sd_ble_gap_adv_set_configure(&handle, &data, &params) == NRF_SUCCESS &&
+      sd_ble_gap_adv_start(handle, CONN_CFG_PERIPHERAL) == NRF_SUCCESS) {
+    applied_mask = channel_mask;
+    masked_fast = fast_left_ms != 0;
+    stats.masked++;
+    return;
+  }
+
+  // Back to Bluefruit's all-channel advertising
+  stats.mask_failed++;
+  mask_refused = true;
+  apply(mode);
+}
+
+void advPolicyBegin() {
+  Bluefruit.Advertising.restartOnDisconnect(false);
+  Bluefruit.Advertising.setFastTimeout(ADV_FAST_TIMEOUT_S);
+  accounted_ms = millis();
+  apply(ADV_CONNECTABLE);
+}
+
+void advPolicySetInterval(uint16_t fast, uint16_t slow) {
+  interval_fast = fast;
+  interval_slow = slow;
+  intervals_changed = true;
+}
+
+void advPolicySetChannelMask(uint8_t mask) {
+  channel_mask = mask ? mask : ADV_CH_ALL;
+  mask_refused = false;
+}
+
+void advPolicyPoll() {
+  uint32_t now = millis();
+  account(now);
+  state = currentState();
+
+  // A new link while connectable advertising was on air: someone found us
+  uint8_t links = Bluefruit.connected() - hidRemoteLinks();
+  if (links > links_seen && mode == ADV_CONNECTABLE) {
+    bool reduced = applied_mask != ADV_CH_ALL;
+    stats.discoveries[reduced]++;
+    stats.discovery_ms[reduced] += now - started_ms;
+  }
+  links_seen = links;
+
+  AdvMode want = ADV_CONNECTABLE;
+  if (state == ADV_STATE_CLOSED) want = config.presence_adv ? ADV_PRESENCE : ADV_OFF;
+
+  // A connect stops advertising inside the SoftDevice, so "running" is
+  // part of the check, not just the mode we last asked for
+  bool stopped = want != ADV_OFF && !Bluefruit.Advertising.isRunning();
+  bool retier = intervals_changed && want == ADV_CONNECTABLE;
+  if (want != mode || stopped || retier) {
+    intervals_changed = false;
+    apply(want);
+  }
+
+  // Mask: after every Bluefruit (re)start, and once more for the slow tier
+  if (mode == ADV_OFF || mask_refused || !Bluefruit.Advertising.isRunning()) return;
+  bool tier_over = masked_fast && now - started_ms >= ADV_FAST_TIMEOUT_S * 1000UL;
+  if (applied_mask != channel_mask || (channel_mask != ADV_CH_ALL && tier_over)) applyMask(now);
+}
+
+void advPolicyPrintStats(Print& out) {
+  out.print("adv/h");
+  for (uint8_t i = 0; i < ADV_STATES; i++) {
+    out.print(" ");
+    out.print(state_names[i]);
+    out.print("=");
+    uint32_t ms = stats.state_ms[i];
+    out.print(ms ? (uint32_t) (stats.milli_events[i] * 3600 / ms) : 0);
+  }
+  out.print(" restarts=");
+  out.println(stats.restarts);
+
+  // Packets per channel per hour of advertising, modeled from the interval
+  // and mask (the SoftDevice doesn't count them), and discovery by mask
+  uint32_t adv_ms = 0;
+  for (uint8_t i = 0; i < ADV_STATES; i++) adv_ms += stats.state_ms[i];
+  out.print("adv ch/h modeled");
+  for (uint8_t ch = 0; ch < ADV_CHANNELS; ch++) {
+    out.print(" ");
+    out.print(37 + ch);
+    out.print("=");
+    out.print(adv_ms ? (uint32_t) (stats.milli_packets[ch] * 3600 / adv_ms) : 0);
+    if (!(applied_mask & (1 << ch))) out.print("(off)");
+  }
+  out.print(" masked=");
+  out.print(stats.masked);
+  out.print(" refused=");
+  out.println(stats.mask_failed);
+
+  static const char* const mask_names[2] = { "all", "reduced" };
+  for (uint8_t i = 0; i < 2; i++) {
+    out.print("discovery ");
+    out.print(mask_names[i]);
+    out.print(" connects=");
+    out.print(stats.discoveries[i]);
+    out.print(" per 1k adv=");
+    uint32_t events = stats.milli_connectable[i] / 1000;
+    out.print(events ? stats.discoveries[i] * 1000.0f / events : 0.0f, 2);
+    out.print(" avg ms=");
+    out.println(stats.discoveries[i] ? stats.discovery_ms[i] / stats.discoveries[i] : 0);
+  }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <Arduino.h>
+#include "adv_channels.h"
+
+// Advertising follows connection state instead of running all the time:
+//   no links                  -> connectable, governor tier intervals
+//   slot free, no owner       -> connectable, so the bonded phone can get in
+//   slots full / owner linked -> off, or a slow non-connectable presence
+//                                beacon if config.presence_adv is set
+// An open pairing window keeps connectable advertising on next to the owner.
+#define ADV_PRESENCE_INTERVAL   6400   // 4 s (units of 0.625ms)
+#define ADV_FAST_TIMEOUT_S      30
+#define ADV_SET_HANDLE          0      // the one advertising set S140 6.1 has, configured by Bluefruit
+
+enum AdvState : uint8_t {
+  ADV_STATE_IDLE,       // no links
+  ADV_STATE_OPEN,       // linked, still admitting
+  ADV_STATE_CLOSED,     // full, or owner connected
+  ADV_STATES
+};
+
+void advPolicyBegin();                                    // end of setupBLE()
+void advPolicySetInterval(uint16_t fast, uint16_t slow);  // energy governor
+void advPolicySetChannelMask(uint8_t mask);               // channel survey, ADV_CH_* bits
+void advPolicyPoll();
+void advPolicyPrintStats(Print& out);
@@ -0,0 +1,264 @@
+/*
+ * On-target microbenchmarks ([env:bench], replaces main.cpp)
+ *
+ * Times the primitives the firmware is built from with the DWT cycle
+ * counter and prints one JSON object per pass over USB CDC:
+ *
+ *   {"suite":"keyfob-bench","pass":"idle","f_cpu":64000000,"hot_path_in_ram":1,
+ *    "results":[{"name":"dispatch_text","n":64,"min":..,"avg":..,"max":..},...],
+ *    "radio_events":0,"flash_errors":0}
+ *
+ * Passes: "idle" (SoftDevice enabled, radio quiet), then "advertising"
+ * (connectable, 20 ms). Any byte received over CDC runs another pass,
+ * "connected" if a phone is connected and subscribed by then, which adds
+ * the notification enqueue.
+ *
+ * The actuation entry really pulses the LOCK output: run it on a board
+ * that isn't wired to a fob. The flash entries use the first page of the
+ * delta bank, which only holds data while an update is being received;
+ * the power-fail record and the state region are left alone.
+ */
+
+#include <Arduino.h>
+#include <bluefruit.h>
+#include <Adafruit_nRFCrypto.h>
+#include "nrf_cc310/include/crys_hmac.h"
+#include "config.h"
+#include "keyfob_uart.h"
+#include "commands.h"
+#include "actuation.h"
+#include "tx_queue.h"
+#include "perf.h"
+#include "radio_activity.h"
+#include "secure_store.h"
+#include "journal.h"
+#include "delta_update.h"
+
+#define BENCH_CDC_WAIT_MS   5000      // for the host to open the port
+#define BENCH_ADV_INTERVAL  32        // 20 ms, units of 0.625ms
+#define BENCH_SCRATCH_PAGE  DELTA_BANK_ADDR   // holds nothing while no update is being received
+
+KeyfobUart bleuart;
+
+static volatile bool flash_done = false;
+static volatile uint32_t flash_errors = 0;
+static bool first_result;
+
+struct BenchStat {
+  uint32_t min;
+  uint32_t max;
+  uint64_t total;
+};
+
+static void emit(const char* name, uint16_t n, const BenchStat& s) {
+  Serial.print(first_result ? "" : ",");
+  Serial.print("{\"name\":\"");  Serial.print(name);
+  Serial.print("\",\"n\":");     Serial.print(n);
+  Serial.print(",\"min\":");     Serial.print(s.min);
+  Serial.print(",\"avg\":");     Serial.print((uint32_t) (s.total / n));
+  Serial.print(",\"max\":");     Serial.print(s.max);
+  Serial.print("}");
+  first_result = false;
+}
+
+// Setup runs before each iteration, untimed
+template <typename Setup, typename Body>
+static void measure(const char* name, uint16_t n, Setup setup, Body body) {
+  BenchStat s = { UINT32_MAX, 0, 0 };
+  for (uint16_t i = 0; i < n; i++) {
+    setup(i);
+    uint32_t t0 = perfCycles();
+    body(i);
+    uint32_t cycles = perfCycles() - t0;
+    if (cycles < s.min) s.min = cycles;
+    if (cycles > s.max) s.max = cycles;
+    s.total += cycles;
+  }
+  emit(name, n, s);
+}
+
+template <typename Body>
+static void measure(const char* name, uint16_t n, Body body) {
+  measure(name, n, [](uint16_t) {}, body);
+}
+
+void soc_event_callback(uint32_t evt) {
+  if (evt == NRF_EVT_FLASH_OPERATION_SUCCESS || evt == NRF_EVT_FLASH_OPERATION_ERROR) {
+    if (evt == NRF_EVT_FLASH_OPERATION_ERROR) flash_errors = flash_errors + 1;
+    flash_done = true;
+  }
+}
+
+// sd_flash_* only queue the operation; it ends in a SoC event
+static void flashWait() {
+  while (!flash_done) yield();
+}
+
+void ble_event_callback(ble_evt_t* evt) {
+  txQueueEvent(evt);
+}
+
+static void benchParse() {
+  static const char line[] = "  !B11;\r\n";
+  static char buf[sizeof(line)];
+  measure("parse_trim", 64,
+          [](uint16_t) { memcpy(buf, line, sizeof(line)); },
+          [](uint16_t) { int len = sizeof(line) - 1; commandTrim(buf, &len); });
+
+  // Dispatch without pressing: a text command and an unassigned button are
+  // the longest paths that end before actuationFire()
+  measure("dispatch_text", 64, [](uint16_t) { dispatchCommand("stats", 5); });
+  measure("dispatch_unassigned", 64, [](uint16_t) { dispatchCommand("!B41;", 5); });
+}
+
+static void benchActuation() {
+  // Arming only: GPIOTE SET + TIMER START. The pulse runs out untimed.
+  measure("actuation_arm", 4,
+          [](uint16_t) { while (actuationBusy()) { actuationPoll(); delay(1); } actuationPoll(); },
+          [](uint16_t) { actuationFire(ACT_LOCK); });
+  while (actuationBusy()) delay(1);
+  actuationPoll();
+}
+
+static void benchNotify() {
+  static uint16_t conn;
+  conn = Bluefruit.connHandle();
+  if (conn == BLE_CONN_HANDLE_INVALID || !bleuart.notifyEnabled(conn)) return;
+
+  // Copy into the ring and the first sd_ble_gatts_hvx(); waits for it to
+  // drain in between
+  static const uint8_t line[TXQ_ENTRY_MAX] = "bench 0123456789abc";
+  measure("notify_enqueue", 8,
+          [](uint16_t) { while (txQueueDepth(conn)) delay(5); },
+          [](uint16_t) { txQueueSend(conn, line, sizeof(line), TXQ_LOW); });
+
+  // Press acknowledgement: runtime text vs. the precomputed frame
+  measure("ack_println", 8,
+          [](uint16_t) { while (txQueueDepth(conn)) delay(5); },
+          [](uint16_t) { txQueuePrintln("Unlocking..."); });
+  measure("ack_frame", 8,
+          [](uint16_t) { while (txQueueDepth(conn)) delay(5); },
+          [](uint16_t i) { commandAck(ACK_UNLOCKING, i); });
+}
+
+static void benchFlash() {
+  static uint32_t words[64];        // 256 bytes
+  for (uint8_t i = 0; i < 64; i++) words[i] = 0xA5A50000 | i;
+
+  // Queue to completion, radio timeslots included
+  measure("flash_erase_page", 2,
+          [](uint16_t) { flash_done = false; },
+          [](uint16_t) { if (sd_flash_page_erase(BENCH_SCRATCH_PAGE / 4096) == NRF_SUCCESS) flashWait(); });
+  measure("flash_write_256", 8,
+          [](uint16_t) { flash_done = false; },
+          [](uint16_t i) {
+            uint32_t* dst = (uint32_t*) (BENCH_SCRATCH_PAGE + i * sizeof(words));
+            if (sd_flash_write(dst, words, 64) == NRF_SUCCESS) flashWait();
+          });
+}
+
+static void benchSaadc() {
+#ifdef NRF52840_XXAA
+  analogReference(AR_DEFAULT);
+  analogReadResolution(12);
+  measure("saadc_vddh", 16, [](uint16_t) { analogReadVDDHDIV5(); });
+#endif
+}
+
+static void benchCrypto() {
+  static nrf_ecb_hal_data_t ecb;
+  measure("ecb_block", 32, [](uint16_t) { sd_ecb_block_encrypt(&ecb); });
+
+  static uint8_t blob[JOURNAL_BLOCK_BYTES];
+  measure("ccm_seal_record", 16, [](uint16_t) { secureSeal(SEAL_JOURNAL, blob, sizeof(JournalRecord)); });
+  measure("ccm_seal_block", 16,
+          [](uint16_t) { secureSeal(SEAL_JOURNAL, blob, JOURNAL_BATCH * sizeof(JournalRecord)); });
+
+  static uint8_t key[32];
+  static uint8_t msg[64];
+  static CRYS_HASH_Result_t mac;
+  measure("hmac_sha256_64", 16, [](uint16_t) {
+    nRFCrypto.begin();
+    CRYS_HMAC(CRYS_HASH_SHA256_mode, key, sizeof(key), msg, sizeof(msg), mac);
+    nRFCrypto.end();
+  });
+
+  static uint8_t copy[JOURNAL_BATCH * sizeof(JournalRecord)];
+  measure("memcpy_block", 16, [](uint16_t) { memcpy(copy, blob, sizeof(copy)); });
+}
+
+static void runPass(const char* pass) {
+  uint32_t radio_events = radioEventCount();
+  flash_errors = 0;
+
+  Serial.print("{\"suite\":\"keyfob-bench\",\"pass\":\"");
+  Serial.print(pass);
+  Serial.print("\",\"f_cpu\":");
+  Serial.print(F_CPU);
+  Serial.print(",\"hot_path_in_ram\":");
+  Serial.print(HOT_PATH_IN_RAM);
+  Serial.print(",\"results\":[");
+  first_result = true;
+
+  benchParse();
+  benchActuation();
+  benchNotify();
+  benchFlash();
+  benchSaadc();
+  benchCrypto();
+
+  Serial.print("],\"radio_events\":");
+  Serial.print(radioEventCount() - radio_events);
+  Serial.print(",\"flash_errors\":");
+  Serial.print(flash_errors);
+  Serial.println("}");
+}
+
+void setup() {
+  #ifdef NRF_POWER_DCDC_ENABLED
+    NRF_POWER->DCDCEN = 1;
+  #endif
+  perfBegin();
+
+  pinMode(STATUS_LED, OUTPUT);
+  digitalWrite(STATUS_LED, LOW);
+  digitalWrite(LOCK_PIN, LOW);
+  digitalWrite(UNLOCK_PIN, LOW);
+  pinMode(LOCK_PIN, OUTPUT);
+  pinMode(UNLOCK_PIN, OUTPUT);
+
+  Serial.begin(115200);
+  while (!Serial && millis() < BENCH_CDC_WAIT_MS) delay(10);
+
+  // Same SoftDevice configuration as the firmware, minus security
+  txQueueBegin();
+  Bluefruit.begin(1, 0);
+  radioActivityBegin();
+  Bluefruit.setName("KeyFob-bench");
+  Bluefruit.autoConnLed(false);
+  Bluefruit.setEventCallback(ble_event_callback);
+  Bluefruit.setSocEventCallback(soc_event_callback);
+  bleuart.begin();
+  actuationBegin();
+  secureBegin();
+
+  runPass("idle");
+
+  Bluefruit.Advertising.addFlags(BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE);
+  Bluefruit.Advertising.addService(bleuart);
+  Bluefruit.Advertising.addName();
+  Bluefruit.Advertising.setInterval(BENCH_ADV_INTERVAL, BENCH_ADV_INTERVAL);
+  Bluefruit.Advertising.restartOnDisconnect(true);
+  Bluefruit.Advertising.start(0);
+  delay(100);
+
+  runPass("advertising");
+}
+
+void loop() {
+  if (Serial.available()) {
+    while (Serial.available()) Serial.read();
+    runPass(Bluefruit.connected() ? "connected" : "advertising");
+  }
+  delay(10);
+}
@@ -0,0 +1,290 @@
+/*
+ * Advertising channel survey in radio timeslots
+ *
+ * loop() runs a burst: hold the dongle link off, open a session once its
+ * own has closed, ask for one EARLIEST slot. In each slot the START signal
+ * does the whole measurement itself: per channel, fast ramp-up into RX,
+ * then an RSSI sample every SURVEY_SAMPLE_US for SURVEY_DWELL_US, then
+ * disable. The slot belongs to us, so the busy-wait costs nobody radio
+ * time; interrupts below the SoftDevice's priority wait ~3 ms, and the
+ * press pulses are timed in hardware anyway. The next slot is requested
+ * SURVEY_SPACING_US later, to catch Wi-Fi traffic at more than one moment.
+ *
+ * When the burst is done (or runs out of time), the session is closed,
+ * the dongle released, and each channel's busy share goes through
+ * advChannelDecide().
+ */
+
+#include "channel_survey.h"
+#include "adv_policy.h"
+#include "dongle_link.h"
+#include "perf.h"
+#include <bluefruit.h>
+
+#define SURVEY_EARLIEST_TIMEOUT_US 100000
+
+enum SurveyStep : uint8_t { SURVEY_IDLE, SURVEY_WAIT_DONGLE, SURVEY_RUNNING, SURVEY_CLOSING };
+
+struct ChannelCount {
+  uint32_t samples;
+  uint32_t busy;
+  uint32_t sum;             // of -dBm, for the mean
+  uint8_t  peak;            // strongest sample, -dBm
+};
+
+struct SurveyStats {
+  uint32_t bursts;
+  uint32_t failed;          // no slot, or not finished in time
+  uint32_t blocked;
+  uint32_t canceled;
+  uint32_t mask_changes;
+  uint32_t last_ok_ms;
+  uint8_t  busy_pct[ADV_CHANNELS];
+  int8_t   mean_dbm[ADV_CHANNELS];
+  int8_t   peak_dbm[ADV_CHANNELS];
+};
+
+static const uint8_t frequencies[ADV_CHANNELS] = { 2, 26, 80 };   // MHz above 2400
+
+static SurveyStep step = SURVEY_IDLE;
+static bool session_open = false;
+static volatile bool closing = false;
+static volatile bool done = false;
+static volatile uint8_t slots_left = 0;
+static uint32_t step_ms = 0;
+static uint32_t next_ms = 0;
+
+static ChannelCount counts[ADV_CHANNELS];         // written in the slot only
+static uint8_t dummy_packet[4];
+static nrf_radio_signal_callback_return_param_t signal_ret;
+static nrf_radio_request_t next_request;
+static AdvChannelState decision;
+static SurveyStats stats;
+
+static void requestEarliest() {
+  nrf_radio_request_t req;
+  req.request_type = NRF_RADIO_REQ_TYPE_EARLIEST;
+  req.params.earliest.hfclk = NRF_RADIO_HFCLK_CFG_XTAL_GUARANTEED;
+  req.params.earliest.priority = NRF_RADIO_PRIORITY_NORMAL;
+  req.params.earliest.length_us = SURVEY_SLOT_US;
+  req.params.earliest.timeout_us = SURVEY_EARLIEST_TIMEOUT_US;
+  sd_radio_request(&req);
+}
+
+static void measure() {
+  NRF_RADIO->POWER = 1;
+  NRF_RADIO->MODE = RADIO_MODE_MODE_Ble_1Mbit << RADIO_MODE_MODE_Pos;
+  NRF_RADIO->MODECNF0 = RADIO_MODECNF0_RU_Fast << RADIO_MODECNF0_RU_Pos;
+  NRF_RADIO->PCNF1 = 4 << RADIO_PCNF1_BALEN_Pos;      // MAXLEN 0: nothing lands
+  NRF_RADIO->PACKETPTR = (uint32_t) dummy_packet;
+  NRF_RADIO->SHORTS = RADIO_SHORTS_READY_START_Msk;
+  NRF_RADIO->INTENCLR = 0xFFFFFFFF;
+
+  for (uint8_t ch = 0; ch < ADV_CHANNELS; ch++) {
+    ChannelCount& c = counts[ch];
+    NRF_RADIO->FREQUENCY = frequencies[ch];
+    NRF_RADIO->EVENTS_READY = 0;
+    NRF_RADIO->TASKS_RXEN = 1;
+    while (!NRF_RADIO->EVENTS_READY) { }
+
+    uint32_t start = perfCycles();
+    uint32_t at = 0;
+    while (at < SURVEY_DWELL_US * 64) {
+      NRF_RADIO->EVENTS_RSSIEND = 0;
+      NRF_RADIO->TASKS_RSSISTART = 1;
+      while (!NRF_RADIO->EVENTS_RSSIEND) { }
+      uint8_t rssi = NRF_RADIO->RSSISAMPLE;
+
+      c.samples++;
+      c.sum += rssi;
+      if (rssi < c.peak) c.peak = rssi;
+      if (-(int16_t) rssi > SURVEY_BUSY_DBM) c.busy++;
+
+      at += SURVEY_SAMPLE_US * 64;
+      while (perfCycles() - start < at) { }
+    }
+
+    NRF_RADIO->EVENTS_DISABLED = 0;
+    NRF_RADIO->TASKS_DISABLE = 1;
+    while (!NRF_RADIO->EVENTS_DISABLED) { }
+  }
+  NRF_RADIO->SHORTS = 0;
+}
+
+static nrf_radio_signal_callback_return_param_t* radioSignal(uint8_t signal) {
+  signal_ret.callback_action = NRF_RADIO_SIGNAL_CALLBACK_ACTION_NONE;
+  if (signal != NRF_RADIO_CALLBACK_SIGNAL_TYPE_START) return &signal_ret;
+
+  if (slots_left) {
+    measure();
+    slots_left = slots_left - 1;
+  }
+  if (slots_left) {
+    next_request.request_type = NRF_RADIO_REQ_TYPE_NORMAL;
+    next_request.params.normal.hfclk = NRF_RADIO_HFCLK_CFG_XTAL_GUARANTEED;
+    next_request.params.normal.priority = NRF_RADIO_PRIORITY_NORMAL;
+    next_request.params.normal.distance_us = SURVEY_SPACING_US;
+    next_request.params.normal.length_us = SURVEY_SLOT_US;
+    signal_ret.callback_action = NRF_RADIO_SIGNAL_CALLBACK_ACTION_REQUEST_AND_END;
+    signal_ret.params.request.p_next = &next_request;
+  }
+  else {
+    done = true;
+    signal_ret.callback_action = NRF_RADIO_SIGNAL_CALLBACK_ACTION_END;
+  }
+  return &signal_ret;
+}
+
+static void decide(bool fresh) {
+  uint8_t before = decision.mask;
+  uint8_t mask = advChannelDecide(&decision, stats.busy_pct, fresh, millis() / 1000);
+  if (mask == before) return;
+
+  stats.mask_changes++;
+  advPolicySetChannelMask(mask);
+  Serial.print("Advertising channels:");
+  for (uint8_t ch = 0; ch < ADV_CHANNELS; ch++) {
+    if (!(mask & (1 << ch))) continue;
+    Serial.print(" ");
+    Serial.print(37 + ch);
+  }
+  Serial.println();
+}
+
+static void finish() {
+  bool ok = done;
+  stats.bursts++;
+  if (!ok) {
+    stats.failed++;
+    return;
+  }
+
+  stats.last_ok_ms = millis();
+  for (uint8_t ch = 0; ch < ADV_CHANNELS; ch++) {
+    const ChannelCount& c = counts[ch];
+    if (c.samples == 0) continue;
+    stats.busy_pct[ch] = c.busy * 100 / c.samples;
+    stats.mean_dbm[ch] = -(int8_t) (c.sum / c.samples);
+    stats.peak_dbm[ch] = -(int8_t) c.peak;
+  }
+  decide(true);
+}
+
+void channelSurveyBegin() {
+  advChannelInit(&decision);
+  next_ms = millis() + SURVEY_PERIOD_S * 1000UL;
+}
+
+void channelSurveyStart() {
+  if (step == SURVEY_IDLE) next_ms = millis();
+}
+
+void channelSurveyPoll() {
+  uint32_t now = millis();
+
+  switch (step) {
+    case SURVEY_IDLE:
+      // Without recent numbers, back to every channel
+      if (decision.mask != ADV_CH_ALL && now - stats.last_ok_ms > SURVEY_STALE_S * 1000UL) decide(false);
+      if ((int32_t) (now - next_ms) < 0) break;
+      next_ms = now + SURVEY_PERIOD_S * 1000UL;
+      dongleLinkHold(true);
+      step = SURVEY_WAIT_DONGLE;
+      step_ms = now;
+      // fall through
+
+    case SURVEY_WAIT_DONGLE:
+      if (!dongleLinkIdle()) {
+        if (now - step_ms > SURVEY_BURST_MS) {
+          dongleLinkHold(false);
+          stats.bursts++;
+          stats.failed++;
+          step = SURVEY_IDLE;
+        }
+        break;
+      }
+      memset(counts, 0, sizeof(counts));
+      for (uint8_t ch = 0; ch < ADV_CHANNELS; ch++) counts[ch].peak = 0xFF;
+      done = false;
+      slots_left = SURVEY_SLOTS;
+      if (sd_radio_session_open(radioSignal) != NRF_SUCCESS) {
+        dongleLinkHold(false);
+        stats.bursts++;
+        stats.failed++;
+        step = SURVEY_IDLE;
+        break;
+      }
+      session_open = true;
+      requestEarliest();
+      step = SURVEY_RUNNING;
+      step_ms = now;
+      break;
+
+    case SURVEY_RUNNING:
+      if (!done && now - step_ms < SURVEY_BURST_MS) break;
+      slots_left = 0;         // a slot still granted ends itself
+      closing = true;
+      sd_radio_session_close();
+      session_open = false;
+      step = SURVEY_CLOSING;
+      finish();
+      break;
+
+    case SURVEY_CLOSING:
+      if (closing) break;
+      dongleLinkHold(false);
+      step = SURVEY_IDLE;
+      break;
+  }
+}
+
+void channelSurveySocEvent(uint32_t evt) {
+  if (!session_open && !closing) return;
+  switch (evt) {
+    case NRF_EVT_RADIO_BLOCKED:
+      stats.blocked++;
+      if (slots_left) requestEarliest();
+      break;
+    case NRF_EVT_RADIO_CANCELED:
+      stats.canceled++;
+      if (slots_left) requestEarliest();
+      break;
+    case NRF_EVT_RADIO_SESSION_CLOSED:
+      closing = false;
+      break;
+    default:
+      break;
+  }
+}
+
+void channelSurveyPrintStats(Print& out) {
+  out.print("survey bursts=");
+  out.print(stats.bursts);
+  out.print(" failed=");
+  out.print(stats.failed);
+  out.print(" blocked=");
+  out.print(stats.blocked);
+  out.print(" canceled=");
+  out.print(stats.canceled);
+  out.print(" mask changes=");
+  out.println(stats.mask_changes);
+
+  if (!stats.last_ok_ms) {
+    out.println("survey no results yet (survey now)");
+    return;
+  }
+  for (uint8_t ch = 0; ch < ADV_CHANNELS; ch++) {
+    out.print(" ch");
+    out.print(37 + ch);
+    out.print(" busy=");
+    out.print(stats.busy_pct[ch]);
+    out.print("% mean=");
+    out.print(stats.mean_dbm[ch]);
+    out.print(" peak=");
+    out.print(stats.peak_dbm[ch]);
+    out.println(decision.mask & (1 << ch) ? "dBm on" : "dBm dropped");
+  }
+  out.print(" last ");
+  out.print((millis() - stats.last_ok_ms) / 1000);
+  out.println("s ago");
+}
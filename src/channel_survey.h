@@ -0,0 +1,30 @@
+#pragma once
+
+#include <Arduino.h>
+#include "adv_channels.h"
+
+// RF survey of the three advertising channels, in SoftDevice radio
+// timeslots: each slot tunes the RADIO to 2402, 2426 and 2480 MHz in turn
+// and samples RSSI, counting samples above SURVEY_BUSY_DBM. A burst of
+// slots every SURVEY_PERIOD_S (or on "survey now") gives each channel a
+// busy share; advChannelDecide() turns that into the advertising channel
+// mask, which adv_policy.cpp applies.
+//
+// The SoftDevice allows one timeslot session per application, so the
+// dongle link is held off for the burst (well under a second).
+#define SURVEY_PERIOD_S     600        // re-survey, and re-decide, this often
+#define SURVEY_STALE_S      1800       // no good survey this long: all channels
+#define SURVEY_SLOTS        8          // per burst
+#define SURVEY_SPACING_US   50000      // between a burst's slots
+#define SURVEY_DWELL_US     1000       // sampling per channel per slot
+#define SURVEY_SAMPLE_US    10         // between RSSI samples
+#define SURVEY_RAMP_US      40         // RADIO fast ramp-up
+#define SURVEY_SLOT_US      (ADV_CHANNELS * (SURVEY_RAMP_US + SURVEY_DWELL_US + 50) + 100)
+#define SURVEY_BURST_MS     2000       // burst not done by then: failed
+#define SURVEY_BUSY_DBM     -75        // above this a sample counts as busy
+
+void channelSurveyBegin();            // after advPolicyBegin()
+void channelSurveyPoll();             // from loop(): bursts, decisions
+void channelSurveySocEvent(uint32_t evt);
+void channelSurveyStart();            // burst now
+void channelSurveyPrintStats(Print& out);
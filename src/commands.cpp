@@ -0,0 +1,107 @@
+#include "commands.h"
+#include "tx_queue.h"
+
+struct AckFrame {
+  char    bytes[TXQ_ENTRY_MAX];
+  uint8_t len;
+  uint8_t seq_at;           // first digit of the press number
+};
+
+// text + " #000\r\n", with lengths from the literals
+#define ACK_FRAME(text) { text " #000\r\n", sizeof(text " #000\r\n") - 1, sizeof(text " #") - 1 }
+
+static constexpr AckFrame ack_frames[ACK_KINDS] = {
+  ACK_FRAME("Locking..."),
+  ACK_FRAME("Unlocking..."),
+  ACK_FRAME("Locked!"),
+  ACK_FRAME("Unlocked!"),
+};
+
+static_assert(ack_frames[ACK_UNLOCKING].len <= TXQ_ENTRY_MAX, "ack fits one queue entry");
+static_assert(ack_frames[ACK_UNLOCKED].len <= TXQ_ENTRY_MAX, "ack fits one queue entry");
+
+static uint16_t press_seq = 0;
+static uint16_t channel_seq[ACT_CHANNELS];
+
+bool commandAck(AckKind kind, uint16_t seq) {
+  const AckFrame& f = ack_frames[kind];
+  uint8_t buf[TXQ_ENTRY_MAX];
+  memcpy(buf, f.bytes, f.len);
+  for (uint8_t i = ACK_SEQ_DIGITS; i > 0; i--, seq /= 10) buf[f.seq_at + i - 1] = '0' + seq % 10;
+  return txQueueSend(BLE_CONN_HANDLE_INVALID, buf, f.len, TXQ_HIGH);
+}
+
+void commandAckReleased(ActChannel ch) {
+  commandAck(ch == ACT_LOCK ? ACK_LOCKED : ACK_UNLOCKED, channel_seq[ch]);
+}
+
+uint16_t commandSeq(ActChannel ch) {
+  return channel_seq[ch];
+}
+
+HOT_PATH CmdResult commandPress(ActChannel ch, bool ack) {
+  if (!actuationFire(ch)) return CMD_BUSY;
+  channel_seq[ch] = ++press_seq;
+  if (ack) commandAck(ch == ACT_LOCK ? ACK_LOCKING : ACK_UNLOCKING, press_seq);
+  return ch == ACT_LOCK ? CMD_LOCK : CMD_UNLOCK;
+}
+
+// The helpers below are inlined into the HOT_PATH functions so the RAM path
+// doesn't call out to strstr()/strcmp()/isspace() in flash
+static inline __attribute__((always_inline)) bool isSpace(char c) {
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline __attribute__((always_inline)) bool equals(const char* a, const char* b) {
+  while (*a && *a == *b) { a++; b++; }
+  return *a == *b;
+}
+
+static inline __attribute__((always_inline)) bool contains(const char* s, const char* word) {
+  for (; *s; s++) {
+    const char* a = s;
+    const char* b = word;
+    while (*b && *a == *b) { a++; b++; }
+    if (!*b) return true;
+  }
+  return false;
+}
+
+// Not const: string literals would be placed in flash (.rodata)
+static char kw_b1[] = "!B11";
+static char kw_b2[] = "!B21";
+static char kw_b3[] = "!B31";
+static char kw_b4[] = "!B41";
+static char kw_lock[] = "lock";
+static char kw_unlock[] = "unlock";
+static char kw_1[] = "1";
+static char kw_2[] = "2";
+
+HOT_PATH char* commandTrim(char* cmd, int* len) {
+  int n = *len;
+  while (n > 0 && isSpace(cmd[n - 1])) n--;
+  cmd[n] = 0;
+  char* p = cmd;
+  while (*p && isSpace(*p)) { p++; n--; }
+  *len = n;
+  return p;
+}
+
+HOT_PATH CmdResult dispatchCommand(const char* cmd, uint16_t len) {
+  // Button 1 = Lock
+  if (contains(cmd, kw_b1) || equals(cmd, kw_lock) || equals(cmd, kw_1)) {
+    return commandPress(ACT_LOCK);
+  }
+  // Button 2 = Unlock
+  if (contains(cmd, kw_b2) || equals(cmd, kw_unlock) || equals(cmd, kw_2)) {
+    return commandPress(ACT_UNLOCK);
+  }
+  // Buttons 3 & 4 do nothing (ignored)
+  if (contains(cmd, kw_b3) || contains(cmd, kw_b4)) {
+    return CMD_UNASSIGNED;
+  }
+  if (len > 0 && cmd[0] != '!') {
+    return CMD_OTHER;
+  }
+  return CMD_IGNORED;
+}
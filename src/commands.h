@@ -0,0 +1,30 @@
+#pragma once
+
+#include <Arduino.h>
+#include "perf.h"
+#include "actuation.h"
+
+// Command parsing and dispatch for the BLE UART RX callback. Kept out of
+// main.cpp so the bench build (bench.cpp) times the same code.
+enum CmdResult : uint8_t { CMD_LOCK, CMD_UNLOCK, CMD_BUSY, CMD_UNASSIGNED, CMD_OTHER, CMD_IGNORED };
+
+// Strips leading/trailing whitespace in place; returns the start, *len updated
+HOT_PATH char* commandTrim(char* cmd, int* len);
+// Presses right here for lock/unlock, everything else is for loop()
+HOT_PATH CmdResult dispatchCommand(const char* cmd, uint16_t len);
+// Arms the channel and numbers the press. ack=false from interrupts (the
+// notification queue takes a mutex): send commandAck() from a task later.
+// The ack goes out after the pin is armed, so it is left in flash.
+HOT_PATH CmdResult commandPress(ActChannel ch, bool ack = true);
+
+// Acknowledgements are fixed frames built at compile time ("Locking... #042"
+// + CRLF); sending one copies it, patches the press number in and queues it
+// as a single notification. The armed/released pair of a press carry the
+// same number.
+enum AckKind : uint8_t { ACK_LOCKING, ACK_UNLOCKING, ACK_LOCKED, ACK_UNLOCKED, ACK_KINDS };
+
+#define ACK_SEQ_DIGITS 3            // press number modulo 1000
+
+bool commandAck(AckKind kind, uint16_t seq);
+void commandAckReleased(ActChannel ch);     // from loop(), after actuationPoll()
+uint16_t commandSeq(ActChannel ch);         // press number of the channel's last press
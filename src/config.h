@@ -0,0 +1,16 @@
+#pragma once
+
+// Pins - raw GPIO numbers, silkscreen labels on SuperMini clones are unreliable
+#define LOCK_PIN 20     // P0.20 - controls LOCK optocoupler
+#define UNLOCK_PIN 22   // P0.22 - controls UNLOCK optocoupler
+#define STATUS_LED 15   // P0.15 - red LED
+#define WIRED_RX_PIN 43 // P1.11 - wired command port RX (3.3V logic)
+#define WIRED_TX_PIN 45 // P1.13 - wired command port TX
+#define IGNITION_PIN 2  // P0.02 - ignition sense, active low (opto or divider to 3.3V)
+#define DOOR_PIN 29     // P0.29 - door switch, active low (closes to ground)
+
+// Button hold time. <100ms some fobs don't register, >500ms feels sluggish
+#define PULSE_MS 300
+
+// Battery: 301230 LiPo, ~130mAh nominal, ~120mAh usable down to 3.0V
+#define BATTERY_MAH 120
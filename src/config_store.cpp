@@ -0,0 +1,73 @@
+#include "config_store.h"
+#include "secure_store.h"
+#include "inputs.h"
+#include "dongle_link.h"
+#include "hid_remote.h"
+#include <InternalFileSystem.h>
+
+using namespace Adafruit_LittleFS_Namespace;
+
+DeviceConfig config;
+
+static void configDefaults() {
+  memset(&config, 0, sizeof(config));
+  config.version = CONFIG_VERSION;
+  config.size = sizeof(config);
+  config.target_runtime_h = 0;
+  config.admit_deadline_s = 0;     // admission.cpp fills in its default
+}
+
+static bool headerValid(const DeviceConfig& c, uint32_t len) {
+  return len >= 4 && c.version == CONFIG_VERSION && c.size >= 4 && c.size <= sizeof(c) && c.size <= len;
+}
+
+void configLoad() {
+  configDefaults();
+  InternalFS.begin();
+
+  DeviceConfig stored;
+  bool legacy;
+  int32_t len = secureReadFile(CONFIG_FILE, SEAL_CONFIG, &stored, sizeof(stored), &legacy);
+  if (len < 0) return;
+
+  if (!headerValid(stored, len)) {
+    Serial.println("Config invalid, using defaults");
+    return;
+  }
+  memcpy(&config, &stored, stored.size);
+  config.size = sizeof(config);
+
+  // Saved before encryption: store it sealed from now on
+  if (legacy) configSave();
+}
+
+bool configApply(const void* data, uint32_t len) {
+  DeviceConfig incoming;
+  memset(&incoming, 0, sizeof(incoming));
+  memcpy(&incoming, data, len < sizeof(incoming) ? len : sizeof(incoming));
+  if (!headerValid(incoming, len)) return false;
+
+  DeviceConfig merged = config;
+  memcpy(&merged, &incoming, incoming.size);
+  merged.size = sizeof(merged);
+  if (merged.target_runtime_h > CONFIG_RUNTIME_MAX_H) return false;
+  // A new target restarts the countdown (governorSetTarget()), otherwise it must fit
+  if (merged.target_runtime_h == config.target_runtime_h &&
+      merged.target_elapsed_h > merged.target_runtime_h) return false;
+  if (merged.admit_deadline_s < CONFIG_ADMIT_MIN_S) return false;
+  if (merged.presence_adv > 1 || merged.usb_export > 1 || merged.wired_port > 1) return false;
+  if (merged.inputs >> IN_COUNT) return false;
+  if (merged.dongle_period_ms &&
+      (merged.dongle_period_ms < DONGLE_PERIOD_MIN_MS || merged.dongle_period_ms > DONGLE_PERIOD_MAX_MS ||
+       merged.dongle_window_us < DONGLE_WINDOW_MIN_US || merged.dongle_window_us > DONGLE_WINDOW_MAX_US)) return false;
+  if (merged.hid_remote > 1) return false;
+  if (merged.hid_interval_ms &&
+      (merged.hid_interval_ms < HID_INTERVAL_MIN_MS || merged.hid_interval_ms > HID_INTERVAL_MAX_MS)) return false;
+
+  config = merged;
+  return configSave();
+}
+
+bool configSave() {
+  return secureWriteFile(CONFIG_FILE, SEAL_CONFIG, &config, sizeof(config));
+}
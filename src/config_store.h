@@ -0,0 +1,40 @@
+#pragma once
+
+#include <Arduino.h>
+
+// User settings, persisted in InternalFS next to the bond data.
+// New fields go at the end; an older, shorter file loads over the defaults,
+// so the new fields keep their default values.
+#define CONFIG_FILE    "/config.bin"
+#define CONFIG_VERSION 1
+#define CONFIG_RUNTIME_MAX_H  8760    // a year
+#define CONFIG_ADMIT_MIN_S    5
+
+struct DeviceConfig {
+  uint16_t version;
+  uint16_t size;
+  uint16_t target_runtime_h;    // energy governor target, 0 = off (full performance)
+  uint16_t admit_deadline_s;    // unauthenticated links are dropped after this
+  uint8_t  presence_adv;        // non-connectable beacon while slots are closed
+  uint8_t  usb_export;          // USB mass-storage diagnostics volume at boot
+  uint8_t  wired_port;          // UARTE command port on WIRED_RX/TX_PIN at boot
+  uint8_t  inputs;              // enabled vehicle inputs, bitmask of VehicleInput
+  uint16_t dongle_period_ms;    // dongle link listen period, 0 = off
+  uint16_t dongle_window_us;    // ... and listen window
+  uint8_t  hid_remote;          // 1: bonded HID remote at hid_addr, kept connected
+  uint8_t  hid_addr_type;       // identity address from the bond
+  uint8_t  hid_addr[6];
+  uint16_t hid_interval_ms;     // its connection interval, 0 = HID_INTERVAL_DEF_MS
+  uint16_t hid_keys[2];         // key code per ActChannel, 0 = none
+  uint16_t target_elapsed_h;    // hours of target_runtime_h already used, saved hourly
+  uint8_t  hid_irk[16];         // resolves the remote's private addresses, all zero = none
+};
+
+extern DeviceConfig config;
+
+void configLoad();
+bool configSave();
+
+// Settings from outside (USB volume): same checks as configLoad() plus
+// range checks, merged over the current config, saved. False if rejected.
+bool configApply(const void* data, uint32_t len);
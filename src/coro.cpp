@@ -0,0 +1,126 @@
+/*
+ * Coroutine scheduler
+ *
+ * Three intrusive lists of awaiters, all inside suspended frames: timers
+ * sorted by wake time, deferred-event waiters, and the ready list.
+ * coroPoll() moves due timers to the ready list and resumes what is on it;
+ * a coroutine resumed there that awaits again lands on a list that is only
+ * looked at in the next pass, so one pass can't loop forever.
+ *
+ * Frames come from the heap (operator new in the promise) and are counted
+ * there; the compiler knows each frame's size, the runtime only adds it up.
+ */
+
+#include "coro.h"
+
+static CoroWaiter* timers = nullptr;
+static CoroWaiter* defer_waiters = nullptr;
+static CoroWaiter* ready = nullptr;
+static CoroWaiter** ready_tail = &ready;
+static CoroStats stats;
+
+CoroTask CoroTask::promise_type::get_return_object_on_allocation_failure() {
+  stats.no_memory++;
+  return CoroTask();
+}
+
+void* CoroTask::promise_type::operator new(size_t size) noexcept {
+  void* frame = malloc(size);
+  if (!frame) return nullptr;
+  stats.started++;
+  stats.live++;
+  stats.frame_bytes += size;
+  if (stats.live > stats.peak_live) stats.peak_live = stats.live;
+  if (stats.frame_bytes > stats.peak_frame_bytes) stats.peak_frame_bytes = stats.frame_bytes;
+  return frame;
+}
+
+void CoroTask::promise_type::operator delete(void* frame, size_t size) noexcept {
+  stats.live--;
+  stats.frame_bytes -= size;
+  free(frame);
+}
+
+void coroWake(CoroWaiter* w) {
+  w->next = nullptr;
+  *ready_tail = w;
+  ready_tail = &w->next;
+}
+
+void CoroSleep::await_suspend(std::coroutine_handle<> h) {
+  handle = h;
+  CoroWaiter** p = &timers;
+  while (*p && (int32_t) (static_cast<CoroSleep*>(*p)->wake_ms - wake_ms) <= 0) p = &(*p)->next;
+  next = *p;
+  *p = this;
+}
+
+void CoroDefer::await_suspend(std::coroutine_handle<> h) {
+  handle = h;
+  next = defer_waiters;
+  defer_waiters = this;
+}
+
+void coroDeferEvent(const DeferEvent& e) {
+  CoroWaiter** p = &defer_waiters;
+  while (*p) {
+    CoroDefer* d = static_cast<CoroDefer*>(*p);
+    if (d->type == e.type && (d->data0 < 0 || d->data0 == e.data[0])) {
+      *p = d->next;
+      d->event = e;
+      coroWake(d);
+    }
+    else {
+      p = &d->next;
+    }
+  }
+}
+
+void coroPoll() {
+  uint32_t now = millis();
+  while (timers && (int32_t) (now - static_cast<CoroSleep*>(timers)->wake_ms) >= 0) {
+    CoroWaiter* w = timers;
+    timers = w->next;
+    coroWake(w);
+  }
+
+  // This pass's list only; resumed coroutines may wake others for the next
+  CoroWaiter* w = ready;
+  ready = nullptr;
+  ready_tail = &ready;
+  while (w) {
+    CoroWaiter* next = w->next;
+    stats.resumes++;
+    w->handle.resume();                 // may free w's frame
+    w = next;
+  }
+}
+
+const CoroStats& coroStats() {
+  return stats;
+}
+
+void coroPrintStats(Print& out) {
+  uint32_t sleeping = 0, waiting = 0;
+  for (CoroWaiter* w = timers; w; w = w->next) sleeping++;
+  for (CoroWaiter* w = defer_waiters; w; w = w->next) waiting++;
+
+  out.print("coro live=");
+  out.print(stats.live);
+  out.print(" peak=");
+  out.print(stats.peak_live);
+  out.print(" frames=");
+  out.print(stats.frame_bytes);
+  out.print("B peak=");
+  out.print(stats.peak_frame_bytes);
+  out.print("B sleeping=");
+  out.print(sleeping);
+  out.print(" on events=");
+  out.print(waiting);
+  out.print(" started=");
+  out.print(stats.started);
+  out.print(" resumes=");
+  out.print(stats.resumes);
+  out.print(" nomem=");
+  out.println(stats.no_memory);
+}
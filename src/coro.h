@@ -0,0 +1,151 @@
+#pragma once
+
+#include <coroutine>           // before Arduino.h and its macros
+#include <Arduino.h>
+#include "deferred.h"
+
+// Stackless coroutines (C++20) run from loop(), for sequences that used to
+// block loop() in delay() or would otherwise need a task and its stack.
+// A coroutine returns CoroTask, starts running when called and runs until
+// its first co_await; its frame (locals that live across a co_await, tens
+// of bytes) is allocated then and freed when it returns:
+//
+//   CoroTask blink() {
+//     for (int i = 0; i < 3; i++) {
+//       led(true);  co_await coroSleep(200);
+//       led(false); co_await coroSleep(200);
+//     }
+//   }
+//
+// Awaitables: coroSleep(ms); coroDefer(type [, data0]) for the next
+// deferred event of that type (BLE connect/disconnect/secured, vehicle input
+// edges, dongle presses; returns the DeferEvent); CoroQueue::receive().
+// A suspended coroutine is only ever resumed from coroPoll(), so code
+// between two co_awaits runs like any other loop() code. Everything here is
+// loop()-only; interrupts and the BLE task reach coroutines through
+// deferPost().
+//
+// Coroutines can't be cancelled: one waiting for an event that never comes
+// keeps its frame, which "coro" stats show.
+
+struct CoroStats {
+  uint32_t live;            // started, not returned
+  uint32_t peak_live;
+  uint32_t frame_bytes;     // heap held by live frames
+  uint32_t peak_frame_bytes;
+  uint32_t started;
+  uint32_t resumes;
+  uint32_t no_memory;       // frame allocation failed, coroutine not run
+};
+
+class CoroTask {
+public:
+  struct promise_type {
+    CoroTask get_return_object() { return CoroTask(); }
+    static CoroTask get_return_object_on_allocation_failure();
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }   // frame freed on return
+    void return_void() {}
+    void unhandled_exception() {}
+    static void* operator new(size_t size) noexcept;
+    static void operator delete(void* frame, size_t size) noexcept;
+  };
+};
+
+// Awaiter state lives in the suspended coroutine's frame; one link is
+// enough, since a waiter is on one list at a time
+struct CoroWaiter {
+  CoroWaiter* next;
+  std::coroutine_handle<> handle;
+};
+
+void coroWake(CoroWaiter* w);         // to the ready list, resumed by coroPoll()
+
+struct CoroSleep : CoroWaiter {
+  uint32_t wake_ms;
+  bool await_ready() const { return false; }
+  void await_suspend(std::coroutine_handle<> h);
+  void await_resume() const {}
+};
+
+struct CoroDefer : CoroWaiter {
+  uint8_t type;             // DeferType
+  int16_t data0;            // -1: any
+  DeferEvent event;
+  bool await_ready() const { return false; }
+  void await_suspend(std::coroutine_handle<> h);
+  DeferEvent await_resume() const { return event; }
+};
+
+inline CoroSleep coroSleep(uint32_t ms) {
+  CoroSleep s;
+  s.wake_ms = millis() + ms;
+  return s;
+}
+
+inline CoroDefer coroDefer(DeferType type, int16_t data0 = -1) {
+  CoroDefer d;
+  d.type = type;
+  d.data0 = data0;
+  return d;
+}
+
+// Fixed-size FIFO between loop() code and coroutines. A pushed item goes
+// straight to the oldest waiting receiver if there is one.
+template <typename T, uint8_t N>
+class CoroQueue {
+public:
+  struct Receive : CoroWaiter {
+    CoroQueue* q;
+    T value;
+    bool await_ready() { return q->pop(value); }
+    void await_suspend(std::coroutine_handle<> h) {
+      handle = h;
+      next = nullptr;
+      CoroWaiter** p = &q->waiters;
+      while (*p) p = &(*p)->next;
+      *p = this;
+    }
+    T await_resume() const { return value; }
+  };
+
+  bool push(const T& v) {
+    if (waiters) {
+      Receive* w = static_cast<Receive*>(waiters);
+      waiters = w->next;
+      w->value = v;
+      coroWake(w);
+      return true;
+    }
+    if (count == N) return false;
+    items[(first + count++) % N] = v;
+    return true;
+  }
+
+  Receive receive() {
+    Receive r;
+    r.q = this;
+    return r;
+  }
+
+  uint8_t size() const { return count; }
+
+private:
+  bool pop(T& v) {
+    if (count == 0) return false;
+    v = items[first];
+    first = (first + 1) % N;
+    count--;
+    return true;
+  }
+
+  T items[N];
+  uint8_t first = 0;
+  uint8_t count = 0;
+  CoroWaiter* waiters = nullptr;
+};
+
+void coroPoll();                      // from loop(): timers due, then the ready list
+void coroDeferEvent(const DeferEvent& e);   // from loop(), for every deferred event
+const CoroStats& coroStats();
+void coroPrintStats(Print& out);
@@ -0,0 +1,141 @@
+/*
+ * Crash capture
+ *
+ * The capture lives in .noinit so the startup code doesn't zero it across
+ * the NVIC_SystemReset() at the end of the fault handler. Nothing here can
+ * touch flash at fault time (the SoftDevice owns NVMC), so the record is
+ * written at the next boot.
+ */
+
+#include "crash_log.h"
+#include "journal.h"
+#include <InternalFileSystem.h>
+
+using namespace Adafruit_LittleFS_Namespace;
+
+#define CRASH_CAPTURE_MAGIC 0xC0FFEE42u
+
+// Reset reasons that mean the firmware died rather than was reset
+#define CRASH_RESETREAS (POWER_RESETREAS_DOG_Msk | POWER_RESETREAS_LOCKUP_Msk)
+
+struct FaultCapture {
+  uint32_t magic;
+  uint16_t boot;
+  uint32_t uptime_ms;
+  uint32_t pc, lr, psr;
+  uint32_t cfsr, hfsr, mmfar, bfar;
+};
+
+static FaultCapture capture __attribute__((section(".noinit")));
+static uint32_t crash_bytes = 0;
+
+extern "C" __attribute__((used)) void crashCapture(const uint32_t* frame) {
+  // Exception frame: r0 r1 r2 r3 r12 lr pc xpsr
+  capture.lr = frame[5];
+  capture.pc = frame[6];
+  capture.psr = frame[7];
+  capture.cfsr = SCB->CFSR;
+  capture.hfsr = SCB->HFSR;
+  capture.mmfar = SCB->MMFAR;
+  capture.bfar = SCB->BFAR;
+  capture.boot = journalBootCount();
+  capture.uptime_ms = millis();
+  capture.magic = CRASH_CAPTURE_MAGIC;
+  NVIC_SystemReset();
+}
+
+// Pick the stack the fault was taken on and hand its frame to crashCapture()
+extern "C" __attribute__((naked)) void HardFault_Handler(void) {
+  __asm volatile(
+    "tst lr, #4      \n"
+    "ite eq          \n"
+    "mrseq r0, msp   \n"
+    "mrsne r0, psp   \n"
+    "b crashCapture  \n");
+}
+
+static void append(const CrashRecord& rec) {
+  CrashRecord kept[CRASH_MAX];
+  uint32_t n = 0;
+
+  File f(InternalFS);
+  if (f.open(CRASH_FILE, FILE_O_READ)) {
+    n = f.read(kept, sizeof(kept)) / sizeof(CrashRecord);
+    f.close();
+  }
+  if (n == CRASH_MAX) {
+    memmove(kept, kept + 1, (CRASH_MAX - 1) * sizeof(CrashRecord));
+    n--;
+  }
+  kept[n++] = rec;
+
+  InternalFS.remove(CRASH_FILE);
+  if (f.open(CRASH_FILE, FILE_O_WRITE)) {
+    f.write((const uint8_t*) kept, n * sizeof(CrashRecord));
+    f.close();
+  }
+}
+
+void crashLogBegin() {
+  uint32_t resetreas = readResetReason();
+  bool faulted = capture.magic == CRASH_CAPTURE_MAGIC;
+
+  if (faulted || (resetreas & CRASH_RESETREAS)) {
+    CrashRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.resetreas = resetreas;
+    rec.boot = faulted ? capture.boot : journalBootCount() - 1;
+    if (faulted) {
+      rec.fault = 1;
+      rec.uptime_ms = capture.uptime_ms;
+      rec.pc = capture.pc;
+      rec.lr = capture.lr;
+      rec.psr = capture.psr;
+      rec.cfsr = capture.cfsr;
+      rec.hfsr = capture.hfsr;
+      rec.mmfar = capture.mmfar;
+      rec.bfar = capture.bfar;
+    }
+    append(rec);
+
+    Serial.print("Crash on previous boot, pc=0x");
+    Serial.println(rec.pc, HEX);
+  }
+  capture.magic = 0;
+
+  File f(InternalFS);
+  if (f.open(CRASH_FILE, FILE_O_READ)) {
+    crash_bytes = f.size() / sizeof(CrashRecord) * sizeof(CrashRecord);
+    f.close();
+  }
+}
+
+uint32_t crashLogExportSize() {
+  return sizeof(ExportHeader) + crash_bytes;
+}
+
+uint32_t crashLogExportRead(uint32_t offset, uint8_t* buf, uint32_t len) {
+  uint32_t size = crashLogExportSize();
+  if (offset >= size) return 0;
+  if (len > size - offset) len = size - offset;
+
+  ExportHeader header;
+  exportFillHeader(header, EXPORT_CRASH, sizeof(CrashRecord));
+
+  uint32_t done = 0;
+  if (offset < sizeof(header)) {
+    done = sizeof(header) - offset;
+    if (done > len) done = len;
+    memcpy(buf, (const uint8_t*) &header + offset, done);
+  }
+  if (done < len) {
+    File f(InternalFS);
+    if (f.open(CRASH_FILE, FILE_O_READ)) {
+      f.seek(offset + done - sizeof(header));
+      f.read(buf + done, len - done);
+      f.close();
+    }
+    done = len;
+  }
+  return done;
+}
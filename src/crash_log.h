@@ -0,0 +1,15 @@
+#pragma once
+
+#include <Arduino.h>
+#include "journal_records.h"
+
+// Crash records. HardFault_Handler saves the faulting frame and fault
+// status registers to RAM that survives a soft reset, then resets. The next
+// boot turns that (or a watchdog / lockup reset reason) into a CrashRecord
+// in /crash.bin, which keeps the last CRASH_MAX.
+#define CRASH_FILE  "/crash.bin"
+#define CRASH_MAX   8
+
+void crashLogBegin();         // after journalBegin()
+uint32_t crashLogExportSize();
+uint32_t crashLogExportRead(uint32_t offset, uint8_t* buf, uint32_t len);
@@ -0,0 +1,102 @@
+/*
+ * Deferred work queue and BLE callback timing
+ *
+ * One consumer, loop(), which only writes tail. Producers are the BLE task
+ * and two interrupts (inputs.cpp, dongle_link.cpp), so a post reserves and
+ * fills its slot inside a FreeRTOS critical section; that masks only
+ * application interrupt priorities, never the SoftDevice's. A barrier
+ * between filling a slot and publishing it orders it for the consumer.
+ */
+
+#include "deferred.h"
+
+#define DEFER_BUDGET_CYCLES (DEFER_BUDGET_US * 64)
+
+struct CallbackStat {
+  uint32_t count;
+  uint32_t max_cycles;
+  uint64_t total_cycles;
+  uint32_t overruns;
+};
+
+static DeferEvent ring[DEFER_DEPTH];
+static volatile uint32_t head = 0;      // next slot to fill
+static volatile uint32_t tail = 0;      // next slot to take
+static uint32_t dropped = 0;
+static uint32_t max_depth = 0;
+
+static CallbackStat cb_stats[CB_COUNT];
+static const char* const cb_names[CB_COUNT] = { "connect", "disconnect", "passkey", "secured", "rx", "event" };
+
+static_assert((DEFER_DEPTH & (DEFER_DEPTH - 1)) == 0, "DEFER_DEPTH must be a power of two");
+
+bool deferPost(DeferType type, uint16_t conn_handle, const void* data, uint8_t len) {
+  UBaseType_t saved = taskENTER_CRITICAL_FROM_ISR();   // task or interrupt
+  uint32_t h = head;
+  uint32_t depth = h - tail;
+  if (depth >= DEFER_DEPTH) {
+    dropped++;
+    taskEXIT_CRITICAL_FROM_ISR(saved);
+    return false;
+  }
+
+  DeferEvent& e = ring[h % DEFER_DEPTH];
+  e.type = type;
+  e.conn = conn_handle;
+  if (len > DEFER_DATA_MAX) len = DEFER_DATA_MAX;
+  memset(e.data, 0, sizeof(e.data));
+  if (len) memcpy(e.data, data, len);
+  e.ms = millis();
+
+  __DMB();                  // slot contents before the new head
+  head = h + 1;
+  if (depth + 1 > max_depth) max_depth = depth + 1;
+  taskEXIT_CRITICAL_FROM_ISR(saved);
+  return true;
+}
+
+bool deferTake(DeferEvent& e) {
+  uint32_t t = tail;
+  if (t == head) return false;
+  __DMB();                  // new head before the slot contents
+  e = ring[t % DEFER_DEPTH];
+  __DMB();
+  tail = t + 1;
+  return true;
+}
+
+void deferLeave(DeferCallback cb, uint32_t start) {
+  uint32_t cycles = DWT->CYCCNT - start;
+  CallbackStat& s = cb_stats[cb];
+  s.count++;
+  s.total_cycles += cycles;
+  if (cycles > s.max_cycles) s.max_cycles = cycles;
+  if (cycles > DEFER_BUDGET_CYCLES) {
+    s.overruns++;
+#if DEFER_BUDGET_STRICT
+    __BKPT(0xCB);
+#endif
+  }
+}
+
+void deferPrintStats(Print& out) {
+  out.print("defer max_depth=");
+  out.print(max_depth);
+  out.print(" dropped=");
+  out.println(dropped);
+
+  for (uint8_t i = 0; i < CB_COUNT; i++) {
+    const CallbackStat& s = cb_stats[i];
+    if (!s.count) continue;
+    out.print("cb ");
+    out.print(cb_names[i]);
+    out.print(" n=");
+    out.print(s.count);
+    out.print(" avg/max us=");
+    out.print((uint32_t) (s.total_cycles / s.count / 64));
+    out.print("/");
+    out.print(s.max_cycles / 64);
+    out.print(" over=");
+    out.println(s.overruns);
+  }
+}
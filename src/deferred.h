@@ -0,0 +1,62 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Deferred work for the Bluefruit BLE task. Callbacks there only note what
+// happened in a ring (consumer: loop(); producers: the BLE task and the
+// vehicle-input and dongle-link interrupts, so deferPost() is safe from an
+// ISR at application priority). loop() drains the ring with deferTake() and
+// does the printing, notifications, journaling and policy in deferredWork()
+// (main.cpp). loop() runs below the BLE task's priority, so that work never
+// holds up SoftDevice events - including the write that carries the next
+// command.
+//
+// Each callback is timed (DWT cycles) against DEFER_BUDGET_US. Build with
+// -DDEFER_BUDGET_STRICT=1 to make an overrun a breakpoint: HardFault without
+// a debugger, so it shows up in CRASH.BIN with the callback's PC.
+#ifndef DEFER_BUDGET_STRICT
+#define DEFER_BUDGET_STRICT 0
+#endif
+
+#define DEFER_DEPTH       16          // events; power of two
+#define DEFER_BUDGET_US   250         // per callback invocation
+#define DEFER_DATA_MAX    6           // passkey digits
+
+enum DeferType : uint8_t {
+  DEFER_CONNECT,
+  DEFER_DISCONNECT,       // data[0] = HCI reason
+  DEFER_PASSKEY,          // data = passkey digits
+  DEFER_PAIR_REFUSED,
+  DEFER_SECURED,          // data[0] = sec_mode.lv
+  DEFER_INPUT,            // data[0] = VehicleInput, data[1] = 1 active
+  DEFER_DONGLE,           // data[0] = ActChannel, data[1] = CmdResult, data[2..5] = counter
+  DEFER_HID,              // data[0] = ActChannel (0xFF none), data[1] = CmdResult (CMD_IGNORED: learned), data[2..3] = key
+  DEFER_TYPES
+};
+
+struct DeferEvent {         // 16 bytes
+  uint8_t  type;            // DeferType
+  uint16_t conn;            // full handle: BLE_CONN_HANDLE_INVALID stays 0xFFFF
+  uint8_t  data[DEFER_DATA_MAX];
+  uint32_t ms;              // millis() when it happened
+};
+
+// Callbacks that run in the BLE task, for the timing stats
+enum DeferCallback : uint8_t {
+  CB_CONNECT,
+  CB_DISCONNECT,
+  CB_PASSKEY,
+  CB_SECURED,
+  CB_RX,
+  CB_EVENT,
+  CB_COUNT
+};
+
+bool deferPost(DeferType type, uint16_t conn_handle, const void* data = nullptr, uint8_t len = 0);
+bool deferTake(DeferEvent& e);          // loop() only
+
+// Around a callback body: start = deferEnter(), then deferLeave(cb, start)
+static inline uint32_t deferEnter() { return DWT->CYCCNT; }
+void deferLeave(DeferCallback cb, uint32_t start);
+
+void deferPrintStats(Print& out);
@@ -0,0 +1,476 @@
+/*
+ * Delta firmware update
+ *
+ * The data characteristic's write callback runs in the BLE task and only
+ * copies into the receive ring; loop() parses and rebuilds. The parser is a
+ * byte-level state machine, so a write may end anywhere: in the header,
+ * inside a varint or inside INSERT data. A COPY is carried out from the
+ * running image at up to DELTA_POLL_BYTES per pass and doesn't wait for
+ * data at all.
+ *
+ * Output goes to the bank with flash_nrf5x_write(), which collects a page
+ * in the core's flash cache; crossing a page boundary flushes it (erase +
+ * program, in SoftDevice flash timeslots). InternalFS shares the cache and
+ * Bluefruit writes bonds through it from the BLE task, so every call into
+ * it holds the filesystem's lock. A journal write in between flushes our
+ * page early, which only costs an extra erase.
+ *
+ * Report: rebuild CPU time is what loop() spent here minus flash flushes
+ * and hashing, which are counted on their own.
+ */
+
+#include "delta_update.h"
+#include "actuation.h"
+#include "journal.h"
+#include "link_cache.h"
+#include "perf.h"
+#include "secure_store.h"
+#include "state_region.h"
+#include <bluefruit.h>
+#include <InternalFileSystem.h>
+#include <flash/flash_nrf5x.h>
+
+#define FLASH_PAGE  4096
+
+// Vendor UUIDs, little-endian; byte 12 tells them apart
+static const uint8_t UUID_SERVICE[16] = { 0x4B,0x46,0x44,0x55,0x00,0x80,0x46,0x4B,0x00,0x80,0x55,0x44,0x01,0x00,0x46,0x4B };
+static const uint8_t UUID_DATA[16]    = { 0x4B,0x46,0x44,0x55,0x00,0x80,0x46,0x4B,0x00,0x80,0x55,0x44,0x02,0x00,0x46,0x4B };
+static const uint8_t UUID_STATUS[16]  = { 0x4B,0x46,0x44,0x55,0x00,0x80,0x46,0x4B,0x00,0x80,0x55,0x44,0x03,0x00,0x46,0x4B };
+
+static BLEService upd_service(UUID_SERVICE);
+static BLECharacteristic data_chr(UUID_DATA);
+static BLECharacteristic status_chr(UUID_STATUS);
+
+// From the linker script: end of the flash image
+extern uint32_t __etext;
+extern uint32_t __data_start__;
+extern uint32_t __data_end__;
+
+enum ParseStep : uint8_t { P_HEADER, P_OP, P_ARG, P_COPY, P_INSERT, P_END };
+
+struct Session {
+  uint8_t  step;            // ParseStep
+  uint8_t  op;              // DeltaOp being read
+  uint8_t  arg;             // varints of it read so far
+  uint8_t  shift;
+  uint32_t value;           // varint being read
+  uint32_t src;             // COPY: next running-image offset
+  uint32_t remaining;       // COPY/INSERT bytes still to produce
+  uint32_t header_got;
+  uint32_t consumed;        // delta bytes taken out of the ring
+  uint32_t acked;           // consumed at the last status notification
+  uint32_t written;         // image bytes rebuilt
+  uint32_t ops;
+  uint32_t copy_bytes;
+  uint32_t insert_bytes;
+  uint64_t cpu_cycles;
+  uint64_t flash_cycles;
+  uint64_t hash_cycles;
+  uint32_t ready_ms;
+};
+
+static DeltaHeader header;
+static Session s;
+static DeltaState state = DELTA_IDLE;
+static DeltaError error = DELTA_OK;
+static bool status_dirty = false;
+static uint32_t image_size = 0;           // running image, from the linker symbols
+
+// BLE task -> loop()
+static uint8_t ring[DELTA_RING];
+static volatile uint32_t ring_head = 0;   // written by the BLE task
+static volatile uint32_t ring_tail = 0;   // written by loop()
+static volatile bool ring_overrun = false;
+static volatile uint16_t data_conn = BLE_CONN_HANDLE_INVALID;
+static volatile uint32_t rx_first_ms = 0;
+static volatile uint32_t rx_last_ms = 0;
+
+// Last finished session, for the report
+static Session last;
+static DeltaHeader last_header;
+static uint32_t last_transfer_ms = 0;
+
+static void dataWrite(uint16_t conn_handle, BLECharacteristic* chr, uint8_t* data, uint16_t len) {
+  uint32_t head = ring_head;
+  if (DELTA_RING - (head - ring_tail) < len) {
+    ring_overrun = true;
+    return;
+  }
+  uint32_t at = head % DELTA_RING;
+  uint32_t first = len < DELTA_RING - at ? len : DELTA_RING - at;
+  memcpy(ring + at, data, first);
+  memcpy(ring, data + first, len - first);
+  ring_head = head + len;
+
+  data_conn = conn_handle;
+  rx_last_ms = millis();
+  if (rx_first_ms == 0) rx_first_ms = rx_last_ms;
+}
+
+static void notifyStatus() {
+  DeltaStatus st;
+  st.state = state;
+  st.error = error;
+  st.window = DELTA_RING;
+  st.consumed = s.consumed;
+  st.written = s.written;
+  status_chr.write(&st, sizeof(st));
+  status_dirty = false;
+  s.acked = s.consumed;
+
+  // Straight to the SoftDevice like tx_queue: it takes one of the link's
+  // HVN buffers, which tx_queue sees as a stall at worst. Retried next pass.
+  uint16_t conn = data_conn;
+  if (conn == BLE_CONN_HANDLE_INVALID || !status_chr.notifyEnabled(conn)) return;
+  uint16_t len = sizeof(st);
+  ble_gatts_hvx_params_t hvx = {};
+  hvx.handle = status_chr.handles().value_handle;
+  hvx.type = BLE_GATT_HVX_NOTIFICATION;
+  hvx.p_len = &len;
+  hvx.p_data = (uint8_t*) &st;
+  if (sd_ble_gatts_hvx(conn, &hvx) != NRF_SUCCESS) status_dirty = true;
+}
+
+static void setState(DeltaState next, DeltaError err = DELTA_OK) {
+  state = next;
+  error = err;
+  status_dirty = true;
+}
+
+static void endSession(DeltaError err) {
+  last = s;
+  last_header = header;
+  last_transfer_ms = rx_last_ms - rx_first_ms;
+  journalLog(JR_UPDATE, JOURNAL_NO_CONN, header.new_size, err);
+  if (err == DELTA_OK) {
+    s.ready_ms = millis();
+    setState(DELTA_READY);
+    Serial.println("Update verified, swapping shortly");
+  }
+  else {
+    setState(DELTA_FAILED, err);
+    Serial.print("Update failed, error ");
+    Serial.println(err);
+  }
+}
+
+static void flushPage() {
+  uint32_t t0 = perfCycles();
+  InternalFS._lockFS();
+  flash_nrf5x_flush();
+  InternalFS._unlockFS();
+  s.flash_cycles += perfCycles() - t0;
+}
+
+static bool hashMatches(uint32_t addr, uint32_t len, const uint8_t* expected) {
+  uint8_t digest[32];
+  uint32_t t0 = perfCycles();
+  bool ok = secureSha256((const void*) addr, len, digest);
+  s.hash_cycles += perfCycles() - t0;
+  return ok && memcmp(digest, expected, sizeof(digest)) == 0;
+}
+
+static void emit(const uint8_t* data, uint32_t len) {
+  while (len) {
+    uint32_t room = FLASH_PAGE - s.written % FLASH_PAGE;
+    uint32_t n = len < room ? len : room;
+    InternalFS._lockFS();
+    flash_nrf5x_write(DELTA_BANK_ADDR + s.written, data, n);
+    InternalFS._unlockFS();
+    s.written += n;
+    data += n;
+    len -= n;
+    if (s.written % FLASH_PAGE == 0) flushPage();
+  }
+}
+
+static void consume(uint32_t n) {
+  ring_tail = ring_tail + n;
+  s.consumed += n;
+}
+
+static void headerDone() {
+  bool fits = image_size <= DELTA_BANK_ADDR - DELTA_APP_ADDR;
+  if (!fits || header.magic != DELTA_MAGIC || header.version != DELTA_VERSION ||
+      header.header_size != sizeof(DeltaHeader) || header.old_size > image_size ||
+      header.new_size == 0 || header.new_size > DELTA_BANK_SIZE ||
+      header.new_size > DELTA_BANK_ADDR - DELTA_APP_ADDR) {
+    endSession(DELTA_ERR_HEADER);
+    return;
+  }
+  if (!hashMatches(DELTA_APP_ADDR, header.old_size, header.old_sha256)) {
+    endSession(DELTA_ERR_BASE);
+    return;
+  }
+  s.step = P_OP;
+}
+
+static void finish() {
+  if (s.written != header.new_size) {
+    endSession(DELTA_ERR_SIZE);
+    return;
+  }
+  if (s.written % FLASH_PAGE) flushPage();
+  s.step = P_END;
+  endSession(hashMatches(DELTA_BANK_ADDR, header.new_size, header.new_sha256) ? DELTA_OK : DELTA_ERR_HASH);
+}
+
+// One op's varints are in: check bounds before producing anything
+static void opReady() {
+  s.ops++;
+  uint32_t room = header.new_size - s.written;
+  if (s.op == DELTA_COPY) {
+    if (s.remaining > room || s.src > header.old_size || s.remaining > header.old_size - s.src) {
+      endSession(DELTA_ERR_OP);
+      return;
+    }
+    s.copy_bytes += s.remaining;
+    s.step = s.remaining ? P_COPY : P_OP;
+  }
+  else {
+    if (s.remaining > room) {
+      endSession(DELTA_ERR_OP);
+      return;
+    }
+    s.insert_bytes += s.remaining;
+    s.step = s.remaining ? P_INSERT : P_OP;
+  }
+}
+
+static void parseByte(uint8_t b) {
+  if (s.step == P_OP) {
+    s.op = b;
+    s.arg = 0;
+    s.shift = 0;
+    s.value = 0;
+    if (b == DELTA_END) finish();
+    else if (b == DELTA_COPY || b == DELTA_INSERT) s.step = P_ARG;
+    else endSession(DELTA_ERR_OP);
+    return;
+  }
+
+  // P_ARG: unsigned LEB128, 32 bits at most
+  s.value |= (uint32_t) (b & 0x7F) << s.shift;
+  if (b & 0x80) {
+    s.shift += 7;
+    if (s.shift > 28) endSession(DELTA_ERR_OP);
+    return;
+  }
+  uint32_t v = s.value;
+  s.value = 0;
+  s.shift = 0;
+  if (s.op == DELTA_COPY && s.arg++ == 0) {
+    s.src = v;
+    return;
+  }
+  s.remaining = v;
+  opReady();
+}
+
+static void rebuild() {
+  uint32_t t0 = perfCycles();
+  uint64_t side = s.flash_cycles + s.hash_cycles;
+  uint32_t budget = DELTA_POLL_BYTES;
+
+  while (state == DELTA_RECEIVING && budget) {
+    if (s.step == P_COPY) {
+      uint32_t n = s.remaining < budget ? s.remaining : budget;
+      emit((const uint8_t*) (DELTA_APP_ADDR + s.src), n);
+      s.src += n;
+      s.remaining -= n;
+      budget -= n;
+      if (s.remaining == 0) s.step = P_OP;
+      continue;
+    }
+
+    uint32_t avail = ring_head - ring_tail;
+    if (avail == 0) break;
+    uint32_t at = ring_tail % DELTA_RING;
+    uint32_t contig = avail < DELTA_RING - at ? avail : DELTA_RING - at;
+    const uint8_t* p = ring + at;
+
+    if (s.step == P_HEADER) {
+      uint32_t n = sizeof(header) - s.header_got;
+      if (n > contig) n = contig;
+      memcpy((uint8_t*) &header + s.header_got, p, n);
+      s.header_got += n;
+      consume(n);
+      if (s.header_got == sizeof(header)) headerDone();
+    }
+    else if (s.step == P_INSERT) {
+      uint32_t n = s.remaining;
+      if (n > contig) n = contig;
+      if (n > budget) n = budget;
+      emit(p, n);
+      consume(n);
+      s.remaining -= n;
+      budget -= n;
+      if (s.remaining == 0) s.step = P_OP;
+    }
+    else {
+      consume(1);
+      parseByte(*p);
+    }
+  }
+
+  uint64_t spent = perfCycles() - t0;
+  side = s.flash_cycles + s.hash_cycles - side;
+  s.cpu_cycles += spent > side ? spent - side : 0;
+}
+
+// Runs from RAM with the SoftDevice off and interrupts masked: the flash
+// under it is being rewritten, so nothing here may call into flash code
+__attribute__((section(".data.delta_swap"), long_call, noinline))
+static void swapAndReset(uint32_t pages) {
+  volatile uint32_t* dst = (volatile uint32_t*) DELTA_APP_ADDR;
+  const volatile uint32_t* src = (const volatile uint32_t*) DELTA_BANK_ADDR;
+  for (uint32_t page = 0; page < pages; page++) {
+    NRF_NVMC->CONFIG = NVMC_CONFIG_WEN_Een << NVMC_CONFIG_WEN_Pos;
+    NRF_NVMC->ERASEPAGE = DELTA_APP_ADDR + page * FLASH_PAGE;
+    while (NRF_NVMC->READY == NVMC_READY_READY_Busy) { }
+    NRF_NVMC->CONFIG = NVMC_CONFIG_WEN_Wen << NVMC_CONFIG_WEN_Pos;
+    for (uint32_t i = 0; i < FLASH_PAGE / 4; i++, dst++, src++) {
+      *dst = *src;
+      while (NRF_NVMC->READY == NVMC_READY_READY_Busy) { }
+    }
+  }
+  NRF_NVMC->CONFIG = NVMC_CONFIG_WEN_Ren << NVMC_CONFIG_WEN_Pos;
+
+  // NVIC_SystemReset() is inline but may be emitted in flash
+  __DSB();
+  SCB->AIRCR = (0x5FAUL << SCB_AIRCR_VECTKEY_Pos) | SCB_AIRCR_SYSRESETREQ_Msk;
+  __DSB();
+  while (true) { }
+}
+
+static void swap() {
+  stateRegionSync();
+  journalFlush();
+  Serial.println("Swapping to the new image");
+  Serial.flush();
+  actuationParkAll();
+  sd_softdevice_disable();
+  __disable_irq();
+  swapAndReset((header.new_size + FLASH_PAGE - 1) / FLASH_PAGE);
+}
+
+static void startSession() {
+  memset(&s, 0, sizeof(s));
+  memset(&header, 0, sizeof(header));
+  s.step = P_HEADER;
+  setState(DELTA_RECEIVING);
+  Serial.println("Update started");
+}
+
+void deltaUpdateBegin() {
+  image_size = (uint32_t) &__etext + ((uint32_t) &__data_end__ - (uint32_t) &__data_start__) - DELTA_APP_ADDR;
+
+  upd_service.begin();
+
+  // Encrypted and MITM-authenticated only, like the UART
+  data_chr.setProperties(CHR_PROPS_WRITE | CHR_PROPS_WRITE_WO_RESP);
+  data_chr.setPermission(SECMODE_NO_ACCESS, SECMODE_ENC_WITH_MITM);
+  data_chr.setMaxLen(LINKCAPS_MTU_MAX - 3);
+  data_chr.setWriteCallback(dataWrite, false);    // in the BLE task, data only valid during the call
+  data_chr.begin();
+
+  status_chr.setProperties(CHR_PROPS_READ | CHR_PROPS_NOTIFY);
+  status_chr.setPermission(SECMODE_ENC_WITH_MITM, SECMODE_NO_ACCESS);
+  status_chr.setFixedLen(sizeof(DeltaStatus));
+  status_chr.begin();
+  notifyStatus();
+}
+
+void deltaUpdatePoll() {
+  uint32_t now = millis();
+  bool data = ring_head != ring_tail;
+
+  switch (state) {
+    case DELTA_IDLE:
+      if (!data) break;
+      startSession();
+      // fall through
+    case DELTA_RECEIVING:
+      if (ring_overrun) endSession(DELTA_ERR_OVERRUN);
+      else if (!data && s.step != P_COPY && now - rx_last_ms > DELTA_IDLE_MS) endSession(DELTA_ERR_TIMEOUT);
+      else rebuild();
+      break;
+
+    case DELTA_READY:
+      // Not in the middle of a press
+      if (now - s.ready_ms > DELTA_SWAP_DELAY_MS && !actuationBusy()) swap();
+      break;
+
+    case DELTA_FAILED:
+      // Drop whatever is still coming; a quiet link ends it
+      ring_tail = ring_head;
+      if (now - rx_last_ms > DELTA_IDLE_MS) deltaUpdateAbort();
+      break;
+  }
+
+  if (status_dirty || s.consumed - s.acked >= DELTA_ACK_BYTES) notifyStatus();
+}
+
+void deltaUpdateAbort() {
+  if (state == DELTA_RECEIVING) endSession(DELTA_ERR_ABORTED);
+  ring_tail = ring_head;
+  ring_overrun = false;
+  rx_first_ms = 0;
+  setState(DELTA_IDLE);
+}
+
+static void printMs(Print& out, const char* label, uint64_t cycles) {
+  out.print(label);
+  out.print((uint32_t) (cycles / 64000));
+}
+
+void deltaUpdatePrintStats(Print& out) {
+  static const char* const names[] = { "idle", "receiving", "verified", "failed" };
+  out.print("update ");
+  out.print(names[state]);
+  if (state == DELTA_RECEIVING) {
+    out.print(" ");
+    out.print(s.consumed);
+    out.print("B in, ");
+    out.print(s.written);
+    out.print("/");
+    out.print(header.new_size);
+    out.print("B out");
+  }
+  out.print(" err=");
+  out.print(error);
+  out.print(" image=");
+  out.print(image_size);
+  out.print("B bank=");
+  out.println(image_size <= DELTA_BANK_ADDR - DELTA_APP_ADDR ? "ok" : "overlaps");
+
+  if (last.consumed == 0) return;
+  uint32_t full = last_header.new_size;
+  out.print(" last: delta=");
+  out.print(last.consumed);
+  out.print("B image=");
+  out.print(full);
+  out.print("B (");
+  out.print(full ? last.consumed * 100 / full : 0);
+  out.print("%) ops=");
+  out.print(last.ops);
+  out.print(" copy=");
+  out.print(last.copy_bytes);
+  out.print("B insert=");
+  out.print(last.insert_bytes);
+  out.println("B");
+
+  // Same throughput for the full image: what the delta saved on air
+  out.print(" transfer ms=");
+  out.print(last_transfer_ms);
+  if (last_transfer_ms) {
+    out.print(" B/s=");
+    out.print((uint32_t) ((uint64_t) last.consumed * 1000 / last_transfer_ms));
+    out.print(" full image ms~");
+    out.print((uint32_t) ((uint64_t) full * last_transfer_ms / last.consumed));
+  }
+  printMs(out, " rebuild cpu ms=", last.cpu_cycles);
+  printMs(out, " hash ms=", last.hash_cycles);
+  printMs(out, " flash ms=", last.flash_cycles);
+  out.println();
+}
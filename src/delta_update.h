@@ -0,0 +1,44 @@
+#pragma once
+
+#include <Arduino.h>
+#include "journal_records.h"
+#include "state_region.h"
+
+// Delta firmware updates over BLE. tools/delta_gen.cpp diffs the running
+// image against the new one (DeltaHeader + COPY/INSERT ops, journal_records.h);
+// the phone writes the delta to the update service and the device rebuilds
+// the new image into the secondary bank as the bytes arrive: COPY ops read
+// the running image in place, INSERT ops come from the stream, and output
+// goes through the core's one-page flash cache. RAM use is the receive ring
+// plus that page, whatever the image size.
+//
+// The running image is hashed against old_sha256 before anything is
+// written, the rebuilt one against new_sha256 before the swap. The swap
+// copies the bank over the application from RAM with the SoftDevice off,
+// then resets.
+//
+// Flow control: the sender keeps at most status.window bytes beyond
+// status.consumed in flight (write without response); status is notified
+// every DELTA_ACK_BYTES and on every state change.
+#define DELTA_APP_ADDR      0x26000    // application start, after S140 6.1.1
+#define DELTA_BANK_ADDR     0x89000    // secondary bank, up to the state region
+#define DELTA_BANK_SIZE     (STATE_REGION_ADDR - DELTA_BANK_ADDR)
+#define DELTA_RING          4096       // receive ring, and the sender's window
+#define DELTA_ACK_BYTES     1024
+#define DELTA_POLL_BYTES    4096       // image bytes rebuilt per loop() pass
+#define DELTA_IDLE_MS       10000      // no data: session dropped
+#define DELTA_SWAP_DELAY_MS 1000       // verified: status and journal out first
+
+static_assert(DELTA_BANK_SIZE == DELTA_IMAGE_MAX, "tools/delta_gen.cpp checks images against DELTA_IMAGE_MAX");
+
+enum DeltaState : uint8_t {
+  DELTA_IDLE = 0,
+  DELTA_RECEIVING,
+  DELTA_READY,              // verified, swap pending
+  DELTA_FAILED              // until DELTA_IDLE_MS without data, or "update abort"
+};
+
+void deltaUpdateBegin();             // in setupBLE() before advertising: adds the service
+void deltaUpdatePoll();              // from loop(): rebuild, verify, swap
+void deltaUpdateAbort();
+void deltaUpdatePrintStats(Print& out);
@@ -0,0 +1,423 @@
+/*
+ * Proprietary dongle link in SoftDevice radio timeslots
+ *
+ * The session asks for one EARLIEST slot. Each slot starts with the START
+ * signal: RADIO set up for RX, and TIMER0 (ours for the slot, started from
+ * 0 by the SoftDevice) compares at the end of the window. A RADIO END with
+ * a good CRC copies the packet out and pends SWI3. TIMER0 disables the
+ * radio and ends the slot while requesting the next one a period after this
+ * one started (NORMAL). When the SoftDevice can't fit that in next to BLE
+ * (BLOCKED/CANCELED SoC events), we start over with EARLIEST.
+ *
+ * Everything in radioSignal() runs at the SoftDevice's radio priority and
+ * stays short: register writes and a 13-byte copy.
+ */
+
+#include "dongle_link.h"
+#include "config_store.h"
+#include "secure_store.h"
+#include "state_region.h"
+#include "commands.h"
+#include "deferred.h"
+#include "perf.h"
+#include "journal.h"
+#include <bluefruit.h>
+
+#define DONGLE_MAGIC   0x4C44464Bu      // "KFDL", also the MAC block prefix
+#define DONGLE_EARLIEST_TIMEOUT_US 100000
+
+struct DongleState {          // DONGLE_FILE, sealed
+  uint32_t magic;
+  uint8_t  key[16];
+  uint32_t counter;           // last accepted
+};
+
+struct DongleStats {
+  uint32_t slots;
+  uint32_t blocked;
+  uint32_t canceled;
+  uint32_t packets;           // CRC good, handed to the SWI
+  uint32_t crc_errors;
+  uint32_t mailbox_full;
+  uint32_t bad;               // wrong length, MAC or command
+  uint32_t repeats;           // the last accepted packet again
+  uint32_t replays;           // older counter, good MAC
+  uint32_t busy;
+  uint32_t lat_n;
+  uint32_t lat_min;
+  uint32_t lat_max;
+  uint64_t lat_total;
+  uint32_t since_ms;          // listening since
+  uint32_t session_slots;     // granted since then
+};
+
+static DongleState state;
+static bool key_valid = false;
+static uint32_t saved_counter = 0;
+
+static volatile bool listening = false;   // slots keep getting requested
+static bool session_open = false;
+static volatile bool closing = false;     // wait for SESSION_CLOSED before reopening
+static bool held = false;                 // session lent to the channel survey
+static uint32_t period_us = 0;            // schedule of the open session
+static uint32_t window_us = 0;
+
+static uint8_t rx_packet[1 + DONGLE_PAYLOAD];     // length + payload, RADIO DMA
+static uint8_t mail[DONGLE_PAYLOAD];              // radio signal -> SWI
+static volatile uint32_t mail_cycles;
+static volatile bool mail_full = false;
+
+static nrf_radio_signal_callback_return_param_t signal_ret;
+static nrf_radio_request_t next_request;
+static nrf_ecb_hal_data_t ecb;
+static DongleStats stats;
+
+static uint32_t slotLengthUs() {
+  return DONGLE_RAMP_US + window_us + DONGLE_SLOT_EXTRA_US;
+}
+
+static void requestEarliest() {
+  nrf_radio_request_t req;
+  req.request_type = NRF_RADIO_REQ_TYPE_EARLIEST;
+  req.params.earliest.hfclk = NRF_RADIO_HFCLK_CFG_XTAL_GUARANTEED;
+  req.params.earliest.priority = NRF_RADIO_PRIORITY_NORMAL;
+  req.params.earliest.length_us = slotLengthUs();
+  req.params.earliest.timeout_us = DONGLE_EARLIEST_TIMEOUT_US;
+  sd_radio_request(&req);
+}
+
+static void radioStartRx() {
+  NRF_RADIO->POWER = 1;
+  NRF_RADIO->MODE = RADIO_MODE_MODE_Nrf_2Mbit << RADIO_MODE_MODE_Pos;
+  NRF_RADIO->MODECNF0 = RADIO_MODECNF0_RU_Fast << RADIO_MODECNF0_RU_Pos;
+  NRF_RADIO->FREQUENCY = DONGLE_FREQ;
+  NRF_RADIO->PCNF0 = 8 << RADIO_PCNF0_LFLEN_Pos;
+  NRF_RADIO->PCNF1 = (DONGLE_PAYLOAD << RADIO_PCNF1_MAXLEN_Pos) |
+                     (4 << RADIO_PCNF1_BALEN_Pos) |
+                     (RADIO_PCNF1_WHITEEN_Enabled << RADIO_PCNF1_WHITEEN_Pos);
+  NRF_RADIO->DATAWHITEIV = DONGLE_FREQ;
+  NRF_RADIO->BASE0 = DONGLE_BASE_ADDR;
+  NRF_RADIO->PREFIX0 = DONGLE_PREFIX;
+  NRF_RADIO->RXADDRESSES = 1;
+  NRF_RADIO->CRCCNF = RADIO_CRCCNF_LEN_Two << RADIO_CRCCNF_LEN_Pos;
+  NRF_RADIO->CRCINIT = 0xFFFF;
+  NRF_RADIO->CRCPOLY = 0x11021;
+  NRF_RADIO->PACKETPTR = (uint32_t) rx_packet;
+
+  // Ramp-up straight into RX, and back into RX after every packet
+  NRF_RADIO->SHORTS = RADIO_SHORTS_READY_START_Msk | RADIO_SHORTS_END_START_Msk;
+  NRF_RADIO->EVENTS_END = 0;
+  NRF_RADIO->INTENSET = RADIO_INTENSET_END_Msk;
+  NVIC_EnableIRQ(RADIO_IRQn);               // the SoftDevice turns it into RADIO signals
+  NRF_RADIO->TASKS_RXEN = 1;
+
+  NRF_TIMER0->EVENTS_COMPARE[0] = 0;
+  NRF_TIMER0->CC[0] = DONGLE_RAMP_US + window_us;
+  NRF_TIMER0->INTENSET = TIMER_INTENSET_COMPARE0_Msk;
+  NVIC_EnableIRQ(TIMER0_IRQn);
+}
+
+static void radioPacket() {
+  uint32_t cycles = perfCycles();
+  if (!NRF_RADIO->CRCSTATUS) {
+    stats.crc_errors++;
+    return;
+  }
+  if (mail_full) {
+    stats.mailbox_full++;
+    return;
+  }
+  // END_START already restarted RX into rx_packet: copy before the next one lands
+  if (rx_packet[0] != DONGLE_PAYLOAD) {
+    stats.bad++;
+    return;
+  }
+  memcpy(mail, rx_packet + 1, DONGLE_PAYLOAD);
+  mail_cycles = cycles;
+  mail_full = true;
+  stats.packets++;
+  NVIC_SetPendingIRQ(SWI3_EGU3_IRQn);
+}
+
+static nrf_radio_signal_callback_return_param_t* radioSignal(uint8_t signal) {
+  signal_ret.callback_action = NRF_RADIO_SIGNAL_CALLBACK_ACTION_NONE;
+
+  switch (signal) {
+    case NRF_RADIO_CALLBACK_SIGNAL_TYPE_START:
+      stats.slots++;
+      stats.session_slots++;
+      if (listening) radioStartRx();
+      else signal_ret.callback_action = NRF_RADIO_SIGNAL_CALLBACK_ACTION_END;
+      break;
+
+    case NRF_RADIO_CALLBACK_SIGNAL_TYPE_RADIO:
+      if (NRF_RADIO->EVENTS_END) {
+        NRF_RADIO->EVENTS_END = 0;
+        radioPacket();
+      }
+      break;
+
+    case NRF_RADIO_CALLBACK_SIGNAL_TYPE_TIMER0:
+      NRF_TIMER0->EVENTS_COMPARE[0] = 0;
+      NRF_TIMER0->INTENCLR = TIMER_INTENCLR_COMPARE0_Msk;
+      NRF_RADIO->SHORTS = 0;
+      NRF_RADIO->INTENCLR = 0xFFFFFFFF;
+      NRF_RADIO->TASKS_DISABLE = 1;
+
+      if (listening) {
+        next_request.request_type = NRF_RADIO_REQ_TYPE_NORMAL;
+        next_request.params.normal.hfclk = NRF_RADIO_HFCLK_CFG_XTAL_GUARANTEED;
+        next_request.params.normal.priority = NRF_RADIO_PRIORITY_NORMAL;
+        next_request.params.normal.distance_us = period_us;
+        next_request.params.normal.length_us = slotLengthUs();
+        signal_ret.callback_action = NRF_RADIO_SIGNAL_CALLBACK_ACTION_REQUEST_AND_END;
+        signal_ret.params.request.p_next = &next_request;
+      }
+      else {
+        signal_ret.callback_action = NRF_RADIO_SIGNAL_CALLBACK_ACTION_END;
+      }
+      break;
+
+    default:
+      break;
+  }
+  return &signal_ret;
+}
+
+static bool macMatches(uint32_t counter, uint8_t command, const uint8_t* mac) {
+  uint32_t device = NRF_FICR->DEVICEID[0];
+  uint32_t magic = DONGLE_MAGIC;
+  memcpy(ecb.key, state.key, sizeof(ecb.key));
+  memset(ecb.cleartext, 0, sizeof(ecb.cleartext));
+  memcpy(ecb.cleartext, &magic, 4);
+  memcpy(ecb.cleartext + 4, &device, 4);
+  memcpy(ecb.cleartext + 8, &counter, 4);
+  ecb.cleartext[12] = command;
+  if (sd_ecb_block_encrypt(&ecb) != NRF_SUCCESS) return false;
+
+  uint8_t diff = 0;
+  for (uint8_t i = 0; i < DONGLE_MAC_SIZE; i++) diff |= ecb.ciphertext[i] ^ mac[i];
+  return diff == 0;
+}
+
+// Verify and press, below the radio's priority so sd_ecb_* is allowed
+extern "C" void SWI3_EGU3_IRQHandler(void) {
+  if (!mail_full) return;
+  uint8_t p[DONGLE_PAYLOAD];
+  memcpy(p, mail, sizeof(p));
+  uint32_t rx_cycles = mail_cycles;
+  __DMB();
+  mail_full = false;
+
+  uint32_t counter = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+  uint8_t command = p[4];
+  if (counter == state.counter) {
+    stats.repeats++;
+    return;
+  }
+  if (!macMatches(counter, command, p + 5) || (command != 'L' && command != 'U')) {
+    stats.bad++;
+    return;
+  }
+  if (counter < state.counter) {
+    stats.replays++;
+    return;
+  }
+  state.counter = counter;
+
+  ActChannel ch = command == 'L' ? ACT_LOCK : ACT_UNLOCK;
+  CmdResult result = commandPress(ch, false);
+  if (result == CMD_BUSY) {
+    stats.busy++;
+  }
+  else {
+    uint32_t cycles = perfCycles() - rx_cycles;
+    stats.lat_n++;
+    stats.lat_total += cycles;
+    if (cycles < stats.lat_min) stats.lat_min = cycles;
+    if (cycles > stats.lat_max) stats.lat_max = cycles;
+  }
+
+  uint8_t data[6] = { ch, result, p[0], p[1], p[2], p[3] };
+  deferPost(DEFER_DONGLE, BLE_CONN_HANDLE_INVALID, data, sizeof(data));
+}
+
+static void start() {
+  period_us = config.dongle_period_ms * 1000UL;
+  window_us = config.dongle_window_us;
+  if (sd_radio_session_open(radioSignal) != NRF_SUCCESS) return;
+  session_open = true;
+  listening = true;
+  stats.since_ms = millis();
+  stats.session_slots = 0;
+  journalLog(JR_DONGLE, JOURNAL_NO_CONN, config.dongle_period_ms, window_us);
+  requestEarliest();
+}
+
+static void stop() {
+  listening = false;          // the slot in progress ends itself
+  closing = true;
+  sd_radio_session_close();
+  session_open = false;
+  journalLog(JR_DONGLE, JOURNAL_NO_CONN, 0);
+}
+
+void dongleLinkBegin() {
+  DongleState stored;
+  bool legacy;
+  if (secureReadFile(DONGLE_FILE, SEAL_DONGLE, &stored, sizeof(stored), &legacy) == sizeof(stored) &&
+      stored.magic == DONGLE_MAGIC && !legacy) {
+    state = stored;
+    key_valid = true;
+    saved_counter = state.counter;
+  }
+  stats.lat_min = UINT32_MAX;
+
+  NVIC_SetPriority(SWI3_EGU3_IRQn, DONGLE_SWI_PRIO);
+  NVIC_ClearPendingIRQ(SWI3_EGU3_IRQn);
+  NVIC_EnableIRQ(SWI3_EGU3_IRQn);
+
+  dongleLinkPoll();
+}
+
+void dongleLinkPoll() {
+  bool want = config.dongle_period_ms && key_valid && !held;
+  if (session_open && (!want || period_us != config.dongle_period_ms * 1000UL ||
+                       window_us != config.dongle_window_us)) {
+    stop();                   // restarted with the new schedule once closed
+  }
+  else if (want && !session_open && !closing) {
+    start();
+  }
+
+  // Across reboots the counter only moves forward
+  uint32_t counter = state.counter;
+  if (key_valid && counter != saved_counter) {
+    if (secureWriteFile(DONGLE_FILE, SEAL_DONGLE, &state, sizeof(state))) saved_counter = counter;
+  }
+}
+
+void dongleLinkHold(bool hold) {
+  held = hold;
+  dongleLinkPoll();
+}
+
+bool dongleLinkIdle() {
+  return !session_open && !closing;
+}
+
+void dongleLinkSocEvent(uint32_t evt) {
+  switch (evt) {
+    case NRF_EVT_RADIO_BLOCKED:
+      stats.blocked++;
+      if (listening) requestEarliest();
+      break;
+    case NRF_EVT_RADIO_CANCELED:
+      stats.canceled++;
+      if (listening) requestEarliest();
+      break;
+    case NRF_EVT_RADIO_SESSION_CLOSED:
+      closing = false;
+      break;
+    default:
+      break;
+  }
+}
+
+bool dongleLinkSetSchedule(uint16_t period_ms, uint16_t window_us) {
+  if (period_ms && (period_ms < DONGLE_PERIOD_MIN_MS || period_ms > DONGLE_PERIOD_MAX_MS ||
+                    window_us < DONGLE_WINDOW_MIN_US || window_us > DONGLE_WINDOW_MAX_US ||
+                    window_us >= period_ms * 1000UL)) {
+    return false;
+  }
+  config.dongle_period_ms = period_ms;
+  if (period_ms) config.dongle_window_us = window_us;
+  configSave();
+  dongleLinkPoll();
+  return true;
+}
+
+void dongleLinkNewKey() {
+  uint8_t key[16];
+  while (sd_rand_application_vector_get(key, sizeof(key)) != NRF_SUCCESS) delay(1);
+
+  NVIC_DisableIRQ(SWI3_EGU3_IRQn);
+  state.magic = DONGLE_MAGIC;
+  memcpy(state.key, key, sizeof(key));
+  state.counter = 0;
+  key_valid = true;
+  NVIC_EnableIRQ(SWI3_EGU3_IRQn);
+
+  secureWriteFile(DONGLE_FILE, SEAL_DONGLE, &state, sizeof(state));
+  saved_counter = 0;
+  stateRegionNoteChange();      // a new key isn't just a counter step
+}
+
+void dongleLinkPrintKey(Print& out) {
+  out.print("dongle key ");
+  if (!key_valid) {
+    out.println("none");
+    return;
+  }
+  for (uint8_t i = 0; i < sizeof(state.key); i++) {
+    if (state.key[i] < 0x10) out.print("0");
+    out.print(state.key[i], HEX);
+  }
+  out.println();
+  out.print("device ");
+  out.println(NRF_FICR->DEVICEID[0], HEX);
+}
+
+void dongleLinkPrintStats(Print& out) {
+  if (!listening) {
+    out.println(key_valid ? "dongle off" : "dongle off (no key)");
+    return;
+  }
+  out.print("dongle ");
+  out.print(period_us / 1000);
+  out.print("ms/");
+  out.print(window_us);
+  out.print("us slots=");
+  out.print(stats.slots);
+  out.print(" blocked=");
+  out.print(stats.blocked);
+  out.print(" canceled=");
+  out.println(stats.canceled);
+
+  out.print(" rx=");
+  out.print(stats.packets);
+  out.print(" crc=");
+  out.print(stats.crc_errors);
+  out.print(" bad=");
+  out.print(stats.bad);
+  out.print(" rep=");
+  out.print(stats.repeats);
+  out.print(" replay=");
+  out.print(stats.replays);
+  out.print(" busy=");
+  out.println(stats.busy);
+
+  if (stats.lat_n) {
+    out.print(" pkt->gpio min/avg/max us=");
+    out.print(stats.lat_min / 64.0f, 1);
+    out.print("/");
+    out.print((float) stats.lat_total / stats.lat_n / 64, 1);
+    out.print("/");
+    out.println(stats.lat_max / 64.0f, 1);
+  }
+
+  // Added current from the slots actually granted, not a measurement: that
+  // comes from a capture (tools/power_profile_analyzer.cpp, "dongle added").
+  // Rate over this listening session only, with the period it runs at
+  uint32_t elapsed_ms = millis() - stats.since_ms;
+  if (listening && elapsed_ms) {
+    float slots_per_s = stats.session_slots * 1000.0f / elapsed_ms;
+    float charge_nc = (float) (DONGLE_RAMP_US + window_us) * DONGLE_RX_UA / 1000 +
+                      (float) DONGLE_XO_LEAD_US * DONGLE_XO_UA / 1000;
+    out.print(" listen model +");
+    out.print(slots_per_s * charge_nc / 1000, 1);
+    out.print("uA (");
+    out.print(slots_per_s, 1);
+    out.println(" slots/s)");
+  }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Proprietary 2.4 GHz link to a companion remote ("dongle"), next to BLE.
+// The SoftDevice hands us the radio in timeslots (Radio Timeslot API): every
+// config.dongle_period_ms we listen for config.dongle_window_us at 2 Mbit on
+// one fixed frequency. No connection, no interval to wait for: a packet is
+// acted on as soon as it has been received.
+//
+// Packet (PCNF: 8-bit length, 5-byte address, CRC16), payload:
+//   counter (4, LE) | command (1: 'L' lock, 'U' unlock) | mac (8)
+// mac = first 8 bytes of AES-128(key, "KFDL" | DEVICEID[0] | counter | command | 0...)
+// The counter must go up; the remote repeats the same packet for at least
+// one period, the repeats are dropped. The key is made on the fob with
+// "dongle key" (printed for flashing into the remote) and kept sealed with
+// the last counter in DONGLE_FILE.
+//
+// Actuation is commandPress() as for BLE, from a software interrupt: the
+// radio signal handler runs at the SoftDevice's priority and can't make SVC
+// calls (ECB). Acks, logging and the counter save are in loop().
+#define DONGLE_FILE          "/dongle.bin"
+#define DONGLE_FREQ          77      // 2477 MHz: above Wi-Fi ch 11, between BLE data channels 35/36
+#define DONGLE_BASE_ADDR     0x4B46444Cu
+#define DONGLE_PREFIX        0xA5
+#define DONGLE_PAYLOAD       13      // counter + command + mac
+#define DONGLE_MAC_SIZE      8
+#define DONGLE_PERIOD_MIN_MS 10
+#define DONGLE_PERIOD_MAX_MS 10000
+#define DONGLE_WINDOW_MIN_US 200     // ramp-up plus one packet with margin
+#define DONGLE_WINDOW_MAX_US 5000
+#define DONGLE_WINDOW_DEF_US 600
+#define DONGLE_RAMP_US       40      // RADIO fast ramp-up
+#define DONGLE_SLOT_EXTRA_US 100     // slot length past the window: radio disable, end
+#define DONGLE_SWI_PRIO      6       // verification + press; below SVC (4), so sd_ecb_* is allowed
+
+// Added current model: RX at 2 Mbit with DC/DC, and the HFXO the SoftDevice
+// starts ahead of each slot
+#define DONGLE_RX_UA         5300
+#define DONGLE_XO_UA         250
+#define DONGLE_XO_LEAD_US    1500
+
+void dongleLinkBegin();              // after configLoad() and secureBegin(); listens if configured
+void dongleLinkPoll();               // from loop(): follows config, saves the counter
+void dongleLinkSocEvent(uint32_t evt);
+bool dongleLinkSetSchedule(uint16_t period_ms, uint16_t window_us);   // 0 = off; persisted
+void dongleLinkHold(bool hold);       // give up the timeslot session for a while (channel survey)
+bool dongleLinkIdle();                // no session open or closing
+void dongleLinkNewKey();             // counter back to 0; the remote's counter starts at 1
+void dongleLinkPrintKey(Print& out); // key and device ID, for flashing into the remote
+void dongleLinkPrintStats(Print& out);
@@ -0,0 +1,347 @@
+/*
+ * Energy-budget governor
+ *
+ * Once a minute:
+ *   budget_mA = remaining_mAh / hours_to_target
+ *   level     = most responsive level with model_mA * margin <= budget_mA
+ * then one level more responsive during hour slots where presses usually
+ * happen. Remaining charge comes from the battery voltage (VDDH/5 on the
+ * SAADC) when it reads sane, otherwise from integrating the modeled current.
+ *
+ * The per-level currents are hand estimates in line with the power analysis
+ * in ARCHITECTURE.md. A calibration fitted from current captures
+ * (CALIB.BIN, tools/power_profile_analyzer.cpp) replaces them entry by
+ * entry, and adds the charge per press.
+ */
+
+#include "energy_governor.h"
+#include "config.h"
+#include "config_store.h"
+#include "link_policy.h"
+#include "adv_policy.h"
+#include "journal.h"
+#include "actuation.h"
+#include "secure_store.h"
+#include "hid_remote.h"
+#include <bluefruit.h>
+
+struct GovSettings {
+  int8_t   tx_dbm;
+  uint16_t adv_fast;        // units of 0.625ms
+  uint16_t adv_slow;
+  uint16_t conn_min;        // units of 1.25ms
+  uint16_t conn_max;
+  uint16_t latency;
+  bool     led;
+  float    adv_ma;          // modeled average current while advertising
+  float    conn_ma;         // ... while connected
+};
+
+static const GovSettings levels[GOV_LEVELS] = {
+  //  dBm  adv fast/slow  conn min/max  lat  LED    adv mA  conn mA
+  {    4,   32,  244,      12,  24,      0,  true,  7.5f,   10.0f },
+  {    0,  160,  668,      24,  40,      4,  true,  3.0f,    4.5f },
+  {   -4,  320, 1636,      48,  80,      8,  false, 1.5f,    2.0f },
+  {   -8,  668, 3200,      80, 160,      6,  false, 0.8f,    1.2f },
+};
+
+static const char* const level_names[GOV_LEVELS] = { "performance", "balanced", "saver", "minimum" };
+
+// LiPo open-circuit voltage -> state of charge
+static const uint16_t soc_mv[]  = { 3300, 3500, 3600, 3650, 3700, 3750, 3800, 3900, 4000, 4100, 4200 };
+static const uint8_t  soc_pct[] = {    0,    5,   10,   18,   28,   38,   48,   64,   78,   90,  100 };
+
+static EnergyCalib calib;
+static bool calibrated = false;
+
+static GovLevel level = GOV_PERFORMANCE;
+static bool likely_window = false;
+static bool on_usb = false;
+static bool power_low = false;          // after a power-fail warning (power_fail.cpp)
+
+static uint32_t last_poll_ms = 0;
+static uint32_t uptime_s = 0;
+static uint32_t target_elapsed_s = 0;
+
+static uint16_t battery_mv = 0;
+static float soc = 100.0f;              // percent
+static float model_used_mah = 0.0f;     // integrated since boot
+static float conn_fraction = 0.0f;      // share of time connected, smoothed
+static uint16_t use_hist[24];           // presses per hour slot (uptime modulo 24h)
+
+uint16_t governorReadBatteryMv() {
+#ifdef NRF52840_XXAA
+  // 0.6V reference, gain 1/6 -> 3.6V full scale on VDDH/5
+  analogReference(AR_DEFAULT);
+  analogReadResolution(12);
+  uint32_t raw = analogReadVDDHDIV5();
+  return raw * 3600UL * 5 / 4095;
+#else
+  return 0;
+#endif
+}
+
+static float socFromMv(uint16_t mv) {
+  if (mv <= soc_mv[0]) return 0;
+  for (uint8_t i = 1; i < sizeof(soc_mv) / sizeof(soc_mv[0]); i++) {
+    if (mv <= soc_mv[i]) {
+      float t = float(mv - soc_mv[i - 1]) / (soc_mv[i] - soc_mv[i - 1]);
+      return soc_pct[i - 1] + t * (soc_pct[i] - soc_pct[i - 1]);
+    }
+  }
+  return 100;
+}
+
+static float modelMa(GovLevel lvl) {
+  const GovSettings& s = levels[lvl];
+  float adv_ma = calib.adv_ua[lvl] ? calib.adv_ua[lvl] / 1000.0f : s.adv_ma;
+  float conn_ma = calib.conn_ua[lvl] ? calib.conn_ua[lvl] / 1000.0f : s.conn_ma;
+  // A HID remote's link or scan comes on top, whatever the level
+  return adv_ma * (1 - conn_fraction) + conn_ma * conn_fraction + hidRemoteModelUa() / 1000.0f;
+}
+
+// uC -> mAh
+static float pressMah(GovLevel lvl) {
+  if (!calib.press_uc) return GOV_PRESS_UC / 3600000.0f;
+  uint32_t uc = calib.press_uc + (levels[lvl].led ? calib.led_uc : 0);
+  return uc / 3600000.0f;
+}
+
+static void calibDefaults() {
+  memset(&calib, 0, sizeof(calib));
+  calib.magic = CALIB_MAGIC;
+  calib.version = CALIB_VERSION;
+  calib.levels = CALIB_LEVELS;
+  calib.size = sizeof(calib);
+}
+
+static bool calibValid(const EnergyCalib& c) {
+  if (c.magic != CALIB_MAGIC || c.version != CALIB_VERSION || c.levels != CALIB_LEVELS ||
+      c.size != sizeof(EnergyCalib)) return false;
+  for (uint8_t i = 0; i < CALIB_LEVELS; i++) {
+    if (c.adv_ua[i] > GOV_CALIB_MAX || c.conn_ua[i] > GOV_CALIB_MAX) return false;
+  }
+  return c.press_uc <= GOV_CALIB_MAX && c.led_uc <= GOV_CALIB_MAX;
+}
+
+static void applyLevel(GovLevel lvl) {
+  const GovSettings& s = levels[lvl];
+
+  Bluefruit.setTxPower(s.tx_dbm);
+  for (uint16_t h = 0; h < BLE_MAX_CONNECTION; h++) {
+    if (Bluefruit.connected(h)) sd_ble_gap_tx_power_set(BLE_GAP_TX_POWER_ROLE_CONN, h, s.tx_dbm);
+  }
+
+  advPolicySetInterval(s.adv_fast, s.adv_slow);
+
+  linkPolicySetParams(s.conn_min, s.conn_max, s.latency);
+  actuationSetLed(s.led);
+}
+
+static bool inLikelyWindow() {
+  uint32_t total = 0;
+  for (uint8_t i = 0; i < 24; i++) total += use_hist[i];
+  uint16_t here = use_hist[(uptime_s / 3600) % 24];
+  return here >= GOV_LIKELY_MIN_USES && here * 24 >= total * 2;  // at least 2x the average slot
+}
+
+static float hoursToTarget() {
+  if (config.target_runtime_h == 0) return 0;
+  float left_s = (float) config.target_runtime_h * 3600 - target_elapsed_s;
+  return left_s > 0 ? left_s / 3600 : 0;
+}
+
+static GovLevel chooseLevel() {
+  if (power_low) return GOV_MINIMUM;
+  float hours = hoursToTarget();
+  if (config.target_runtime_h == 0 || hours <= 0 || on_usb) return GOV_PERFORMANCE;
+
+  float budget_ma = soc / 100 * BATTERY_MAH / hours;
+  uint8_t lvl = GOV_MINIMUM;
+  for (uint8_t i = 0; i < GOV_LEVELS; i++) {
+    if (modelMa((GovLevel) i) * GOV_MARGIN_PCT / 100 <= budget_ma) {
+      lvl = i;
+      break;
+    }
+  }
+
+  likely_window = inLikelyWindow();
+  if (likely_window && lvl > GOV_PERFORMANCE) lvl--;
+  return (GovLevel) lvl;
+}
+
+static void evaluate() {
+  uint32_t status = 0;
+  bool was_usb = on_usb;
+  on_usb = sd_power_usbregstatus_get(&status) == NRF_SUCCESS &&
+           (status & POWER_USBREGSTATUS_VBUSDETECT_Msk);
+  if (on_usb != was_usb) journalLog(JR_USB, JOURNAL_NO_CONN, on_usb);
+
+  uint16_t mv = governorReadBatteryMv();
+  if (!on_usb && mv >= 2800 && mv <= 4300) {
+    float measured = socFromMv(mv);
+    soc = battery_mv == 0 ? measured : soc + (measured - soc) / 4;
+    battery_mv = mv;
+  }
+  else if (!on_usb) {
+    soc = 100.0f - model_used_mah * 100 / BATTERY_MAH;
+    if (soc < 0) soc = 0;
+  }
+
+  static uint8_t evaluations = 0;
+  if (evaluations++ % GOV_JOURNAL_EVERY == 0) {
+    journalLog(JR_BATTERY, JOURNAL_NO_CONN, battery_mv, (uint32_t) soc);
+  }
+
+  GovLevel next = chooseLevel();
+  if (next != level) {
+    Serial.print("Governor: ");
+    Serial.print(level_names[level]);
+    Serial.print(" -> ");
+    Serial.println(level_names[next]);
+    level = next;
+    applyLevel(level);
+    journalLog(JR_GOV_LEVEL, JOURNAL_NO_CONN, level);
+  }
+}
+
+void governorBegin() {
+  calibDefaults();
+  EnergyCalib stored;
+  bool legacy;
+  if (secureReadFile(GOV_CALIB_FILE, SEAL_CALIB, &stored, sizeof(stored), &legacy) == sizeof(stored) &&
+      calibValid(stored)) {
+    calib = stored;
+    calibrated = true;
+    if (legacy) secureWriteFile(GOV_CALIB_FILE, SEAL_CALIB, &calib, sizeof(calib));
+  }
+
+  // Resumes where the last boot left off, to the hour
+  target_elapsed_s = (uint32_t) config.target_elapsed_h * 3600;
+
+  last_poll_ms = millis();
+  evaluate();
+}
+
+void governorPoll() {
+  uint32_t now = millis();
+  uint32_t dt_ms = now - last_poll_ms;
+  if (dt_ms < GOV_PERIOD_MS) return;
+  last_poll_ms = now;
+
+  uptime_s += dt_ms / 1000;
+  target_elapsed_s += dt_ms / 1000;
+
+  // Saved once an hour: a reboot loses at most that much of the countdown
+  uint32_t elapsed_h = target_elapsed_s / 3600;
+  if (config.target_runtime_h && elapsed_h > config.target_elapsed_h &&
+      config.target_elapsed_h < config.target_runtime_h) {
+    config.target_elapsed_h = elapsed_h < config.target_runtime_h ? elapsed_h : config.target_runtime_h;
+    configSave();
+  }
+
+  // Sampled once per period, smoothed over ~8 periods
+  conn_fraction += ((Bluefruit.connected() > hidRemoteLinks() ? 1.0f : 0.0f) - conn_fraction) / 8;
+  model_used_mah += modelMa(level) * dt_ms / 3600000.0f;
+
+  evaluate();
+}
+
+void governorNotePress() {
+  uint16_t& slot = use_hist[(uptime_s / 3600) % 24];
+  if (slot < 0xFFFF) slot++;
+  model_used_mah += pressMah(level);
+}
+
+void governorSetTarget(uint16_t hours) {
+  config.target_runtime_h = hours;
+  config.target_elapsed_h = 0;
+  target_elapsed_s = 0;
+  configSave();
+  evaluate();
+}
+
+void governorSetPowerLow(bool low) {
+  if (low == power_low) return;
+  power_low = low;
+  evaluate();
+}
+
+bool governorApplyCalib(const EnergyCalib& c) {
+  if (!calibValid(c)) return false;
+  if (!secureWriteFile(GOV_CALIB_FILE, SEAL_CALIB, &c, sizeof(c))) return false;
+  calib = c;
+  calibrated = true;
+  evaluate();
+  return true;
+}
+
+uint32_t governorCalibExportSize() {
+  return sizeof(EnergyCalib);
+}
+
+uint32_t governorCalibExportRead(uint32_t offset, uint8_t* buf, uint32_t len) {
+  if (offset >= sizeof(calib)) return 0;
+  if (len > sizeof(calib) - offset) len = sizeof(calib) - offset;
+  memcpy(buf, (const uint8_t*) &calib + offset, len);
+  return len;
+}
+
+void governorExportLearned(GovLearned* out) {
+  memcpy(out->use_hist, use_hist, sizeof(use_hist));
+  out->phase_s = uptime_s % 86400;
+  out->conn_fraction = conn_fraction;
+}
+
+void governorImportLearned(const void* data, uint16_t len) {
+  GovLearned in;
+  governorExportLearned(&in);
+  memcpy(&in, data, len < sizeof(in) ? len : sizeof(in));
+  if (in.phase_s >= 86400 || !(in.conn_fraction >= 0.0f && in.conn_fraction <= 1.0f)) return;
+
+  // The hour slots carry on where the last run left off
+  memcpy(use_hist, in.use_hist, sizeof(use_hist));
+  uptime_s = in.phase_s;
+  conn_fraction = in.conn_fraction;
+}
+
+GovLevel governorLevel() {
+  return level;
+}
+
+void governorPrintStatus(Print& out) {
+  out.print("gov level=");
+  out.print(level_names[level]);
+  if (power_low) out.print(" (supply low)");
+  else if (likely_window) out.print(" (likely-use window)");
+  out.println();
+
+  if (on_usb) {
+    out.println("on USB power");
+  }
+  else {
+    out.print("batt ");
+    out.print(battery_mv);
+    out.print("mV soc=");
+    out.print(soc, 0);
+    out.print("% model=");
+    out.print(modelMa(level), 1);
+    out.println(calibrated ? "mA (calibrated)" : "mA");
+
+    // Projected end of charge at the current level
+    out.print("empty in ");
+    out.print(soc / 100 * BATTERY_MAH / modelMa(level), 1);
+    out.println("h");
+  }
+
+  if (config.target_runtime_h == 0) {
+    out.println("no target (runtime <hours> to set)");
+  }
+  else {
+    out.print("target ");
+    out.print(config.target_runtime_h);
+    out.print("h, ");
+    out.print(hoursToTarget(), 1);
+    out.println("h left");
+  }
+}
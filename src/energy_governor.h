@@ -0,0 +1,56 @@
+#pragma once
+
+#include <Arduino.h>
+#include "journal_records.h"
+
+// Energy-budget governor. Given a target runtime (config.target_runtime_h,
+// counted from when it was set; the hours used are saved with the config,
+// so a reboot resumes the countdown), compares state of charge with
+// the time left and picks the most responsive level whose modeled current
+// still fits the budget.
+enum GovLevel : uint8_t {
+  GOV_PERFORMANCE = 0,  // boot defaults: +4 dBm, 20ms fast adv, 15-30ms conn
+  GOV_BALANCED,
+  GOV_SAVER,            // LED off, no connect banner
+  GOV_MINIMUM,
+  GOV_LEVELS
+};
+
+#define GOV_PERIOD_MS       60000UL   // re-evaluate once a minute
+#define GOV_MARGIN_PCT      110       // modeled current must fit with 10% to spare
+#define GOV_LIKELY_MIN_USES 2         // presses in an hour slot before it counts as likely
+#define GOV_JOURNAL_EVERY   10        // battery journaled every 10th evaluation
+#define GOV_CALIB_FILE      "/calib.bin"
+#define GOV_PRESS_UC        10200     // built-in charge per press: 34 mA for 300 ms, LED included
+#define GOV_CALIB_MAX       100000    // sanity limit for calibrated uA / uC values
+
+static_assert(GOV_LEVELS == CALIB_LEVELS, "EnergyCalib covers every level");
+
+// What the governor learns while running, kept in the state region
+// (state_region.cpp) so a reboot or update doesn't start it from zero.
+// New fields go at the end.
+#define GOV_LEARNED_VERSION 1
+
+struct GovLearned {
+  uint16_t use_hist[24];    // presses per hour slot
+  uint32_t phase_s;         // uptime modulo a day when saved: the slots' origin
+  float    conn_fraction;
+};
+
+void governorBegin();                 // after setupBLE()
+void governorPoll();
+void governorNotePress();             // feeds the likely-use histogram
+void governorSetTarget(uint16_t hours);
+void governorSetPowerLow(bool low);   // power-fail warning: GOV_MINIMUM until cleared
+uint16_t governorReadBatteryMv();     // VDDH now, 0 where it can't be read
+GovLevel governorLevel();
+void governorPrintStatus(Print& out);
+
+// Measured per-level currents (tools/power_profile_analyzer.cpp). Checked,
+// saved and used from the next evaluation; false if rejected.
+bool governorApplyCalib(const EnergyCalib& c);
+uint32_t governorCalibExportSize();
+uint32_t governorCalibExportRead(uint32_t offset, uint8_t* buf, uint32_t len);
+
+void governorExportLearned(GovLearned* out);
+void governorImportLearned(const void* data, uint16_t len);   // before governorBegin(); shorter = older, rest stays
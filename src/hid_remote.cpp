@@ -0,0 +1,730 @@
+/*
+ * BLE HID remote over the central role
+ *
+ * Bluefruit does the scanning, the connect and keeps the bond; the rest is
+ * SoftDevice calls stepped from hidRemoteEvent() in the BLE task, so
+ * nothing waits on the radio:
+ *   connected   encrypt with the stored bond, or pair (Just Works, bond)
+ *   secured     HID service -> characteristics -> each input Report's CCCD
+ *               (skipped on a reconnect: the handles are kept in RAM)
+ *   subscribed  notifications on, then our connection parameters; reports
+ *               are acted on from here only
+ * Bluefruit's client classes find one characteristic per UUID, and a HID
+ * service has several Report characteristics, hence the raw discovery.
+ *
+ * Setup runs at HID_SETUP_INTERVAL, so the round trips are quick; then the
+ * link goes to config.hid_interval_ms with slave latency. Many remotes ask
+ * for a short interval of their own once connected; they get ours back up
+ * to HID_PARAM_RETRIES times.
+ *
+ * Latency: a notification is handled in this task as it arrives, so the
+ * measured part is radio event end (radio_activity.cpp) -> pulse armed:
+ * SoftDevice, BLE task wake-up, Bluefruit's dispatch and ours. Before that
+ * the report waits for the next connection event, 0 to one interval.
+ */
+
+#include "hid_remote.h"
+#include "commands.h"
+#include "config_store.h"
+#include "deferred.h"
+#include "link_cache.h"
+#include "radio_activity.h"
+#include "state_region.h"
+#include "perf.h"
+
+#define HID_LAT_MAX_CYCLES   (20 * 64000)   // radio end further back than this: not the remote's event
+
+enum HidStep : uint8_t {
+  HID_IDLE,                 // no remote, or waiting for loop() to scan
+  HID_SCANNING,
+  HID_CONNECTING,
+  HID_SECURING,
+  HID_DISC_SERVICE,
+  HID_DISC_CHARS,
+  HID_DISC_DESCS,
+  HID_SUBSCRIBING,
+  HID_READY,
+  HID_STEPS
+};
+
+struct HidReport {
+  uint16_t value;           // Report value handle
+  uint16_t end;             // last handle before the next characteristic
+  uint16_t cccd;
+  bool     down;            // a key is held in this report
+};
+
+struct HidStats {
+  uint32_t connects;
+  uint32_t disconnects;
+  uint32_t setup_failed;    // timed out, or no input reports
+  uint32_t secure_failed;
+  uint32_t ready_count;
+  uint32_t ready_total_ms;  // link lost (or boot) to subscribed
+  uint32_t ready_last_ms;
+  uint32_t reports;
+  uint32_t early;           // before the link was secured and subscribed: dropped
+  uint32_t presses;
+  uint32_t busy;
+  uint32_t unassigned;
+  uint32_t lat_n;
+  uint64_t lat_total;       // radio event end -> armed, cycles
+  uint32_t lat_min;
+  uint32_t lat_max;
+  uint32_t param_asked;
+  uint32_t param_overridden;     // the remote's parameters took over again
+  uint32_t scan_ms[2];           // [slow, fast]
+};
+
+static const char* const step_names[HID_STEPS] = {
+  "idle", "scanning", "connecting", "securing", "service", "chars", "descs", "subscribing", "ready"
+};
+
+static volatile HidStep step = HID_IDLE;
+static volatile uint16_t conn = BLE_CONN_HANDLE_INVALID;
+static volatile uint32_t step_ms = 0;
+static volatile bool pairing = false;
+static volatile bool paired_new = false;       // bonded: loop() saves the identity from the bond
+static volatile int8_t learn_ch = -1;
+static uint32_t pair_started_ms = 0;
+static uint32_t lost_ms = 0;                   // scan fast for a while after this
+static bool scan_fast = false;
+static uint32_t scan_started_ms = 0;
+static bool ready_reported = false;
+
+static HidReport reports[HID_REPORTS_MAX];
+static uint8_t report_count = 0;               // also the handle cache: same remote, no discovery
+static uint8_t report_at = 0;
+static ble_gattc_handle_range_t service_range;
+static ble_gap_addr_t peer;
+static uint16_t interval = 0;                  // 1.25 ms units, as on air
+static uint16_t latency = 0;
+static uint8_t param_tries = 0;
+static const uint8_t cccd_notify[2] = { BLE_GATT_HVX_NOTIFICATION, 0 };
+static HidStats stats;
+
+static uint16_t intervalMs() {
+  return config.hid_interval_ms ? config.hid_interval_ms : HID_INTERVAL_DEF_MS;
+}
+
+static void setStep(HidStep s) {
+  step = s;
+  step_ms = millis();
+}
+
+static bool hasIrk() {
+  static const uint8_t zero_irk[16] = { 0 };
+  return memcmp(config.hid_irk, zero_irk, 16) != 0;
+}
+
+// The remote advertises and connects from a private address that changes;
+// the bond's identity address is only seen if it has no IRK
+static bool isRemote(const ble_gap_addr_t& a) {
+  if (!config.hid_remote) return false;
+  if (a.addr_type == BLE_GAP_ADDR_TYPE_RANDOM_PRIVATE_RESOLVABLE && hasIrk()) return linkCacheResolve(config.hid_irk, a.addr);
+  return a.addr_type == config.hid_addr_type && memcmp(a.addr, config.hid_addr, 6) == 0;
+}
+
+static void drop() {
+  sd_ble_gap_disconnect(conn, BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+}
+
+// ---------------------------------------------------------------------------
+// Scanning (callback in the BLE task)
+
+static bool looksLikeRemote(ble_gap_evt_adv_report_t* report) {
+  if (!report->type.connectable) return false;
+  if (!pairing) return isRemote(report->peer_addr);
+  if (report->rssi < HID_PAIR_RSSI) return false;
+
+  if (Bluefruit.Scanner.checkReportForUuid(report, UUID16_SVC_HUMAN_INTERFACE_DEVICE)) return true;
+  uint8_t appearance[2];
+  if (Bluefruit.Scanner.parseReportByType(report, BLE_GAP_AD_TYPE_APPEARANCE, appearance, 2) == 2) {
+    uint16_t a = appearance[0] | (appearance[1] << 8);
+    return (a >> 6) == (BLE_APPEARANCE_GENERIC_HID >> 6);
+  }
+  return false;
+}
+
+static void scanCallback(ble_gap_evt_adv_report_t* report) {
+  if (step == HID_SCANNING && looksLikeRemote(report) && Bluefruit.Central.connect(report)) {
+    stats.scan_ms[scan_fast] += millis() - scan_started_ms;
+    setStep(HID_CONNECTING);
+    return;
+  }
+  Bluefruit.Scanner.resume();
+}
+
+static void scanStop(uint32_t now) {
+  Bluefruit.Scanner.stop();
+  stats.scan_ms[scan_fast] += now - scan_started_ms;
+}
+
+static void scanStart(uint32_t now, bool fast) {
+  scan_fast = fast;
+  scan_started_ms = now;
+  if (fast) Bluefruit.Scanner.setInterval(HID_SCAN_FAST_INTERVAL, HID_SCAN_FAST_WINDOW);
+  else Bluefruit.Scanner.setInterval(HID_SCAN_SLOW_INTERVAL, HID_SCAN_SLOW_WINDOW);
+  Bluefruit.Scanner.start(0);
+}
+
+// ---------------------------------------------------------------------------
+// Setup steps (BLE task)
+
+static void requestParams() {
+  uint16_t ms = intervalMs();
+  uint32_t timeout_ms = (1 + HID_SLAVE_LATENCY) * ms * 3UL;
+  if (timeout_ms < HID_SUP_TIMEOUT_MS) timeout_ms = HID_SUP_TIMEOUT_MS;
+  if (timeout_ms > 32000) timeout_ms = 32000;
+
+  ble_gap_conn_params_t p;
+  p.min_conn_interval = ms * 4 / 5;
+  p.max_conn_interval = ms * 4 / 5;
+  p.slave_latency     = HID_SLAVE_LATENCY;
+  p.conn_sup_timeout  = timeout_ms / 10;
+  if (sd_ble_gap_conn_param_update(conn, &p) == NRF_SUCCESS) stats.param_asked++;
+}
+
+static void secure() {
+  setStep(HID_SECURING);
+  BLEConnection* c = Bluefruit.Connection(conn);
+  bond_keys_t keys;
+  if (!pairing && c && c->loadKeys(&keys)) {
+    sd_ble_gap_encrypt(conn, &keys.peer_enc.master_id, &keys.peer_enc.enc_info);
+    return;
+  }
+
+  ble_gap_sec_params_t p;
+  memset(&p, 0, sizeof(p));
+  p.bond = 1;
+  p.io_caps = BLE_GAP_IO_CAPS_NONE;
+  p.min_key_size = 7;
+  p.max_key_size = 16;
+  p.kdist_own.enc = 1;
+  p.kdist_own.id = 1;
+  p.kdist_peer.enc = 1;
+  p.kdist_peer.id = 1;
+  sd_ble_gap_authenticate(conn, &p);
+}
+
+static void discoverChars(uint16_t from) {
+  ble_gattc_handle_range_t range = { from, service_range.end_handle };
+  if (sd_ble_gattc_characteristics_discover(conn, &range) != NRF_SUCCESS) drop();
+}
+
+// Next report from report_at that has handles left for descriptors
+static void discoverDescs(uint16_t from) {
+  while (report_at < report_count && reports[report_at].end <= reports[report_at].value) report_at++;
+  if (report_at == report_count) return;
+  ble_gattc_handle_range_t range = { from ? from : (uint16_t) (reports[report_at].value + 1), reports[report_at].end };
+  if (sd_ble_gattc_descriptors_discover(conn, &range) != NRF_SUCCESS) drop();
+}
+
+static void ready() {
+  setStep(HID_READY);
+  uint32_t ms = millis() - lost_ms;
+  stats.ready_count++;
+  stats.ready_total_ms += ms;
+  stats.ready_last_ms = ms;
+  param_tries = 0;
+  requestParams();
+}
+
+static void subscribeNext() {
+  if (report_at == report_count) {
+    ready();
+    return;
+  }
+  ble_gattc_write_params_t w;
+  memset(&w, 0, sizeof(w));
+  w.write_op = BLE_GATT_OP_WRITE_REQ;
+  w.handle = reports[report_at].cccd;
+  w.len = sizeof(cccd_notify);
+  w.p_value = cccd_notify;
+  if (sd_ble_gattc_write(conn, &w) != NRF_SUCCESS) drop();
+}
+
+static void subscribe() {
+  setStep(HID_SUBSCRIBING);
+  report_at = 0;
+  subscribeNext();
+}
+
+// Reports without a CCCD can't notify; the rest move to the front
+static void descsDone() {
+  uint8_t kept = 0;
+  for (uint8_t i = 0; i < report_count; i++) {
+    if (reports[i].cccd) reports[kept++] = reports[i];
+  }
+  report_count = kept;
+  if (!report_count) {
+    stats.setup_failed++;
+    drop();
+    return;
+  }
+  subscribe();
+}
+
+static void onServices(const ble_gattc_evt_t& e) {
+  const ble_gattc_evt_prim_srvc_disc_rsp_t& r = e.params.prim_srvc_disc_rsp;
+  if (e.gatt_status != BLE_GATT_STATUS_SUCCESS || r.count == 0) {
+    stats.setup_failed++;
+    drop();
+    return;
+  }
+  service_range = r.services[0].handle_range;
+  report_count = 0;
+  setStep(HID_DISC_CHARS);
+  discoverChars(service_range.start_handle);
+}
+
+static void onChars(const ble_gattc_evt_t& e) {
+  const ble_gattc_evt_char_disc_rsp_t& r = e.params.char_disc_rsp;
+  if (e.gatt_status == BLE_GATT_STATUS_SUCCESS && r.count) {
+    uint16_t last = 0;
+    for (uint16_t i = 0; i < r.count; i++) {
+      const ble_gattc_char_t& c = r.chars[i];
+      // The previous report's descriptors end before this declaration
+      if (report_count && reports[report_count - 1].end == 0) reports[report_count - 1].end = c.handle_decl - 1;
+      if (c.uuid.type == BLE_UUID_TYPE_BLE && c.uuid.uuid == BLE_UUID_REPORT_CHAR && c.char_props.notify &&
+          report_count < HID_REPORTS_MAX) {
+        reports[report_count++] = { c.handle_value, 0, 0, false };
+      }
+      last = c.handle_value;
+    }
+    if (last < service_range.end_handle) {
+      discoverChars(last + 1);
+      return;
+    }
+  }
+
+  // Attribute not found: past the last characteristic
+  if (report_count && reports[report_count - 1].end == 0) reports[report_count - 1].end = service_range.end_handle;
+  setStep(HID_DISC_DESCS);
+  report_at = 0;
+  discoverDescs(0);
+  if (report_at == report_count) descsDone();
+}
+
+static void onDescs(const ble_gattc_evt_t& e) {
+  const ble_gattc_evt_desc_disc_rsp_t& r = e.params.desc_disc_rsp;
+  HidReport& rep = reports[report_at];
+  uint16_t last = 0;
+  if (e.gatt_status == BLE_GATT_STATUS_SUCCESS) {
+    for (uint16_t i = 0; i < r.count; i++) {
+      if (r.descs[i].uuid.uuid == BLE_UUID_DESCRIPTOR_CLIENT_CHAR_CONFIG) rep.cccd = r.descs[i].handle;
+      last = r.descs[i].handle;
+    }
+  }
+  if (!rep.cccd && r.count && last && last < rep.end) {
+    discoverDescs(last + 1);
+    return;
+  }
+  report_at++;
+  discoverDescs(0);
+  if (report_at == report_count) descsDone();
+}
+
+// ---------------------------------------------------------------------------
+// Reports
+
+static void post(uint8_t ch, CmdResult result, uint16_t key) {
+  uint8_t data[4] = { ch, result, (uint8_t) key, (uint8_t) (key >> 8) };
+  deferPost(DEFER_HID, conn, data, sizeof(data));
+}
+
+// Key code: report index | offset of the first non-zero byte | that byte
+static void keyDown(uint16_t key) {
+  int8_t learn = learn_ch;
+  if (learn >= 0) {
+    learn_ch = -1;
+    post(learn, CMD_IGNORED, key);
+    return;
+  }
+
+  int8_t ch = -1;
+  for (uint8_t i = 0; i < ACT_CHANNELS; i++) {
+    if (config.hid_keys[i] == key) ch = i;
+  }
+  if (ch < 0) {
+    stats.unassigned++;
+    post(0xFF, CMD_UNASSIGNED, key);
+    return;
+  }
+
+  CmdResult result = commandPress((ActChannel) ch);
+  if (result == CMD_BUSY) {
+    stats.busy++;
+  }
+  else {
+    stats.presses++;
+    uint32_t cycles = perfCycles() - radioLastEndCycles();
+    if (cycles < HID_LAT_MAX_CYCLES) {
+      stats.lat_n++;
+      stats.lat_total += cycles;
+      if (cycles < stats.lat_min) stats.lat_min = cycles;
+      if (cycles > stats.lat_max) stats.lat_max = cycles;
+    }
+  }
+  post(ch, result, key);
+}
+
+static void onReport(const ble_gattc_evt_hvx_t& x) {
+  uint8_t r = 0;
+  while (r < report_count && reports[r].value != x.handle) r++;
+  if (r == report_count) return;
+  stats.reports++;
+
+  uint8_t at = 0;
+  while (at < x.len && !x.data[at]) at++;
+  if (at == x.len) {
+    reports[r].down = false;        // all keys up
+    return;
+  }
+  if (reports[r].down) return;      // held, or another key with it
+  reports[r].down = true;
+  keyDown((r << 12) | ((at & 0x0F) << 8) | x.data[at]);
+}
+
+// ---------------------------------------------------------------------------
+
+void hidRemoteBegin() {
+  stats.lat_min = UINT32_MAX;
+  lost_ms = millis();
+
+  Bluefruit.Scanner.setRxCallback(scanCallback);
+  Bluefruit.Scanner.restartOnDisconnect(false);   // hidRemotePoll() decides
+  Bluefruit.Scanner.useActiveScan(false);
+  Bluefruit.Central.setConnInterval(HID_SETUP_INTERVAL, HID_SETUP_INTERVAL);
+  Bluefruit.Central.setConnSupervisionTimeout(HID_SUP_TIMEOUT_MS / 10);
+}
+
+void hidRemoteEvent(ble_evt_t* evt) {
+  uint16_t h = evt->evt.common_evt.conn_handle;
+
+  switch (evt->header.evt_id) {
+    case BLE_GAP_EVT_CONNECTED: {
+      const ble_gap_evt_connected_t& c = evt->evt.gap_evt.params.connected;
+      if (c.role != BLE_GAP_ROLE_CENTRAL) return;
+      conn = h;
+      peer = c.peer_addr;
+      interval = c.conn_params.max_conn_interval;
+      latency = c.conn_params.slave_latency;
+      stats.connects++;
+      if (pairing || !isRemote(peer)) report_count = 0;
+      secure();
+      return;
+    }
+
+    case BLE_GAP_EVT_TIMEOUT:
+      if (evt->evt.gap_evt.params.timeout.src == BLE_GAP_TIMEOUT_SRC_CONN && step == HID_CONNECTING) setStep(HID_IDLE);
+      return;
+
+    default:
+      break;
+  }
+
+  if (conn == BLE_CONN_HANDLE_INVALID || h != conn) return;
+  const ble_gattc_evt_t& g = evt->evt.gattc_evt;
+
+  switch (evt->header.evt_id) {
+    case BLE_GAP_EVT_CONN_SEC_UPDATE:
+      if (step != HID_SECURING || evt->evt.gap_evt.params.conn_sec_update.conn_sec.sec_mode.lv < 2) break;
+      if (report_count) {
+        subscribe();
+      }
+      else {
+        ble_uuid_t hid = { UUID16_SVC_HUMAN_INTERFACE_DEVICE, BLE_UUID_TYPE_BLE };
+        setStep(HID_DISC_SERVICE);
+        if (sd_ble_gattc_primary_services_discover(conn, 1, &hid) != NRF_SUCCESS) drop();
+      }
+      break;
+
+    case BLE_GAP_EVT_AUTH_STATUS: {
+      const ble_gap_evt_auth_status_t& a = evt->evt.gap_evt.params.auth_status;
+      if (a.auth_status != BLE_GAP_SEC_STATUS_SUCCESS) {
+        stats.secure_failed++;
+        drop();
+      }
+      else if (pairing && a.bonded) {
+        pairing = false;
+        paired_new = true;
+      }
+      break;
+    }
+
+    case BLE_GATTC_EVT_PRIM_SRVC_DISC_RSP:
+      if (step == HID_DISC_SERVICE) onServices(g);
+      break;
+
+    case BLE_GATTC_EVT_CHAR_DISC_RSP:
+      if (step == HID_DISC_CHARS) onChars(g);
+      break;
+
+    case BLE_GATTC_EVT_DESC_DISC_RSP:
+      if (step == HID_DISC_DESCS) onDescs(g);
+      break;
+
+    case BLE_GATTC_EVT_WRITE_RSP:
+      if (step != HID_SUBSCRIBING) break;
+      report_at++;
+      subscribeNext();
+      break;
+
+    case BLE_GATTC_EVT_HVX:
+      // Only on the encrypted, subscribed link: the report handles are kept
+      // from the last session, and a peer with the remote's address but not
+      // its key could otherwise notify on them in plaintext while securing
+      if (step == HID_READY) onReport(g.params.hvx);
+      else stats.early++;
+      break;
+
+    case BLE_GAP_EVT_CONN_PARAM_UPDATE_REQUEST:
+      // Our parameters are the answer once the remote is set up
+      if (step == HID_READY) requestParams();
+      break;
+
+    case BLE_GAP_EVT_CONN_PARAM_UPDATE: {
+      const ble_gap_conn_params_t& p = evt->evt.gap_evt.params.conn_param_update.conn_params;
+      interval = p.max_conn_interval;
+      latency = p.slave_latency;
+      if (step != HID_READY || interval == intervalMs() * 4 / 5) break;
+      stats.param_overridden++;
+      if (param_tries < HID_PARAM_RETRIES) {
+        param_tries++;
+        requestParams();
+      }
+      break;
+    }
+
+    case BLE_GAP_EVT_DISCONNECTED:
+      conn = BLE_CONN_HANDLE_INVALID;
+      for (uint8_t i = 0; i < report_count; i++) reports[i].down = false;
+      stats.disconnects++;
+      lost_ms = millis();
+      ready_reported = false;
+      setStep(HID_IDLE);
+      break;
+
+    default:
+      break;
+  }
+}
+
+// Keyed by the identity in the bond, not the address it connected from.
+// Bluefruit writes the bond file from its own handler of the same event,
+// so this waits for it while the link is up.
+static void savePaired() {
+  uint16_t h = conn;
+  BLEConnection* c = h != BLE_CONN_HANDLE_INVALID ? Bluefruit.Connection(h) : NULL;
+  bond_keys_t keys;
+  if (!c || !c->bonded() || !c->loadKeys(&keys)) {
+    if (c) return;
+    paired_new = false;
+    Serial.println("HID remote lost before its bond was saved; pair it again");
+    return;
+  }
+  paired_new = false;
+
+  memcpy(config.hid_irk, keys.peer_id.id_info.irk, 16);
+  if (hasIrk()) {
+    config.hid_addr_type = keys.peer_id.id_addr_info.addr_type;
+    memcpy(config.hid_addr, keys.peer_id.id_addr_info.addr, 6);
+  }
+  else {
+    config.hid_addr_type = peer.addr_type;
+    memcpy(config.hid_addr, peer.addr, 6);
+  }
+  config.hid_remote = 1;
+  configSave();
+  stateRegionSync();
+  Serial.println("HID remote paired; assign its keys with 'hid learn lock' / 'hid learn unlock'");
+}
+
+void hidRemotePoll() {
+  uint32_t now = millis();
+
+  if (pairing && now - pair_started_ms > HID_PAIR_S * 1000UL && step <= HID_CONNECTING) {
+    pairing = false;
+    Serial.println("No HID remote found nearby");
+  }
+
+  if (paired_new) savePaired();
+
+  if (step == HID_READY && !ready_reported) {
+    ready_reported = true;
+    Serial.printf("HID remote ready after %lu ms\n", stats.ready_last_ms);
+  }
+
+  // Connect or a setup step hanging
+  if (step >= HID_CONNECTING && step < HID_READY && now - step_ms > HID_SETUP_TIMEOUT_MS) {
+    stats.setup_failed++;
+    if (step == HID_CONNECTING) {
+      sd_ble_gap_connect_cancel();
+      setStep(HID_IDLE);
+    }
+    else {
+      step_ms = now;
+      drop();
+    }
+  }
+
+  bool want = pairing || config.hid_remote;
+  bool fast = pairing || now - lost_ms < HID_SCAN_FAST_S * 1000UL;
+  if (step == HID_SCANNING && (!want || fast != scan_fast)) {
+    scanStop(now);
+    setStep(HID_IDLE);
+  }
+  if (step == HID_IDLE && want) {
+    setStep(HID_SCANNING);
+    scanStart(now, fast);
+  }
+}
+
+bool hidRemoteOwns(uint16_t conn_handle) {
+  return conn_handle != BLE_CONN_HANDLE_INVALID && conn_handle == conn;
+}
+
+uint8_t hidRemoteLinks() {
+  return conn != BLE_CONN_HANDLE_INVALID;
+}
+
+static void forget() {
+  if (step == HID_SCANNING) {
+    scanStop(millis());
+    setStep(HID_IDLE);
+  }
+  if (conn != BLE_CONN_HANDLE_INVALID) drop();
+  Bluefruit.Central.clearBonds();
+  report_count = 0;
+  learn_ch = -1;
+  config.hid_remote = 0;
+  memset(config.hid_keys, 0, sizeof(config.hid_keys));
+  memset(config.hid_irk, 0, sizeof(config.hid_irk));
+  configSave();
+  stateRegionSync();
+}
+
+void hidRemotePair() {
+  forget();
+  lost_ms = millis();
+  pair_started_ms = lost_ms;
+  pairing = true;
+  Serial.println("Pairing a HID remote: hold it next to the board and press a key");
+}
+
+void hidRemoteForget() {
+  pairing = false;
+  forget();
+  Serial.println("HID remote forgotten");
+}
+
+void hidRemoteLearn(ActChannel ch) {
+  learn_ch = ch;
+}
+
+void hidRemoteKeyLearned(ActChannel ch, uint16_t key) {
+  for (uint8_t i = 0; i < ACT_CHANNELS; i++) {
+    if (config.hid_keys[i] == key) config.hid_keys[i] = 0;
+  }
+  config.hid_keys[ch] = key;
+  configSave();
+  Serial.printf("HID key 0x%04X now %s\n", key, ch == ACT_LOCK ? "LOCK" : "UNLOCK");
+}
+
+bool hidRemoteSetInterval(uint16_t ms) {
+  if (ms < HID_INTERVAL_MIN_MS || ms > HID_INTERVAL_MAX_MS) return false;
+  config.hid_interval_ms = ms;
+  configSave();
+  if (step == HID_READY) {
+    param_tries = 0;
+    requestParams();
+  }
+  return true;
+}
+
+uint32_t hidRemoteModelUa() {
+  if (conn != BLE_CONN_HANDLE_INVALID && interval) return HID_EVENT_NC * 4 / (interval * 5UL);
+  if (step != HID_SCANNING) return 0;
+  if (scan_fast) return HID_SCAN_RX_UA * HID_SCAN_FAST_WINDOW / HID_SCAN_FAST_INTERVAL;
+  return HID_SCAN_RX_UA * HID_SCAN_SLOW_WINDOW / HID_SCAN_SLOW_INTERVAL;
+}
+
+void hidRemotePrintStats(Print& out) {
+  out.print("hid ");
+  if (config.hid_remote) {
+    for (int8_t i = 5; i >= 0; i--) {
+      if (config.hid_addr[i] < 0x10) out.print("0");
+      out.print(config.hid_addr[i], HEX);
+      if (i) out.print(":");
+    }
+  }
+  else {
+    out.print(pairing ? "pairing" : "none");
+  }
+  out.print(" ");
+  out.print(step_names[step]);
+  if (conn != BLE_CONN_HANDLE_INVALID) {
+    out.print(" interval=");
+    out.print(interval * 5 / 4);
+    out.print("ms latency=");
+    out.print(latency);
+  }
+  out.print(" +");
+  out.print(hidRemoteModelUa());
+  out.println("uA");
+
+  out.print(" connects=");
+  out.print(stats.connects);
+  out.print(" drops=");
+  out.print(stats.disconnects);
+  out.print(" setup fail=");
+  out.print(stats.setup_failed);
+  out.print(" secure fail=");
+  out.print(stats.secure_failed);
+  if (stats.ready_count) {
+    out.print(" ready avg=");
+    out.print(stats.ready_total_ms / stats.ready_count);
+    out.print("ms last=");
+    out.print(stats.ready_last_ms);
+    out.print("ms");
+  }
+  out.println();
+
+  out.print(" reports=");
+  out.print(stats.reports);
+  out.print(" early=");
+  out.print(stats.early);
+  out.print(" presses=");
+  out.print(stats.presses);
+  out.print(" busy=");
+  out.print(stats.busy);
+  out.print(" unassigned=");
+  out.print(stats.unassigned);
+  out.print(" keys lock=0x");
+  out.print(config.hid_keys[ACT_LOCK], HEX);
+  out.print(" unlock=0x");
+  out.println(config.hid_keys[ACT_UNLOCK], HEX);
+
+  if (stats.lat_n) {
+    out.print(" radio->gpio min/avg/max us=");
+    out.print(stats.lat_min / 64.0f, 1);
+    out.print("/");
+    out.print((float) stats.lat_total / stats.lat_n / 64, 1);
+    out.print("/");
+    out.print(stats.lat_max / 64.0f, 1);
+    out.print(" + wait 0-");
+    out.print(intervalMs());
+    out.println("ms for the event");
+  }
+
+  out.print(" params asked=");
+  out.print(stats.param_asked);
+  out.print(" overridden=");
+  out.print(stats.param_overridden);
+  out.print(" scanned fast=");
+  out.print(stats.scan_ms[1] / 1000);
+  out.print("s slow=");
+  out.print(stats.scan_ms[0] / 1000);
+  out.println("s");
+}
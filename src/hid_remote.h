@@ -0,0 +1,54 @@
+#pragma once
+
+#include <Arduino.h>
+#include <bluefruit.h>
+#include "actuation.h"
+
+// BLE HID remote (camera shutter button and the like) as a trigger, over
+// the central role. "hid pair" scans for a connectable device advertising
+// HID that is held close (HID_PAIR_RSSI), connects, bonds, finds its input
+// Report characteristics and subscribes to them. From then on the remote is
+// reconnected whenever it advertises and kept on a long connection interval.
+//
+// A key going down in a report is a key code (report, first non-zero byte
+// and its value); "hid learn lock" assigns the next one to a channel.
+// Assigned keys press through commandPress() in the BLE task, as a command
+// from the phone would; unassigned ones are only reported.
+//
+// The remote's link is Just Works (no display or keys to check a PIN), so
+// it gets no access to the UART service, which wants MITM.
+#define HID_MAX_CENTRAL         1
+#define HID_REPORTS_MAX         6        // input reports subscribed to
+#define HID_PAIR_S              30       // "hid pair" scans this long
+#define HID_PAIR_RSSI           -60      // dBm: only a remote held next to the board
+#define HID_SETUP_INTERVAL      12       // 15 ms (1.25 ms units) while bonding and discovering
+#define HID_INTERVAL_DEF_MS     150      // then this, unless "hid interval"
+#define HID_INTERVAL_MIN_MS     15
+#define HID_INTERVAL_MAX_MS     1000
+#define HID_SLAVE_LATENCY       4        // the remote may skip events; it sends at the next one
+#define HID_SUP_TIMEOUT_MS      6000     // at least; longer for long intervals
+#define HID_PARAM_RETRIES       3        // our parameters asked for again after the remote's
+#define HID_SETUP_TIMEOUT_MS    5000     // connect, security or a discovery step
+#define HID_SCAN_FAST_S         30       // after a disconnect or boot: scan at HID_SCAN_FAST_*
+#define HID_SCAN_FAST_INTERVAL  96       // 60 ms (0.625 ms units)
+#define HID_SCAN_FAST_WINDOW    48       // 30 ms
+#define HID_SCAN_SLOW_INTERVAL  2048     // 1.28 s
+#define HID_SCAN_SLOW_WINDOW    32       // 20 ms
+
+// Current model: one empty connection event as central (1M PHY, DC/DC,
+// Online Power Profiler), and RX while scanning
+#define HID_EVENT_NC            2500
+#define HID_SCAN_RX_UA          5300
+
+void hidRemoteBegin();                // in setupBLE(), after Bluefruit.begin()
+void hidRemotePoll();                 // from loop(): scanning, timeouts, saving
+void hidRemoteEvent(ble_evt_t* evt);  // from the BLE event callback: setup steps, reports
+bool hidRemoteOwns(uint16_t conn_handle);
+uint8_t hidRemoteLinks();             // central links up, for code that counts phones
+void hidRemotePair();                 // forgets the current remote
+void hidRemoteForget();
+void hidRemoteLearn(ActChannel ch);   // next key down goes to ch
+void hidRemoteKeyLearned(ActChannel ch, uint16_t key);   // from loop(): saved
+bool hidRemoteSetInterval(uint16_t ms);
+uint32_t hidRemoteModelUa();          // link or scanning, right now
+void hidRemotePrintStats(Print& out);
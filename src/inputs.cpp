@@ -0,0 +1,171 @@
+/*
+ * Vehicle signal inputs
+ *
+ * DETECT is the OR of every pin whose level matches its SENSE setting, and
+ * the PORT event fires on its rising edge. Re-arming SENSE to the opposite
+ * of the level just read keeps DETECT low until the next change; a pin that
+ * changes between the read and the re-arm raises DETECT again right away,
+ * so no edge is lost. While a contact bounces, DETECT follows it and each
+ * PORT event restarts the window, so the interrupt only runs once the pins
+ * have been quiet for INPUT_DEBOUNCE_MS.
+ */
+
+#include "inputs.h"
+#include "config.h"
+#include "config_store.h"
+#include "deferred.h"
+#include <bluefruit.h>
+#include <nrf_gpio.h>
+
+#define INPUT_DEBOUNCE_TICKS ((INPUT_DEBOUNCE_MS * 32768UL + 999) / 1000)   // RTC2, no prescaler
+
+struct InputHw {
+  uint8_t pin;
+  bool active_low;
+  nrf_gpio_pin_pull_t pull;
+  const char* name;
+};
+
+static const InputHw hw[IN_COUNT] = {
+  { IGNITION_PIN, true, NRF_GPIO_PIN_PULLUP, "ignition" },
+  { DOOR_PIN,     true, NRF_GPIO_PIN_PULLUP, "door" },
+};
+
+static volatile uint8_t enabled = 0;      // pins set up; follows config.inputs
+static volatile uint8_t high = 0;         // debounced levels, one bit per input
+static volatile uint32_t changes[IN_COUNT];
+static volatile uint32_t windows = 0;     // debounce windows that ran out
+static volatile uint32_t bounces = 0;     // ... with every input back where it started
+
+static void arm(uint8_t i, bool level_high) {
+  nrf_gpio_cfg_sense_set(hw[i].pin, level_high ? NRF_GPIO_PIN_SENSE_LOW : NRF_GPIO_PIN_SENSE_HIGH);
+}
+
+static bool isActive(uint8_t i, bool level_high) {
+  return level_high != hw[i].active_low;
+}
+
+// Debounce window over
+extern "C" void RTC2_IRQHandler(void) {
+  NRF_RTC2->EVENTS_COMPARE[0] = 0;
+  NRF_RTC2->TASKS_STOP = 1;
+  windows = windows + 1;
+
+  bool changed = false;
+  for (uint8_t i = 0; i < IN_COUNT; i++) {
+    if (!(enabled & (1 << i))) continue;
+    bool level = nrf_gpio_pin_read(hw[i].pin);
+    arm(i, level);
+    if (level == bool(high & (1 << i))) continue;
+
+    high = high ^ (1 << i);
+    changes[i] = changes[i] + 1;
+    changed = true;
+    uint8_t data[2] = { i, isActive(i, level) };
+    deferPost(DEFER_INPUT, BLE_CONN_HANDLE_INVALID, data, sizeof(data));
+  }
+  if (!changed) bounces = bounces + 1;
+}
+
+static void configure(uint8_t i, bool on) {
+  NVIC_DisableIRQ(RTC2_IRQn);
+  if (on) {
+    nrf_gpio_cfg_input(hw[i].pin, hw[i].pull);
+    bool level = nrf_gpio_pin_read(hw[i].pin);
+    if (level) high = high | (1 << i);
+    else high = high & ~(1 << i);
+    arm(i, level);
+    enabled = enabled | (1 << i);
+  }
+  else {
+    enabled = enabled & ~(1 << i);
+    nrf_gpio_cfg_default(hw[i].pin);      // input disconnected, SENSE off
+  }
+  NVIC_EnableIRQ(RTC2_IRQn);
+}
+
+void inputsBegin() {
+  // 32 kHz one-shot; the PPI channels below clear and start it
+  NRF_RTC2->TASKS_STOP = 1;
+  NRF_RTC2->TASKS_CLEAR = 1;
+  NRF_RTC2->PRESCALER = 0;
+  NRF_RTC2->CC[0] = INPUT_DEBOUNCE_TICKS;
+  NRF_RTC2->EVENTS_COMPARE[0] = 0;
+  NRF_RTC2->INTENSET = RTC_INTENSET_COMPARE0_Msk;
+  NVIC_SetPriority(RTC2_IRQn, INPUT_IRQ_PRIO);
+  NVIC_ClearPendingIRQ(RTC2_IRQn);
+  NVIC_EnableIRQ(RTC2_IRQn);
+
+  // Any edge: GPIOTE PORT -> PPI -> RTC2 CLEAR + START
+  sd_ppi_channel_assign(INPUT_PPI_CH_BASE, &NRF_GPIOTE->EVENTS_PORT, &NRF_RTC2->TASKS_CLEAR);
+  sd_ppi_channel_assign(INPUT_PPI_CH_BASE + 1, &NRF_GPIOTE->EVENTS_PORT, &NRF_RTC2->TASKS_START);
+  sd_ppi_channel_enable_set(3UL << INPUT_PPI_CH_BASE);
+
+  inputsPoll();
+}
+
+void inputsPoll() {
+  for (uint8_t i = 0; i < IN_COUNT; i++) {
+    bool want = config.inputs & (1 << i);
+    if (want != bool(enabled & (1 << i))) configure(i, want);
+  }
+}
+
+void inputsEnable(VehicleInput in, bool on) {
+  if (on) config.inputs |= 1 << in;
+  else config.inputs &= ~(1 << in);
+  configSave();
+  inputsPoll();
+}
+
+int8_t inputByName(const char* name) {
+  for (uint8_t i = 0; i < IN_COUNT; i++) {
+    if (strcmp(name, hw[i].name) == 0) return i;
+  }
+  return -1;
+}
+
+const char* inputName(VehicleInput in) {
+  return hw[in].name;
+}
+
+bool inputActive(VehicleInput in) {
+  return (enabled & (1 << in)) && isActive(in, high & (1 << in));
+}
+
+bool inputsSystemOff() {
+  if (!enabled) return false;
+  // SENSE is already armed for the level each input isn't at; DETECT wakes
+  // the chip through a reset, RESETREAS.OFF ends up in JR_BOOT
+  sd_power_system_off();
+  while (true) {}                         // only returns under a debugger
+}
+
+void inputsPrintStats(Print& out) {
+  out.print("inputs");
+  uint8_t pulled = 0;
+  for (uint8_t i = 0; i < IN_COUNT; i++) {
+    out.print(" ");
+    out.print(hw[i].name);
+    out.print("=");
+    if (!(enabled & (1 << i))) {
+      out.print("off");
+      continue;
+    }
+    bool level = high & (1 << i);
+    out.print(isActive(i, level) ? "active" : "inactive");
+    out.print("/");
+    out.print(changes[i]);
+    // Current only flows while the input holds the pin against its pull
+    if ((hw[i].pull == NRF_GPIO_PIN_PULLUP && !level) || (hw[i].pull == NRF_GPIO_PIN_PULLDOWN && level)) pulled++;
+  }
+  out.println();
+
+  out.print(" debounce=");
+  out.print(windows);
+  out.print(" bounce=");
+  out.print(bounces);
+  out.print(" idle +0uA pulls +");
+  out.print(pulled * INPUT_PULL_UA);
+  out.println("uA");
+}
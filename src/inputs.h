@@ -0,0 +1,36 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Vehicle signal inputs (ignition, door switch) for features that react to
+// the car. Nothing polls them: each enabled pin's SENSE is set to the level
+// it isn't at, so a change raises the GPIO DETECT signal and the GPIOTE
+// PORT event. PPI turns that into CLEAR + START of RTC2, so every bounce
+// restarts the debounce window; when RTC2 reaches INPUT_DEBOUNCE_MS the
+// interrupt reads the pins, posts DEFER_INPUT for each one that settled at a
+// new level and re-arms SENSE. Idle, that is no clock beyond the 32 kHz one
+// that is always on, and no CPU.
+//
+// The same SENSE settings wake the chip from System OFF (inputsSystemOff()).
+enum VehicleInput : uint8_t {
+  IN_IGNITION = 0,
+  IN_DOOR = 1,
+  IN_COUNT
+};
+
+#define INPUT_DEBOUNCE_MS  20
+#define INPUT_PPI_CH_BASE  15     // PPI channels 15-16 (wired port has 12-14)
+#define INPUT_IRQ_PRIO     3      // application priority, may post to the defer ring
+#define INPUT_PULL_UA      254    // 3.3V across the ~13k internal pull, input held active
+
+void inputsBegin();               // after configLoad() and Bluefruit.begin() (uses sd_ppi_*)
+void inputsPoll();                // from loop(): follows config.inputs
+void inputsEnable(VehicleInput in, bool on);    // persisted
+int8_t inputByName(const char* name);           // -1 if unknown
+const char* inputName(VehicleInput in);
+bool inputActive(VehicleInput in);              // debounced; false if disabled
+
+// Flushes nothing itself: journal first. Wakes (reset) when an enabled input
+// changes. False if no input is enabled, since nothing could wake it.
+bool inputsSystemOff();
+void inputsPrintStats(Print& out);
@@ -0,0 +1,314 @@
+/*
+ * Event journal
+ *
+ * Small records, eagerly written, would cost a flash erase every few
+ * hundred events and stall the CPU during each write. Instead records sit
+ * in a RAM batch and go out JOURNAL_BATCH at a time from loop(), or when
+ * the batch is JOURNAL_FLUSH_MS old.
+ *
+ * Each write is one sealed block, so encryption runs once per batch on the
+ * CC310 rather than per record. Block headers are plaintext (authenticated
+ * associated data), which lets journalBegin() count records without
+ * decrypting anything.
+ */
+
+#include "journal.h"
+#include "secure_store.h"
+#include <InternalFileSystem.h>
+
+using namespace Adafruit_LittleFS_Namespace;
+
+#define JOURNAL_FILE_TMP    "/journal.tmp"
+#define BLOCKS_PER_FILE     (JOURNAL_FILE_BYTES / JOURNAL_BLOCK_BYTES)
+
+enum { FILE_OLD, FILE_NEW, FILES };
+static const char* const file_names[FILES] = { JOURNAL_FILE_OLD, JOURNAL_FILE_NEW };
+
+static JournalRecord batch[JOURNAL_BATCH];
+static uint8_t batch_count = 0;
+static uint32_t batch_since_ms = 0;
+static uint32_t dropped = 0;
+static SemaphoreHandle_t batch_mutex;
+
+// Records per block on flash, from the block headers
+static uint8_t block_records[FILES][BLOCKS_PER_FILE];
+static uint8_t file_blocks[FILES];
+static SemaphoreHandle_t file_mutex;       // flush vs. export reads
+
+// Export reads: open file and last decrypted block, under file_mutex
+static File reader(InternalFS);
+static int8_t reader_file = -1;
+static uint8_t block_buf[JOURNAL_BLOCK_BYTES];
+static int8_t cached_file = -1;
+static uint8_t cached_block = 0;
+
+static uint16_t boot = 0;
+
+void exportFillHeader(ExportHeader& h, ExportKind kind, uint16_t record_size) {
+  h.magic = EXPORT_MAGIC;
+  h.version = EXPORT_VERSION;
+  h.kind = kind;
+  h.record_size = record_size;
+  h.device_id[0] = NRF_FICR->DEVICEID[0];
+  h.device_id[1] = NRF_FICR->DEVICEID[1];
+}
+
+static uint32_t fileRecords(uint8_t file) {
+  uint32_t n = 0;
+  for (uint8_t b = 0; b < file_blocks[file]; b++) n += block_records[file][b];
+  return n;
+}
+
+static void closeReader() {
+  if (reader_file >= 0) reader.close();
+  reader_file = -1;
+  cached_file = -1;
+}
+
+// Decrypts block b of a file into block_buf; records start at
+// block_buf + sizeof(SealHeader)
+static bool loadBlock(uint8_t file, uint8_t b) {
+  if (cached_file == file && cached_block == b) return true;
+  if (reader_file != file) {
+    closeReader();
+    if (!reader.open(file_names[file], FILE_O_READ)) return false;
+    reader_file = file;
+  }
+  cached_file = -1;
+  reader.seek((uint32_t) b * JOURNAL_BLOCK_BYTES);
+  if (reader.read(block_buf, JOURNAL_BLOCK_BYTES) != JOURNAL_BLOCK_BYTES) return false;
+  if (secureOpen(SEAL_JOURNAL, block_buf, JOURNAL_BLOCK_BYTES) < 0) return false;
+  cached_file = file;
+  cached_block = b;
+  return true;
+}
+
+// Counts blocks and their records from the plaintext headers; stops at
+// the first torn or foreign block
+static void scanFile(uint8_t file) {
+  file_blocks[file] = 0;
+  File f(InternalFS);
+  if (!f.open(file_names[file], FILE_O_READ)) return;
+
+  SealHeader h;
+  for (uint8_t b = 0; b < BLOCKS_PER_FILE; b++) {
+    f.seek((uint32_t) b * JOURNAL_BLOCK_BYTES);
+    if (f.read(&h, sizeof(h)) != sizeof(h)) break;
+    if (h.version != SEAL_VERSION || h.kind != SEAL_JOURNAL ||
+        h.len > JOURNAL_BATCH * sizeof(JournalRecord) || h.len % sizeof(JournalRecord)) break;
+    if (f.size() < (uint32_t) (b + 1) * JOURNAL_BLOCK_BYTES) break;
+    block_records[file][b] = h.len / sizeof(JournalRecord);
+    file_blocks[file] = b + 1;
+  }
+  f.close();
+}
+
+static bool writeBlock(File& f, const JournalRecord* records, uint8_t n) {
+  static uint8_t out[JOURNAL_BLOCK_BYTES];
+  memset(out, 0, sizeof(out));
+  memcpy(out + sizeof(SealHeader), records, n * sizeof(JournalRecord));
+  if (!secureSeal(SEAL_JOURNAL, out, n * sizeof(JournalRecord))) return false;
+  return f.write(out, sizeof(out)) == sizeof(out);
+}
+
+// Journal files from before encryption: plain 16-byte records. Re-written
+// as sealed blocks, keeping the newest that fit.
+static void migrateLegacy(uint8_t file) {
+  File in(InternalFS);
+  if (!in.open(file_names[file], FILE_O_READ)) return;
+  uint32_t total = in.size() / sizeof(JournalRecord);
+  uint32_t skip = total > BLOCKS_PER_FILE * JOURNAL_BATCH ? total - BLOCKS_PER_FILE * JOURNAL_BATCH : 0;
+
+  InternalFS.remove(JOURNAL_FILE_TMP);
+  File out(InternalFS);
+  if (out.open(JOURNAL_FILE_TMP, FILE_O_WRITE)) {
+    JournalRecord chunk[JOURNAL_BATCH];
+    in.seek(skip * sizeof(JournalRecord));
+    for (uint32_t done = skip; done < total; done += JOURNAL_BATCH) {
+      uint32_t n = in.read(chunk, sizeof(chunk)) / sizeof(JournalRecord);
+      if (n == 0 || !writeBlock(out, chunk, n)) break;
+    }
+    out.close();
+  }
+  in.close();
+
+  InternalFS.remove(file_names[file]);
+  InternalFS.rename(JOURNAL_FILE_TMP, file_names[file]);
+  Serial.print("Journal migrated to sealed blocks: ");
+  Serial.println(file_names[file]);
+}
+
+static bool isLegacy(uint8_t file) {
+  File f(InternalFS);
+  if (!f.open(file_names[file], FILE_O_READ)) return false;
+  uint8_t head[sizeof(SealHeader) + SEAL_TAG_SIZE];
+  uint32_t len = f.read(head, sizeof(head));
+  uint32_t size = f.size();
+  f.close();
+  return size > 0 && (size % JOURNAL_BLOCK_BYTES != 0 || !secureIsSealed(head, len));
+}
+
+// Boot counter continues from the newest record on flash
+static uint16_t lastBoot() {
+  for (int8_t file = FILE_NEW; file >= FILE_OLD; file--) {
+    for (int8_t b = file_blocks[file] - 1; b >= 0; b--) {
+      uint8_t n = block_records[file][b];
+      if (n == 0 || !loadBlock(file, b)) continue;
+      const JournalRecord* r = (const JournalRecord*) (block_buf + sizeof(SealHeader));
+      return r[n - 1].boot;
+    }
+  }
+  return 0;
+}
+
+void journalBegin() {
+  batch_mutex = xSemaphoreCreateMutex();
+  file_mutex = xSemaphoreCreateMutex();
+
+  for (uint8_t file = 0; file < FILES; file++) {
+    if (isLegacy(file) && secureAcceptsLegacy()) {
+      migrateLegacy(file);
+    }
+    else if (isLegacy(file)) {
+      InternalFS.remove(file_names[file]);
+      Serial.print("Journal file not sealed, removed: ");
+      Serial.println(file_names[file]);
+    }
+    scanFile(file);
+  }
+  boot = lastBoot() + 1;
+  closeReader();
+}
+
+uint16_t journalBootCount() {
+  return boot;
+}
+
+void journalLog(JournalType type, uint8_t conn, uint32_t a, uint32_t b) {
+  if (!batch_mutex) return;     // a phone connected before setup() got here
+  xSemaphoreTake(batch_mutex, portMAX_DELAY);
+  if (batch_count < JOURNAL_BATCH) {
+    if (batch_count == 0) batch_since_ms = millis();
+    JournalRecord& r = batch[batch_count++];
+    r.uptime_ms = millis();
+    r.boot = boot;
+    r.type = type;
+    r.conn = conn;
+    r.a = a;
+    r.b = b;
+  }
+  else {
+    dropped++;      // loop() hasn't caught up; keep the older records
+  }
+  xSemaphoreGive(batch_mutex);
+}
+
+// Records taken out of the batch, so journalLog() isn't held up by the write
+static JournalRecord flushing[JOURNAL_BATCH];
+
+static bool append(const JournalRecord* records, uint32_t n) {
+  bool ok = true;
+  xSemaphoreTake(file_mutex, portMAX_DELAY);
+  closeReader();
+
+  for (uint32_t done = 0; ok && done < n; done += JOURNAL_BATCH) {
+    uint8_t count = n - done < JOURNAL_BATCH ? n - done : JOURNAL_BATCH;
+
+    if (file_blocks[FILE_NEW] == BLOCKS_PER_FILE) {
+      InternalFS.remove(JOURNAL_FILE_OLD);
+      InternalFS.rename(JOURNAL_FILE_NEW, JOURNAL_FILE_OLD);
+      memcpy(block_records[FILE_OLD], block_records[FILE_NEW], BLOCKS_PER_FILE);
+      file_blocks[FILE_OLD] = file_blocks[FILE_NEW];
+      file_blocks[FILE_NEW] = 0;
+    }
+
+    // FILE_O_WRITE appends
+    ok = false;
+    File f(InternalFS);
+    if (f.open(JOURNAL_FILE_NEW, FILE_O_WRITE)) {
+      ok = writeBlock(f, records + done, count);
+      f.close();
+    }
+    if (ok) block_records[FILE_NEW][file_blocks[FILE_NEW]++] = count;
+  }
+
+  xSemaphoreGive(file_mutex);
+  return ok;
+}
+
+bool journalFlush() {
+  xSemaphoreTake(batch_mutex, portMAX_DELAY);
+  uint8_t n = batch_count;
+  memcpy(flushing, batch, n * sizeof(JournalRecord));
+  batch_count = 0;
+  xSemaphoreGive(batch_mutex);
+  if (n == 0) return true;
+  return append(flushing, n);
+}
+
+uint8_t journalBatched() {
+  return batch_count;
+}
+
+void journalPoll() {
+  if (batch_count == 0) return;
+  if (batch_count >= JOURNAL_BATCH * 3 / 4 || millis() - batch_since_ms >= JOURNAL_FLUSH_MS) {
+    journalFlush();
+  }
+}
+
+uint32_t journalExportSize() {
+  return sizeof(ExportHeader) +
+         (fileRecords(FILE_OLD) + fileRecords(FILE_NEW) + batch_count) * sizeof(JournalRecord);
+}
+
+// Export: header, then records of /journal.1, /journal.0 and the RAM batch
+uint32_t journalExportRead(uint32_t offset, uint8_t* buf, uint32_t len) {
+  ExportHeader header;
+  exportFillHeader(header, EXPORT_JOURNAL, sizeof(JournalRecord));
+
+  uint32_t done = 0;
+  if (offset < sizeof(header)) {
+    done = sizeof(header) - offset;
+    if (done > len) done = len;
+    memcpy(buf, (const uint8_t*) &header + offset, done);
+  }
+
+  xSemaphoreTake(file_mutex, portMAX_DELAY);
+  xSemaphoreTake(batch_mutex, portMAX_DELAY);
+
+  // Walk blocks in export order; the batch is the last "block"
+  uint32_t base = sizeof(header);
+  for (uint8_t file = FILE_OLD; file <= FILES && done < len; file++) {
+    uint8_t blocks = file < FILES ? file_blocks[file] : 1;
+    for (uint8_t b = 0; b < blocks && done < len; b++) {
+      uint32_t size = (file < FILES ? block_records[file][b] : batch_count) * sizeof(JournalRecord);
+      uint32_t pos = offset + done;
+      if (pos < base + size) {
+        uint32_t at = pos - base;
+        uint32_t n = size - at;
+        if (n > len - done) n = len - done;
+
+        const uint8_t* src = (const uint8_t*) batch;
+        if (file < FILES) {
+          src = loadBlock(file, b) ? block_buf + sizeof(SealHeader) : NULL;
+        }
+        if (src) memcpy(buf + done, src + at, n);
+        else memset(buf + done, 0, n);
+        done += n;
+      }
+      base += size;
+    }
+  }
+
+  xSemaphoreGive(batch_mutex);
+  xSemaphoreGive(file_mutex);
+  return done;
+}
+
+void journalPrintStats(Print& out) {
+  out.print("journal boot=");  out.print(boot);
+  out.print(" flash=");        out.print(fileRecords(FILE_OLD) + fileRecords(FILE_NEW));
+  out.print(" batch=");        out.print(batch_count);
+  out.print(" dropped=");      out.println(dropped);
+}
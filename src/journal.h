@@ -0,0 +1,34 @@
+#pragma once
+
+#include <Arduino.h>
+#include "journal_records.h"
+
+// Event journal in InternalFS. Records are batched in RAM and appended to
+// /journal.0 as one sealed block (secure_store.h) of up to JOURNAL_BATCH
+// records, padded to JOURNAL_BLOCK_BYTES so blocks tile flash pages; once
+// the file reaches JOURNAL_FILE_BYTES it becomes /journal.1 (dropping the
+// previous one), so 1-2 files of history are kept. Safe to call
+// journalLog() from the BLE task.
+#define JOURNAL_FILE_NEW    "/journal.0"
+#define JOURNAL_FILE_OLD    "/journal.1"
+#define JOURNAL_FILE_BYTES  8192          // 16 blocks, 480 records
+#define JOURNAL_BLOCK_BYTES 512           // 8 per 4 KB page
+#define JOURNAL_BATCH       30            // records per block: 16 header + 480 + 16 tag
+#define JOURNAL_FLUSH_MS    3600000UL     // write at least hourly (power_fail.cpp flushes on a warning)
+#define JOURNAL_NO_CONN     0xFF
+
+void journalBegin();                      // after secureBegin() and configLoad()
+void journalLog(JournalType type, uint8_t conn = JOURNAL_NO_CONN, uint32_t a = 0, uint32_t b = 0);
+void journalPoll();
+bool journalFlush();
+uint8_t journalBatched();                 // records logged but not written yet
+uint16_t journalBootCount();
+
+void journalPrintStats(Print& out);
+
+// Export view for usb_export.cpp: ExportHeader, then every record oldest
+// first, including the batch not yet written. Decrypted a block at a time.
+uint32_t journalExportSize();
+uint32_t journalExportRead(uint32_t offset, uint8_t* buf, uint32_t len);
+
+void exportFillHeader(ExportHeader& h, ExportKind kind, uint16_t record_size);
@@ -0,0 +1,153 @@
+#pragma once
+
+// On-flash / exported record formats. Plain C++ with <stdint.h> only, so
+// host tools under tools/ decode dumps with the same definitions.
+// All fields little-endian, structs are packed to their natural alignment.
+
+#include <stdint.h>
+
+// Every exported file starts with this header (16 bytes)
+#define EXPORT_MAGIC        0x424F464Bu   // "KFOB"
+#define EXPORT_VERSION      1
+
+enum ExportKind : uint8_t {
+  EXPORT_JOURNAL = 1,
+  EXPORT_TRACE,
+  EXPORT_CRASH
+};
+
+struct ExportHeader {
+  uint32_t magic;
+  uint8_t  version;
+  uint8_t  kind;            // ExportKind
+  uint16_t record_size;     // bytes per record after the header
+  uint32_t device_id[2];    // FICR DEVICEID, tells units apart
+};
+
+// Journal: one record per thing that happened
+enum JournalType : uint8_t {
+  JR_BOOT = 1,        // a = RESETREAS, b = 1 if the previous shutdown was clean
+  JR_PRESS,           // a = channel (0 lock, 1 unlock)
+  JR_CONNECT,         // conn = handle
+  JR_DISCONNECT,      // conn = handle, a = HCI reason
+  JR_SECURED,         // conn = handle, a = AdmitClass
+  JR_EVICT,           // conn = handle
+  JR_BATTERY,         // a = mV, b = state of charge %
+  JR_GOV_LEVEL,       // a = GovLevel
+  JR_USB,             // a = 1 running from USB power, 0 back on battery
+  JR_CONN_PARAMS,     // conn = handle, a = interval (1.25 ms units), b = slave latency
+  JR_INPUT,           // a = VehicleInput, b = 1 active, 0 inactive
+  JR_UPDATE,          // a = new image size, b = DeltaError (0: verified, swapping)
+  JR_STATE,           // a = files restored from the state region, b = StateSource
+  JR_POWER_LOW,       // a = VDDH mV at the power-fail warning
+  JR_DONGLE,          // a = dongle listen period ms (0 = stopped), b = window us
+  JR_TYPES
+};
+
+struct JournalRecord {      // 16 bytes
+  uint32_t uptime_ms;
+  uint16_t boot;            // boot counter, uptime restarts with it
+  uint8_t  type;            // JournalType
+  uint8_t  conn;            // connection handle, 0xFF if none
+  uint32_t a;
+  uint32_t b;
+};
+
+// Trace: one record per lock/unlock command, RX callback -> pulse armed
+struct TraceRecord {        // 12 bytes
+  uint32_t uptime_ms;
+  uint32_t cycles;          // 64 MHz CPU cycles
+  uint8_t  context;         // PerfContext
+  uint8_t  reserved;
+  uint16_t boot;
+};
+
+// Crash: written at the boot after a fault, watchdog or lockup reset
+struct CrashRecord {        // 48 bytes
+  uint32_t resetreas;       // POWER->RESETREAS at that boot
+  uint16_t boot;            // boot that crashed
+  uint16_t fault;           // 1 = registers below were captured by HardFault
+  uint32_t uptime_ms;
+  uint32_t pc;
+  uint32_t lr;
+  uint32_t psr;
+  uint32_t cfsr;
+  uint32_t hfsr;
+  uint32_t mmfar;
+  uint32_t bfar;
+  uint32_t reserved[2];
+};
+
+// Energy model calibration, fitted from current captures by
+// tools/power_profile_analyzer.cpp and loaded by the governor (CALIB.BIN on
+// the USB volume). Zero entries keep the built-in estimate.
+#define CALIB_MAGIC         0x4C43464Bu   // "KFCL"
+#define CALIB_VERSION       1
+#define CALIB_LEVELS        4             // GovLevel count
+
+struct EnergyCalib {        // 52 bytes
+  uint32_t magic;
+  uint8_t  version;
+  uint8_t  levels;          // CALIB_LEVELS
+  uint16_t size;            // sizeof(EnergyCalib) when written
+  uint32_t adv_ua[CALIB_LEVELS];    // average current per governor level, no link
+  uint32_t conn_ua[CALIB_LEVELS];   // ... with a phone connected
+  uint32_t press_uc;        // charge per press above the state it happened in
+  uint32_t led_uc;          // extra per press when the level has the LED on
+  uint32_t capture_s;       // capture time behind the fit
+};
+
+// Delta firmware update, made by tools/delta_gen.cpp and applied by
+// src/delta_update.cpp. A DeltaHeader, then ops until DELTA_END; lengths
+// and offsets are unsigned LEB128 varints:
+//   DELTA_COPY   src len    len bytes of the running image from offset src
+//   DELTA_INSERT len bytes  literal bytes
+// Ops produce the new image front to back.
+#define DELTA_MAGIC         0x5544464Bu   // "KFDU"
+#define DELTA_VERSION       1
+#define DELTA_IMAGE_MAX     0x61000       // largest new image: the secondary bank (DELTA_BANK_SIZE)
+
+enum DeltaOp : uint8_t {
+  DELTA_END = 0,
+  DELTA_COPY,
+  DELTA_INSERT
+};
+
+struct DeltaHeader {        // 80 bytes
+  uint32_t magic;
+  uint16_t version;
+  uint16_t header_size;     // sizeof(DeltaHeader) when written
+  uint32_t old_size;        // image the delta applies to
+  uint32_t new_size;
+  uint8_t  old_sha256[32];
+  uint8_t  new_sha256[32];
+};
+
+enum DeltaError : uint8_t {
+  DELTA_OK = 0,
+  DELTA_ERR_HEADER,         // bad magic/version, or sizes out of range
+  DELTA_ERR_BASE,           // running image doesn't match old_sha256
+  DELTA_ERR_OP,             // unknown op, or one that reads/writes out of range
+  DELTA_ERR_SIZE,           // DELTA_END before new_size bytes
+  DELTA_ERR_HASH,           // reconstructed image doesn't match new_sha256
+  DELTA_ERR_OVERRUN,        // sender ignored the flow control window
+  DELTA_ERR_TIMEOUT,
+  DELTA_ERR_ABORTED
+};
+
+// Status notification from the device (update service)
+struct DeltaStatus {        // 12 bytes
+  uint8_t  state;           // DeltaState in delta_update.h
+  uint8_t  error;           // DeltaError
+  uint16_t window;          // bytes the sender may have in flight
+  uint32_t consumed;        // delta bytes taken out of the receive ring
+  uint32_t written;         // image bytes reconstructed
+};
+
+static_assert(sizeof(ExportHeader) == 16, "ExportHeader layout");
+static_assert(sizeof(JournalRecord) == 16, "JournalRecord layout");
+static_assert(sizeof(TraceRecord) == 12, "TraceRecord layout");
+static_assert(sizeof(CrashRecord) == 48, "CrashRecord layout");
+static_assert(sizeof(EnergyCalib) == 52, "EnergyCalib layout");
+static_assert(sizeof(DeltaHeader) == 80, "DeltaHeader layout");
+static_assert(sizeof(DeltaStatus) == 12, "DeltaStatus layout");
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <bluefruit.h>
+
+// BLEUart that exposes the TX characteristic value handle, so notifications
+// can be pushed with sd_ble_gatts_hvx() directly. The SoftDevice call returns
+// NRF_ERROR_RESOURCES instead of blocking when its buffers are full, unlike
+// bleuart.write() which waits on the connection's HVN semaphore.
+class KeyfobUart : public BLEUart {
+public:
+  uint16_t txValueHandle() { return _txd.handles().value_handle; }
+};
+
+extern KeyfobUart bleuart;
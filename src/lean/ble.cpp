@@ -0,0 +1,504 @@
+/*
+ * S140 stack, NUS and bonding for the lean build
+ *
+ * Events are pulled by main() with sd_ble_evt_get() and handled here in
+ * thread mode, one at a time; nothing else runs at that level, so nothing
+ * here needs a lock. A GATTS write to the RX characteristic goes straight
+ * to leanCommand(), the same place in the chain as Bluefruit's RX callback.
+ *
+ * Bonding is legacy pairing, passkey display, MITM. We hand out our LTK and
+ * keep it with its EDIV/RAND and the phone's identity; a reconnecting phone
+ * asks for it in SEC_INFO_REQUEST. Bonds go to LEAN_BOND_PAGE with the
+ * SoftDevice's flash API (erase, then write, each finished by a SoC event).
+ */
+
+#include "ble.h"
+#include <nrf_sdm.h>
+#include <nrf_soc.h>
+
+#define BOND_MAGIC    0x424C464Bu   // "KFLB"
+#define NUS_SERVICE   0x0001
+#define NUS_RX        0x0002
+#define NUS_TX        0x0003
+
+// 6E400001-B5A3-F393-E0A9-E50E24DCCA9E, little-endian
+static const ble_uuid128_t nus_base = {{ 0x9E, 0xCA, 0xDC, 0x24, 0x0E, 0xE5, 0xA9, 0xE0,
+                                         0x93, 0xF3, 0xA3, 0xB5, 0x00, 0x00, 0x40, 0x6E }};
+
+// From the linker script: where the application's RAM starts
+extern uint32_t __data_start__;
+
+struct Bond {
+  ble_gap_enc_key_t own_enc;        // LTK we distributed, found by EDIV/RAND
+  ble_gap_id_key_t  peer_id;
+  uint8_t used;
+};
+
+struct BondPage {
+  uint32_t magic;
+  uint32_t next;                    // slot the next new bond replaces
+  Bond bonds[LEAN_BONDS];
+};
+
+union BondStore {
+  BondPage page;
+  uint32_t words[(sizeof(BondPage) + 3) / 4];   // sd_flash_write() takes words
+};
+
+struct Link {
+  uint16_t handle;
+  bool secured;
+  bool notify;
+};
+
+enum FlashStep : uint8_t { FLASH_IDLE, FLASH_ERASING, FLASH_WRITING };
+
+static uint8_t uuid_type;
+static ble_gatts_char_handles_t rx_handles;
+static ble_gatts_char_handles_t tx_handles;
+
+static uint8_t adv_handle = BLE_GAP_ADV_SET_HANDLE_NOT_SET;
+static uint8_t adv_buf[BLE_GAP_ADV_SET_DATA_SIZE_MAX];
+static uint8_t scan_buf[BLE_GAP_ADV_SET_DATA_SIZE_MAX];
+static ble_gap_adv_data_t adv_data;
+static bool advertising = false;
+
+static Link links[LEAN_PRPH_LINKS];
+static BondStore store;
+static BondStore flash_copy;        // what the SoftDevice is writing
+static Bond pairing;                // keys of the pairing in progress
+static ble_gap_sec_keyset_t keyset;
+static FlashStep flash_step = FLASH_IDLE;
+static bool save_pending = false;
+static uint32_t pairing_until_ms = 0;
+static uint32_t dropped = 0;
+
+static Link* findLink(uint16_t conn) {
+  for (Link& l : links) {
+    if (l.handle == conn) return &l;
+  }
+  return nullptr;
+}
+
+uint8_t bleLinks() {
+  uint8_t n = 0;
+  for (const Link& l : links) n += l.handle != BLE_CONN_HANDLE_INVALID;
+  return n;
+}
+
+uint8_t bleBondCount() {
+  uint8_t n = 0;
+  for (const Bond& b : store.page.bonds) n += b.used;
+  return n;
+}
+
+uint32_t bleDropped() {
+  return dropped;
+}
+
+static bool pairingAllowed() {
+  return bleBondCount() == 0 || (int32_t) (pairing_until_ms - leanMillis()) > 0;
+}
+
+void bleOpenPairing() {
+  pairing_until_ms = leanMillis() + LEAN_PAIRING_S * 1000UL;
+}
+
+// ---------------------------------------------------------------------------
+// Advertising
+
+static uint8_t adField(uint8_t* p, uint8_t type, const void* data, uint8_t len) {
+  p[0] = len + 1;
+  p[1] = type;
+  memcpy(p + 2, data, len);
+  return len + 2;
+}
+
+static void advStart(bool fast) {
+  ble_gap_adv_params_t params;
+  memset(&params, 0, sizeof(params));
+  params.properties.type = BLE_GAP_ADV_TYPE_CONNECTABLE_SCANNABLE_UNDIRECTED;
+  params.primary_phy = BLE_GAP_PHY_1MBPS;
+  params.filter_policy = BLE_GAP_ADV_FP_ANY;
+  params.interval = fast ? LEAN_ADV_FAST : LEAN_ADV_SLOW;
+  params.duration = fast ? LEAN_ADV_FAST_S * 100 : BLE_GAP_ADV_TIMEOUT_GENERAL_UNLIMITED;
+
+  if (sd_ble_gap_adv_set_configure(&adv_handle, &adv_data, &params) != NRF_SUCCESS) return;
+  sd_ble_gap_tx_power_set(BLE_GAP_TX_POWER_ROLE_ADV, adv_handle, 4);
+  advertising = sd_ble_gap_adv_start(adv_handle, LEAN_CONN_TAG) == NRF_SUCCESS;
+}
+
+// Same decision as adv_policy.cpp, minus the presence beacon
+static void advUpdate() {
+  uint8_t n = bleLinks();
+  bool owner = false;
+  for (const Link& l : links) owner |= l.handle != BLE_CONN_HANDLE_INVALID && l.secured;
+  bool want = n < LEAN_PRPH_LINKS && (!owner || pairingAllowed());
+
+  if (want && !advertising) advStart(true);
+  else if (!want && advertising) {
+    sd_ble_gap_adv_stop(adv_handle);
+    advertising = false;
+  }
+}
+
+static void advSetup() {
+  uint8_t flags = BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE;
+  int8_t tx_power = 4;
+  uint8_t len = 0;
+  len += adField(adv_buf + len, BLE_GAP_AD_TYPE_FLAGS, &flags, 1);
+  len += adField(adv_buf + len, BLE_GAP_AD_TYPE_TX_POWER_LEVEL, &tx_power, 1);
+  len += adField(adv_buf + len, BLE_GAP_AD_TYPE_128BIT_SERVICE_UUID_COMPLETE, nus_base.uuid128, 16);
+  adv_buf[len - 16 + 12] = NUS_SERVICE & 0xFF;     // 16-bit part of the UUID
+  adv_buf[len - 16 + 13] = NUS_SERVICE >> 8;
+  adv_data.adv_data.p_data = adv_buf;
+  adv_data.adv_data.len = len;
+
+  len = adField(scan_buf, BLE_GAP_AD_TYPE_COMPLETE_LOCAL_NAME, "KeyFob", 6);
+  adv_data.scan_rsp_data.p_data = scan_buf;
+  adv_data.scan_rsp_data.len = len;
+}
+
+// ---------------------------------------------------------------------------
+// Stack, GAP, NUS
+
+static void stackEnable() {
+  uint32_t ram_start = (uint32_t) &__data_start__;
+  ble_cfg_t cfg;
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.conn_cfg.conn_cfg_tag = LEAN_CONN_TAG;
+  cfg.conn_cfg.params.gap_conn_cfg.conn_count = LEAN_PRPH_LINKS;
+  cfg.conn_cfg.params.gap_conn_cfg.event_length = BLE_GAP_EVENT_LENGTH_DEFAULT;
+  sd_ble_cfg_set(BLE_CONN_CFG_GAP, &cfg, ram_start);
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.conn_cfg.conn_cfg_tag = LEAN_CONN_TAG;
+  cfg.conn_cfg.params.gatt_conn_cfg.att_mtu = LEAN_MTU;
+  sd_ble_cfg_set(BLE_CONN_CFG_GATT, &cfg, ram_start);
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.conn_cfg.conn_cfg_tag = LEAN_CONN_TAG;
+  cfg.conn_cfg.params.gatts_conn_cfg.hvn_tx_queue_size = LEAN_HVN_QUEUE;
+  sd_ble_cfg_set(BLE_CONN_CFG_GATTS, &cfg, ram_start);
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.gap_cfg.role_count_cfg.adv_set_count = 1;
+  cfg.gap_cfg.role_count_cfg.periph_role_count = LEAN_PRPH_LINKS;
+  cfg.gap_cfg.role_count_cfg.central_role_count = 0;
+  cfg.gap_cfg.role_count_cfg.central_sec_count = 0;
+  sd_ble_cfg_set(BLE_GAP_CFG_ROLE_COUNT, &cfg, ram_start);
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.common_cfg.vs_uuid_cfg.vs_uuid_count = 1;
+  sd_ble_cfg_set(BLE_COMMON_CFG_VS_UUID, &cfg, ram_start);
+
+  // Fails with NRF_ERROR_NO_MEM and the RAM start it needs if the linker
+  // script leaves the SoftDevice too little
+  uint32_t needed = ram_start;
+  if (sd_ble_enable(&needed) != NRF_SUCCESS) {
+    logText("sd_ble_enable failed:");
+    logValue("ram_start_needed", needed);
+    logLine("");
+  }
+}
+
+static void gapSetup() {
+  ble_gap_conn_sec_mode_t open;
+  BLE_GAP_CONN_SEC_MODE_SET_OPEN(&open);
+  sd_ble_gap_device_name_set(&open, (const uint8_t*) "KeyFob", 6);
+
+  // link_policy.h values
+  ble_gap_conn_params_t ppcp;
+  ppcp.min_conn_interval = 12;
+  ppcp.max_conn_interval = 24;
+  ppcp.slave_latency = 0;
+  ppcp.conn_sup_timeout = 200;
+  sd_ble_gap_ppcp_set(&ppcp);
+}
+
+static void addChar(uint16_t service, uint16_t uuid16, bool rx, ble_gatts_char_handles_t* handles) {
+  ble_uuid_t uuid = { uuid16, uuid_type };
+
+  ble_gatts_attr_md_t cccd_md;
+  memset(&cccd_md, 0, sizeof(cccd_md));
+  BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+  BLE_GAP_CONN_SEC_MODE_SET_ENC_WITH_MITM(&cccd_md.write_perm);
+  cccd_md.vloc = BLE_GATTS_VLOC_STACK;
+
+  ble_gatts_char_md_t char_md;
+  memset(&char_md, 0, sizeof(char_md));
+  if (rx) {
+    char_md.char_props.write = 1;
+    char_md.char_props.write_wo_resp = 1;
+  }
+  else {
+    char_md.char_props.notify = 1;
+    char_md.p_cccd_md = &cccd_md;
+  }
+
+  ble_gatts_attr_md_t attr_md;
+  memset(&attr_md, 0, sizeof(attr_md));
+  BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.read_perm);
+  if (rx) BLE_GAP_CONN_SEC_MODE_SET_ENC_WITH_MITM(&attr_md.write_perm);
+  else BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.write_perm);
+  attr_md.vloc = BLE_GATTS_VLOC_STACK;
+  attr_md.vlen = 1;
+
+  ble_gatts_attr_t attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.p_uuid = &uuid;
+  attr.p_attr_md = &attr_md;
+  attr.max_len = LEAN_MTU - 3;
+
+  sd_ble_gatts_characteristic_add(service, &char_md, &attr, handles);
+}
+
+static void nusSetup() {
+  sd_ble_uuid_vs_add(&nus_base, &uuid_type);
+  ble_uuid_t uuid = { NUS_SERVICE, uuid_type };
+  uint16_t service;
+  sd_ble_gatts_service_add(BLE_GATTS_SRVC_TYPE_PRIMARY, &uuid, &service);
+  addChar(service, NUS_RX, true, &rx_handles);
+  addChar(service, NUS_TX, false, &tx_handles);
+}
+
+bool bleSend(uint16_t conn, const char* text, uint16_t len) {
+  bool ok = true;
+  for (const Link& l : links) {
+    if (l.handle == BLE_CONN_HANDLE_INVALID || !l.notify) continue;
+    if (conn != BLE_CONN_HANDLE_INVALID && l.handle != conn) continue;
+    uint16_t n = len;
+    ble_gatts_hvx_params_t hvx;
+    memset(&hvx, 0, sizeof(hvx));
+    hvx.handle = tx_handles.value_handle;
+    hvx.type = BLE_GATT_HVX_NOTIFICATION;
+    hvx.p_len = &n;
+    hvx.p_data = (const uint8_t*) text;
+    if (sd_ble_gatts_hvx(l.handle, &hvx) != NRF_SUCCESS) {
+      dropped++;
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+// ---------------------------------------------------------------------------
+// Bonds
+
+static void bondsLoad() {
+  memcpy(&store, (const void*) LEAN_BOND_PAGE, sizeof(store));
+  if (store.page.magic != BOND_MAGIC || store.page.next >= LEAN_BONDS) {
+    memset(&store, 0, sizeof(store));
+    store.page.magic = BOND_MAGIC;
+  }
+}
+
+static void bondAdd() {
+  // A phone pairing again replaces its old entry
+  uint32_t slot = store.page.next;
+  for (uint32_t i = 0; i < LEAN_BONDS; i++) {
+    const Bond& b = store.page.bonds[i];
+    if (b.used && memcmp(&b.peer_id.id_info, &pairing.peer_id.id_info, sizeof(b.peer_id.id_info)) == 0) slot = i;
+  }
+  if (slot == store.page.next) store.page.next = (store.page.next + 1) % LEAN_BONDS;
+  pairing.used = 1;
+  store.page.bonds[slot] = pairing;
+  save_pending = true;
+}
+
+static const Bond* bondFind(const ble_gap_master_id_t& id) {
+  for (const Bond& b : store.page.bonds) {
+    if (b.used && b.own_enc.master_id.ediv == id.ediv &&
+        memcmp(b.own_enc.master_id.rand, id.rand, BLE_GAP_SEC_RAND_LEN) == 0) return &b;
+  }
+  return nullptr;
+}
+
+void bleSocEvent(uint32_t evt) {
+  if (evt == NRF_EVT_FLASH_OPERATION_ERROR) {
+    flash_step = FLASH_IDLE;
+    save_pending = true;                  // blePoll() starts over
+    return;
+  }
+  if (evt != NRF_EVT_FLASH_OPERATION_SUCCESS) return;
+
+  if (flash_step == FLASH_ERASING) {
+    if (sd_flash_write((uint32_t*) LEAN_BOND_PAGE, flash_copy.words, sizeof(flash_copy.words) / 4) == NRF_SUCCESS) {
+      flash_step = FLASH_WRITING;
+    }
+    else {
+      flash_step = FLASH_IDLE;
+      save_pending = true;
+    }
+  }
+  else if (flash_step == FLASH_WRITING) {
+    flash_step = FLASH_IDLE;
+    logLine("Bonds saved");
+  }
+}
+
+void blePoll() {
+  if (save_pending && flash_step == FLASH_IDLE) {
+    flash_copy = store;
+    if (sd_flash_page_erase(LEAN_BOND_PAGE / 4096) == NRF_SUCCESS) {
+      flash_step = FLASH_ERASING;
+      save_pending = false;
+    }
+  }
+
+  // Pairing window closing can turn advertising off
+  static bool was_open = false;
+  bool open = pairingAllowed();
+  if (open != was_open) {
+    was_open = open;
+    advUpdate();
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Events
+
+static void secParamsReply(uint16_t conn) {
+  if (!pairingAllowed()) {
+    logLine("Pairing refused - send 'pair' from a paired phone first");
+    sd_ble_gap_sec_params_reply(conn, BLE_GAP_SEC_STATUS_PAIRING_NOT_SUPP, nullptr, nullptr);
+    return;
+  }
+
+  ble_gap_sec_params_t params;
+  memset(&params, 0, sizeof(params));
+  params.bond = 1;
+  params.mitm = 1;
+  params.io_caps = BLE_GAP_IO_CAPS_DISPLAY_ONLY;
+  params.min_key_size = 7;
+  params.max_key_size = 16;
+  params.kdist_own.enc = 1;
+  params.kdist_peer.id = 1;
+
+  memset(&pairing, 0, sizeof(pairing));
+  memset(&keyset, 0, sizeof(keyset));
+  keyset.keys_own.p_enc_key = &pairing.own_enc;
+  keyset.keys_peer.p_id_key = &pairing.peer_id;
+  sd_ble_gap_sec_params_reply(conn, BLE_GAP_SEC_STATUS_SUCCESS, &params, &keyset);
+}
+
+void bleEvent(const ble_evt_t* evt, uint32_t start_cycles) {
+  uint16_t conn = evt->evt.gap_evt.conn_handle;
+  Link* link = findLink(conn);
+
+  switch (evt->header.evt_id) {
+    case BLE_GAP_EVT_CONNECTED:
+      advertising = false;                // connectable advertising ends with a link
+      link = findLink(BLE_CONN_HANDLE_INVALID);
+      if (link) {
+        link->handle = conn;
+        link->secured = false;
+        link->notify = false;
+      }
+      logLine("BLE Connected!");
+      advUpdate();
+      break;
+
+    case BLE_GAP_EVT_DISCONNECTED:
+      if (link) link->handle = BLE_CONN_HANDLE_INVALID;
+      logText("BLE Disconnected");
+      logValue("reason", evt->evt.gap_evt.params.disconnected.reason);
+      logLine("");
+      advUpdate();
+      break;
+
+    case BLE_GAP_EVT_ADV_SET_TERMINATED:
+      // Fast period over: slow until something changes
+      advertising = false;
+      if (evt->evt.gap_evt.params.adv_set_terminated.reason == BLE_GAP_EVT_ADV_SET_TERMINATED_REASON_TIMEOUT) advStart(false);
+      break;
+
+    case BLE_GAP_EVT_SEC_PARAMS_REQUEST:
+      secParamsReply(conn);
+      break;
+
+    case BLE_GAP_EVT_PASSKEY_DISPLAY: {
+      char pin[7];
+      memcpy(pin, evt->evt.gap_evt.params.passkey_display.passkey, 6);
+      pin[6] = 0;
+      logText("Enter this PIN on your phone: ");
+      logLine(pin);
+      break;
+    }
+
+    case BLE_GAP_EVT_SEC_INFO_REQUEST: {
+      const Bond* b = bondFind(evt->evt.gap_evt.params.sec_info_request.master_id);
+      sd_ble_gap_sec_info_reply(conn, b ? &b->own_enc.enc_info : nullptr, nullptr, nullptr);
+      break;
+    }
+
+    case BLE_GAP_EVT_AUTH_STATUS: {
+      const ble_gap_evt_auth_status_t& a = evt->evt.gap_evt.params.auth_status;
+      if (a.auth_status == BLE_GAP_SEC_STATUS_SUCCESS && a.bonded) bondAdd();
+      break;
+    }
+
+    case BLE_GAP_EVT_CONN_SEC_UPDATE: {
+      const ble_gap_conn_sec_mode_t& m = evt->evt.gap_evt.params.conn_sec_update.conn_sec.sec_mode;
+      if (link && m.sm == 1 && m.lv >= 3) {
+        link->secured = true;
+        logLine("Connection secured (encrypted & authenticated)");
+        ble_gap_conn_params_t ppcp;
+        sd_ble_gap_ppcp_get(&ppcp);
+        sd_ble_gap_conn_param_update(conn, &ppcp);
+        advUpdate();
+      }
+      break;
+    }
+
+    case BLE_GAP_EVT_PHY_UPDATE_REQUEST: {
+      ble_gap_phys_t phys = { BLE_GAP_PHY_AUTO, BLE_GAP_PHY_AUTO };
+      sd_ble_gap_phy_update(conn, &phys);
+      break;
+    }
+
+    case BLE_GAP_EVT_DATA_LENGTH_UPDATE_REQUEST:
+      sd_ble_gap_data_length_update(conn, nullptr, nullptr);
+      break;
+
+    case BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST:
+      sd_ble_gatts_exchange_mtu_reply(evt->evt.gatts_evt.conn_handle, LEAN_MTU);
+      break;
+
+    case BLE_GATTS_EVT_SYS_ATTR_MISSING:
+      sd_ble_gatts_sys_attr_set(evt->evt.gatts_evt.conn_handle, nullptr, 0, 0);
+      break;
+
+    case BLE_GATTS_EVT_WRITE: {
+      const ble_gatts_evt_write_t& w = evt->evt.gatts_evt.params.write;
+      uint16_t c = evt->evt.gatts_evt.conn_handle;
+      if (w.handle == rx_handles.value_handle) leanCommand(c, (const char*) w.data, w.len, start_cycles);
+      else if (w.handle == tx_handles.cccd_handle && w.len == 2) {
+        Link* l = findLink(c);
+        if (l) l->notify = w.data[0] & BLE_GATT_HVX_NOTIFICATION;
+      }
+      break;
+    }
+
+    case BLE_GATTC_EVT_TIMEOUT:
+    case BLE_GATTS_EVT_TIMEOUT:
+      sd_ble_gap_disconnect(conn, BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+      break;
+
+    default:
+      break;
+  }
+}
+
+void bleBegin() {
+  for (Link& l : links) l.handle = BLE_CONN_HANDLE_INVALID;
+  bondsLoad();
+  bleOpenPairing();                     // as after boot in admission.cpp
+
+  stackEnable();
+  gapSetup();
+  nusSetup();
+  advSetup();
+  advUpdate();
+}
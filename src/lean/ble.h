@@ -0,0 +1,26 @@
+#pragma once
+
+#include "lean.h"
+#include <ble.h>
+
+// BLE for the lean build, straight on the S140 API: stack configuration,
+// the Nordic UART Service (same UUIDs as BLEUart; RX write and TX CCCD
+// need an encrypted MITM link), passkey-display bonding with the bonds in
+// one flash page, and advertising that follows the links the way
+// adv_policy.cpp does: fast for 30 s, then slow, off while a bonded phone
+// is connected (unless a pairing window is open) or both slots are taken.
+#define LEAN_BONDS        4
+#define LEAN_HVN_QUEUE    4            // TXQ_HVN_CREDITS
+
+void bleBegin();                       // after sd_softdevice_enable()
+void bleEvent(const ble_evt_t* evt, uint32_t start_cycles);
+void bleSocEvent(uint32_t evt);
+void blePoll();                        // pairing window, bond saving
+
+// conn BLE_CONN_HANDLE_INVALID: every link that enabled notifications.
+// Never waits: false if the SoftDevice's queue was full.
+bool bleSend(uint16_t conn, const char* text, uint16_t len);
+void bleOpenPairing();                 // LEAN_PAIRING_S from now
+uint8_t bleLinks();
+uint8_t bleBondCount();
+uint32_t bleDropped();
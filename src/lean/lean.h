@@ -0,0 +1,41 @@
+#pragma once
+
+// [env:lean]: the key fob without the Arduino layer. Bluefruit, FreeRTOS,
+// Serial/TinyUSB and the loop task are replaced by the S140 API, nrfx HAL
+// calls and one event loop in main() that sleeps in sd_app_evt_wait().
+// Same pins and pulse (../config.h), same NUS service, MITM bonding and
+// acknowledgement texts, so the phone app can't tell the builds apart.
+//
+// Not here: journal, USB drive, governor, link cache, wired port, inputs,
+// dongle, delta updates. Log output is plain UART on the wired port's TX pin.
+
+#include <stdint.h>
+#include <string.h>
+#include <nrf.h>
+#include "../config.h"
+
+// Same placement as perf.h, which can't be included here (Arduino.h)
+#define HOT_PATH __attribute__((section(".data.hot_path"), long_call, noinline))
+
+#define LEAN_CONN_TAG       1
+#define LEAN_PRPH_LINKS     2          // ADMIT_MAX_PRPH
+#define LEAN_MTU            247
+#define LEAN_ADV_FAST       32         // 20 ms, governor "performance" tier
+#define LEAN_ADV_SLOW       244        // 152.5 ms
+#define LEAN_ADV_FAST_S     30         // ADV_FAST_TIMEOUT_S
+#define LEAN_PAIRING_S      120        // ADMIT_PAIRING_WINDOW_S
+#define LEAN_BOND_PAGE      0xE9000    // last page of [env:nicenano]'s delta bank, which holds nothing between updates
+#define LEAN_LOG_BAUD       UARTE_BAUDRATE_BAUDRATE_Baud115200
+#define LEAN_SD_EVT_PRIO    6
+#define LEAN_PULSE_PRIO     3
+
+// main.cpp
+uint32_t leanMillis();                 // RTC1, from reset
+HOT_PATH void leanCommand(uint16_t conn, const char* cmd, uint16_t len, uint32_t start_cycles);
+
+// log.cpp: blocking UARTE0 TX, main loop only
+void logBegin();
+void logText(const char* text);
+void logLine(const char* text);
+void logValue(const char* label, uint32_t value);   // " label=value"
+char* formatU32(char* out, uint32_t value);         // no terminator; returns the end
@@ -0,0 +1,68 @@
+/*
+ * Log output for the lean build
+ *
+ * UARTE0 TX only, on the wired port's TX pin, through a small RAM buffer
+ * (EasyDMA can't read flash). Blocking: ~87 us per character at 115200,
+ * fine for a handful of lines per connection. Replaces Serial, which needs
+ * TinyUSB and its task.
+ */
+
+#include "lean.h"
+#include <nrf_gpio.h>
+#include <nrf_uarte.h>
+
+#define LOG_CHUNK 32
+
+static uint8_t tx_buf[LOG_CHUNK];
+
+void logBegin() {
+  nrf_gpio_pin_set(WIRED_TX_PIN);
+  nrf_gpio_cfg_output(WIRED_TX_PIN);
+  nrf_uarte_txrx_pins_set(NRF_UARTE0, WIRED_TX_PIN, NRF_UARTE_PSEL_DISCONNECTED);
+  nrf_uarte_baudrate_set(NRF_UARTE0, (nrf_uarte_baudrate_t) LEAN_LOG_BAUD);
+  nrf_uarte_configure(NRF_UARTE0, NRF_UARTE_PARITY_EXCLUDED, NRF_UARTE_HWFC_DISABLED);
+  nrf_uarte_enable(NRF_UARTE0);
+}
+
+static void send(const char* p, uint32_t len) {
+  while (len) {
+    uint32_t n = len < LOG_CHUNK ? len : LOG_CHUNK;
+    memcpy(tx_buf, p, n);
+    nrf_uarte_event_clear(NRF_UARTE0, NRF_UARTE_EVENT_ENDTX);
+    nrf_uarte_tx_buffer_set(NRF_UARTE0, tx_buf, n);
+    nrf_uarte_task_trigger(NRF_UARTE0, NRF_UARTE_TASK_STARTTX);
+    while (!nrf_uarte_event_check(NRF_UARTE0, NRF_UARTE_EVENT_ENDTX)) { }
+    // Stopped between lines, so the transmitter doesn't hold HFCLK
+    nrf_uarte_task_trigger(NRF_UARTE0, NRF_UARTE_TASK_STOPTX);
+    p += n;
+    len -= n;
+  }
+}
+
+void logText(const char* text) {
+  send(text, strlen(text));
+}
+
+void logLine(const char* text) {
+  logText(text);
+  send("\r\n", 2);
+}
+
+char* formatU32(char* out, uint32_t value) {
+  char digits[10];
+  uint8_t n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  while (n) *out++ = digits[--n];
+  return out;
+}
+
+void logValue(const char* label, uint32_t value) {
+  char buf[12];
+  send(" ", 1);
+  logText(label);
+  send("=", 1);
+  send(buf, formatU32(buf, value) - buf);
+}
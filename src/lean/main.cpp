@@ -0,0 +1,255 @@
+/*
+ * Key fob trigger, lean build ([env:lean])
+ *
+ * main() replaces the core's: no FreeRTOS scheduler, no loop task, no
+ * USB. The core is only there for the startup code, linker script and
+ * headers; the linker leaves its main(), wiring and RTOS objects out since
+ * nothing here refers to them.
+ *
+ * One thread: pull SoC and BLE events from the SoftDevice, report pulse
+ * ends, save bonds, sleep in sd_app_evt_wait() until the next event or
+ * interrupt. A write on the NUS RX characteristic is handled inside its
+ * event, so "latency" below is event pickup to pulse armed, the lean
+ * counterpart of perf's RX callback to pulse armed.
+ *
+ * stats reports image size, static RAM, main() to advertising and press
+ * latency for the comparison with [env:nicenano] in ARCHITECTURE.md. Boot
+ * time from reset includes the bootloader and startup code, which the CPU
+ * can't time; it comes from a current capture.
+ */
+
+#include "lean.h"
+#include "ble.h"
+#include "pulse.h"
+#include <nrf_sdm.h>
+#include <nrf_soc.h>
+
+#define LEAN_APP_ADDR  0x26000
+
+// From the linker script
+extern uint32_t __etext;
+extern uint32_t __data_start__;
+extern uint32_t __data_end__;
+extern uint32_t __bss_end__;
+extern uint32_t __StackTop;
+extern uint32_t __StackLimit;
+
+struct PressStats {
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint64_t total;
+};
+
+static volatile uint32_t rtc_overflows = 0;
+static uint32_t boot_cycles = 0;         // main() to advertising
+static PressStats press;
+static uint16_t press_seq = 0;
+static uint16_t channel_seq[PULSE_CHANNELS];
+
+// Wakes sd_app_evt_wait(); the events themselves are pulled in main()
+extern "C" void SD_EVT_IRQHandler(void) { }
+
+extern "C" void RTC1_IRQHandler(void) {
+  NRF_RTC1->EVENTS_OVRFLW = 0;
+  rtc_overflows = rtc_overflows + 1;
+}
+
+static void sdFault(uint32_t id, uint32_t pc, uint32_t info) {
+  NVIC_SystemReset();
+}
+
+uint32_t leanMillis() {
+  uint32_t ovf, count;
+  do {
+    ovf = rtc_overflows;
+    count = NRF_RTC1->COUNTER;
+  } while (ovf != rtc_overflows);
+  return (uint32_t) ((((uint64_t) ovf << 24) | count) * 1000 / 32768);
+}
+
+static void clockBegin() {
+  // 32 kHz, started by the SoftDevice; overflow every 512 s
+  NRF_RTC1->PRESCALER = 0;
+  NRF_RTC1->EVTENSET = RTC_EVTENSET_OVRFLW_Msk;
+  NRF_RTC1->INTENSET = RTC_INTENSET_OVRFLW_Msk;
+  NVIC_SetPriority(RTC1_IRQn, LEAN_SD_EVT_PRIO);
+  NVIC_EnableIRQ(RTC1_IRQn);
+  NRF_RTC1->TASKS_START = 1;
+}
+
+// ---------------------------------------------------------------------------
+// Replies, split to 20 bytes (default ATT MTU) like tx_queue.cpp
+
+static void reply(uint16_t conn, const char* text) {
+  char line[64];
+  uint16_t len = strlen(text);
+  if (len > sizeof(line) - 2) len = sizeof(line) - 2;
+  memcpy(line, text, len);
+  line[len++] = '\r';
+  line[len++] = '\n';
+  for (uint16_t at = 0; at < len; at += 20) {
+    bleSend(conn, line + at, len - at < 20 ? len - at : 20);
+  }
+}
+
+// "Locking... #042" as in commands.cpp
+static void ack(const char* text, uint16_t seq) {
+  char line[24];
+  char* p = line + strlen(text);
+  memcpy(line, text, p - line);
+  *p++ = ' ';
+  *p++ = '#';
+  for (int8_t i = 2; i >= 0; i--, seq /= 10) p[i] = '0' + seq % 10;
+  p[3] = 0;
+  reply(BLE_CONN_HANDLE_INVALID, line);
+}
+
+static char* appendValue(char* p, const char* label, uint32_t value) {
+  *p++ = ' ';
+  uint32_t n = strlen(label);
+  memcpy(p, label, n);
+  p += n;
+  *p++ = '=';
+  p = formatU32(p, value);
+  *p = 0;
+  return p;
+}
+
+static void printStats(uint16_t conn) {
+  char line[64];
+  uint32_t image = (uint32_t) &__etext + ((uint32_t) &__data_end__ - (uint32_t) &__data_start__) - LEAN_APP_ADDR;
+  uint32_t ram = (uint32_t) &__bss_end__ - (uint32_t) &__data_start__;
+  uint32_t stack = (uint32_t) &__StackTop - (uint32_t) &__StackLimit;
+
+  char* p = line;
+  *p = 0;
+  p = appendValue(p, "flash", image);
+  p = appendValue(p, "ram", ram);
+  p = appendValue(p, "stack", stack);
+  reply(conn, line + 1);
+
+  p = appendValue(line, "main_us", boot_cycles / 64);
+  p = appendValue(p, "links", bleLinks());
+  p = appendValue(p, "bonds", bleBondCount());
+  p = appendValue(p, "drop", bleDropped());
+  reply(conn, line + 1);
+
+  p = appendValue(line, "press", press.count);
+  if (press.count) {
+    p = appendValue(p, "min_us", press.min / 64);
+    p = appendValue(p, "avg_us", (uint32_t) (press.total / press.count / 64));
+    p = appendValue(p, "max_us", press.max / 64);
+  }
+  reply(conn, line + 1);
+}
+
+// ---------------------------------------------------------------------------
+// Commands: the same texts dispatchCommand() takes, plus stats and pair
+
+static HOT_PATH bool pressCommand(const char* cmd, PulseChannel* ch) {
+  if (strstr(cmd, "!B11") || strcmp(cmd, "lock") == 0 || strcmp(cmd, "1") == 0) *ch = PULSE_LOCK;
+  else if (strstr(cmd, "!B21") || strcmp(cmd, "unlock") == 0 || strcmp(cmd, "2") == 0) *ch = PULSE_UNLOCK;
+  else return false;
+  return true;
+}
+
+HOT_PATH void leanCommand(uint16_t conn, const char* data, uint16_t len, uint32_t start_cycles) {
+  char cmd[32];
+  if (len > sizeof(cmd) - 1) len = sizeof(cmd) - 1;
+  memcpy(cmd, data, len);
+  while (len && (cmd[len - 1] == '\r' || cmd[len - 1] == '\n' || cmd[len - 1] == ' ')) len--;
+  cmd[len] = 0;
+
+  PulseChannel ch;
+  if (pressCommand(cmd, &ch)) {
+    if (!pulseFire(ch)) {
+      logLine("Button still pressed, ignored");
+      return;
+    }
+    uint32_t cycles = DWT->CYCCNT - start_cycles;
+    if (press.count == 0 || cycles < press.min) press.min = cycles;
+    if (cycles > press.max) press.max = cycles;
+    press.total += cycles;
+    press.count++;
+
+    channel_seq[ch] = ++press_seq;
+    ack(ch == PULSE_LOCK ? "Locking..." : "Unlocking...", press_seq);
+    logLine(ch == PULSE_LOCK ? ">>> LOCK" : ">>> UNLOCK");
+    return;
+  }
+
+  if (strstr(cmd, "!B31") || strstr(cmd, "!B41")) return;       // not assigned
+  if (len == 0 || cmd[0] == '!') return;                        // other controller packets
+  if (strcmp(cmd, "stats") == 0) printStats(conn);
+  else if (strcmp(cmd, "pair") == 0) {
+    bleOpenPairing();
+    reply(conn, "Pairing open for 120 s");
+  }
+  else reply(conn, "Commands: lock, unlock, 1, 2, stats, pair");
+}
+
+// ---------------------------------------------------------------------------
+
+int main() {
+  NRF_POWER->DCDCEN = 1;
+
+  // I-cache and cycle counter, as perfBegin(); main_us counts from here
+  NRF_NVMC->ICACHECNF = NVMC_ICACHECNF_CACHEEN_Enabled << NVMC_ICACHECNF_CACHEEN_Pos;
+  CoreDebug->DEMCR = CoreDebug->DEMCR | CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL = DWT->CTRL | DWT_CTRL_CYCCNTENA_Msk;
+
+  logBegin();
+
+  nrf_clock_lf_cfg_t lf;
+  lf.source = NRF_CLOCK_LF_SRC_XTAL;
+  lf.rc_ctiv = 0;
+  lf.rc_temp_ctiv = 0;
+  lf.accuracy = NRF_CLOCK_LF_ACCURACY_20_PPM;
+  uint32_t err = sd_softdevice_enable(&lf, sdFault);
+  if (err != NRF_SUCCESS) {
+    // No radio and no sd_* call without it; the outputs are still inputs
+    logText("sd_softdevice_enable failed:");
+    logValue("err", err);
+    logLine("");
+    while (true) __WFE();
+  }
+  NVIC_SetPriority(SD_EVT_IRQn, LEAN_SD_EVT_PRIO);
+  NVIC_EnableIRQ(SD_EVT_IRQn);
+
+  clockBegin();
+  pulseBegin();
+  bleBegin();
+  boot_cycles = DWT->CYCCNT;
+
+  logLine("===========================================");
+  logLine("  KEY FOB TRIGGER - BLE (lean build)");
+  logLine("===========================================");
+  logText("Advertising, after main()");
+  logValue("us", boot_cycles / 64);
+  logLine("");
+
+  static uint32_t evt_buf[(BLE_EVT_LEN_MAX(LEAN_MTU) + 3) / 4];
+  while (true) {
+    uint32_t soc_evt;
+    while (sd_evt_get(&soc_evt) == NRF_SUCCESS) bleSocEvent(soc_evt);
+
+    while (true) {
+      uint16_t len = sizeof(evt_buf);
+      if (sd_ble_evt_get((uint8_t*) evt_buf, &len) != NRF_SUCCESS) break;
+      bleEvent((const ble_evt_t*) evt_buf, DWT->CYCCNT);
+    }
+
+    // Pulse ends are timed in hardware; report them here
+    uint8_t released = pulsePoll();
+    for (uint8_t ch = 0; ch < PULSE_CHANNELS; ch++) {
+      if (!(released & (1 << ch))) continue;
+      ack(ch == PULSE_LOCK ? "Locked!" : "Unlocked!", channel_seq[ch]);
+      logLine(ch == PULSE_LOCK ? ">>> LOCK COMPLETE" : ">>> UNLOCK COMPLETE");
+    }
+
+    blePoll();
+    sd_app_evt_wait();
+  }
+}
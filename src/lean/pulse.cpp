@@ -0,0 +1,89 @@
+#include "pulse.h"
+#include <nrf_gpio.h>
+#include <nrf_soc.h>
+
+struct PulseHw {
+  uint8_t pin;
+  NRF_TIMER_Type* timer;
+  IRQn_Type irq;
+};
+
+// Not const: in RAM next to the hot path, as in actuation.cpp
+static PulseHw hw[PULSE_CHANNELS] = {
+  { LOCK_PIN,   NRF_TIMER3, TIMER3_IRQn },
+  { UNLOCK_PIN, NRF_TIMER4, TIMER4_IRQn },
+};
+
+static volatile bool busy[PULSE_CHANNELS];
+static volatile bool released[PULSE_CHANNELS];
+
+void pulseBegin() {
+  nrf_gpio_pin_clear(STATUS_LED);
+  nrf_gpio_cfg_output(STATUS_LED);
+
+  for (uint8_t ch = 0; ch < PULSE_CHANNELS; ch++) {
+    const PulseHw& h = hw[ch];
+    uint8_t gpiote_ch = PULSE_GPIOTE_CH_BASE + ch;
+    uint8_t ppi_ch = PULSE_PPI_CH_BASE + ch;
+
+    // Low before output, so there is never a glitch on the optocoupler
+    nrf_gpio_pin_clear(h.pin);
+    nrf_gpio_cfg_output(h.pin);
+
+    NRF_GPIOTE->CONFIG[gpiote_ch] =
+        (GPIOTE_CONFIG_MODE_Task << GPIOTE_CONFIG_MODE_Pos) |
+        (h.pin << GPIOTE_CONFIG_PSEL_Pos) |
+        (GPIOTE_CONFIG_POLARITY_None << GPIOTE_CONFIG_POLARITY_Pos) |
+        (GPIOTE_CONFIG_OUTINIT_Low << GPIOTE_CONFIG_OUTINIT_Pos);
+
+    // 1MHz one-shot: compare clears and stops the timer
+    h.timer->TASKS_STOP = 1;
+    h.timer->MODE = TIMER_MODE_MODE_Timer;
+    h.timer->BITMODE = TIMER_BITMODE_BITMODE_32Bit;
+    h.timer->PRESCALER = 4;
+    h.timer->CC[0] = PULSE_MS * 1000UL;
+    h.timer->SHORTS = TIMER_SHORTS_COMPARE0_CLEAR_Msk | TIMER_SHORTS_COMPARE0_STOP_Msk;
+    h.timer->INTENSET = TIMER_INTENSET_COMPARE0_Msk;
+    NVIC_SetPriority(h.irq, LEAN_PULSE_PRIO);
+    NVIC_EnableIRQ(h.irq);
+
+    // Pulse end: TIMER COMPARE0 -> PPI -> GPIOTE CLR
+    sd_ppi_channel_assign(ppi_ch, &h.timer->EVENTS_COMPARE[0], &NRF_GPIOTE->TASKS_CLR[gpiote_ch]);
+    sd_ppi_channel_enable_set(1UL << ppi_ch);
+  }
+}
+
+HOT_PATH bool pulseFire(PulseChannel ch) {
+  if (busy[ch]) return false;
+  busy[ch] = true;
+
+  const PulseHw& h = hw[ch];
+  nrf_gpio_pin_set(STATUS_LED);
+  h.timer->TASKS_CLEAR = 1;
+  NRF_GPIOTE->TASKS_SET[PULSE_GPIOTE_CH_BASE + ch] = 1;
+  h.timer->TASKS_START = 1;
+  return true;
+}
+
+static void pulseEnded(uint8_t ch) {
+  hw[ch].timer->EVENTS_COMPARE[0] = 0;
+  (void) hw[ch].timer->EVENTS_COMPARE[0];
+
+  busy[ch] = false;
+  released[ch] = true;
+  if (!busy[0] && !busy[1]) nrf_gpio_pin_clear(STATUS_LED);
+}
+
+extern "C" void TIMER3_IRQHandler(void) { pulseEnded(PULSE_LOCK); }
+extern "C" void TIMER4_IRQHandler(void) { pulseEnded(PULSE_UNLOCK); }
+
+uint8_t pulsePoll() {
+  uint8_t mask = 0;
+  for (uint8_t ch = 0; ch < PULSE_CHANNELS; ch++) {
+    if (released[ch]) {
+      released[ch] = false;
+      mask |= 1 << ch;
+    }
+  }
+  return mask;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "lean.h"
+
+// actuation.cpp without Arduino: GPIOTE sets the pin, TIMER3/4 COMPARE0
+// clears it through PPI after PULSE_MS. Same channels and resources.
+enum PulseChannel : uint8_t {
+  PULSE_LOCK = 0,
+  PULSE_UNLOCK = 1,
+  PULSE_CHANNELS
+};
+
+#define PULSE_GPIOTE_CH_BASE 6
+#define PULSE_PPI_CH_BASE    10
+
+void pulseBegin();                          // after sd_softdevice_enable() (sd_ppi_*)
+HOT_PATH bool pulseFire(PulseChannel ch);   // false if that channel is already pressed
+uint8_t pulsePoll();                        // bitmask of channels released since last call
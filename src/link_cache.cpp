@@ -0,0 +1,365 @@
+/*
+ * Per-bond link capability cache
+ *
+ * Cold connect: the phone drives MTU/DLE/PHY/connection updates one after
+ * another, we ask for connection parameters after LINK_PARAM_DELAY_MS and
+ * start MTU/DLE/PHY ourselves once the link is secured, to learn what the
+ * phone accepts.
+ *
+ * Warm connect: the phone's private address is resolved against the IRKs
+ * we keep here (same ah() check the SoftDevice's peer manager does), and
+ * every procedure it accepted before is started right in the CONNECTED
+ * event. Procedures it refused are skipped.
+ *
+ * Time-to-ready = connect -> secured and all started procedures finished.
+ *
+ * linkCacheEvent() runs in the BLE task, linkCacheSecured() and
+ * linkCachePoll() in loop(); both sides change the per-link progress and
+ * the cache entries and start procedures, so each holds `lock` while it
+ * does. The file is written from a copy, outside the lock.
+ */
+
+#include "link_cache.h"
+#include "link_policy.h"
+#include "admission.h"
+#include "secure_store.h"
+
+#define LINKCAP_ALL (LINKCAP_MTU | LINKCAP_DLE | LINKCAP_PHY | LINKCAP_CONN)
+
+struct CacheFile {
+  uint16_t version;
+  uint16_t count;
+  LinkCaps entries[LINKCAPS_MAX];
+};
+
+struct LinkProgress {
+  bool     active;
+  bool     warm;
+  bool     secured;
+  bool     ready;
+  int8_t   entry;           // cache entry, -1 until identified
+  uint8_t  to_start;        // LINKCAP_* still to start (SoftDevice was busy)
+  uint8_t  pending;         // started, waiting for the result
+  uint8_t  attempted;       // started on this connection
+  uint8_t  rejected;        // refused on this connection
+  uint32_t connected_ms;
+  uint32_t pending_since_ms;
+  uint32_t secured_ms;
+  uint32_t last_done_ms;
+  LinkCaps seen;            // what this connection ended up with
+};
+
+struct CacheStats {
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t ready_count[2];          // [cold, warm]
+  uint32_t ready_total_ms[2];
+};
+
+static CacheFile cache;
+static CacheFile saving;                // copy written by save()
+static SemaphoreHandle_t lock;
+static LinkProgress links[ADMIT_CONN_HANDLES];
+static CacheStats stats;
+static uint32_t lru_clock = 0;
+static volatile bool dirty = false;
+
+void linkCacheBegin() {
+  memset(&cache, 0, sizeof(cache));
+
+  CacheFile stored;
+  bool legacy;
+  if (secureReadFile(LINKCAPS_FILE, SEAL_LINKCAPS, &stored, sizeof(stored), &legacy) == sizeof(stored) &&
+      stored.version == LINKCAPS_VERSION) {
+    cache = stored;
+    if (legacy) secureWriteFile(LINKCAPS_FILE, SEAL_LINKCAPS, &cache, sizeof(cache));   // sealed from now on
+  }
+  cache.version = LINKCAPS_VERSION;
+  cache.count = LINKCAPS_MAX;
+
+  for (uint8_t i = 0; i < LINKCAPS_MAX; i++) {
+    if (cache.entries[i].last_used > lru_clock) lru_clock = cache.entries[i].last_used;
+  }
+  lock = xSemaphoreCreateMutex();
+}
+
+static void save() {
+  xSemaphoreTake(lock, portMAX_DELAY);
+  saving = cache;
+  dirty = false;
+  xSemaphoreGive(lock);
+  secureWriteFile(LINKCAPS_FILE, SEAL_LINKCAPS, &saving, sizeof(saving));
+}
+
+// Bluetooth Core Vol 3 Part H 2.2.2: hash == ah(IRK, prand)
+bool linkCacheResolve(const uint8_t irk[16], const uint8_t addr[6]) {
+  nrf_ecb_hal_data_t ecb;
+  for (uint8_t i = 0; i < 16; i++) ecb.key[i] = irk[15 - i];
+  memset(ecb.cleartext, 0, sizeof(ecb.cleartext));
+  for (uint8_t i = 0; i < 3; i++) ecb.cleartext[15 - i] = addr[3 + i];
+
+  if (sd_ecb_block_encrypt(&ecb) != NRF_SUCCESS) return false;
+  for (uint8_t i = 0; i < 3; i++) {
+    if (ecb.ciphertext[15 - i] != addr[i]) return false;
+  }
+  return true;
+}
+
+static int8_t findEntry(const ble_gap_addr_t& addr) {
+  for (uint8_t i = 0; i < LINKCAPS_MAX; i++) {
+    const LinkCaps& e = cache.entries[i];
+    if (!e.valid) continue;
+    if (addr.addr_type == BLE_GAP_ADDR_TYPE_RANDOM_PRIVATE_RESOLVABLE) {
+      if (linkCacheResolve(e.irk, addr.addr)) return i;
+    }
+    else if (memcmp(e.id_addr, addr.addr, 6) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int8_t findOrAllocate(const uint8_t id_addr[6]) {
+  int8_t oldest = 0;
+  for (uint8_t i = 0; i < LINKCAPS_MAX; i++) {
+    const LinkCaps& e = cache.entries[i];
+    if (e.valid && memcmp(e.id_addr, id_addr, 6) == 0) return i;
+    if (!e.valid) return i;
+    if (e.last_used < cache.entries[oldest].last_used) oldest = i;
+  }
+  memset(&cache.entries[oldest], 0, sizeof(LinkCaps));
+  return oldest;
+}
+
+static void startOne(LinkProgress& link, uint8_t bit, uint32_t err) {
+  if (err == NRF_ERROR_BUSY) return;    // retried from linkCachePoll()
+  link.to_start &= ~bit;
+  if (err == NRF_SUCCESS) {
+    link.pending |= bit;
+    link.attempted |= bit;
+  }
+}
+
+// Starts everything in to_start at once; the SoftDevice runs the ATT and
+// link layer procedures side by side
+static void startProcedures(uint16_t conn_handle) {
+  LinkProgress& link = links[conn_handle];
+  if (link.to_start == 0) return;
+  link.pending_since_ms = millis();
+
+  if (link.to_start & LINKCAP_MTU) {
+    startOne(link, LINKCAP_MTU, sd_ble_gattc_exchange_mtu_request(conn_handle, LINKCAPS_MTU_MAX));
+  }
+  if (link.to_start & LINKCAP_DLE) {
+    ble_gap_data_length_params_t dl;
+    memset(&dl, BLE_GAP_DATA_LENGTH_AUTO, sizeof(dl));
+    startOne(link, LINKCAP_DLE, sd_ble_gap_data_length_update(conn_handle, &dl, NULL));
+  }
+  if (link.to_start & LINKCAP_PHY) {
+    ble_gap_phys_t phys = { BLE_GAP_PHY_2MBPS, BLE_GAP_PHY_2MBPS };
+    startOne(link, LINKCAP_PHY, sd_ble_gap_phy_update(conn_handle, &phys));
+  }
+  if (link.to_start & LINKCAP_CONN) {
+    linkPolicyRequestNow(conn_handle);
+    startOne(link, LINKCAP_CONN, NRF_SUCCESS);
+  }
+}
+
+static void finished(LinkProgress& link, uint8_t bit, bool refused) {
+  if (refused && (link.pending & bit)) link.rejected |= bit;
+  link.pending &= ~bit;
+  link.to_start &= ~bit;
+  link.last_done_ms = millis();
+}
+
+// Runs in the Bluefruit BLE task
+void linkCacheEvent(ble_evt_t* evt) {
+  uint16_t conn_handle = evt->evt.common_evt.conn_handle;
+  if (conn_handle >= ADMIT_CONN_HANDLES) return;
+  if (!lock) return;            // a phone connected before setup() got here
+  LinkProgress& link = links[conn_handle];
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+  switch (evt->header.evt_id) {
+    case BLE_GAP_EVT_CONNECTED: {
+      const ble_gap_evt_connected_t& c = evt->evt.gap_evt.params.connected;
+      if (c.role != BLE_GAP_ROLE_PERIPH) break;
+
+      link = LinkProgress();
+      link.active = true;
+      link.connected_ms = millis();
+      link.last_done_ms = link.connected_ms;
+      link.seen.mtu = BLE_GATT_ATT_MTU_DEFAULT;
+      link.seen.data_len = BLE_GAP_DATA_LENGTH_DEFAULT;
+      link.seen.phy = BLE_GAP_PHY_1MBPS;
+      link.seen.interval = c.conn_params.max_conn_interval;
+      link.seen.latency = c.conn_params.slave_latency;
+      memcpy(link.seen.id_addr, c.peer_addr.addr, 6);
+
+      link.entry = findEntry(c.peer_addr);
+      if (link.entry >= 0) {
+        stats.hits++;
+        link.warm = true;
+        link.to_start = LINKCAP_ALL & ~cache.entries[link.entry].rejected;
+        startProcedures(conn_handle);
+      }
+      else {
+        stats.misses++;
+      }
+      break;
+    }
+
+    case BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST: {
+      // Phone started it - nothing left for us to do
+      uint16_t mtu = evt->evt.gatts_evt.params.exchange_mtu_request.client_rx_mtu;
+      link.seen.mtu = mtu < LINKCAPS_MTU_MAX ? mtu : LINKCAPS_MTU_MAX;
+      finished(link, LINKCAP_MTU, false);
+      break;
+    }
+
+    case BLE_GATTC_EVT_EXCHANGE_MTU_RSP: {
+      uint16_t mtu = evt->evt.gattc_evt.params.exchange_mtu_rsp.server_rx_mtu;
+      link.seen.mtu = mtu < LINKCAPS_MTU_MAX ? mtu : LINKCAPS_MTU_MAX;
+      finished(link, LINKCAP_MTU, mtu <= BLE_GATT_ATT_MTU_DEFAULT);
+      break;
+    }
+
+    case BLE_GAP_EVT_DATA_LENGTH_UPDATE: {
+      uint16_t octets = evt->evt.gap_evt.params.data_length_update.effective_params.max_tx_octets;
+      link.seen.data_len = octets;
+      finished(link, LINKCAP_DLE, octets <= BLE_GAP_DATA_LENGTH_DEFAULT);
+      break;
+    }
+
+    case BLE_GAP_EVT_PHY_UPDATE: {
+      const ble_gap_evt_phy_update_t& p = evt->evt.gap_evt.params.phy_update;
+      link.seen.phy = p.tx_phy;
+      finished(link, LINKCAP_PHY, p.status != BLE_HCI_STATUS_CODE_SUCCESS || p.tx_phy != BLE_GAP_PHY_2MBPS);
+      break;
+    }
+
+    case BLE_GAP_EVT_CONN_PARAM_UPDATE: {
+      const ble_gap_conn_params_t& p = evt->evt.gap_evt.params.conn_param_update.conn_params;
+      link.seen.interval = p.max_conn_interval;
+      link.seen.latency = p.slave_latency;
+      finished(link, LINKCAP_CONN, false);
+      break;
+    }
+
+    case BLE_GAP_EVT_DISCONNECTED:
+      if (!link.active) break;
+      link.active = false;
+      if (link.entry >= 0) {
+        // Identity stays; negotiated values and refusals are replaced by
+        // what this connection tried
+        LinkCaps& e = cache.entries[link.entry];
+        e.mtu = link.seen.mtu;
+        e.data_len = link.seen.data_len;
+        e.phy = link.seen.phy;
+        e.interval = link.seen.interval;
+        e.latency = link.seen.latency;
+        e.rejected = (e.rejected & ~link.attempted) | link.rejected;
+        e.valid = 1;
+        e.last_used = ++lru_clock;
+        dirty = true;
+      }
+      break;
+
+    default:
+      break;
+  }
+  xSemaphoreGive(lock);
+}
+
+void linkCacheSecured(uint16_t conn_handle, uint32_t secured_ms) {
+  if (conn_handle >= ADMIT_CONN_HANDLES) return;
+  BLEConnection* conn = Bluefruit.Connection(conn_handle);
+  bond_keys_t keys;
+  bool bonded = conn && conn->bonded() && conn->loadKeys(&keys);    // reads the bond file: outside the lock
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+  LinkProgress& link = links[conn_handle];
+  if (!link.active) {
+    xSemaphoreGive(lock);
+    return;
+  }
+  link.secured = true;
+  link.secured_ms = secured_ms;
+
+  // Only bonded phones get an entry, keyed by the identity in the bond
+  if (link.entry < 0 && bonded) {
+    static const uint8_t zero_irk[16] = { 0 };
+    bool has_irk = memcmp(keys.peer_id.id_info.irk, zero_irk, 16) != 0;
+    const uint8_t* id_addr = has_irk ? keys.peer_id.id_addr_info.addr : link.seen.id_addr;
+
+    link.entry = findOrAllocate(id_addr);
+    LinkCaps& e = cache.entries[link.entry];
+    memcpy(e.id_addr, id_addr, 6);
+    memcpy(e.irk, keys.peer_id.id_info.irk, 16);
+  }
+
+  // Cold connect: learn what this phone supports
+  if (!link.warm) {
+    link.to_start = (LINKCAP_MTU | LINKCAP_DLE | LINKCAP_PHY) & ~link.pending;
+    startProcedures(conn_handle);
+  }
+  xSemaphoreGive(lock);
+}
+
+void linkCachePoll() {
+  uint32_t now = millis();
+
+  for (uint16_t h = 0; h < ADMIT_CONN_HANDLES; h++) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    LinkProgress& link = links[h];
+    if (!link.active) {
+      xSemaphoreGive(lock);
+      continue;
+    }
+
+    startProcedures(h);
+
+    // Phones answer a connection parameter request by applying it or not at all
+    if ((link.pending & LINKCAP_CONN) && now - link.pending_since_ms > LINKCAPS_READY_MS) {
+      finished(link, LINKCAP_CONN, true);
+    }
+
+    bool settled = (link.pending == 0 && link.to_start == 0) ||
+                   now - link.connected_ms > LINKCAPS_READY_MS;
+    bool became_ready = !link.ready && link.secured && settled;
+    bool warm = link.warm;
+    uint32_t ready_ms = 0;
+    if (became_ready) {
+      link.ready = true;
+      uint32_t done_ms = link.last_done_ms > link.secured_ms ? link.last_done_ms : link.secured_ms;
+      ready_ms = done_ms - link.connected_ms;
+      stats.ready_count[warm]++;
+      stats.ready_total_ms[warm] += ready_ms;
+    }
+    xSemaphoreGive(lock);
+
+    if (became_ready) {
+      Serial.print(warm ? "Warm" : "Cold");
+      Serial.print(" connect ready in ");
+      Serial.print(ready_ms);
+      Serial.println(" ms");
+    }
+  }
+
+  if (dirty) save();
+}
+
+void linkCachePrintStats(Print& out) {
+  out.print("linkcache hits=");  out.print(stats.hits);
+  out.print(" misses=");         out.println(stats.misses);
+
+  static const char* const names[2] = { "cold", "warm" };
+  for (uint8_t i = 0; i < 2; i++) {
+    if (stats.ready_count[i] == 0) continue;
+    out.print(names[i]);
+    out.print(" ready avg ms=");
+    out.print(stats.ready_total_ms[i] / stats.ready_count[i]);
+    out.print(" n=");
+    out.println(stats.ready_count[i]);
+  }
+}
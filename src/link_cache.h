@@ -0,0 +1,43 @@
+#pragma once
+
+#include <Arduino.h>
+#include <bluefruit.h>
+
+// Per-bond cache of what each phone negotiated last time (ATT MTU, data
+// length, PHY, connection interval/latency) and which procedures it
+// refused. On reconnect the known-good procedures are started right at
+// connect, all at once, and refused ones are skipped.
+#define LINKCAPS_FILE       "/linkcaps.bin"
+#define LINKCAPS_VERSION    1
+#define LINKCAPS_MAX        4        // bonds remembered, least recently used dropped
+#define LINKCAPS_MTU_MAX    247      // configPrphConn() ATT MTU
+#define LINKCAPS_EVENT_LEN  6        // 7.5ms connection events, room for 251-byte PDUs
+#define LINKCAPS_READY_MS   3000     // stop waiting for procedures after this
+
+// Procedures, as bits in LinkCaps::rejected and in per-link masks
+#define LINKCAP_MTU   0x01
+#define LINKCAP_DLE   0x02
+#define LINKCAP_PHY   0x04
+#define LINKCAP_CONN  0x08
+
+struct LinkCaps {
+  uint8_t  valid;
+  uint8_t  rejected;        // LINKCAP_* bits the phone refused
+  uint8_t  phy;             // BLE_GAP_PHY_*
+  uint8_t  id_addr[6];      // identity address from the bond
+  uint8_t  irk[16];         // resolves the phone's private addresses at connect
+  uint16_t mtu;
+  uint16_t data_len;        // LL max TX octets, 27 = no DLE
+  uint16_t interval;        // units of 1.25ms
+  uint16_t latency;
+  uint32_t last_used;       // LRU stamp
+};
+
+void linkCacheBegin();
+void linkCacheEvent(ble_evt_t* evt);        // BLE task
+void linkCacheSecured(uint16_t conn_handle, uint32_t secured_ms);
+void linkCachePoll();
+void linkCachePrintStats(Print& out);
+
+// True if the resolvable private address addr was made with irk (any task)
+bool linkCacheResolve(const uint8_t irk[16], const uint8_t addr[6]);
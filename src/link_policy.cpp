@@ -0,0 +1,216 @@
+/*
+ * Link-loss policy
+ *
+ * The SoftDevice only reports a lost link after the supervision timeout the
+ * phone picked. Until then the connection slot stays taken and we don't
+ * advertise, so the next phone can't get in. Here we:
+ *   - request a supervision timeout sized for a keyfob
+ *   - watch RSSI events as a heartbeat of connection events
+ *   - ping quiet links with an empty notification (acked at link layer,
+ *     reported back as HVN_TX_COMPLETE)
+ *   - disconnect links that stay silent past the stall threshold
+ *   - measure time from last sign of life to advertising again
+ */
+
+#include "link_policy.h"
+#include "keyfob_uart.h"
+#include "journal.h"
+
+struct LinkState {
+  bool     active;
+  bool     params_requested;
+  bool     dropping;          // we asked the SoftDevice to disconnect it
+  uint32_t connected_ms;
+  uint32_t last_alive_ms;
+  uint32_t last_ping_ms;
+  uint16_t interval;          // units of 1.25ms
+  uint16_t latency;
+};
+
+static LinkState links[BLE_MAX_CONNECTION];
+static LinkStats stats;
+
+static uint16_t pref_min_interval = LINK_CONN_INTERVAL_MIN;
+static uint16_t pref_max_interval = LINK_CONN_INTERVAL_MAX;
+static uint16_t pref_latency = 0;
+
+static volatile bool recovery_pending = false;
+static volatile uint32_t recovery_start_ms = 0;
+
+// Spec requires timeout > (1 + latency) * interval * 2; keep 3x for margin
+static uint16_t supervisionTimeoutMs() {
+  uint32_t min_ms = (1UL + pref_latency) * pref_max_interval * 5 / 4 * 3;
+  return min_ms > LINK_SUP_TIMEOUT_MS ? min_ms : LINK_SUP_TIMEOUT_MS;
+}
+
+static void setPreferredParams() {
+  // Peripheral Preferred Connection Parameters, read by phones that honour them
+  Bluefruit.Periph.setConnInterval(pref_min_interval, pref_max_interval);
+  Bluefruit.Periph.setConnSlaveLatency(pref_latency);
+  Bluefruit.Periph.setConnSupervisionTimeoutMS(supervisionTimeoutMs());
+}
+
+void linkPolicyBegin() {
+  setPreferredParams();
+}
+
+void linkPolicySetParams(uint16_t min_interval, uint16_t max_interval, uint16_t latency) {
+  if (min_interval == pref_min_interval && max_interval == pref_max_interval && latency == pref_latency) return;
+  pref_min_interval = min_interval;
+  pref_max_interval = max_interval;
+  pref_latency = latency;
+  setPreferredParams();
+
+  // Re-request on the next poll for links already up
+  for (uint16_t h = 0; h < BLE_MAX_CONNECTION; h++) {
+    links[h].params_requested = false;
+  }
+}
+
+static uint32_t stallThreshold(const LinkState& link) {
+  // With slave latency we only listen (and sample RSSI) every latency+1 events
+  uint32_t heartbeat_ms = (link.interval * 5UL / 4) * (link.latency + 1) * (LINK_HEARTBEAT_SKIP + 1);
+  uint32_t stall_ms = heartbeat_ms * LINK_STALL_HEARTBEATS;
+  return stall_ms > LINK_STALL_MS ? stall_ms : LINK_STALL_MS;
+}
+
+static void requestLinkParams(uint16_t conn_handle) {
+  ble_gap_conn_params_t params;
+  params.min_conn_interval = pref_min_interval;
+  params.max_conn_interval = pref_max_interval;
+  params.slave_latency     = pref_latency;
+  params.conn_sup_timeout  = supervisionTimeoutMs() / 10;  // units of 10ms
+  sd_ble_gap_conn_param_update(conn_handle, &params);
+}
+
+void linkPolicyRequestNow(uint16_t conn_handle) {
+  if (conn_handle >= BLE_MAX_CONNECTION) return;
+  links[conn_handle].params_requested = true;
+  requestLinkParams(conn_handle);
+}
+
+static bool sendKeepalive(uint16_t conn_handle) {
+  if (!bleuart.notifyEnabled(conn_handle)) return false;
+
+  // Zero-length notification: cheapest packet that needs a link-layer ack
+  uint16_t len = 0;
+  ble_gatts_hvx_params_t hvx = {};
+  hvx.handle = bleuart.txValueHandle();
+  hvx.type   = BLE_GATT_HVX_NOTIFICATION;
+  hvx.p_len  = &len;
+  return sd_ble_gatts_hvx(conn_handle, &hvx) == NRF_SUCCESS;
+}
+
+// Runs in the Bluefruit BLE task
+void linkPolicyEvent(ble_evt_t* evt) {
+  uint16_t conn_handle = evt->evt.common_evt.conn_handle;
+  if (conn_handle >= BLE_MAX_CONNECTION) return;
+
+  LinkState& link = links[conn_handle];
+  uint32_t now = millis();
+
+  switch (evt->header.evt_id) {
+    case BLE_GAP_EVT_CONNECTED:
+      if (evt->evt.gap_evt.params.connected.role != BLE_GAP_ROLE_PERIPH) break;
+      link = LinkState();
+      link.active = true;
+      link.connected_ms = now;
+      link.last_alive_ms = now;
+      link.last_ping_ms = now;
+      link.interval = evt->evt.gap_evt.params.connected.conn_params.max_conn_interval;
+      link.latency = evt->evt.gap_evt.params.connected.conn_params.slave_latency;
+      journalLog(JR_CONN_PARAMS, conn_handle, link.interval, link.latency);
+      sd_ble_gap_rssi_start(conn_handle, 0, LINK_HEARTBEAT_SKIP);
+      break;
+
+    case BLE_GAP_EVT_CONN_PARAM_UPDATE:
+      link.interval = evt->evt.gap_evt.params.conn_param_update.conn_params.max_conn_interval;
+      link.latency = evt->evt.gap_evt.params.conn_param_update.conn_params.slave_latency;
+      link.last_alive_ms = now;
+      journalLog(JR_CONN_PARAMS, conn_handle, link.interval, link.latency);
+      break;
+
+    case BLE_GAP_EVT_RSSI_CHANGED:
+    case BLE_GATTS_EVT_WRITE:
+    case BLE_GATTS_EVT_HVN_TX_COMPLETE:
+      link.last_alive_ms = now;
+      break;
+
+    case BLE_GAP_EVT_DISCONNECTED: {
+      if (!link.active) break;
+      uint8_t reason = evt->evt.gap_evt.params.disconnected.reason;
+      if (reason == BLE_HCI_CONNECTION_TIMEOUT || link.dropping) {
+        stats.losses++;
+        recovery_start_ms = link.last_alive_ms;
+        recovery_pending = true;
+      }
+      link.active = false;
+      break;
+    }
+
+    default:
+      break;
+  }
+}
+
+// Runs from loop()
+void linkPolicyPoll() {
+  uint32_t now = millis();
+
+  for (uint16_t h = 0; h < BLE_MAX_CONNECTION; h++) {
+    LinkState& link = links[h];
+    if (!link.active || link.dropping) continue;
+
+    if (!link.params_requested && now - link.connected_ms >= LINK_PARAM_DELAY_MS) {
+      requestLinkParams(h);
+      link.params_requested = true;
+    }
+
+    uint32_t stall_ms = stallThreshold(link);
+    uint32_t silent_ms = now - link.last_alive_ms;
+
+    if (silent_ms >= stall_ms) {
+      Serial.print("Link stalled, dropping (silent ");
+      Serial.print(silent_ms);
+      Serial.println(" ms)");
+      link.dropping = true;
+      stats.stall_drops++;
+      sd_ble_gap_disconnect(h, BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+    }
+    else if (silent_ms >= stall_ms / 2 && now - link.last_ping_ms >= stall_ms / 2) {
+      link.last_ping_ms = now;
+      if (sendKeepalive(h)) stats.keepalives++;
+    }
+  }
+
+  // adv_policy.cpp brings advertising back; time it from the last
+  // moment we know the phone was still there
+  if (recovery_pending && Bluefruit.Advertising.isRunning()) {
+    recovery_pending = false;
+    uint32_t recovery_ms = now - recovery_start_ms;
+    if (stats.recoveries == 0 || recovery_ms < stats.recovery_min_ms) stats.recovery_min_ms = recovery_ms;
+    if (recovery_ms > stats.recovery_max_ms) stats.recovery_max_ms = recovery_ms;
+    stats.recovery_total_ms += recovery_ms;
+    stats.recoveries++;
+
+    Serial.print("Link loss -> connectable in ");
+    Serial.print(recovery_ms);
+    Serial.println(" ms");
+  }
+}
+
+void linkPolicyPrintStats(Print& out) {
+  out.print("link losses=");     out.print(stats.losses);
+  out.print(" stall_drops=");    out.print(stats.stall_drops);
+  out.print(" keepalives=");     out.println(stats.keepalives);
+  if (stats.recoveries > 0) {
+    out.print("recovery ms min/avg/max=");
+    out.print(stats.recovery_min_ms); out.print("/");
+    out.print(stats.recovery_total_ms / stats.recoveries); out.print("/");
+    out.println(stats.recovery_max_ms);
+  }
+}
+
+const LinkStats& linkPolicyStats() {
+  return stats;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <Arduino.h>
+#include <bluefruit.h>
+
+// Connection parameters requested from the phone shortly after connect.
+// 2 s supervision timeout: survives a pocket/body block, but a phone that
+// walks away frees the slot in seconds instead of the 5-20 s phones default to.
+#define LINK_CONN_INTERVAL_MIN  12     // 15ms (units of 1.25ms)
+#define LINK_CONN_INTERVAL_MAX  24     // 30ms
+#define LINK_SUP_TIMEOUT_MS     2000
+#define LINK_PARAM_DELAY_MS     1000   // let discovery finish before asking
+
+// Liveness: RSSI is only sampled when a packet from the phone arrives in a
+// connection event, so RSSI events double as a connection-event heartbeat.
+#define LINK_HEARTBEAT_SKIP     7      // one RSSI event per 8 samples
+#define LINK_STALL_MS           1500   // minimum silence before we drop a link
+#define LINK_STALL_HEARTBEATS   4      // ...or this many missed heartbeats
+
+struct LinkStats {
+  uint32_t losses;            // supervision timeouts + our own stall drops
+  uint32_t stall_drops;       // links we tore down ourselves
+  uint32_t keepalives;        // empty notifications sent to quiet links
+  uint32_t recoveries;        // losses followed by advertising again
+  uint32_t recovery_min_ms;   // last sign of life -> advertising again
+  uint32_t recovery_max_ms;
+  uint32_t recovery_total_ms;
+};
+
+void linkPolicyBegin();
+void linkPolicyEvent(ble_evt_t* evt);
+void linkPolicyPoll();
+
+// Change the interval/latency asked of phones (energy governor). The
+// supervision timeout grows if needed to stay valid for the new values.
+void linkPolicySetParams(uint16_t min_interval, uint16_t max_interval, uint16_t latency);
+
+// Ask right away instead of after LINK_PARAM_DELAY_MS (phone known to accept)
+void linkPolicyRequestNow(uint16_t conn_handle);
+void linkPolicyPrintStats(Print& out);
+const LinkStats& linkPolicyStats();
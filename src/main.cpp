@@ -12,68 +12,390 @@
  *   GND ────────────── PC817C Pin 2 (Cathode)
  *   PC817C Pin 3&4 ─── Key fob UNLOCK button
  * 
+ * WIRED COMMAND PORT (optional, "wired on"), 3.3V logic:
+ *   P1.11 ──────────── host TX
+ *   P1.13 ──────────── host RX
+ *   GND ────────────── host GND
+ * 
+ * VEHICLE INPUTS (optional, "input <name> on"), active low, 3.3V max:
+ *   P0.02 ──────────── ignition (opto output or divider)
+ *   P0.29 ──────────── door switch to GND
+ * 
  * PHONE APP: "Bluefruit Connect"
  * - Button 1 = LOCK, Button 2 = UNLOCK
  * - No password required
+ * 
+ * BLE HID REMOTE (optional, "hid pair"): a shutter button or similar,
+ * keys assigned with "hid learn lock" / "hid learn unlock"
  */
 
 #include <Arduino.h>
 #include <bluefruit.h>
-
-#define LOCK_PIN 20     // P0.20 - controls LOCK optocoupler
-#define UNLOCK_PIN 22   // P0.22 - controls UNLOCK optocoupler
-#define STATUS_LED 15   // P0.15 - red LED
+#include "config.h"
+#include "keyfob_uart.h"
+#include "link_policy.h"
+#include "tx_queue.h"
+#include "actuation.h"
+#include "perf.h"
+#include "radio_activity.h"
+#include "config_store.h"
+#include "energy_governor.h"
+#include "admission.h"
+#include "link_cache.h"
+#include "adv_policy.h"
+#include "journal.h"
+#include "crash_log.h"
+#include "usb_export.h"
+#include "power_fail.h"
+#include "secure_store.h"
+#include "commands.h"
+#include "deferred.h"
+#include "wired_port.h"
+#include "inputs.h"
+#include "dongle_link.h"
+#include "delta_update.h"
+#include "coro.h"
+#include "state_region.h"
+#include "channel_survey.h"
+#include "ram_power.h"
+#include "hid_remote.h"
 
 // BLE UART Service
-BLEUart bleuart;
+KeyfobUart bleuart;
+
+// Commands handed from the RX callback to loop() for logging, and for
+// anything that isn't actuation (stats, help). One producer (the BLE task)
+// and one consumer (loop()), the same ring as deferred.cpp. With every slot
+// taken a command is refused before it is dispatched, so nothing is pressed
+// that loop() wouldn't journal.
+#define LOOP_CMD_SLOTS 4
+#define LOOP_CMD_MAX   32             // line incl. terminator; longer lines are refused
+#define UART_RX_CHUNK  64
+
+struct LoopCommand {
+  char      text[LOOP_CMD_MAX];
+  CmdResult result;
+};
+
+static LoopCommand loop_cmds[LOOP_CMD_SLOTS];
+static volatile uint32_t loop_cmd_head = 0;   // written by the BLE task
+static volatile uint32_t loop_cmd_tail = 0;   // written by loop()
+static uint32_t loop_cmd_busy = 0;            // refused, ring full
+static uint32_t loop_cmd_long = 0;            // refused, line too long
 
 // Forward declarations
 bool pairing_passkey_callback(uint16_t conn_handle, uint8_t const passkey[6], bool match_request);
 void secured_callback(uint16_t conn_handle);
 
-void pressLock() {
-  Serial.println(">>> LOCK");
-  bleuart.println("Locking...");
-  digitalWrite(STATUS_LED, HIGH);
-  
-  digitalWrite(LOCK_PIN, HIGH);
-  delay(300);
-  digitalWrite(LOCK_PIN, LOW);
-  
-  digitalWrite(STATUS_LED, LOW);
-  Serial.println(">>> LOCK COMPLETE");
-  bleuart.println("Locked!");
+static void rxCommand(char* line, int len, uint32_t start, uint32_t radio_events) {
+  line[len] = 0;
+  char* p = commandTrim(line, &len);
+  if (len == 0) return;
+
+  uint32_t head = loop_cmd_head;
+  if (head - loop_cmd_tail >= LOOP_CMD_SLOTS) {
+    loop_cmd_busy++;
+    txQueuePrintln("Busy, command refused");
+    return;
+  }
+
+  CmdResult result = dispatchCommand(p, len);
+  if (result == CMD_LOCK || result == CMD_UNLOCK) {
+    perfRecordCommand(perfCycles() - start, radio_events);
+  }
+
+  LoopCommand& slot = loop_cmds[head % LOOP_CMD_SLOTS];
+  strcpy(slot.text, p);
+  slot.result = result;
+  __DMB();                  // slot contents before the new head
+  loop_cmd_head = head + 1;
 }
 
-void pressUnlock() {
-  Serial.println(">>> UNLOCK");
-  bleuart.println("Unlocking...");
-  digitalWrite(STATUS_LED, HIGH);
-  
-  digitalWrite(UNLOCK_PIN, HIGH);
-  delay(300);
-  digitalWrite(UNLOCK_PIN, LOW);
-  
-  digitalWrite(STATUS_LED, LOW);
-  Serial.println(">>> UNLOCK COMPLETE");
-  bleuart.println("Unlocked!");
+// Runs in the BLE task as soon as a write to the RX characteristic lands.
+// Drains the FIFO: one command per line, or the whole write if it has no
+// line end (controller button packets)
+void uart_rx_callback(uint16_t conn_handle) {
+  uint32_t start = perfCycles();
+  uint32_t radio_events = radioEventCount();
+
+  char buf[UART_RX_CHUNK];
+  char line[LOOP_CMD_MAX];
+  int len = 0;
+  bool too_long = false;
+  int n;
+  while ((n = bleuart.read((uint8_t*) buf, sizeof(buf))) > 0) {
+    for (int i = 0; i < n; i++) {
+      if (buf[i] == '\r' || buf[i] == '\n') {
+        if (!too_long) rxCommand(line, len, start, radio_events);
+        len = 0;
+        too_long = false;
+      }
+      else if (len < LOOP_CMD_MAX - 1) {
+        line[len++] = buf[i];
+      }
+      else if (!too_long) {
+        too_long = true;
+        loop_cmd_long++;
+        txQueuePrintln("Command too long, refused");
+      }
+    }
+  }
+  if (len && !too_long) rxCommand(line, len, start, radio_events);
+  deferLeave(CB_RX, start);
 }
 
-// BLE connect callback
+void handleLoopCommand(const char* cmd) {
+  if (strcmp(cmd, "stats") == 0) {
+    TxQueuePrint out(TXQ_LOW);
+    linkPolicyPrintStats(Serial);
+    linkPolicyPrintStats(out);
+    txQueuePrintStats(Serial);
+    txQueuePrintStats(out);
+    admissionPrintStats(Serial);
+    admissionPrintStats(out);
+    linkCachePrintStats(Serial);
+    linkCachePrintStats(out);
+    advPolicyPrintStats(Serial);
+    advPolicyPrintStats(out);
+    channelSurveyPrintStats(Serial);
+    channelSurveyPrintStats(out);
+    deferPrintStats(Serial);
+    deferPrintStats(out);
+    wiredPortPrintStats(Serial);
+    wiredPortPrintStats(out);
+    inputsPrintStats(Serial);
+    inputsPrintStats(out);
+    dongleLinkPrintStats(Serial);
+    dongleLinkPrintStats(out);
+    hidRemotePrintStats(Serial);
+    hidRemotePrintStats(out);
+    deltaUpdatePrintStats(Serial);
+    deltaUpdatePrintStats(out);
+    coroPrintStats(Serial);
+    coroPrintStats(out);
+    stateRegionPrintStats(Serial);
+    stateRegionPrintStats(out);
+    ramPowerPrintStats(Serial);
+    ramPowerPrintStats(out);
+    journalPrintStats(Serial);
+    journalPrintStats(out);
+  }
+  else if (strcmp(cmd, "perf") == 0) {
+    TxQueuePrint out(TXQ_LOW);
+    perfPrintStats(Serial);
+    perfPrintStats(out);
+    Serial.printf("rx refused busy=%lu long=%lu\n", loop_cmd_busy, loop_cmd_long);
+    out.printf("rx refused busy=%lu long=%lu\n", loop_cmd_busy, loop_cmd_long);
+  }
+  else if (strcmp(cmd, "perf flash on") == 0 || strcmp(cmd, "perf flash off") == 0) {
+    perfFlashLoad(cmd[11] == 'o' && cmd[12] == 'n');
+  }
+  else if (strcmp(cmd, "perf reset") == 0) {
+    perfReset();
+  }
+  else if (strcmp(cmd, "pair") == 0) {
+    admissionOpenPairingWindow();
+    txQueuePrintln("Pairing window open for 2 min", TXQ_LOW);
+  }
+  else if (strncmp(cmd, "admit ", 6) == 0 && atoi(cmd + 6) > 0) {
+    config.admit_deadline_s = atoi(cmd + 6);
+    configSave();
+  }
+  else if (strcmp(cmd, "presence on") == 0 || strcmp(cmd, "presence off") == 0) {
+    config.presence_adv = cmd[10] == 'n';
+    configSave();
+  }
+  else if (strcmp(cmd, "usb on") == 0 || strcmp(cmd, "usb off") == 0) {
+    usbExportEnable(cmd[5] == 'n');
+  }
+  else if (strcmp(cmd, "wired on") == 0 || strcmp(cmd, "wired off") == 0) {
+    wiredPortEnable(cmd[7] == 'n');
+  }
+  else if (strcmp(cmd, "wired test") == 0) {
+    TxQueuePrint out(TXQ_LOW);
+    wiredPortLoopback(Serial);
+    wiredPortLoopback(out);
+  }
+  else if (strncmp(cmd, "input ", 6) == 0) {
+    char name[12];
+    const char* state = strchr(cmd + 6, ' ');
+    int8_t in = -1;
+    if (state && state - (cmd + 6) < (int) sizeof(name)) {
+      memcpy(name, cmd + 6, state - (cmd + 6));
+      name[state - (cmd + 6)] = 0;
+      in = inputByName(name);
+    }
+    if (in >= 0 && (strcmp(state, " on") == 0 || strcmp(state, " off") == 0)) {
+      inputsEnable((VehicleInput) in, state[2] == 'n');
+    }
+    else {
+      txQueuePrintln("input ignition|door on|off", TXQ_LOW);
+    }
+  }
+  else if (strcmp(cmd, "sleep") == 0) {
+    if (!config.inputs) {
+      txQueuePrintln("No input enabled to wake on", TXQ_LOW);
+    }
+    else {
+      Serial.println("System OFF until an input changes");
+      stateRegionSync();
+      journalFlush();
+      actuationParkAll();
+      inputsSystemOff();
+    }
+  }
+  else if (strcmp(cmd, "dongle key") == 0) {
+    // The key stays off the air: read it from the USB serial console
+    dongleLinkNewKey();
+    dongleLinkPrintKey(Serial);
+    txQueuePrintln("New dongle key on the serial console", TXQ_LOW);
+  }
+  else if (strcmp(cmd, "dongle off") == 0) {
+    dongleLinkSetSchedule(0, 0);
+  }
+  else if (strncmp(cmd, "dongle ", 7) == 0) {
+    const char* window = strchr(cmd + 7, ' ');
+    if (!dongleLinkSetSchedule(atoi(cmd + 7), window ? atoi(window + 1) : DONGLE_WINDOW_DEF_US)) {
+      txQueuePrintln("dongle <ms> [window us], 10-10000 ms", TXQ_LOW);
+    }
+  }
+  else if (strcmp(cmd, "hid") == 0) {
+    TxQueuePrint out(TXQ_LOW);
+    hidRemotePrintStats(Serial);
+    hidRemotePrintStats(out);
+  }
+  else if (strcmp(cmd, "hid pair") == 0) {
+    hidRemotePair();
+    txQueuePrintln("Hold the remote close, press a key", TXQ_LOW);
+  }
+  else if (strcmp(cmd, "hid forget") == 0) {
+    hidRemoteForget();
+  }
+  else if (strcmp(cmd, "hid learn lock") == 0 || strcmp(cmd, "hid learn unlock") == 0) {
+    hidRemoteLearn(cmd[10] == 'l' ? ACT_LOCK : ACT_UNLOCK);
+    txQueuePrintln("Press the remote's key", TXQ_LOW);
+  }
+  else if (strncmp(cmd, "hid interval ", 13) == 0) {
+    if (!hidRemoteSetInterval(atoi(cmd + 13))) txQueuePrintln("hid interval 15-1000 (ms)", TXQ_LOW);
+  }
+  else if (strcmp(cmd, "update") == 0) {
+    TxQueuePrint out(TXQ_LOW);
+    deltaUpdatePrintStats(Serial);
+    deltaUpdatePrintStats(out);
+  }
+  else if (strcmp(cmd, "update abort") == 0) {
+    deltaUpdateAbort();
+    txQueuePrintln("Update aborted", TXQ_LOW);
+  }
+  else if (strcmp(cmd, "state") == 0 || strcmp(cmd, "state sync") == 0) {
+    if (cmd[5]) stateRegionSync();
+    TxQueuePrint out(TXQ_LOW);
+    stateRegionPrintStats(Serial);
+    stateRegionPrintStats(out);
+  }
+  else if (strcmp(cmd, "survey") == 0 || strcmp(cmd, "survey now") == 0) {
+    if (cmd[6]) channelSurveyStart();
+    TxQueuePrint out(TXQ_LOW);
+    channelSurveyPrintStats(Serial);
+    channelSurveyPrintStats(out);
+  }
+  else if (strcmp(cmd, "ram") == 0) {
+    TxQueuePrint out(TXQ_LOW);
+    ramPowerPrintStats(Serial);
+    ramPowerPrintStats(out);
+  }
+  else if (strcmp(cmd, "crypto") == 0) {
+    TxQueuePrint out(TXQ_LOW);
+    secureBench(Serial);
+    secureBench(out);
+  }
+  else if (strcmp(cmd, "runtime") == 0) {
+    TxQueuePrint out(TXQ_LOW);
+    governorPrintStatus(Serial);
+    governorPrintStatus(out);
+  }
+  else if (strncmp(cmd, "runtime ", 8) == 0) {
+    char* end;
+    long hours = strtol(cmd + 8, &end, 10);
+    if (end == cmd + 8 || *end || hours < 0 || hours > CONFIG_RUNTIME_MAX_H) {
+      txQueuePrintln("runtime 0-8760 (h)", TXQ_LOW);
+    }
+    else {
+      governorSetTarget(hours);
+      TxQueuePrint out(TXQ_LOW);
+      governorPrintStatus(out);
+    }
+  }
+  else {
+    txQueuePrintln("Commands: lock, unlock, 1, 2, stats, perf,", TXQ_LOW);
+    txQueuePrintln("runtime [h], pair, admit <s>,", TXQ_LOW);
+    txQueuePrintln("presence on/off, usb on/off, crypto,", TXQ_LOW);
+    txQueuePrintln("wired on/off/test, input <name> on/off,", TXQ_LOW);
+    txQueuePrintln("sleep, dongle <ms> [us]/off/key,", TXQ_LOW);
+    txQueuePrintln("update [abort], state [sync], survey [now], ram", TXQ_LOW);
+    txQueuePrintln("hid [pair/forget/interval <ms>],", TXQ_LOW);
+    txQueuePrintln("hid learn lock/unlock", TXQ_LOW);
+    txQueuePrintln("Or use Controller buttons 1-2", TXQ_LOW);
+  }
+}
+
+// After dispatchCommand(): presses are already done, log and account them
+void logCommand(const char* cmd, CmdResult result) {
+  switch (result) {
+    case CMD_LOCK:       Serial.println(">>> LOCK"); governorNotePress(); journalLog(JR_PRESS, JOURNAL_NO_CONN, ACT_LOCK); break;
+    case CMD_UNLOCK:     Serial.println(">>> UNLOCK"); governorNotePress(); journalLog(JR_PRESS, JOURNAL_NO_CONN, ACT_UNLOCK); break;
+    case CMD_BUSY:       Serial.println("Button still pressed, ignored"); break;
+    case CMD_UNASSIGNED: Serial.println("Button not assigned"); break;
+    case CMD_OTHER:      handleLoopCommand(cmd); break;
+    default: break;
+  }
+}
+
+// BLE task callbacks: slot bookkeeping that the next callback may depend
+// on stays here, everything else goes to deferredWork() in loop()
+
 void connect_callback(uint16_t conn_handle) {
-  Serial.println("BLE Connected!");
-  bleuart.println("===== KEYFOB READY =====");
-  bleuart.println("Button 1 = LOCK");
-  bleuart.println("Button 2 = UNLOCK");
+  uint32_t start = deferEnter();
+  admissionConnect(conn_handle);
+  deferPost(DEFER_CONNECT, conn_handle);
+  deferLeave(CB_CONNECT, start);
 }
 
-// BLE disconnect callback
 void disconnect_callback(uint16_t conn_handle, uint8_t reason) {
-  Serial.println("BLE Disconnected");
+  uint32_t start = deferEnter();
+  admissionDisconnect(conn_handle);
+  deferPost(DEFER_DISCONNECT, conn_handle, &reason, 1);
+  deferLeave(CB_DISCONNECT, start);
+}
+
+// Raw SoftDevice events, for policies that need more than the callbacks
+// above. These are short state machine steps and stay in the BLE task.
+void ble_event_callback(ble_evt_t* evt) {
+  uint32_t start = deferEnter();
+  linkPolicyEvent(evt);
+  txQueueEvent(evt);
+  linkCacheEvent(evt);
+  hidRemoteEvent(evt);
+  deferLeave(CB_EVENT, start);
+}
+
+// SoftDevice SoC events, from the core's SoC task
+void soc_event_callback(uint32_t evt) {
+  powerFailSocEvent(evt);
+  dongleLinkSocEvent(evt);
+  channelSurveySocEvent(evt);
 }
 
 void setupBLE() {
-  Bluefruit.begin();
+  // Notification buffer pool must be configured before begin()
+  txQueueBegin();
+  
+  // Two peripheral slots, so a stranger can't lock out the bonded phone,
+  // and one central link for a HID remote; that one only carries key
+  // reports, so it gets the smallest SoftDevice buffers
+  Bluefruit.configCentralBandwidth(BANDWIDTH_LOW);
+  Bluefruit.begin(ADMIT_MAX_PRPH, HID_MAX_CENTRAL);
+  radioActivityBegin();
   Bluefruit.setTxPower(4);  // Max power for range
   Bluefruit.setName("KeyFob");
   
@@ -89,55 +411,155 @@ void setupBLE() {
   // Callbacks
   Bluefruit.Periph.setConnectCallback(connect_callback);
   Bluefruit.Periph.setDisconnectCallback(disconnect_callback);
+  Bluefruit.setEventCallback(ble_event_callback);
+  Bluefruit.setSocEventCallback(soc_event_callback);
+  
+  // Scanner and central link for the HID remote (scanning from loop())
+  hidRemoteBegin();
+  
+  // Supervision timeout / connection interval preferences
+  linkPolicyBegin();
   
   // CRITICAL: Set UART permissions BEFORE begin() to REQUIRE pairing
   bleuart.setPermission(SECMODE_ENC_WITH_MITM, SECMODE_ENC_WITH_MITM);  // Require pairing with MITM
   
   // Start UART service (encryption required)
+  bleuart.setRxCallback(uart_rx_callback);
   bleuart.begin();
   
+  // Delta firmware updates, same security
+  deltaUpdateBegin();
+  
   // Start advertising
   Bluefruit.Advertising.addFlags(BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE);
   Bluefruit.Advertising.addTxPower();
   Bluefruit.Advertising.addService(bleuart);
   Bluefruit.Advertising.addName();
   
-  Bluefruit.Advertising.restartOnDisconnect(true);
-  Bluefruit.Advertising.setInterval(32, 244);  // Fast advertising
-  Bluefruit.Advertising.setFastTimeout(30);
-  Bluefruit.Advertising.start(0);  // Advertise forever
+  // Started, stopped and restarted by connection state from here on,
+  // on the channels the periodic survey finds usable
+  advPolicyBegin();
+  channelSurveyBegin();
   
   Serial.println("BLE advertising as 'KeyFob' - SECURED");
   Serial.println("Pairing required - encryption enforced on UART");
 }
 
-// Pairing passkey callback - displays PIN to user
+// Pairing passkey callback - the answer is needed now, the PIN display
+// can wait for loop()
 bool pairing_passkey_callback(uint16_t conn_handle, uint8_t const passkey[6], bool match_request) {
-  Serial.println("===========================================");
-  Serial.println("  PAIRING REQUEST");
-  Serial.println("===========================================");
-  Serial.print("Enter this PIN on your phone: ");
-  for(int i=0; i<6; i++) {
-    Serial.print((char)passkey[i]);
+  uint32_t start = deferEnter();
+  bool allow = admissionAllowPairing(conn_handle);
+  if (allow) deferPost(DEFER_PASSKEY, conn_handle, passkey, 6);
+  else deferPost(DEFER_PAIR_REFUSED, conn_handle);
+  deferLeave(CB_PASSKEY, start);
+  return allow;
+}
+
+void secured_callback(uint16_t conn_handle) {
+  uint32_t start = deferEnter();
+  // The HID remote's link is not a phone's
+  if (!hidRemoteOwns(conn_handle)) {
+    BLEConnection* conn = Bluefruit.Connection(conn_handle);
+    uint8_t level = conn ? conn->getSecureMode().lv : 0;
+    deferPost(DEFER_SECURED, conn_handle, &level, 1);
   }
-  Serial.println();
-  Serial.println("===========================================");
-  
-  // Also send to BLE UART
-  bleuart.print("Pairing PIN: ");
-  for(int i=0; i<6; i++) {
-    bleuart.print((char)passkey[i]);
+  deferLeave(CB_SECURED, start);
+}
+
+// Everything the callbacks above handed over, in order
+void deferredWork(const DeferEvent& e) {
+  switch (e.type) {
+    case DEFER_CONNECT:
+      Serial.println("BLE Connected!");
+      journalLog(JR_CONNECT, e.conn);
+      if (governorLevel() >= GOV_SAVER) break;
+      txQueuePrintln("===== KEYFOB READY =====", TXQ_LOW);
+      txQueuePrintln("Button 1 = LOCK", TXQ_LOW);
+      txQueuePrintln("Button 2 = UNLOCK", TXQ_LOW);
+      break;
+
+    case DEFER_DISCONNECT:
+      Serial.print("BLE Disconnected, reason 0x");
+      Serial.println(e.data[0], HEX);
+      journalLog(JR_DISCONNECT, e.conn, e.data[0]);
+      break;
+
+    case DEFER_PAIR_REFUSED:
+      Serial.println("Pairing refused - send 'pair' from a paired phone first");
+      admissionRefusePairing(e.conn);
+      break;
+
+    case DEFER_PASSKEY: {
+      Serial.println("===========================================");
+      Serial.println("  PAIRING REQUEST");
+      Serial.println("===========================================");
+      Serial.print("Enter this PIN on your phone: ");
+      for(int i=0; i<6; i++) {
+        Serial.print((char)e.data[i]);
+      }
+      Serial.println();
+      Serial.println("===========================================");
+
+      // Also send to BLE UART
+      char line[20] = "Pairing PIN: ";
+      memcpy(line + 13, e.data, 6);
+      txQueuePrintln(line);
+      break;
+    }
+
+    case DEFER_INPUT:
+      Serial.print("Input ");
+      Serial.print(inputName((VehicleInput) e.data[0]));
+      Serial.println(e.data[1] ? " active" : " inactive");
+      journalLog(JR_INPUT, JOURNAL_NO_CONN, e.data[0], e.data[1]);
+      break;
+
+    case DEFER_DONGLE: {
+      // Pressed in the interrupt; the acknowledgement needs a task
+      ActChannel ch = (ActChannel) e.data[0];
+      CmdResult result = (CmdResult) e.data[1];
+      Serial.print("Received (dongle): ");
+      Serial.println(ch == ACT_LOCK ? "lock" : "unlock");
+      if (result != CMD_BUSY) commandAck(ch == ACT_LOCK ? ACK_LOCKING : ACK_UNLOCKING, commandSeq(ch));
+      logCommand("", result);
+      break;
+    }
+
+    case DEFER_HID: {
+      // Pressed in the BLE task already, acknowledged too
+      uint16_t key = e.data[2] | (e.data[3] << 8);
+      CmdResult result = (CmdResult) e.data[1];
+      if (result == CMD_IGNORED) {
+        hidRemoteKeyLearned((ActChannel) e.data[0], key);
+        break;
+      }
+      Serial.printf("Received (hid): key 0x%04X\n", key);
+      logCommand("", result);
+      break;
+    }
+
+    case DEFER_SECURED:
+      admissionSecured(e.conn, e.data[0]);
+      if (e.data[0] < ADMIT_MIN_SEC_LEVEL) break;
+      Serial.println("Connection secured (encrypted & authenticated)");
+      linkCacheSecured(e.conn, e.ms);
+      txQueuePrintln(">>> DEVICE PAIRED <<<", TXQ_LOW);
+      txQueuePrintln("Connection secured!", TXQ_LOW);
+      break;
+
+    default:
+      break;
   }
-  bleuart.println();
-  
-  return true;  // Accept pairing
 }
 
-// Secured connection callback
-void secured_callback(uint16_t conn_handle) {
-  Serial.println("Connection secured (encrypted & authenticated)");
-  bleuart.println(">>> DEVICE PAIRED <<<");
-  bleuart.println("Connection secured!");
+CoroTask bootBlink() {
+  for (int i = 0; i < 3; i++) {
+    digitalWrite(STATUS_LED, HIGH);
+    co_await coroSleep(200);
+    digitalWrite(STATUS_LED, LOW);
+    co_await coroSleep(200);
+  }
 }
 
 void setup() {
@@ -147,6 +569,12 @@ void setup() {
     NRF_POWER->DCDCEN = 1;
   #endif
   
+  // Instruction cache + cycle counter, also before the SoftDevice starts
+  perfBegin();
+  
+  // Read the power-fail mark and clear it while NVMC is still ours
+  powerFailCheck();
+  
   // Disable all LEDs first
   pinMode(STATUS_LED, OUTPUT);
   digitalWrite(STATUS_LED, LOW);
@@ -162,51 +590,136 @@ void setup() {
   Serial.println("  KEY FOB TRIGGER - BLE (Battery Mode)");
   Serial.println("===========================================");
   
-  // Setup trigger pins
-  pinMode(LOCK_PIN, OUTPUT);
-  pinMode(UNLOCK_PIN, OUTPUT);
+  // Setup trigger pins - write LOW before enabling the output
   digitalWrite(LOCK_PIN, LOW);
   digitalWrite(UNLOCK_PIN, LOW);
+  pinMode(LOCK_PIN, OUTPUT);
+  pinMode(UNLOCK_PIN, OUTPUT);
   
   // Setup BLE
   setupBLE();
   
-  // Startup blinks (red LED only)
-  for (int i = 0; i < 3; i++) {
-    digitalWrite(STATUS_LED, HIGH);
-    delay(200);
-    digitalWrite(STATUS_LED, LOW);
-    delay(200);
-  }
+  // Hand the trigger pins to GPIOTE/TIMER/PPI (needs the SoftDevice for PPI)
+  actuationBegin();
+  
+  // Settings and diagnostics stores from flash (sealed, so the store key
+  // comes first; files missing from InternalFS come back from the state
+  // region before anything loads), then let the governor pick radio/LED settings
+  secureBegin();
+  stateRegionBegin();
+  configLoad();
+  journalBegin();
+  powerFailBegin();
+  crashLogBegin();
+  usbExportBegin();
+  governorBegin();
+  admissionBegin();
+  linkCacheBegin();
+  
+  // Wired command port and vehicle inputs, if enabled (PPI: after the SoftDevice)
+  wiredPortBegin();
+  inputsBegin();
+  
+  // Dongle link listens in radio timeslots next to BLE, if set up
+  dongleLinkBegin();
+  
+  // Every store has loaded and re-saved what it found unsealed: from here
+  // on unsealed files are refused
+  secureEndMigration();
+  
+  // RAM sections the linker left empty go off (sd_power_ram_*: after the SoftDevice)
+  ramPowerBegin();
+  
+  // Startup blinks (red LED only), from loop() while BLE is already served
+  bootBlink();
   
   Serial.println("Ready! Waiting for BLE connection...");
   Serial.println("Battery power mode enabled");
+  // millis() starts with the scheduler: not from reset (ARCHITECTURE.md)
+  Serial.printf("Setup done after %lu ms\n", millis());
 }
 
 void loop() {
-  // Check for BLE commands
-  if (bleuart.available()) {
-    String cmd = bleuart.readString();
-    cmd.trim();
-    
+  // Detect dead links and time recovery
+  linkPolicyPoll();
+  
+  // Optional flash-write load for hot path measurements
+  perfPoll();
+  
+  // Keep radio/LED settings within the runtime budget
+  governorPoll();
+  
+  // Save after a power-fail warning, or re-arm once the supply is back
+  powerFailPoll();
+  
+  // Batched journal writes, settings written over USB
+  journalPoll();
+  usbExportPoll();
+  
+  // Drop links that don't authenticate in time
+  admissionPoll();
+  
+  // Advertise only as much as the connection state calls for, on the
+  // channels the last survey left
+  channelSurveyPoll();
+  advPolicyPoll();
+  
+  // Time-to-ready, and save what phones negotiated
+  linkCachePoll();
+  
+  // Printing, notifications and policy the BLE callbacks handed over
+  DeferEvent deferred;
+  while (deferTake(deferred)) {
+    deferredWork(deferred);
+    coroDeferEvent(deferred);
+  }
+  
+  // Coroutines whose timer or event came up
+  coroPoll();
+  
+  // Commands arrive through uart_rx_callback(); log them and handle the rest
+  while (loop_cmd_tail != loop_cmd_head) {
+    __DMB();                // new head before the slot contents
+    const LoopCommand& c = loop_cmds[loop_cmd_tail % LOOP_CMD_SLOTS];
     Serial.print("Received: ");
-    Serial.println(cmd);
-    
-    // Button 1 = Lock
-    if (cmd.indexOf("!B11") >= 0 || cmd == "lock" || cmd == "1") {
-      pressLock();
-    }
-    // Button 2 = Unlock
-    else if (cmd.indexOf("!B21") >= 0 || cmd == "unlock" || cmd == "2") {
-      pressUnlock();
-    }
-    // Buttons 3 & 4 do nothing (ignored)
-    else if (cmd.indexOf("!B31") >= 0 || cmd.indexOf("!B41") >= 0) {
-      Serial.println("Button not assigned");
-    }
-    else if (cmd.length() > 0 && cmd[0] != '!') {
-      bleuart.println("Commands: lock, unlock, 1, 2");
-      bleuart.println("Or use Controller buttons 1-2");
-    }
+    Serial.println(c.text);
+    logCommand(c.text, c.result);
+    loop_cmd_tail = loop_cmd_tail + 1;
   }
+  
+  // Wired port, inputs, dongle link and HID remote follow config
+  // (commands, CONFIG.BIN); wired and HID presses are already done
+  wiredPortPoll();
+  inputsPoll();
+  dongleLinkPoll();
+  hidRemotePoll();
+  
+  // Delta firmware update: rebuild what arrived, swap once verified
+  deltaUpdatePoll();
+  
+  // Bonds, settings and learned state into the reserved flash pages
+  stateRegionPoll();
+  
+  char wired_cmd[8];
+  CmdResult wired_result;
+  if (wiredPortTake(wired_cmd, sizeof(wired_cmd), &wired_result)) {
+    Serial.print("Received (wired): ");
+    Serial.println(wired_cmd);
+    logCommand(wired_cmd, wired_result);
+  }
+  
+  // Pulse ends are timed in hardware; report them here
+  uint8_t released = actuationPoll();
+  if (released & (1 << ACT_LOCK)) {
+    Serial.println(">>> LOCK COMPLETE");
+    commandAckReleased(ACT_LOCK);
+    wiredPortReleased(ACT_LOCK);
+  }
+  if (released & (1 << ACT_UNLOCK)) {
+    Serial.println(">>> UNLOCK COMPLETE");
+    commandAckReleased(ACT_UNLOCK);
+    wiredPortReleased(ACT_UNLOCK);
+  }
+  
+  delay(10);
 }
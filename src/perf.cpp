@@ -0,0 +1,158 @@
+/*
+ * Hot-path profiling
+ *
+ * Cycle counts come from the DWT cycle counter, bucketed by what else was
+ * happening (radio event, flash write). The flash instruction cache is
+ * enabled explicitly with profiling on, so hit/miss counters can be read.
+ */
+
+#include "perf.h"
+#include "radio_activity.h"
+#include "journal.h"
+#include <InternalFileSystem.h>
+
+using namespace Adafruit_LittleFS_Namespace;
+
+#define PERF_FLASH_FILE  "/perf.tmp"
+#define PERF_FLASH_BYTES 4096
+
+struct CycleStat {
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint64_t total;
+};
+
+static CycleStat stats[PERF_CONTEXTS];
+static volatile bool flash_busy = false;
+static bool flash_load = false;
+
+// Last PERF_TRACE_DEPTH commands, exported as TRACE.BIN
+static TraceRecord trace[PERF_TRACE_DEPTH];
+static volatile uint32_t trace_count = 0;
+
+static const char* const context_names[PERF_CONTEXTS] = { "quiet", "radio", "flash" };
+
+void perfBegin() {
+  // Cache on, with hit/miss counting. Done before the SoftDevice is enabled,
+  // same as DCDCEN in setup().
+  NRF_NVMC->ICACHECNF = (NVMC_ICACHECNF_CACHEEN_Enabled << NVMC_ICACHECNF_CACHEEN_Pos) |
+                        (NVMC_ICACHECNF_CACHEPROFEN_Enabled << NVMC_ICACHECNF_CACHEPROFEN_Pos);
+  NRF_NVMC->IHIT = 0;
+  NRF_NVMC->IMISS = 0;
+
+  CoreDebug->DEMCR = CoreDebug->DEMCR | CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL = DWT->CTRL | DWT_CTRL_CYCCNTENA_Msk;
+}
+
+void perfRecordCommand(uint32_t cycles, uint32_t radio_events_at_start) {
+  PerfContext ctx = PERF_QUIET;
+  if (flash_busy) ctx = PERF_FLASH;
+  else if (radioActive() || radioEventCount() != radio_events_at_start) ctx = PERF_RADIO;
+
+  CycleStat& s = stats[ctx];
+  if (s.count == 0 || cycles < s.min) s.min = cycles;
+  if (cycles > s.max) s.max = cycles;
+  s.total += cycles;
+  s.count++;
+
+  TraceRecord& t = trace[trace_count % PERF_TRACE_DEPTH];
+  t.uptime_ms = millis();
+  t.cycles = cycles;
+  t.context = ctx;
+  t.reserved = 0;
+  t.boot = journalBootCount();
+  trace_count = trace_count + 1;
+}
+
+uint32_t perfTraceExportSize() {
+  uint32_t n = trace_count < PERF_TRACE_DEPTH ? trace_count : PERF_TRACE_DEPTH;
+  return sizeof(ExportHeader) + n * sizeof(TraceRecord);
+}
+
+// ExportHeader, then the ring oldest first
+uint32_t perfTraceExportRead(uint32_t offset, uint8_t* buf, uint32_t len) {
+  ExportHeader header;
+  exportFillHeader(header, EXPORT_TRACE, sizeof(TraceRecord));
+
+  uint32_t count = trace_count;
+  uint32_t first = count > PERF_TRACE_DEPTH ? count % PERF_TRACE_DEPTH : 0;
+  uint32_t size = perfTraceExportSize();
+  uint32_t done = 0;
+
+  while (done < len && offset + done < size) {
+    uint32_t pos = offset + done;
+    const uint8_t* src;
+    uint32_t avail;
+    if (pos < sizeof(header)) {
+      src = (const uint8_t*) &header + pos;
+      avail = sizeof(header) - pos;
+    }
+    else {
+      uint32_t rec = (pos - sizeof(header)) / sizeof(TraceRecord);
+      uint32_t at = (pos - sizeof(header)) % sizeof(TraceRecord);
+      src = (const uint8_t*) &trace[(first + rec) % PERF_TRACE_DEPTH] + at;
+      avail = sizeof(TraceRecord) - at;
+    }
+    uint32_t n = avail < len - done ? avail : len - done;
+    memcpy(buf + done, src, n);
+    done += n;
+  }
+  return done;
+}
+
+void perfFlashLoad(bool on) {
+  flash_load = on;
+  if (!on) InternalFS.remove(PERF_FLASH_FILE);
+}
+
+void perfPoll() {
+  if (!flash_load) return;
+
+  // Rewrite a scratch file so a flash erase/write is nearly always in flight
+  static uint8_t block[256];
+  File f(InternalFS);
+  if (!f.open(PERF_FLASH_FILE, FILE_O_WRITE)) return;
+
+  flash_busy = true;
+  f.seek(0);
+  for (uint32_t n = 0; n < PERF_FLASH_BYTES; n += sizeof(block)) {
+    block[0]++;
+    f.write(block, sizeof(block));
+  }
+  f.close();
+  flash_busy = false;
+}
+
+void perfReset() {
+  memset(stats, 0, sizeof(stats));
+  NRF_NVMC->IHIT = 0;
+  NRF_NVMC->IMISS = 0;
+}
+
+void perfPrintStats(Print& out) {
+  out.print("hot path in ");
+  out.println(HOT_PATH_IN_RAM ? "RAM" : "flash");
+
+  for (uint8_t i = 0; i < PERF_CONTEXTS; i++) {
+    const CycleStat& s = stats[i];
+    if (s.count == 0) continue;
+    out.print(context_names[i]);
+    out.print(" n=");   out.print(s.count);
+    out.print(" cyc="); out.print(s.min);
+    out.print("/");     out.print((uint32_t)(s.total / s.count));
+    out.print("/");     out.println(s.max);
+  }
+
+  uint32_t hit = NRF_NVMC->IHIT;
+  uint32_t miss = NRF_NVMC->IMISS;
+  out.print("icache hit=");  out.print(hit);
+  out.print(" miss=");       out.print(miss);
+  if (hit + miss > 0) {
+    out.print(" (");
+    out.print((uint32_t)((uint64_t)hit * 100 / (hit + miss)));
+    out.print("%)");
+  }
+  out.println();
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <Arduino.h>
+#include "journal_records.h"
+
+// Actuation-critical code (command parsing, dispatch, GPIO/timer arming,
+// pulse-end IRQs) is tagged HOT_PATH and runs from RAM, away from flash wait
+// states and from CPU stalls while the SoftDevice writes flash. A HOT_PATH
+// function only calls other HOT_PATH or inlined code. Build with
+// -DHOT_PATH_IN_RAM=0 to get the flash-resident baseline for comparison.
+#ifndef HOT_PATH_IN_RAM
+#define HOT_PATH_IN_RAM 1
+#endif
+
+#if HOT_PATH_IN_RAM
+// .data.* input sections are linked into .data, which the startup code
+// copies from flash to RAM. long_call: RAM is out of BL range from flash.
+#define HOT_PATH __attribute__((section(".data.hot_path"), long_call, noinline))
+#else
+#define HOT_PATH __attribute__((noinline))
+#endif
+
+// What else was going on while a command was being handled
+enum PerfContext : uint8_t {
+  PERF_QUIET,       // nothing
+  PERF_RADIO,       // a radio event started or ended during the command
+  PERF_FLASH,       // a flash write was in flight
+  PERF_CONTEXTS
+};
+
+void perfBegin();               // before Bluefruit.begin(): I-cache + DWT
+void perfPoll();                // from loop(): runs the flash-write load when enabled
+
+static inline uint32_t perfCycles() { return DWT->CYCCNT; }
+
+// Cycles from RX callback entry to pulse armed
+void perfRecordCommand(uint32_t cycles, uint32_t radio_events_at_start);
+
+// Per-command trace (TraceRecord) for usb_export.cpp
+#define PERF_TRACE_DEPTH 128
+uint32_t perfTraceExportSize();
+uint32_t perfTraceExportRead(uint32_t offset, uint8_t* buf, uint32_t len);
+
+void perfFlashLoad(bool on);    // keep a flash write in flight for measurements
+void perfReset();
+void perfPrintStats(Print& out);
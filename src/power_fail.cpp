@@ -0,0 +1,161 @@
+/*
+ * Power-fail warning
+ *
+ * The warning comes at VDDH 3.5 V, well above brown-out, so the save runs
+ * from loop() like any other flash write and the firmware keeps going in
+ * its lowest governor level:
+ *   warning (SoC task)  outputs parked, POF off until re-armed
+ *   powerFailPoll()     JR_POWER_LOW journaled, batch flushed, page marked,
+ *                       presses allowed again, governor at minimum
+ *   anything journaled after that: mark withdrawn (consumed = 0), since a
+ *                       cut now would lose it and the comparator is off
+ *   VDDH >= PFAIL_ARM_MV again (checked every PFAIL_CHECK_MS): mark
+ *                       withdrawn if still standing, re-armed, governor
+ *                       back to normal
+ *
+ * Page layout: magic, boot number, VDDH mV, done marker, consumed word.
+ * The mark is one flash_nrf5x write (erase and program, under the
+ * InternalFS lock since the page cache is shared with it), once per warning.
+ * Withdrawing it is one more: the core's driver only writes whole pages
+ * through its cache, and a bare sd_flash_write() would leave a completion
+ * behind on the semaphore it waits on. So at most two erases per warning.
+ * At the next boot, before the SoftDevice owns NVMC, the consumed word is
+ * cleared with a single word write, so the mark counts once and booting
+ * never erases anything.
+ */
+
+#include "power_fail.h"
+#include "actuation.h"
+#include "energy_governor.h"
+#include <bluefruit.h>
+#include <InternalFileSystem.h>
+#include <flash/flash_nrf5x.h>
+
+#define PFAIL_MAGIC   0x50464C32u   // "PFL2"
+#define PFAIL_DONE    0x444F4E45u   // "DONE"
+
+struct PfailMark {
+  uint32_t magic;
+  uint32_t boot;
+  uint32_t vddh_mv;
+  uint32_t done;
+  uint32_t consumed;        // 0xFFFFFFFF until the next boot has seen it
+};
+
+// From the linker script: end of the flash image
+extern uint32_t __etext;
+extern uint32_t __data_start__;
+extern uint32_t __data_end__;
+
+static volatile bool armed = false;
+static volatile bool warned = false;
+static bool last_clean = false;
+static bool usable = false;
+static bool marked = false;     // the page says clean as of now
+static uint32_t checked_ms = 0;
+
+static const PfailMark* const mark = (const PfailMark*) PFAIL_PAGE_ADDR;
+
+void powerFailCheck() {
+  last_clean = mark->magic == PFAIL_MAGIC && mark->done == PFAIL_DONE && mark->consumed == 0xFFFFFFFF;
+  if (!last_clean) return;
+
+  // SoftDevice not enabled yet: NVMC is ours, and a word write needs no erase
+  NRF_NVMC->CONFIG = NVMC_CONFIG_WEN_Wen << NVMC_CONFIG_WEN_Pos;
+  *(volatile uint32_t*) &mark->consumed = 0;
+  while (NRF_NVMC->READY == NVMC_READY_READY_Busy) { }
+  NRF_NVMC->CONFIG = NVMC_CONFIG_WEN_Ren << NVMC_CONFIG_WEN_Pos;
+}
+
+static void arm() {
+  sd_power_pof_threshold_set(PFAIL_THRESHOLD);
+  sd_power_pof_thresholdvddh_set(PFAIL_THRESHOLDVDDH);
+  sd_power_pof_enable(1);
+  armed = true;
+}
+
+// 0 (no reading) counts as fine: VDDH isn't measured on this build
+static bool supplyOk(uint16_t mv) {
+  return mv == 0 || mv >= PFAIL_ARM_MV;
+}
+
+void powerFailBegin() {
+  uint32_t image_end = (uint32_t) &__etext + ((uint32_t) &__data_end__ - (uint32_t) &__data_start__);
+
+  journalLog(JR_BOOT, JOURNAL_NO_CONN, readResetReason(), last_clean);
+  Serial.println(last_clean ? "Last shutdown: clean" : "Last shutdown: not clean");
+
+  if (image_end > PFAIL_PAGE_ADDR) {
+    Serial.println("Power-fail page overlaps the firmware, save disabled");
+    return;
+  }
+  usable = true;
+  checked_ms = millis();
+
+  uint16_t mv = governorReadBatteryMv();
+  if (!supplyOk(mv)) {
+    Serial.printf("Supply low (%u mV): power-fail warning not armed\n", mv);
+    governorSetPowerLow(true);
+    return;
+  }
+  arm();
+}
+
+bool powerFailLastShutdownClean() {
+  return last_clean;
+}
+
+void powerFailSocEvent(uint32_t evt) {
+  if (evt != NRF_EVT_POWER_FAILURE_WARNING || !armed) return;
+  armed = false;
+
+  // A press running now must not become a long one; the rest is loop()'s
+  actuationParkAll();
+  warned = true;
+}
+
+static void writeMark(uint16_t mv, uint32_t consumed) {
+  PfailMark m = { PFAIL_MAGIC, journalBootCount(), mv, PFAIL_DONE, consumed };
+  InternalFS._lockFS();
+  flash_nrf5x_write(PFAIL_PAGE_ADDR, &m, sizeof(m));
+  flash_nrf5x_flush();
+  InternalFS._unlockFS();
+}
+
+// The next boot reads a consumed mark as "not clean"
+static void withdrawMark() {
+  if (!marked) return;
+  marked = false;
+  writeMark(mark->vddh_mv, 0);
+}
+
+void powerFailPoll() {
+  if (!usable) return;
+
+  if (warned) {
+    warned = false;
+    sd_power_pof_enable(0);
+    uint16_t mv = governorReadBatteryMv();
+    journalLog(JR_POWER_LOW, JOURNAL_NO_CONN, mv);
+    journalFlush();
+    writeMark(mv, 0xFFFFFFFF);
+    marked = journalBatched() == 0;   // something got in meanwhile: not clean
+    if (!marked) writeMark(mv, 0);
+    actuationResume();
+    governorSetPowerLow(true);
+    Serial.printf("Power-fail warning at %u mV: journal saved, running at minimum\n", mv);
+    checked_ms = millis();
+    return;
+  }
+
+  if (marked && journalBatched()) withdrawMark();
+
+  if (armed || millis() - checked_ms < PFAIL_CHECK_MS) return;
+  checked_ms = millis();
+  uint16_t mv = governorReadBatteryMv();
+  if (!supplyOk(mv)) return;
+  withdrawMark();             // a cut from here on isn't through the warning
+  arm();
+  governorSetPowerLow(false);
+  Serial.printf("Supply back at %u mV: power-fail warning armed\n", mv);
+}
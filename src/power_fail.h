@@ -0,0 +1,28 @@
+#pragma once
+
+#include <Arduino.h>
+#include "journal.h"
+
+// Power-fail warning. Below the POF threshold the SoftDevice raises
+// NRF_EVT_POWER_FAILURE_WARNING; the handler only parks the optocoupler
+// outputs and the LED. powerFailPoll() then journals the event, flushes the
+// journal batch, marks the page (the previous run went down through the
+// warning: a clean shutdown) and drops the governor to its minimum level.
+// Nothing resets: at VDDH 3.5 V a LiPo still has a few percent left.
+//
+// The warning is armed only with VDDH at PFAIL_ARM_MV or above, at boot or
+// once it comes back, so a nearly empty battery can't bounce between
+// warning and re-arm.
+#define PFAIL_THRESHOLD      NRF_POWER_THRESHOLD_V28        // regulated VDD
+#define PFAIL_THRESHOLDVDDH  NRF_POWER_THRESHOLDVDDH_V35    // LiPo on VDDH: empty, or switched off
+#define PFAIL_VDDH_MV        3500       // PFAIL_THRESHOLDVDDH in mV
+#define PFAIL_HYST_MV        200
+#define PFAIL_ARM_MV         (PFAIL_VDDH_MV + PFAIL_HYST_MV)
+#define PFAIL_CHECK_MS       60000UL    // VDDH checked this often while not armed
+#define PFAIL_PAGE_ADDR      0xEC000    // 4 KB page right below InternalFS
+
+void powerFailCheck();                  // first thing in setup(), before the SoftDevice
+void powerFailBegin();                  // after journalBegin(); logs JR_BOOT
+void powerFailPoll();                   // from loop(): save after a warning, re-arm
+void powerFailSocEvent(uint32_t evt);   // from the SoC event callback
+bool powerFailLastShutdownClean();
@@ -0,0 +1,37 @@
+#include "radio_activity.h"
+#include "perf.h"
+#include <bluefruit.h>
+
+static volatile bool active = false;
+static volatile uint32_t events = 0;
+static volatile uint32_t last_end = 0;
+
+void radioActivityBegin() {
+  // Lowest application priority - we only count, never act, in the handler
+  sd_nvic_ClearPendingIRQ(SWI1_EGU1_IRQn);
+  sd_nvic_SetPriority(SWI1_EGU1_IRQn, 7);
+  sd_nvic_EnableIRQ(SWI1_EGU1_IRQn);
+  sd_radio_notification_cfg_set(NRF_RADIO_NOTIFICATION_TYPE_INT_ON_BOTH,
+                                NRF_RADIO_NOTIFICATION_DISTANCE_800US);
+}
+
+// Fires once before the radio goes active and once after it goes inactive
+extern "C" void SWI1_EGU1_IRQHandler(void) {
+  active = !active;
+  if (!active) {
+    events = events + 1;
+    last_end = perfCycles();
+  }
+}
+
+bool radioActive() {
+  return active;
+}
+
+uint32_t radioEventCount() {
+  return events;
+}
+
+uint32_t radioLastEndCycles() {
+  return last_end;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <Arduino.h>
+
+// SoftDevice radio notifications: an interrupt before and after every radio
+// event (advertising, connection, scanning). Lets the application know when
+// the radio has been busy without touching the RADIO peripheral, which the
+// SoftDevice owns.
+
+void radioActivityBegin();          // after Bluefruit.begin()
+bool radioActive();                 // inside a radio event right now
+uint32_t radioEventCount();         // completed radio events since boot
+uint32_t radioLastEndCycles();      // perfCycles() when the last one ended
@@ -0,0 +1,137 @@
+/*
+ * RAM section power
+ *
+ * The regions to keep come from the linker map, so they follow the build:
+ *   softdevice  RAM_POWER_BASE to __data_start__ (what Bluefruit.begin()
+ *               configured the SoftDevice for)
+ *   static      __data_start__ to __bss_end__
+ *   heap        __bss_end__ to __StackLimit: FreeRTOS task stacks and
+ *               everything malloc'd, .noinit (crash capture) included.
+ *               All of it is kept, not just what sbrk has handed out so
+ *               far, since malloc may grow into it at any time
+ *   stack       __StackLimit to __StackTop, the MSP stack (interrupts)
+ * A section touching any of them stays on; the rest go off once, at boot.
+ * Their content is gone then, which is fine since nothing was linked
+ * there. Retention (System OFF) is cleared with power: nothing needs to
+ * survive System OFF, which wakes through a reset.
+ *
+ * The saving is modeled from the datasheet's System ON idle figures with and
+ * without RAM, spread evenly over the 256 KB.
+ */
+
+#include "ram_power.h"
+#include <nrf_soc.h>
+#include <unistd.h>
+
+// From the linker script
+extern uint32_t __data_start__;
+extern uint32_t __bss_end__;
+extern uint32_t __StackLimit;
+extern uint32_t __StackTop;
+
+enum RamUse : uint8_t { RAM_FREE, RAM_SD, RAM_STATIC, RAM_HEAP, RAM_STACK };
+
+static const char use_char[] = { '.', 'S', 'D', 'H', 'T' };
+
+static uint8_t use[RAM_POWER_SECTIONS];
+static uint8_t off_count = 0;
+static uint32_t off_bytes = 0;
+static uint32_t failed = 0;
+
+static uint32_t sectionStart(uint8_t i) {
+  if (i < 16) return RAM_POWER_BASE + i * 0x1000;
+  return RAM_POWER_BASE + 0x10000 + (i - 16) * 0x8000;
+}
+
+static uint32_t sectionSize(uint8_t i) {
+  return i < 16 ? 0x1000 : 0x8000;
+}
+
+// POWER.RAM[block], bit within it
+static uint8_t sectionBlock(uint8_t i) {
+  return i < 16 ? i / 2 : 8;
+}
+
+static uint8_t sectionBit(uint8_t i) {
+  return i < 16 ? i % 2 : i - 16;
+}
+
+static void mark(uint32_t start, uint32_t end, RamUse what) {
+  for (uint8_t i = 0; i < RAM_POWER_SECTIONS; i++) {
+    uint32_t s = sectionStart(i);
+    if (start < s + sectionSize(i) && end > s && use[i] == RAM_FREE) use[i] = what;
+  }
+}
+
+void ramPowerBegin() {
+  uint32_t data = (uint32_t) &__data_start__;
+  uint32_t bss_end = (uint32_t) &__bss_end__;
+  uint32_t stack_limit = (uint32_t) &__StackLimit;
+  uint32_t stack_top = (uint32_t) &__StackTop;
+
+  // Stack first: a section it shares with the heap reads as stack
+  mark(stack_limit, stack_top, RAM_STACK);
+  mark(RAM_POWER_BASE, data, RAM_SD);
+  mark(data, bss_end, RAM_STATIC);
+  mark(bss_end, stack_limit, RAM_HEAP);
+
+  for (uint8_t i = 0; i < RAM_POWER_SECTIONS; i++) {
+    if (use[i] != RAM_FREE) continue;
+    uint8_t bit = sectionBit(i);
+    uint32_t mask = (POWER_RAM_POWER_S0POWER_Msk << bit) | (POWER_RAM_POWER_S0RETENTION_Msk << bit);
+    if (sd_power_ram_power_clr(sectionBlock(i), mask) != NRF_SUCCESS) {
+      failed++;
+      use[i] = RAM_HEAP;      // reported as on
+      continue;
+    }
+    off_count++;
+    off_bytes += sectionSize(i);
+  }
+
+  Serial.print("RAM: ");
+  Serial.print(off_count);
+  Serial.print(" of ");
+  Serial.print(RAM_POWER_SECTIONS);
+  Serial.print(" sections off (");
+  Serial.print(off_bytes / 1024);
+  Serial.println(" KB)");
+}
+
+void ramPowerPrintStats(Print& out) {
+  // One character per section as the hardware reports it; a section
+  // listed as kept but read back off would show '!'
+  out.print("ram ");
+  for (uint8_t i = 0; i < RAM_POWER_SECTIONS; i++) {
+    if (i == 16) out.print(" ");
+    uint32_t power = 0;
+    sd_power_ram_power_get(sectionBlock(i), &power);
+    bool on = power & (POWER_RAM_POWER_S0POWER_Msk << sectionBit(i));
+    out.print(on ? use_char[use[i]] : use[i] == RAM_FREE ? '.' : '!');
+  }
+  out.println(" (S=softdevice D=static H=heap T=stack .=off; 16x4K 6x32K)");
+
+  uint32_t heap_used = (uint32_t) sbrk(0) - (uint32_t) &__bss_end__;
+  out.print(" static=");
+  out.print(((uint32_t) &__bss_end__ - (uint32_t) &__data_start__) / 1024);
+  out.print("K heap=");
+  out.print(heap_used / 1024);
+  out.print("K of ");
+  out.print(((uint32_t) &__StackLimit - (uint32_t) &__bss_end__) / 1024);
+  out.print("K stack=");
+  out.print(((uint32_t) &__StackTop - (uint32_t) &__StackLimit) / 1024);
+  out.print("K top=0x");
+  out.println((uint32_t) &__StackTop, HEX);
+
+  out.print(" off=");
+  out.print(off_count);
+  out.print(" (");
+  out.print(off_bytes / 1024);
+  out.print("K) failed=");
+  out.print(failed);
+  out.print(" idle -");
+  out.print(off_bytes / 1024 * RAM_POWER_FULL_NA / (RAM_POWER_SIZE / 1024));
+  out.println("nA modeled");
+  if ((uint32_t) &__StackTop > RAM_POWER_TOP) {
+    out.println(" (core linker script: RAM not packed, see ld/keyfob_s140_v6.ld)");
+  }
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <Arduino.h>
+
+// RAM section power. The nRF52840's 256 KB are 16 sections of 4 KB
+// (RAM0-RAM7, two each) and 6 of 32 KB (RAM8), each powered on its own, and
+// every one draws retention current in System ON idle whether anything
+// lives there or not. At boot the sections that hold nothing from the
+// linker map (SoftDevice RAM below __data_start__, .data/.bss, heap, MSP
+// stack) are switched off, power and System OFF retention both.
+//
+// With the core's linker script the stack sits at the top of RAM and the
+// heap runs up to it, so every section counts as used. ld/keyfob_s140_v6.ld
+// ends RAM at RAM_POWER_TOP instead: same layout, packed into the low
+// sections, and the ones above can go off.
+#define RAM_POWER_BASE      0x20000000
+#define RAM_POWER_SIZE      0x40000    // 256 KB
+#define RAM_POWER_TOP       0x20020000 // end of RAM in ld/keyfob_s140_v6.ld
+#define RAM_POWER_SECTIONS  22         // 16 x 4 KB, then 6 x 32 KB
+#define RAM_POWER_FULL_NA   1380       // all 256 KB on vs off, System ON idle (PS: 2.35 - 0.97 uA)
+
+void ramPowerBegin();                  // end of setup(): SoftDevice on (sd_power_ram_*)
+void ramPowerPrintStats(Print& out);
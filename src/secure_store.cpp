@@ -0,0 +1,268 @@
+/*
+ * At-rest encryption on the CC310
+ *
+ * Nonces: 8 random bytes drawn once per boot + a 32-bit counter, so they
+ * never repeat under the device key without keeping a counter in flash.
+ * The CC310 is only powered (nRFCrypto.begin()/end()) around each call.
+ *
+ * Dumping FICR gives the key material too, so this only protects a chip
+ * with APPROTECT enabled against reading the data out of a chip-off dump
+ * or a file copied off the filesystem; it doesn't replace readback
+ * protection.
+ */
+
+#include "secure_store.h"
+#include "perf.h"
+#include "journal.h"
+#include <bluefruit.h>
+#include <Adafruit_nRFCrypto.h>
+#include <InternalFileSystem.h>
+#include "nrf_cc310/include/crys_aesccm.h"
+#include "nrf_cc310/include/crys_hmac.h"
+#include "nrf_cc310/include/crys_hash.h"
+
+using namespace Adafruit_LittleFS_Namespace;
+
+static CRYS_AESCCM_Key_t key;
+static uint8_t salt[8];
+static uint32_t counter = 0;
+static bool ready = false;
+static SemaphoreHandle_t cc_mutex;
+static uint8_t file_buf[SEAL_FILE_MAX];       // file helpers, loop() only
+static int8_t sealed_only = -1;               // SECURE_MARK_FILE seen; -1 not looked yet
+static uint32_t rejected = 0;                 // unsealed files refused
+
+#define HASH_CHUNK 1024
+
+static const char kdf_label[] = "keyfob-store-v1";
+
+void secureBegin() {
+  cc_mutex = xSemaphoreCreateMutex();
+
+  // Per-boot nonce salt from the SoftDevice RNG pool
+  uint8_t got = 0;
+  while (got < sizeof(salt)) {
+    uint8_t avail = 0;
+    sd_rand_application_bytes_available_get(&avail);
+    if (avail > sizeof(salt) - got) avail = sizeof(salt) - got;
+    if (avail && sd_rand_application_vector_get(salt + got, avail) == NRF_SUCCESS) got += avail;
+    else delay(1);
+  }
+
+  // key = HMAC-SHA256(ER || IR, label || DEVICEID)[0..15]
+  uint8_t root[32];
+  memcpy(root, (const void*) NRF_FICR->ER, 16);
+  memcpy(root + 16, (const void*) NRF_FICR->IR, 16);
+  uint8_t info[sizeof(kdf_label) - 1 + 8];
+  memcpy(info, kdf_label, sizeof(kdf_label) - 1);
+  memcpy(info + sizeof(kdf_label) - 1, (const void*) NRF_FICR->DEVICEID, 8);
+
+  CRYS_HASH_Result_t mac;
+  nRFCrypto.begin();
+  ready = CRYS_HMAC(CRYS_HASH_SHA256_mode, root, sizeof(root), info, sizeof(info), mac) == CRYS_OK;
+  nRFCrypto.end();
+
+  memset(key, 0, sizeof(key));
+  memcpy(key, mac, 16);
+  memset(root, 0, sizeof(root));
+  memset(mac, 0, sizeof(mac));
+
+  if (!ready) Serial.println("CC310 key derivation failed: settings and journal not saved");
+}
+
+static CRYSError_t ccm(SaSiAesEncryptMode_t mode, uint8_t* blob, uint16_t len) {
+  SealHeader* h = (SealHeader*) blob;
+  uint8_t* text = blob + sizeof(SealHeader);
+  uint8_t* tag = text + len;
+
+  nRFCrypto.begin();
+  CRYSError_t err = CRYS_AESCCM(mode, key, CRYS_AES_Key128BitSize,
+                                h->nonce, SEAL_NONCE_SIZE,
+                                blob, sizeof(SealHeader),
+                                text, len, text,
+                                SEAL_TAG_SIZE, tag);
+  nRFCrypto.end();
+  return err;
+}
+
+uint32_t secureSeal(SealKind kind, uint8_t* blob, uint16_t len) {
+  if (!ready) return 0;
+  xSemaphoreTake(cc_mutex, portMAX_DELAY);
+
+  SealHeader* h = (SealHeader*) blob;
+  memcpy(h->nonce, salt, sizeof(salt));
+  uint32_t n = counter++;
+  memcpy(h->nonce + sizeof(salt), &n, sizeof(n));
+  h->len = len;
+  h->kind = kind;
+  h->version = SEAL_VERSION;
+
+  bool ok = ccm(SASI_AES_ENCRYPT, blob, len) == CRYS_OK;
+  xSemaphoreGive(cc_mutex);
+  return ok ? sizeof(SealHeader) + len + SEAL_TAG_SIZE : 0;
+}
+
+static bool writeRaw(const char* path, const uint8_t* data, uint32_t size) {
+  File f(InternalFS);
+  InternalFS.remove(path);
+  if (!f.open(path, FILE_O_WRITE)) return false;
+  bool ok = f.write(data, size) == size;
+  f.close();
+  return ok;
+}
+
+bool secureIsSealed(const uint8_t* blob, uint32_t blob_len) {
+  const SealHeader* h = (const SealHeader*) blob;
+  return blob_len >= SEAL_OVERHEAD && h->version == SEAL_VERSION &&
+         h->kind >= SEAL_JOURNAL && h->kind < SEAL_KINDS &&
+         h->len <= blob_len - SEAL_OVERHEAD;
+}
+
+int32_t secureOpen(SealKind kind, uint8_t* blob, uint32_t blob_len) {
+  if (!ready || !secureIsSealed(blob, blob_len)) return -1;
+  const SealHeader* h = (const SealHeader*) blob;
+  if (h->kind != kind) return -1;
+
+  xSemaphoreTake(cc_mutex, portMAX_DELAY);
+  bool ok = ccm(SASI_AES_DECRYPT, blob, h->len) == CRYS_OK;
+  xSemaphoreGive(cc_mutex);
+  return ok ? h->len : -1;
+}
+
+bool secureWriteFile(const char* path, SealKind kind, const void* data, uint16_t len) {
+  // Without a key nothing is written: a plaintext file would be refused
+  // on the next boot anyway
+  if (!ready || len + SEAL_OVERHEAD > SEAL_FILE_MAX) return false;
+  memcpy(file_buf + sizeof(SealHeader), data, len);
+  uint32_t size = secureSeal(kind, file_buf, len);
+  if (size == 0) return false;
+  return writeRaw(path, file_buf, size);
+}
+
+// The marker is itself sealed, and the state region brings it back if it
+// is deleted, so neither a plaintext file nor removing the marker gets an
+// unsealed file accepted again
+static bool sealedOnly() {
+  if (sealed_only < 0) {
+    uint32_t magic = 0;
+    File f(InternalFS);
+    int32_t len = -1;
+    if (f.open(SECURE_MARK_FILE, FILE_O_READ)) {
+      len = f.read(file_buf, sizeof(file_buf));
+      f.close();
+    }
+    if (len > 0 && secureOpen(SEAL_MARK, file_buf, len) == sizeof(magic)) {
+      memcpy(&magic, file_buf + sizeof(SealHeader), sizeof(magic));
+    }
+    sealed_only = magic == SECURE_MARK_MAGIC;
+  }
+  return sealed_only;
+}
+
+bool secureAcceptsLegacy() {
+  return ready && !sealedOnly();
+}
+
+void secureEndMigration() {
+  if (!ready || sealedOnly()) return;
+  uint32_t magic = SECURE_MARK_MAGIC;
+  if (!secureWriteFile(SECURE_MARK_FILE, SEAL_MARK, &magic, sizeof(magic))) return;
+  sealed_only = 1;
+  Serial.println("Store: legacy files migrated, only sealed files accepted from now on");
+}
+
+int32_t secureReadFile(const char* path, SealKind kind, void* data, uint16_t max, bool* legacy) {
+  *legacy = false;
+  if (!ready) return -1;
+  bool strict = sealedOnly();         // before file_buf is filled
+  File f(InternalFS);
+  if (!f.open(path, FILE_O_READ)) return -1;
+
+  int32_t len = f.read(file_buf, sizeof(file_buf));
+  f.close();
+  if (len <= 0) return -1;
+
+  if (!secureIsSealed(file_buf, len)) {
+    // Written before encryption: handed back for migration, until
+    // secureEndMigration() at the end of the first boot with a key
+    if (strict) {
+      rejected++;
+      return -1;
+    }
+    *legacy = true;
+    if (len > max) len = max;
+    memcpy(data, file_buf, len);
+    return len;
+  }
+
+  len = secureOpen(kind, file_buf, len);
+  if (len < 0) return -1;
+  if (len > max) len = max;
+  memcpy(data, file_buf + sizeof(SealHeader), len);
+  return len;
+}
+
+bool secureSha256(const void* data, uint32_t len, uint8_t digest[32]) {
+  static uint8_t chunk[HASH_CHUNK] __attribute__((aligned(4)));
+  if (!ready) return false;
+  xSemaphoreTake(cc_mutex, portMAX_DELAY);
+
+  CRYS_HASHUserContext_t ctx;
+  CRYS_HASH_Result_t result;
+  const uint8_t* p = (const uint8_t*) data;
+  nRFCrypto.begin();
+  bool ok = CRYS_HASH_Init(&ctx, CRYS_HASH_SHA256_mode) == CRYS_OK;
+  while (ok && len) {
+    uint32_t n = len < HASH_CHUNK ? len : HASH_CHUNK;
+    memcpy(chunk, p, n);
+    ok = CRYS_HASH_Update(&ctx, chunk, n) == CRYS_OK;
+    p += n;
+    len -= n;
+  }
+  ok = ok && CRYS_HASH_Finish(&ctx, result) == CRYS_OK;
+  nRFCrypto.end();
+
+  xSemaphoreGive(cc_mutex);
+  if (ok) memcpy(digest, result, 32);
+  return ok;
+}
+
+void secureBench(Print& out) {
+  // One record and one journal block, against writing them in plaintext,
+  // which is what sealing replaced
+  static uint8_t blob[JOURNAL_BLOCK_BYTES];
+  static const uint16_t sizes[2] = { sizeof(JournalRecord), JOURNAL_BATCH * sizeof(JournalRecord) };
+  uint32_t block_extra_us = 0;
+
+  for (uint8_t i = 0; i < 2; i++) {
+    uint16_t len = sizes[i];
+    memset(blob + sizeof(SealHeader), 0x5A, len);
+
+    uint32_t t0 = perfCycles();
+    bool plain_ok = writeRaw(SECURE_BENCH_FILE, blob + sizeof(SealHeader), len);
+    uint32_t t1 = perfCycles();
+    uint32_t size = secureSeal(SEAL_JOURNAL, blob, len);
+    uint32_t t2 = perfCycles();
+    bool sealed_ok = size && writeRaw(SECURE_BENCH_FILE, blob, size);
+    uint32_t t3 = perfCycles();
+    int32_t opened = secureOpen(SEAL_JOURNAL, blob, size);
+    uint32_t t4 = perfCycles();
+
+    uint32_t plain_us = (t1 - t0) / 64;
+    uint32_t sealed_us = (t3 - t1) / 64;
+    out.print("ccm ");               out.print(len);
+    out.print("B plain write us=");  out.print(plain_us);
+    out.print(" sealed write us=");  out.print(sealed_us);
+    out.print(" (seal ");            out.print((t2 - t1) / 64);
+    out.print(") open us=");         out.print((t4 - t3) / 64);
+    out.print(" ok=");               out.println(plain_ok && sealed_ok && opened == len ? 1 : 0);
+    block_extra_us = sealed_us > plain_us ? sealed_us - plain_us : 0;
+  }
+  InternalFS.remove(SECURE_BENCH_FILE);
+
+  // What sealing adds per journal record when a whole block goes out at once
+  out.print("per record in a full block, us=");
+  out.print(block_extra_us / JOURNAL_BATCH);
+  out.print(" unsealed files refused=");
+  out.println(rejected);
+}
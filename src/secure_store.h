@@ -0,0 +1,61 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Authenticated encryption (AES-128-CCM, 16-byte tag) for what we persist,
+// on the CryptoCell CC310. A sealed blob is
+//   SealHeader | ciphertext (len bytes) | tag
+// with the header as associated data, so kind and length are authenticated
+// too. The key is derived per device from FICR ER/IR at boot (HMAC-SHA256,
+// also on the CC310); the nRF52840 has no KMU to keep it in.
+#define SEAL_VERSION      1
+#define SEAL_NONCE_SIZE   12
+#define SEAL_TAG_SIZE     16
+#define SEAL_OVERHEAD     (sizeof(SealHeader) + SEAL_TAG_SIZE)
+#define SEAL_FILE_MAX     512         // secureWriteFile()/secureReadFile() blob limit
+#define SECURE_MARK_FILE  "/sealed.bin"   // present: unsealed files are refused
+#define SECURE_MARK_MAGIC 0x4C414553u     // "SEAL"
+#define SECURE_BENCH_FILE "/crypto.tmp"   // secureBench() scratch
+
+enum SealKind : uint8_t {
+  SEAL_JOURNAL = 1,
+  SEAL_CONFIG,
+  SEAL_LINKCAPS,
+  SEAL_PFAIL,               // no longer written; keeps the numbering
+  SEAL_CALIB,
+  SEAL_DONGLE,
+  SEAL_STATE,
+  SEAL_MARK,                // SECURE_MARK_FILE
+  SEAL_KINDS
+};
+
+struct SealHeader {         // 16 bytes
+  uint8_t  nonce[SEAL_NONCE_SIZE];    // per-boot random salt + counter
+  uint16_t len;
+  uint8_t  kind;            // SealKind
+  uint8_t  version;
+};
+
+void secureBegin();                   // after Bluefruit.begin() (RNG), before the stores
+
+// In place: plaintext at blob + sizeof(SealHeader), room for the tag after it.
+// Returns the sealed size, 0 on failure.
+uint32_t secureSeal(SealKind kind, uint8_t* blob, uint16_t len);
+// In place; returns the plaintext length, or -1 if it isn't a valid blob of this kind
+int32_t secureOpen(SealKind kind, uint8_t* blob, uint32_t blob_len);
+bool secureIsSealed(const uint8_t* blob, uint32_t blob_len);
+
+// Whole small files (config, link cache). Writing fails without a key.
+// Reading a file written before encryption existed returns it as is with
+// *legacy set, so callers can migrate by saving again; that works until
+// secureEndMigration(), then unsealed files are refused for good.
+bool secureWriteFile(const char* path, SealKind kind, const void* data, uint16_t len);
+int32_t secureReadFile(const char* path, SealKind kind, void* data, uint16_t max, bool* legacy);
+void secureEndMigration();            // end of setup(), after every store has loaded
+bool secureAcceptsLegacy();           // until then, for stores that migrate on their own (journal)
+
+// SHA-256 of any memory range, flash included (copied through RAM for the
+// CC310 DMA). False if the CC310 isn't usable.
+bool secureSha256(const void* data, uint32_t len, uint8_t digest[32]);
+
+void secureBench(Print& out);         // sealed vs. plaintext file write, open cost
@@ -0,0 +1,410 @@
+/*
+ * State region: bonds, settings and learned state kept across updates
+ *
+ * Once a minute loop() rebuilds the body from InternalFS and the governor
+ * and compares CRCs with what was last written. A change in a bond or
+ * settings file goes out at that check; sections that change with use
+ * (the governor's histogram, the dongle counter) only every 6 h, or when
+ * something else is written anyway, or on stateRegionSync() before the
+ * delta swap and System OFF. Each write erases one page, alternating, so
+ * a page sees at most two erases a day from the slow sections.
+ *
+ * A write goes to the page not holding the current generation, through
+ * the core's flash cache (erase + program in SoftDevice timeslots), and is
+ * read back. Power loss in between leaves the other page as it was.
+ *
+ * Boot: newest valid page (magic, layout, seal tag, sections that tile
+ * the body), else the other one, else none and the region is built from
+ * InternalFS at the first poll. Files are written back only where
+ * InternalFS has nothing, so InternalFS always wins when it has the file.
+ * An older layout is read as is and rewritten in the current one by the
+ * next write.
+ */
+
+#include "state_region.h"
+#include "secure_store.h"
+#include "config_store.h"
+#include "link_cache.h"
+#include "energy_governor.h"
+#include "dongle_link.h"
+#include "admission.h"
+#include "journal.h"
+#include "perf.h"
+#include <InternalFileSystem.h>
+#include <flash/flash_nrf5x.h>
+
+using namespace Adafruit_LittleFS_Namespace;
+
+#define SEC_FILE_VERSION  1
+
+// From the linker script: end of the flash image
+extern uint32_t __etext;
+extern uint32_t __data_start__;
+extern uint32_t __data_end__;
+
+// Our settings files; bonds are picked up from Bluefruit's directories
+static const char* const files[] = { CONFIG_FILE, LINKCAPS_FILE, GOV_CALIB_FILE, DONGLE_FILE, SECURE_MARK_FILE };
+static const char* const bond_dirs[] = { BOND_DIR_PRPH, BOND_DIR_CNTR };
+
+struct Summary {
+  uint32_t len;             // body bytes
+  uint32_t crc_fast;        // bond and settings sections
+  uint32_t crc_slow;        // sections that change with use
+  uint8_t  files;
+  uint8_t  bonds;
+};
+
+struct StateStats {
+  uint8_t  source;          // StateSource at boot
+  uint8_t  restored;        // files written back to InternalFS at boot
+  uint32_t writes;
+  uint32_t failed;
+  uint32_t skipped;         // files left out of the last body, no room
+  uint32_t write_cycles;    // last write: seal + erase + program + read back
+  uint32_t check_cycles;    // last check: rebuild + CRC
+};
+
+// Sealed in place: SealHeader | body | tag
+static uint8_t blob[SEAL_OVERHEAD + STATE_BODY_MAX] __attribute__((aligned(4)));
+static uint8_t* const body = blob + sizeof(SealHeader);
+
+static bool enabled = false;
+static bool boot_logged = false;
+static bool change_noted = false;
+static int8_t page = -1;            // holds the current generation, -1 none yet
+static uint32_t generation = 0;
+static Summary written;             // what the current page holds
+static uint32_t last_check_ms = 0;
+static uint32_t last_write_ms = 0;
+static StateStats stats;
+
+static uint32_t crc32(uint32_t crc, const uint8_t* p, uint32_t len) {
+  crc = ~crc;
+  while (len--) {
+    crc ^= *p++;
+    for (uint8_t i = 0; i < 8; i++) crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+  }
+  return ~crc;
+}
+
+static uint32_t padded(uint32_t n) {
+  return (n + 3) & ~3u;
+}
+
+static uint32_t pageAddr(uint8_t index) {
+  return STATE_REGION_ADDR + index * STATE_PAGE;
+}
+
+static bool isPath(const StateSection* sec, const char* path) {
+  const uint8_t* d = (const uint8_t*) (sec + 1);
+  return d[0] == strlen(path) && memcmp(d + 1, path, d[0]) == 0;
+}
+
+static bool isBond(const StateSection* sec) {
+  const uint8_t* d = (const uint8_t*) (sec + 1);
+  for (uint8_t i = 0; i < sizeof(bond_dirs) / sizeof(bond_dirs[0]); i++) {
+    uint8_t n = strlen(bond_dirs[i]);
+    if (d[0] > n && memcmp(d + 1, bond_dirs[i], n) == 0 && d[1 + n] == '/') return true;
+  }
+  return false;
+}
+
+static bool isSlow(const StateSection* sec) {
+  return sec->id == STATE_SEC_GOVERNOR || (sec->id == STATE_SEC_FILE && isPath(sec, DONGLE_FILE));
+}
+
+// Sections must tile the body exactly; file sections need a sane path
+static bool sectionsValid(const uint8_t* data, uint32_t len) {
+  uint32_t at = 0;
+  while (at < len) {
+    if (len - at < sizeof(StateSection)) return false;
+    const StateSection* sec = (const StateSection*) (data + at);
+    uint32_t next = at + sizeof(StateSection) + padded(sec->len);
+    if (next > len) return false;
+    if (sec->id == STATE_SEC_FILE) {
+      const uint8_t* d = (const uint8_t*) (sec + 1);
+      if (sec->len < 2 || d[0] == 0 || d[0] > STATE_PATH_MAX || 1u + d[0] >= sec->len || d[1] != '/') return false;
+    }
+    at = next;
+  }
+  return true;
+}
+
+static void summarize(const uint8_t* data, uint32_t len, Summary* s) {
+  memset(s, 0, sizeof(*s));
+  s->len = len;
+  for (uint32_t at = 0; at < len; ) {
+    const StateSection* sec = (const StateSection*) (data + at);
+    uint32_t n = sizeof(StateSection) + padded(sec->len);
+    if (isSlow(sec)) s->crc_slow = crc32(s->crc_slow, data + at, n);
+    else s->crc_fast = crc32(s->crc_fast, data + at, n);
+    if (sec->id == STATE_SEC_FILE) {
+      if (isBond(sec)) s->bonds++;
+      else s->files++;
+    }
+    at += n;
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Building the body
+
+static StateSection* reserve(uint32_t* at, uint8_t id, uint8_t version, uint32_t len) {
+  uint32_t need = sizeof(StateSection) + padded(len);
+  if (*at + need > STATE_BODY_MAX) return nullptr;
+  StateSection* sec = (StateSection*) (body + *at);
+  sec->id = id;
+  sec->version = version;
+  sec->len = len;
+  memset((uint8_t*) (sec + 1) + len, 0, padded(len) - len);
+  return sec;
+}
+
+static void appendFile(uint32_t* at, const char* path) {
+  File f(InternalFS);
+  if (!f.open(path, FILE_O_READ)) return;
+  uint32_t size = f.size();
+  uint8_t path_len = strlen(path);
+  StateSection* sec = nullptr;
+  if (size && path_len <= STATE_PATH_MAX) {
+    sec = reserve(at, STATE_SEC_FILE, SEC_FILE_VERSION, 1 + path_len + size);
+    if (!sec) stats.skipped++;
+  }
+  if (sec) {
+    uint8_t* d = (uint8_t*) (sec + 1);
+    d[0] = path_len;
+    memcpy(d + 1, path, path_len);
+    if (f.read(d + 1 + path_len, size) == (int) size) *at += sizeof(StateSection) + padded(sec->len);
+  }
+  f.close();
+}
+
+static uint32_t build() {
+  uint32_t at = 0;
+  stats.skipped = 0;
+
+  GovLearned learned;
+  governorExportLearned(&learned);
+  StateSection* sec = reserve(&at, STATE_SEC_GOVERNOR, GOV_LEARNED_VERSION, sizeof(learned));
+  memcpy(sec + 1, &learned, sizeof(learned));
+  at += sizeof(StateSection) + padded(sizeof(learned));
+
+  for (uint8_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) appendFile(&at, files[i]);
+
+  for (uint8_t i = 0; i < sizeof(bond_dirs) / sizeof(bond_dirs[0]); i++) {
+    File dir(bond_dirs[i], FILE_O_READ, InternalFS);
+    if (!dir) continue;
+    char path[STATE_PATH_MAX + 2];
+    while (File f = dir.openNextFile(FILE_O_READ)) {
+      bool is_file = !f.isDirectory();
+      int n = snprintf(path, sizeof(path), "%s/%s", bond_dirs[i], f.name());
+      f.close();
+      if (is_file && n > 0 && n <= STATE_PATH_MAX) appendFile(&at, path);
+    }
+    dir.close();
+  }
+  return at;
+}
+
+// ---------------------------------------------------------------------------
+// Boot
+
+static bool loadPage(uint8_t index, uint32_t* len) {
+  const StateHeader* h = (const StateHeader*) pageAddr(index);
+  if (h->magic != STATE_MAGIC || h->layout == 0 || h->layout > STATE_LAYOUT_VERSION) return false;
+  if (h->size < SEAL_OVERHEAD || h->size > sizeof(blob) || sizeof(StateHeader) + h->size > STATE_PAGE) return false;
+
+  memcpy(blob, h + 1, h->size);
+  int32_t n = secureOpen(SEAL_STATE, blob, h->size);
+  if (n < 0 || !sectionsValid(body, n)) return false;
+  *len = n;
+  return true;
+}
+
+static void mkdirFor(const char* path) {
+  const char* slash = strrchr(path, '/');
+  if (slash == path) return;
+  char dir[STATE_PATH_MAX + 1];
+  memcpy(dir, path, slash - path);
+  dir[slash - path] = 0;
+  if (!InternalFS.exists(dir)) InternalFS.mkdir(dir);
+}
+
+static uint8_t restore(const uint8_t* data, uint32_t len) {
+  uint8_t restored = 0;
+  for (uint32_t at = 0; at < len; at += sizeof(StateSection) + padded(((const StateSection*) (data + at))->len)) {
+    const StateSection* sec = (const StateSection*) (data + at);
+    const uint8_t* d = (const uint8_t*) (sec + 1);
+
+    if (sec->id == STATE_SEC_GOVERNOR) {
+      governorImportLearned(d, sec->len);
+    }
+    else if (sec->id == STATE_SEC_FILE) {
+      char path[STATE_PATH_MAX + 1];
+      memcpy(path, d + 1, d[0]);
+      path[d[0]] = 0;
+      if (InternalFS.exists(path)) continue;
+
+      mkdirFor(path);
+      uint32_t size = sec->len - 1 - d[0];
+      File f(InternalFS);
+      if (!f.open(path, FILE_O_WRITE)) continue;
+      bool ok = f.write(d + 1 + d[0], size) == size;
+      f.close();
+      if (ok) restored++;
+    }
+    // Unknown sections come from a newer build: skipped
+  }
+  return restored;
+}
+
+void stateRegionBegin() {
+  uint32_t image_end = (uint32_t) &__etext + ((uint32_t) &__data_end__ - (uint32_t) &__data_start__);
+  if (image_end > STATE_REGION_ADDR) {
+    Serial.println("State region overlaps the firmware, disabled");
+    return;
+  }
+  enabled = true;
+  last_check_ms = millis() - STATE_CHECK_MS;      // first check at the first poll
+
+  // Newest generation first, the other page as the fallback
+  const StateHeader* h0 = (const StateHeader*) pageAddr(0);
+  const StateHeader* h1 = (const StateHeader*) pageAddr(1);
+  uint8_t newest = (h1->magic == STATE_MAGIC && (h0->magic != STATE_MAGIC || h1->generation > h0->generation)) ? 1 : 0;
+
+  uint32_t len = 0;
+  for (uint8_t i = 0; i < STATE_REGION_PAGES; i++) {
+    uint8_t index = newest ^ i;
+    if (!loadPage(index, &len)) continue;
+    page = index;
+    generation = ((const StateHeader*) pageAddr(index))->generation;
+    stats.source = i == 0 ? STATE_SRC_NEWEST : STATE_SRC_FALLBACK;
+    break;
+  }
+
+  if (page < 0) {
+    Serial.println("State region empty or invalid, building it from InternalFS");
+    return;
+  }
+
+  summarize(body, len, &written);
+  stats.restored = restore(body, len);
+  if (stats.source == STATE_SRC_FALLBACK) change_noted = true;     // the newest page needs rewriting
+  Serial.print("State region gen ");
+  Serial.print(generation);
+  if (stats.source == STATE_SRC_FALLBACK) Serial.print(" (fallback)");
+  Serial.print(", files restored: ");
+  Serial.println(stats.restored);
+}
+
+// ---------------------------------------------------------------------------
+// Writing
+
+static bool writePage(const Summary& now) {
+  uint32_t t0 = perfCycles();
+  uint32_t size = secureSeal(SEAL_STATE, blob, now.len);
+  if (size == 0) {
+    stats.failed++;
+    return false;
+  }
+
+  uint8_t target = page < 0 ? 0 : page ^ 1;
+  uint32_t addr = pageAddr(target);
+  StateHeader h = { STATE_MAGIC, STATE_LAYOUT_VERSION, (uint16_t) size, generation + 1 };
+  // The core's page cache is InternalFS's too, and Bluefruit saves bonds
+  // from the BLE task: hold the filesystem's lock for as long as we use it
+  InternalFS._lockFS();
+  flash_nrf5x_write(addr, &h, sizeof(h));
+  flash_nrf5x_write(addr + sizeof(h), blob, size);
+  flash_nrf5x_flush();
+  InternalFS._unlockFS();
+
+  bool ok = memcmp((const void*) addr, &h, sizeof(h)) == 0 &&
+            memcmp((const void*) (addr + sizeof(h)), blob, size) == 0;
+  stats.write_cycles = perfCycles() - t0;
+  if (!ok) {
+    stats.failed++;
+    return false;
+  }
+
+  page = target;
+  generation++;
+  written = now;
+  last_write_ms = millis();
+  change_noted = false;
+  stats.writes++;
+  return true;
+}
+
+// Rebuilds and compares; writes if a fast section changed, or if allowed
+// to write for a slow-only change
+static bool check(bool slow_ok) {
+  uint32_t t0 = perfCycles();
+  Summary now;
+  summarize(body, build(), &now);
+  stats.check_cycles = perfCycles() - t0;
+
+  bool fast = page < 0 || change_noted || now.len != written.len || now.crc_fast != written.crc_fast;
+  bool slow = now.crc_slow != written.crc_slow;
+  if (!fast && !(slow && slow_ok)) return true;
+  return writePage(now);
+}
+
+void stateRegionPoll() {
+  if (!enabled) return;
+  if (!boot_logged) {
+    // journalBegin() runs after stateRegionBegin()
+    journalLog(JR_STATE, JOURNAL_NO_CONN, stats.restored, stats.source);
+    boot_logged = true;
+  }
+
+  uint32_t now = millis();
+  if (now - last_check_ms < STATE_CHECK_MS) return;
+  last_check_ms = now;
+  check(page < 0 || now - last_write_ms >= STATE_SLOW_PERIOD_S * 1000UL);
+}
+
+void stateRegionNoteChange() {
+  change_noted = true;
+}
+
+bool stateRegionSync() {
+  if (!enabled) return false;
+  last_check_ms = millis();
+  return check(true);
+}
+
+void stateRegionPrintStats(Print& out) {
+  static const char* const sources[] = { "none", "newest", "fallback" };
+  if (!enabled) {
+    out.println("state region disabled (image overlaps)");
+    return;
+  }
+  out.print("state page=");
+  out.print(page);
+  out.print(" gen=");
+  out.print(generation);
+  out.print(" boot=");
+  out.print(sources[stats.source]);
+  out.print(" restored=");
+  out.print(stats.restored);
+  out.print(" body=");
+  out.print(written.len);
+  out.print("/");
+  out.print(STATE_BODY_MAX);
+  out.print("B files=");
+  out.print(written.files);
+  out.print(" bonds=");
+  out.println(written.bonds);
+
+  out.print("state writes=");
+  out.print(stats.writes);
+  out.print(" failed=");
+  out.print(stats.failed);
+  out.print(" skipped=");
+  out.print(stats.skipped);
+  out.print(" write_ms=");
+  out.print(stats.write_cycles / 64000);
+  out.print(" check_us=");
+  out.println(stats.check_cycles / 64);
+}
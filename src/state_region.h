@@ -0,0 +1,66 @@
+#pragma once
+
+#include <Arduino.h>
+#include "power_fail.h"
+
+// State that has to outlive firmware updates: Bluefruit's bond files, our
+// settings files (config, link cache, calibration, dongle key) and what the
+// governor has learned, copied into two reserved flash pages right below
+// the power-fail page. Neither update path writes there: the delta bank
+// ends below it, and images that would reach it are refused.
+//
+// InternalFS stays the working copy. At boot, a file the region has but
+// InternalFS lacks (reformatted filesystem, wiped by a tool) is written
+// back before the stores load, so bonds and link caches survive and
+// nothing is learned from scratch. The governor's learned state only lives
+// here.
+//
+// Page: StateHeader | sealed body (secure_store.h, SEAL_STATE). Body:
+// StateSection | data, 4-byte aligned, one per file or learned block.
+// Pages alternate; the valid page with the higher generation wins, and a
+// torn or corrupt newest page falls back to the other one.
+#define STATE_REGION_ADDR     0xEA000    // two 4 KB pages, up to PFAIL_PAGE_ADDR
+#define STATE_REGION_PAGES    2
+#define STATE_PAGE            4096
+#define STATE_MAGIC           0x5453464Bu   // "KFST"
+#define STATE_LAYOUT_VERSION  1
+#define STATE_BODY_MAX        2048       // sealed in RAM in one piece
+#define STATE_CHECK_MS        60000UL    // compare against InternalFS this often
+#define STATE_SETTLE_MS       5000       // after a change, before writing
+#define STATE_SLOW_PERIOD_S   21600      // slow-changing sections alone: at most every 6 h
+#define STATE_PATH_MAX        31
+
+static_assert(STATE_REGION_ADDR + STATE_REGION_PAGES * STATE_PAGE == PFAIL_PAGE_ADDR,
+              "State region sits right below the power-fail page");
+
+struct StateHeader {        // 12 bytes, plaintext
+  uint32_t magic;           // STATE_MAGIC
+  uint16_t layout;          // STATE_LAYOUT_VERSION
+  uint16_t size;            // sealed body bytes that follow
+  uint32_t generation;      // higher = newer
+};
+
+enum StateSectionId : uint8_t {
+  STATE_SEC_FILE = 1,       // path length (1) | path | file bytes as stored in InternalFS
+  STATE_SEC_GOVERNOR,       // GovLearned
+};
+
+// Newer section versions may only append fields: a shorter section loads
+// over the defaults, the same rule as DeviceConfig
+struct StateSection {       // 4 bytes, then len bytes, padded to 4
+  uint8_t  id;              // StateSectionId
+  uint8_t  version;
+  uint16_t len;
+};
+
+enum StateSource : uint8_t {
+  STATE_SRC_NONE = 0,       // no valid page: built from InternalFS
+  STATE_SRC_NEWEST,
+  STATE_SRC_FALLBACK,       // newest page invalid, older one used
+};
+
+void stateRegionBegin();              // after secureBegin(), before configLoad() and the other stores
+void stateRegionPoll();               // from loop(): writes changes
+void stateRegionNoteChange();         // write at the next check, even if only slow sections changed
+bool stateRegionSync();               // write now if anything changed (before a swap or System OFF)
+void stateRegionPrintStats(Print& out);
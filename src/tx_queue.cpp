@@ -0,0 +1,244 @@
+/*
+ * Non-blocking notification queue
+ *
+ * bleuart.println() takes the connection's HVN semaphore and waits when the
+ * SoftDevice has no free notification buffer, which stalls whatever called
+ * it - including the press functions. Here producers only copy into a ring.
+ * The ring is drained into sd_ble_gatts_hvx() while we hold TX credits (one
+ * per SoftDevice HVN buffer) and refilled from HVN_TX_COMPLETE.
+ */
+
+#include "tx_queue.h"
+#include "link_cache.h"
+#include "keyfob_uart.h"
+
+struct TxEntry {
+  uint8_t len;
+  uint8_t prio;
+  uint8_t data[TXQ_ENTRY_MAX];
+};
+
+struct TxRing {
+  bool    active;
+  uint8_t credits;
+  uint8_t head;
+  uint8_t count;
+  TxEntry entries[TXQ_DEPTH];
+};
+
+static TxRing rings[TXQ_MAX_CONN];
+static TxQueueStats stats;
+static SemaphoreHandle_t ring_mutex;
+
+void txQueueBegin() {
+  ring_mutex = xSemaphoreCreateMutex();
+
+  // Size the SoftDevice's HVN buffer pool to match our credit count; MTU and
+  // event length leave room for what link_cache.cpp negotiates
+  Bluefruit.configPrphConn(LINKCAPS_MTU_MAX, LINKCAPS_EVENT_LEN,
+                           TXQ_HVN_CREDITS, BLE_GATTC_WRITE_CMD_TX_QUEUE_SIZE_DEFAULT);
+}
+
+static TxEntry& entryAt(TxRing& ring, uint8_t i) {
+  return ring.entries[(ring.head + i) % TXQ_DEPTH];
+}
+
+// Removes the oldest low priority entry, keeping order of the rest
+static bool evictLow(TxRing& ring) {
+  for (uint8_t i = 0; i < ring.count; i++) {
+    if (entryAt(ring, i).prio != TXQ_LOW) continue;
+    for (uint8_t j = i; j + 1 < ring.count; j++) {
+      entryAt(ring, j) = entryAt(ring, j + 1);
+    }
+    ring.count--;
+    return true;
+  }
+  return false;
+}
+
+// Room for chunks entries once low priority ones make way for a high one
+static bool hasRoom(TxRing& ring, uint16_t chunks, TxPriority prio) {
+  uint16_t room = TXQ_DEPTH - ring.count;
+  if (prio == TXQ_HIGH) {
+    for (uint8_t i = 0; i < ring.count; i++) {
+      if (entryAt(ring, i).prio == TXQ_LOW) room++;
+    }
+  }
+  return chunks <= room;
+}
+
+static bool push(TxRing& ring, const uint8_t* data, uint8_t len, TxPriority prio) {
+  if (ring.count == TXQ_DEPTH) {
+    if (prio == TXQ_LOW) {
+      stats.dropped_low++;
+      return false;
+    }
+    if (!evictLow(ring)) {
+      stats.dropped_high++;
+      return false;
+    }
+    stats.evicted_low++;
+  }
+
+  TxEntry& e = entryAt(ring, ring.count);
+  e.len = len;
+  e.prio = prio;
+  memcpy(e.data, data, len);
+  ring.count++;
+
+  stats.queued++;
+  if (ring.count > stats.max_depth) stats.max_depth = ring.count;
+  return true;
+}
+
+// Caller holds ring_mutex
+static void pump(uint16_t conn_handle) {
+  TxRing& ring = rings[conn_handle];
+
+  while (ring.count > 0) {
+    if (ring.credits == 0) {
+      stats.credit_stalls++;
+      return;
+    }
+
+    TxEntry& e = ring.entries[ring.head];
+    uint16_t len = e.len;
+    ble_gatts_hvx_params_t hvx = {};
+    hvx.handle = bleuart.txValueHandle();
+    hvx.type   = BLE_GATT_HVX_NOTIFICATION;
+    hvx.p_data = e.data;
+    hvx.p_len  = &len;
+
+    uint32_t err = sd_ble_gatts_hvx(conn_handle, &hvx);
+    if (err == NRF_ERROR_RESOURCES) {
+      // Someone else used a buffer behind our back; wait for TX complete
+      ring.credits = 0;
+      stats.credit_stalls++;
+      return;
+    }
+
+    // Sent, or undeliverable (unsubscribed, disconnecting) - drop either way
+    if (err == NRF_SUCCESS) {
+      ring.credits--;
+      stats.sent++;
+    }
+    ring.head = (ring.head + 1) % TXQ_DEPTH;
+    ring.count--;
+  }
+}
+
+static bool sendOne(uint16_t conn_handle, const uint8_t* data, uint16_t len, TxPriority prio) {
+  TxRing& ring = rings[conn_handle];
+  if (!ring.active || !bleuart.notifyEnabled(conn_handle)) return false;
+
+  // The whole message or none of it: the phone can't use half a reply
+  uint16_t chunks = (len + TXQ_ENTRY_MAX - 1) / TXQ_ENTRY_MAX;
+  if (!hasRoom(ring, chunks, prio)) {
+    if (prio == TXQ_LOW) stats.dropped_low += chunks;
+    else stats.dropped_high += chunks;
+    return false;
+  }
+
+  while (len > 0) {
+    uint8_t chunk = len > TXQ_ENTRY_MAX ? TXQ_ENTRY_MAX : len;
+    push(ring, data, chunk, prio);
+    data += chunk;
+    len -= chunk;
+  }
+  pump(conn_handle);
+  return true;
+}
+
+bool txQueueSend(uint16_t conn_handle, const uint8_t* data, uint16_t len, TxPriority prio) {
+  uint32_t start = micros();
+  bool ok = false;
+
+  xSemaphoreTake(ring_mutex, portMAX_DELAY);
+  if (conn_handle == BLE_CONN_HANDLE_INVALID) {
+    for (uint16_t h = 0; h < TXQ_MAX_CONN; h++) {
+      ok |= sendOne(h, data, len, prio);
+    }
+  }
+  else if (conn_handle < TXQ_MAX_CONN) {
+    ok = sendOne(conn_handle, data, len, prio);
+  }
+  xSemaphoreGive(ring_mutex);
+
+  stats.blocked_us += micros() - start;
+  return ok;
+}
+
+bool txQueuePrintln(const char* text, TxPriority prio) {
+  // Same bytes bleuart.println() would have produced
+  uint8_t line[64];
+  size_t len = strlen(text);
+  if (len > sizeof(line) - 2) len = sizeof(line) - 2;
+  memcpy(line, text, len);
+  line[len++] = '\r';
+  line[len++] = '\n';
+  return txQueueSend(BLE_CONN_HANDLE_INVALID, line, len, prio);
+}
+
+// Runs in the Bluefruit BLE task
+void txQueueEvent(ble_evt_t* evt) {
+  uint16_t conn_handle = evt->evt.common_evt.conn_handle;
+  if (conn_handle >= TXQ_MAX_CONN) return;
+  TxRing& ring = rings[conn_handle];
+
+  switch (evt->header.evt_id) {
+    case BLE_GAP_EVT_CONNECTED:
+      if (evt->evt.gap_evt.params.connected.role != BLE_GAP_ROLE_PERIPH) break;
+      xSemaphoreTake(ring_mutex, portMAX_DELAY);
+      ring.active = true;
+      ring.credits = TXQ_HVN_CREDITS;
+      ring.head = 0;
+      ring.count = 0;
+      xSemaphoreGive(ring_mutex);
+      break;
+
+    case BLE_GAP_EVT_DISCONNECTED:
+      xSemaphoreTake(ring_mutex, portMAX_DELAY);
+      ring.active = false;
+      ring.count = 0;
+      xSemaphoreGive(ring_mutex);
+      break;
+
+    case BLE_GATTS_EVT_HVN_TX_COMPLETE:
+      xSemaphoreTake(ring_mutex, portMAX_DELAY);
+      ring.credits += evt->evt.gatts_evt.params.hvn_tx_complete.count;
+      if (ring.credits > TXQ_HVN_CREDITS) ring.credits = TXQ_HVN_CREDITS;
+      if (ring.active) pump(conn_handle);
+      xSemaphoreGive(ring_mutex);
+      break;
+
+    default:
+      break;
+  }
+}
+
+uint16_t txQueueDepth(uint16_t conn_handle) {
+  return conn_handle < TXQ_MAX_CONN ? rings[conn_handle].count : 0;
+}
+
+void txQueuePrintStats(Print& out) {
+  out.print("txq queued=");    out.print(stats.queued);
+  out.print(" sent=");         out.print(stats.sent);
+  out.print(" max_depth=");    out.println(stats.max_depth);
+  out.print("txq drop_low=");  out.print(stats.dropped_low);
+  out.print(" evict_low=");    out.print(stats.evicted_low);
+  out.print(" drop_high=");    out.println(stats.dropped_high);
+  out.print("txq stalls=");    out.print(stats.credit_stalls);
+  out.print(" blocked_us=");   out.println(stats.blocked_us);
+}
+
+size_t TxQueuePrint::write(uint8_t c) {
+  _buf[_len++] = c;
+  if (c == '\n' || _len == TXQ_ENTRY_MAX) flush();
+  return 1;
+}
+
+void TxQueuePrint::flush() {
+  if (_len == 0) return;
+  txQueueSend(BLE_CONN_HANDLE_INVALID, _buf, _len, _prio);
+  _len = 0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <Arduino.h>
+#include <bluefruit.h>
+
+// Outbound notification queue. Callers never wait on the radio: messages go
+// into a fixed ring per connection and are pushed to the SoftDevice only while
+// it has HVN buffers free. BLE_GATTS_EVT_HVN_TX_COMPLETE refills it.
+#define TXQ_MAX_CONN     3      // rings, indexed by conn_handle: 2 phones, and the HID remote takes a handle
+#define TXQ_DEPTH        16     // entries per ring
+#define TXQ_ENTRY_MAX    20     // payload per entry = one notification at default MTU
+#define TXQ_HVN_CREDITS  4      // SoftDevice HVN queue size per link
+
+enum TxPriority : uint8_t {
+  TXQ_LOW  = 0,   // banners, help, stats - first to go under pressure
+  TXQ_HIGH = 1,   // actuation acks, pairing
+};
+
+struct TxQueueStats {
+  uint32_t queued;          // entries accepted
+  uint32_t sent;            // entries handed to the SoftDevice
+  uint32_t dropped_low;     // low priority rejected because the ring was full
+  uint32_t evicted_low;     // queued low priority entries removed for a high one
+  uint32_t dropped_high;    // ring full of high priority entries
+  uint32_t credit_stalls;   // pump found data but no free HVN buffer
+  uint32_t max_depth;
+  uint32_t blocked_us;      // total time callers spent inside txQueueSend()
+};
+
+void txQueueBegin();              // before Bluefruit.begin()
+void txQueueEvent(ble_evt_t* evt);
+
+// conn_handle BLE_CONN_HANDLE_INVALID sends to every subscribed connection.
+// Data longer than TXQ_ENTRY_MAX is split over several entries, queued all
+// together or, if the ring can't take them all, dropped whole.
+bool txQueueSend(uint16_t conn_handle, const uint8_t* data, uint16_t len, TxPriority prio);
+bool txQueuePrintln(const char* text, TxPriority prio = TXQ_HIGH);
+
+uint16_t txQueueDepth(uint16_t conn_handle);
+void txQueuePrintStats(Print& out);
+
+// Print adapter, so code written against Print can report over BLE without
+// blocking. Output is cut into entries at '\n' or when an entry fills up.
+class TxQueuePrint : public Print {
+public:
+  explicit TxQueuePrint(TxPriority prio) : _prio(prio), _len(0) {}
+  ~TxQueuePrint() { flush(); }
+
+  size_t write(uint8_t c) override;
+  void flush() override;
+
+private:
+  TxPriority _prio;
+  uint8_t _len;
+  uint8_t _buf[TXQ_ENTRY_MAX];
+};
@@ -0,0 +1,259 @@
+/*
+ * USB mass-storage export
+ *
+ * Volume layout (512-byte sectors, 1 sector per cluster):
+ *   LBA 0      boot sector
+ *   LBA 1-2    FAT12, two copies
+ *   LBA 3      root directory
+ *   LBA 4...   data, cluster 2 onwards
+ *
+ * Each file owns a fixed cluster range sized for its maximum; the FAT and
+ * directory entries are built from the current sizes whenever the host
+ * reads them. Host writes to the metadata sectors are dropped (the next
+ * read regenerates them). A data sector written into CONFIG.BIN's or
+ * CALIB.BIN's range or into free space that parses as a valid DeviceConfig
+ * or EnergyCalib is applied from loop(), so both in-place writes and
+ * copy-over-file work.
+ */
+
+#include "usb_export.h"
+#include "journal.h"
+#include "crash_log.h"
+#include "perf.h"
+#include "config_store.h"
+#include "energy_governor.h"
+#include "coro.h"
+#include <Adafruit_TinyUSB.h>
+
+#define USBX_FAT_LBA        1
+#define USBX_FATS           2
+#define USBX_ROOT_LBA       (USBX_FAT_LBA + USBX_FATS)
+#define USBX_DATA_LBA       (USBX_ROOT_LBA + 1)
+#define USBX_CLUSTERS       (USBX_SECTORS - USBX_DATA_LBA)
+#define USBX_FAT_DATE       0x5821    // 2024-01-01, there is no wall clock
+
+struct VirtualFile {
+  char      name[11];             // 8.3, space padded
+  uint8_t   attr;
+  uint32_t  max_size;
+  uint32_t  (*size)();
+  uint32_t  (*read)(uint32_t offset, uint8_t* buf, uint32_t len);
+  uint16_t  first_cluster;        // filled in by layout()
+};
+
+static uint32_t configSize() {
+  return sizeof(DeviceConfig);
+}
+
+static uint32_t configRead(uint32_t offset, uint8_t* buf, uint32_t len) {
+  if (offset >= sizeof(config)) return 0;
+  if (len > sizeof(config) - offset) len = sizeof(config) - offset;
+  memcpy(buf, (const uint8_t*) &config + offset, len);
+  return len;
+}
+
+static VirtualFile files[] = {
+  { {'J','O','U','R','N','A','L',' ','B','I','N'}, 0x01,
+    sizeof(ExportHeader) + 2 * JOURNAL_FILE_BYTES + JOURNAL_BATCH * sizeof(JournalRecord),
+    journalExportSize, journalExportRead, 0 },
+  { {'T','R','A','C','E',' ',' ',' ','B','I','N'}, 0x01,
+    sizeof(ExportHeader) + PERF_TRACE_DEPTH * sizeof(TraceRecord),
+    perfTraceExportSize, perfTraceExportRead, 0 },
+  { {'C','R','A','S','H',' ',' ',' ','B','I','N'}, 0x01,
+    sizeof(ExportHeader) + CRASH_MAX * sizeof(CrashRecord),
+    crashLogExportSize, crashLogExportRead, 0 },
+  { {'C','A','L','I','B',' ',' ',' ','B','I','N'}, 0x00,
+    sizeof(EnergyCalib),
+    governorCalibExportSize, governorCalibExportRead, 0 },
+  { {'C','O','N','F','I','G',' ',' ','B','I','N'}, 0x00,
+    sizeof(DeviceConfig),
+    configSize, configRead, 0 },
+};
+#define USBX_FILES      (sizeof(files) / sizeof(files[0]))
+#define USBX_CALIB      (USBX_FILES - 2)
+#define USBX_CONFIG     (USBX_FILES - 1)
+
+static Adafruit_USBD_MSC usb_msc;
+static bool started = false;
+static uint16_t free_cluster = 0;     // first cluster not owned by a file
+
+static DeviceConfig pending_config;
+static volatile bool config_pending = false;
+static EnergyCalib pending_calib;
+static volatile bool calib_pending = false;
+
+static uint16_t clustersFor(uint32_t bytes) {
+  return (bytes + USBX_SECTOR_SIZE - 1) / USBX_SECTOR_SIZE;
+}
+
+static void layout() {
+  uint16_t cluster = 2;
+  for (uint8_t i = 0; i < USBX_FILES; i++) {
+    files[i].first_cluster = cluster;
+    cluster += clustersFor(files[i].max_size);
+  }
+  free_cluster = cluster;
+}
+
+static void put16(uint8_t* p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+static void put32(uint8_t* p, uint32_t v) { put16(p, v); put16(p + 2, v >> 16); }
+
+static void bootSector(uint8_t* s) {
+  static const uint8_t jump_oem[11] = { 0xEB, 0x3C, 0x90, 'M','S','W','I','N','4','.','1' };
+  memcpy(s, jump_oem, sizeof(jump_oem));
+  put16(s + 11, USBX_SECTOR_SIZE);
+  s[13] = 1;                          // sectors per cluster
+  put16(s + 14, USBX_FAT_LBA);        // reserved sectors
+  s[16] = USBX_FATS;
+  put16(s + 17, USBX_ROOT_ENTRIES);
+  put16(s + 19, USBX_SECTORS);
+  s[21] = 0xF8;                       // fixed disk
+  put16(s + 22, 1);                   // sectors per FAT
+  put16(s + 24, 1);                   // sectors per track
+  put16(s + 26, 1);                   // heads
+  s[36] = 0x80;                       // drive number
+  s[38] = 0x29;                       // extended boot signature
+  put32(s + 39, NRF_FICR->DEVICEID[0]);
+  memcpy(s + 43, "KEYFOB     FAT12   ", 19);
+  s[510] = 0x55;
+  s[511] = 0xAA;
+}
+
+static void fat12Set(uint8_t* fat, uint16_t n, uint16_t v) {
+  uint16_t i = n + n / 2;
+  if (n & 1) {
+    fat[i] = (fat[i] & 0x0F) | (v << 4);
+    fat[i + 1] = v >> 4;
+  }
+  else {
+    fat[i] = v;
+    fat[i + 1] = (fat[i + 1] & 0xF0) | ((v >> 8) & 0x0F);
+  }
+}
+
+static void fatSector(uint8_t* s) {
+  fat12Set(s, 0, 0xFF8);
+  fat12Set(s, 1, 0xFFF);
+  for (uint8_t i = 0; i < USBX_FILES; i++) {
+    uint16_t used = clustersFor(files[i].size());
+    for (uint16_t k = 0; k < used; k++) {
+      uint16_t c = files[i].first_cluster + k;
+      fat12Set(s, c, k + 1 < used ? c + 1 : 0xFFF);
+    }
+  }
+}
+
+static void rootSector(uint8_t* s) {
+  memcpy(s, "KEYFOB     ", 11);
+  s[11] = 0x08;                       // volume label
+
+  for (uint8_t i = 0; i < USBX_FILES; i++) {
+    uint8_t* e = s + 32 * (i + 1);
+    uint32_t size = files[i].size();
+    memcpy(e, files[i].name, 11);
+    e[11] = files[i].attr;
+    put16(e + 16, USBX_FAT_DATE);     // created
+    put16(e + 18, USBX_FAT_DATE);     // accessed
+    put16(e + 24, USBX_FAT_DATE);     // modified
+    put16(e + 26, size ? files[i].first_cluster : 0);
+    put32(e + 28, size);
+  }
+}
+
+static void dataSector(uint16_t cluster, uint8_t* s) {
+  for (uint8_t i = 0; i < USBX_FILES; i++) {
+    const VirtualFile& f = files[i];
+    if (cluster < f.first_cluster || cluster >= f.first_cluster + clustersFor(f.max_size)) continue;
+    f.read((uint32_t) (cluster - f.first_cluster) * USBX_SECTOR_SIZE, s, USBX_SECTOR_SIZE);
+    return;
+  }
+}
+
+// TinyUSB device task
+static int32_t msc_read_cb(uint32_t lba, void* buffer, uint32_t bufsize) {
+  uint8_t* s = (uint8_t*) buffer;
+  for (uint32_t done = 0; done < bufsize; done += USBX_SECTOR_SIZE, lba++, s += USBX_SECTOR_SIZE) {
+    memset(s, 0, USBX_SECTOR_SIZE);
+    if (lba == 0)                     bootSector(s);
+    else if (lba < USBX_ROOT_LBA)     fatSector(s);
+    else if (lba == USBX_ROOT_LBA)    rootSector(s);
+    else if (lba < USBX_SECTORS)      dataSector(lba - USBX_DATA_LBA + 2, s);
+  }
+  return bufsize;
+}
+
+static int32_t msc_write_cb(uint32_t lba, uint8_t* buffer, uint32_t bufsize) {
+  for (uint32_t done = 0; done < bufsize; done += USBX_SECTOR_SIZE, lba++, buffer += USBX_SECTOR_SIZE) {
+    if (lba < USBX_DATA_LBA || lba >= USBX_SECTORS) continue;
+    uint16_t cluster = lba - USBX_DATA_LBA + 2;
+    if (cluster != files[USBX_CONFIG].first_cluster && cluster != files[USBX_CALIB].first_cluster &&
+        cluster < free_cluster) continue;
+
+    // Checked again by governorApplyCalib() / configApply(); this just
+    // filters unrelated data
+    const EnergyCalib* e = (const EnergyCalib*) buffer;
+    if (e->magic == CALIB_MAGIC) {
+      if (calib_pending) continue;
+      memcpy(&pending_calib, buffer, sizeof(pending_calib));
+      calib_pending = true;
+      continue;
+    }
+
+    const DeviceConfig* c = (const DeviceConfig*) buffer;
+    if (config_pending) continue;
+    if (c->version != CONFIG_VERSION || c->size < 4 || c->size > sizeof(DeviceConfig)) continue;
+    memcpy(&pending_config, buffer, sizeof(pending_config));
+    config_pending = true;
+  }
+  return bufsize;
+}
+
+static void msc_flush_cb() {
+}
+
+static CoroTask reenumerate() {
+  TinyUSBDevice.detach();
+  co_await coroSleep(10);
+  TinyUSBDevice.attach();
+}
+
+static void start() {
+  layout();
+  usb_msc.setID("KeyFob", "Diagnostics", "1.0");
+  usb_msc.setReadWriteCallback(msc_read_cb, msc_write_cb, msc_flush_cb);
+  usb_msc.setCapacity(USBX_SECTORS, USBX_SECTOR_SIZE);
+  usb_msc.setUnitReady(true);
+  usb_msc.begin();
+  started = true;
+
+  // The core enumerated CDC-only before setup(); re-enumerate with MSC
+  if (TinyUSBDevice.mounted()) reenumerate();
+}
+
+void usbExportBegin() {
+  if (config.usb_export) start();
+}
+
+void usbExportEnable(bool on) {
+  config.usb_export = on;
+  configSave();
+  if (on && !started) start();
+  else if (started) usb_msc.setUnitReady(on);
+}
+
+void usbExportPoll() {
+  if (calib_pending) {
+    bool ok = governorApplyCalib(pending_calib);
+    calib_pending = false;
+    Serial.println(ok ? "CALIB.BIN applied" : "CALIB.BIN rejected");
+  }
+  if (!config_pending) return;
+
+  uint16_t old_target = config.target_runtime_h;
+  bool ok = configApply(&pending_config, sizeof(pending_config));
+  config_pending = false;
+
+  Serial.println(ok ? "CONFIG.BIN applied" : "CONFIG.BIN rejected");
+  if (ok && config.target_runtime_h != old_target) governorSetTarget(config.target_runtime_h);
+  if (ok && !config.usb_export) usb_msc.setUnitReady(false);
+}
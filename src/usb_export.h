@@ -0,0 +1,19 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Optional USB mass-storage diagnostics volume (TinyUSB MSC, next to the
+// CDC serial port). A small FAT12 volume is generated on the fly:
+//   JOURNAL.BIN  journal.cpp records
+//   TRACE.BIN    perf.cpp per-command trace
+//   CRASH.BIN    crash_log.cpp records
+//   CONFIG.BIN   DeviceConfig - write it back to change settings
+// File contents are read from InternalFS / RAM straight into the USB
+// buffer for each sector; nothing is staged.
+#define USBX_SECTOR_SIZE    512
+#define USBX_SECTORS        256       // 128 KB volume
+#define USBX_ROOT_ENTRIES   16
+
+void usbExportBegin();                // after the stores; no-op unless config.usb_export
+void usbExportEnable(bool on);        // 'usb on/off', saved, re-enumerates
+void usbExportPoll();                 // applies a CONFIG.BIN written by the host
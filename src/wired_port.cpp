@@ -0,0 +1,440 @@
+/*
+ * Wired command port (UARTE1, EasyDMA)
+ *
+ * RX: two DMA buffers. The receiver is stopped by hardware when the line has
+ * been idle for WIRED_IDLE_US (RXDRDY -> PPI -> TIMER2 CLEAR/START, TIMER2
+ * COMPARE0 -> PPI -> STOPRX), which ends the transfer with ENDRX and then
+ * RXTO. ENDRX points the DMA at the other buffer and copies the frame out;
+ * RXTO restarts the receiver. A buffer that fills up before the line goes
+ * idle also ends in ENDRX but without RXTO, so it is restarted right away
+ * and the rest of that burst is dropped.
+ *
+ * The frames go through a queue to a task at the BLE task's priority:
+ * dispatchCommand() queues notifications, which takes a mutex, so it can't
+ * run in the interrupt.
+ */
+
+#include "wired_port.h"
+#include "config.h"
+#include "config_store.h"
+#include <bluefruit.h>
+#include <nrf_gpio.h>
+
+#define WIRED_CMD_LEN   5         // '!' 'B' button state sum
+#define WIRED_REPLY_LEN 6         // '!' type code seq_hi seq_lo sum
+#define WIRED_TEST_WAIT_US 5000   // past wire time + idle before a loopback frame counts as lost
+
+struct WiredFrame {
+  uint8_t  len;
+  uint8_t  data[WIRED_FRAME_MAX];
+  uint32_t cycles;                // DWT at the frame's end-of-RX interrupt
+};
+
+struct WiredStats {
+  uint32_t frames;                // queued for the task
+  uint32_t bad;                   // wrong length, type or checksum
+  uint32_t oversize;              // filled the buffer
+  uint32_t dropped;               // queue full
+  uint32_t tx_timeouts;
+  uint32_t refused;               // button down while loop() hadn't logged the last one
+  uint32_t irqs;
+  uint32_t irq_max_cycles;
+  uint64_t irq_total_cycles;
+  uint32_t handled;               // frames answered
+  uint32_t handle_max_cycles;     // end-of-RX interrupt to reply queued
+  uint64_t handle_total_cycles;
+};
+
+static uint8_t rx_buf[2][WIRED_FRAME_MAX];
+static uint8_t tx_buf[WIRED_FRAME_MAX];
+static uint8_t rx_cur = 0;                // buffer the DMA is filling
+static bool overlong = false;             // dropping the rest of a burst
+static volatile bool running = false;
+static volatile bool rx_stopped = false;
+
+static TaskHandle_t task = NULL;
+static QueueHandle_t rx_queue = NULL;
+static SemaphoreHandle_t tx_token = NULL; // taken while a frame is going out
+static WiredStats stats;
+
+// Last command, for loop() to log
+static char last_cmd[WIRED_CMD_LEN];
+static volatile CmdResult last_result;
+static volatile bool last_ready = false;
+
+// Loopback test: loop() sends test_frame, the task stamps its return
+static uint8_t test_frame[WIRED_FRAME_MAX];
+static volatile uint8_t test_len = 0;     // nonzero while a test runs
+static volatile bool test_seen = false;
+static volatile uint32_t test_cycles = 0;
+static volatile uint32_t test_corrupt = 0;
+
+static uint8_t packetSum(const uint8_t* data, uint8_t len) {
+  uint8_t sum = 0;
+  for (uint8_t i = 0; i < len; i++) sum += data[i];
+  return ~sum;
+}
+
+static bool wiredSend(const uint8_t* data, uint8_t len) {
+  if (!running) return false;
+  if (xSemaphoreTake(tx_token, pdMS_TO_TICKS(WIRED_TX_TIMEOUT_MS)) != pdTRUE) {
+    stats.tx_timeouts++;
+    return false;
+  }
+  if (!running) {                 // stopped while we waited
+    xSemaphoreGive(tx_token);
+    return false;
+  }
+  memcpy(tx_buf, data, len);
+  NRF_UARTE1->TXD.PTR = (uint32_t) tx_buf;
+  NRF_UARTE1->TXD.MAXCNT = len;
+  NRF_UARTE1->TASKS_STARTTX = 1;  // ENDTX gives the token back
+  return true;
+}
+
+static bool reply(uint8_t type, uint8_t code, uint16_t seq) {
+  uint8_t frame[WIRED_REPLY_LEN] = { '!', type, code, (uint8_t) (seq >> 8), (uint8_t) seq, 0 };
+  frame[WIRED_REPLY_LEN - 1] = packetSum(frame, WIRED_REPLY_LEN - 1);
+  return wiredSend(frame, sizeof(frame));
+}
+
+static void handleFrame(const WiredFrame& f) {
+  bool command = f.len >= 2 && f.data[0] == '!' && f.data[1] == 'B';
+  if (!command || f.len != WIRED_CMD_LEN || packetSum(f.data, WIRED_CMD_LEN - 1) != f.data[WIRED_CMD_LEN - 1]) {
+    stats.bad++;
+    // Only commands get an answer: our own replies looped back (or line
+    // noise) must not start a ping-pong
+    if (command) reply('A', 'E', 0);
+    return;
+  }
+
+  // Every button down ends up in loop()'s log and journal, like over BLE:
+  // with the last one not taken yet, refuse before anything is pressed.
+  // Releases ('0') are ignored by dispatch and never logged.
+  if (f.data[3] == '1' && last_ready) {
+    stats.refused++;
+    reply('A', 'B', 0);
+    return;
+  }
+
+  char cmd[WIRED_CMD_LEN] = { '!', 'B', (char) f.data[2], (char) f.data[3], 0 };
+  CmdResult result = dispatchCommand(cmd, WIRED_CMD_LEN - 1);
+
+  switch (result) {
+    case CMD_LOCK:   reply('A', 'L', commandSeq(ACT_LOCK)); break;
+    case CMD_UNLOCK: reply('A', 'U', commandSeq(ACT_UNLOCK)); break;
+    case CMD_BUSY:   reply('A', 'B', 0); break;
+    default:         reply('A', 'N', 0); break;   // unassigned button, release
+  }
+
+  uint32_t cycles = perfCycles() - f.cycles;
+  stats.handled++;
+  stats.handle_total_cycles += cycles;
+  if (cycles > stats.handle_max_cycles) stats.handle_max_cycles = cycles;
+
+  if (result != CMD_IGNORED && !last_ready) {
+    memcpy(last_cmd, cmd, sizeof(cmd));
+    last_result = result;
+    __DMB();                  // command before the flag
+    last_ready = true;
+  }
+}
+
+static void loopbackFrame(const WiredFrame& f) {
+  if (f.len == test_len && memcmp(f.data, test_frame, f.len) == 0) {
+    test_cycles = perfCycles();
+    test_seen = true;
+  }
+  else {
+    test_corrupt = test_corrupt + 1;
+  }
+}
+
+static void wiredTask(void*) {
+  WiredFrame f;
+  for (;;) {
+    if (xQueueReceive(rx_queue, &f, portMAX_DELAY) != pdTRUE) continue;
+    if (test_len) loopbackFrame(f);
+    else handleFrame(f);
+  }
+}
+
+extern "C" void UARTE1_IRQHandler(void) {
+  uint32_t start = perfCycles();
+  NRF_UARTE_Type* u = NRF_UARTE1;
+  BaseType_t woken = pdFALSE;
+
+  if (u->EVENTS_ENDRX) {
+    u->EVENTS_ENDRX = 0;
+    uint32_t len = u->RXD.AMOUNT;
+    bool idle = NRF_TIMER2->EVENTS_COMPARE[0];
+    uint8_t done = rx_cur;
+
+    // Receiver restarts into the other buffer before this one is copied
+    rx_cur ^= 1;
+    u->RXD.PTR = (uint32_t) rx_buf[rx_cur];
+    if (!idle && running) u->TASKS_STARTRX = 1;
+
+    if (len >= WIRED_FRAME_MAX || overlong) {
+      if (!overlong) stats.oversize++;
+      overlong = !idle;
+    }
+    else if (len && running) {
+      WiredFrame f;
+      f.len = len;
+      memcpy(f.data, rx_buf[done], len);
+      f.cycles = start;
+      if (xQueueSendFromISR(rx_queue, &f, &woken) == pdTRUE) stats.frames++;
+      else stats.dropped++;
+    }
+  }
+
+  // Stopped on idle: listen for the next frame
+  if (u->EVENTS_RXTO) {
+    u->EVENTS_RXTO = 0;
+    NRF_TIMER2->EVENTS_COMPARE[0] = 0;
+    if (running) u->TASKS_STARTRX = 1;
+    else rx_stopped = true;
+  }
+
+  if (u->EVENTS_ENDTX) {
+    u->EVENTS_ENDTX = 0;
+    u->TASKS_STOPTX = 1;          // the transmitter holds the HF clock until stopped
+    xSemaphoreGiveFromISR(tx_token, &woken);
+  }
+
+  uint32_t cycles = perfCycles() - start;
+  stats.irqs++;
+  stats.irq_total_cycles += cycles;
+  if (cycles > stats.irq_max_cycles) stats.irq_max_cycles = cycles;
+  portYIELD_FROM_ISR(woken);
+}
+
+static void start() {
+  if (!task) {
+    rx_queue = xQueueCreate(WIRED_QUEUE_DEPTH, sizeof(WiredFrame));
+    tx_token = xSemaphoreCreateBinary();
+    xSemaphoreGive(tx_token);
+    xTaskCreate(wiredTask, "wired", WIRED_TASK_STACK, NULL, TASK_PRIO_HIGH, &task);
+  }
+
+  // TX idles high; RX pulled up so an unconnected input reads idle
+  nrf_gpio_pin_set(WIRED_TX_PIN);
+  nrf_gpio_cfg_output(WIRED_TX_PIN);
+  nrf_gpio_cfg_input(WIRED_RX_PIN, NRF_GPIO_PIN_PULLUP);
+
+  NRF_UARTE_Type* u = NRF_UARTE1;
+  u->PSEL.TXD = WIRED_TX_PIN;
+  u->PSEL.RXD = WIRED_RX_PIN;
+  u->BAUDRATE = WIRED_BAUD_REG;
+  u->CONFIG = 0;                  // 8N1, no flow control
+  u->SHORTS = 0;
+  u->EVENTS_ENDRX = 0;
+  u->EVENTS_RXTO = 0;
+  u->EVENTS_ENDTX = 0;
+  u->INTENCLR = 0xFFFFFFFF;
+  u->INTENSET = UARTE_INTENSET_ENDRX_Msk | UARTE_INTENSET_RXTO_Msk | UARTE_INTENSET_ENDTX_Msk;
+  u->ENABLE = UARTE_ENABLE_ENABLE_Enabled;
+
+  // Idle detector: 1MHz one-shot, restarted by every byte
+  NRF_TIMER2->TASKS_STOP = 1;
+  NRF_TIMER2->TASKS_CLEAR = 1;
+  NRF_TIMER2->MODE = TIMER_MODE_MODE_Timer;
+  NRF_TIMER2->BITMODE = TIMER_BITMODE_BITMODE_16Bit;
+  NRF_TIMER2->PRESCALER = 4;
+  NRF_TIMER2->CC[0] = WIRED_IDLE_US;
+  NRF_TIMER2->SHORTS = TIMER_SHORTS_COMPARE0_CLEAR_Msk | TIMER_SHORTS_COMPARE0_STOP_Msk;
+  NRF_TIMER2->EVENTS_COMPARE[0] = 0;
+
+  sd_ppi_channel_assign(WIRED_PPI_CH_BASE, &u->EVENTS_RXDRDY, &NRF_TIMER2->TASKS_CLEAR);
+  sd_ppi_channel_assign(WIRED_PPI_CH_BASE + 1, &u->EVENTS_RXDRDY, &NRF_TIMER2->TASKS_START);
+  sd_ppi_channel_assign(WIRED_PPI_CH_BASE + 2, &NRF_TIMER2->EVENTS_COMPARE[0], &u->TASKS_STOPRX);
+  sd_ppi_channel_enable_set(7UL << WIRED_PPI_CH_BASE);
+
+  rx_cur = 0;
+  overlong = false;
+  u->RXD.PTR = (uint32_t) rx_buf[0];
+  u->RXD.MAXCNT = WIRED_FRAME_MAX;
+
+  running = true;
+  NVIC_ClearPendingIRQ(UARTE1_IRQn);
+  NVIC_SetPriority(UARTE1_IRQn, WIRED_IRQ_PRIO);
+  NVIC_EnableIRQ(UARTE1_IRQn);
+  u->TASKS_STARTRX = 1;
+}
+
+static void stop() {
+  // Let a frame that is going out finish
+  xSemaphoreTake(tx_token, pdMS_TO_TICKS(WIRED_TX_TIMEOUT_MS));
+
+  running = false;
+  rx_stopped = false;
+  sd_ppi_channel_enable_clr(7UL << WIRED_PPI_CH_BASE);
+  NRF_TIMER2->TASKS_STOP = 1;
+  NRF_UARTE1->TASKS_STOPRX = 1;
+  uint32_t t0 = millis();
+  while (!rx_stopped && millis() - t0 < 2) yield();
+
+  NVIC_DisableIRQ(UARTE1_IRQn);
+  NRF_UARTE1->ENABLE = UARTE_ENABLE_ENABLE_Disabled;
+  NRF_UARTE1->PSEL.TXD = 0xFFFFFFFF;
+  NRF_UARTE1->PSEL.RXD = 0xFFFFFFFF;
+  nrf_gpio_cfg_default(WIRED_TX_PIN);
+  nrf_gpio_cfg_default(WIRED_RX_PIN);
+  xSemaphoreGive(tx_token);
+}
+
+void wiredPortBegin() {
+  if (config.wired_port) start();
+}
+
+void wiredPortPoll() {
+  if (config.wired_port && !running) start();
+  else if (!config.wired_port && running) stop();
+}
+
+void wiredPortEnable(bool on) {
+  config.wired_port = on;
+  configSave();
+  wiredPortPoll();
+}
+
+bool wiredPortTake(char* cmd, uint8_t size, CmdResult* result) {
+  if (!last_ready) return false;
+  strlcpy(cmd, last_cmd, size);
+  *result = last_result;
+  last_ready = false;
+  return true;
+}
+
+void wiredPortReleased(ActChannel ch) {
+  reply('D', ch == ACT_LOCK ? 'L' : 'U', commandSeq(ch));
+}
+
+struct LoopbackPhase {
+  uint16_t ok;
+  uint16_t lost;
+  uint32_t min_cycles;
+  uint32_t max_cycles;
+  uint64_t total_cycles;
+  uint32_t span_cycles;
+};
+
+// Stop-and-wait: each frame goes out once the previous one came back
+static void loopbackRun(uint8_t len, LoopbackPhase& p) {
+  memset(&p, 0, sizeof(p));
+  p.min_cycles = UINT32_MAX;
+  uint32_t wait = (len * 10 * 1000000UL / WIRED_BAUD + WIRED_IDLE_US + WIRED_TEST_WAIT_US) * 64;
+
+  uint32_t phase_start = perfCycles();
+  for (uint16_t i = 0; i < WIRED_TEST_FRAMES; i++) {
+    test_frame[0] = '!';
+    test_frame[1] = 'T';
+    for (uint8_t j = 2; j < len - 1; j++) test_frame[j] = i + j;
+    test_frame[len - 1] = packetSum(test_frame, len - 1);
+    test_seen = false;
+    test_len = len;
+
+    uint32_t t0 = perfCycles();
+    if (!wiredSend(test_frame, len)) {
+      p.lost++;
+      continue;
+    }
+    while (!test_seen && perfCycles() - t0 < wait) yield();
+    if (!test_seen) {
+      p.lost++;
+      continue;
+    }
+
+    uint32_t cycles = test_cycles - t0;
+    p.ok++;
+    p.total_cycles += cycles;
+    if (cycles < p.min_cycles) p.min_cycles = cycles;
+    if (cycles > p.max_cycles) p.max_cycles = cycles;
+  }
+  p.span_cycles = perfCycles() - phase_start;
+  test_len = 0;
+}
+
+void wiredPortLoopback(Print& out) {
+  if (!running) {
+    out.println("wired port off (wired on)");
+    return;
+  }
+  test_corrupt = 0;
+
+  // Latency: command-sized frames, sent to handled by the task
+  LoopbackPhase p;
+  loopbackRun(WIRED_CMD_LEN, p);
+  out.print("wired loop ");
+  out.print(WIRED_CMD_LEN);
+  out.print("B ok=");
+  out.print(p.ok);
+  out.print("/");
+  out.println(WIRED_TEST_FRAMES);
+  if (p.ok) {
+    out.print(" rtt min/avg/max=");
+    out.print(p.min_cycles / 64);
+    out.print("/");
+    out.print((uint32_t) (p.total_cycles / p.ok / 64));
+    out.print("/");
+    out.print(p.max_cycles / 64);
+    out.print("us line=");
+    out.print(WIRED_CMD_LEN * 10 * 1000000UL / WIRED_BAUD);
+    out.print("+");
+    out.print(WIRED_IDLE_US);
+    out.println("us");
+  }
+
+  // Throughput: full frames, idle gap and turnaround included
+  loopbackRun(WIRED_FRAME_MAX - 1, p);
+  out.print("wired loop ");
+  out.print(WIRED_FRAME_MAX - 1);
+  out.print("B ok=");
+  out.print(p.ok);
+  out.print("/");
+  out.println(WIRED_TEST_FRAMES);
+  out.print(" ");
+  out.print((uint32_t) ((uint64_t) p.ok * (WIRED_FRAME_MAX - 1) * 64000000ULL / p.span_cycles));
+  out.print("B/s line=");
+  out.print(WIRED_BAUD / 10);
+  out.print("B/s corrupt=");
+  out.println(test_corrupt);
+}
+
+void wiredPortPrintStats(Print& out) {
+  if (!running) {
+    out.println("wired off");
+    return;
+  }
+  out.print("wired rx=");
+  out.print(stats.frames);
+  out.print(" bad=");
+  out.print(stats.bad);
+  out.print(" long=");
+  out.print(stats.oversize);
+  out.print(" drop=");
+  out.print(stats.dropped);
+  out.print(" txto=");
+  out.print(stats.tx_timeouts);
+  out.print(" refused=");
+  out.println(stats.refused);
+
+  out.print(" irq n=");
+  out.print(stats.irqs);
+  if (stats.irqs) {
+    out.print(" avg=");
+    out.print((uint32_t) (stats.irq_total_cycles / stats.irqs));
+    out.print(" max=");
+    out.print(stats.irq_max_cycles);
+    out.print("cyc");
+  }
+  if (stats.handled) {
+    out.print(" reply avg=");
+    out.print((uint32_t) (stats.handle_total_cycles / stats.handled / 64));
+    out.print(" max=");
+    out.print(stats.handle_max_cycles / 64);
+    out.print("us");
+  }
+  out.println();
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <Arduino.h>
+#include "commands.h"
+
+// Wired command port for hardwired installs (alarm panel, telematics box):
+// UARTE1 on WIRED_RX_PIN/WIRED_TX_PIN, no USB or radio involved. It carries
+// the Bluefruit control packets the app sends over BLE, and here their
+// checksum is checked, since a wire has no link-layer CRC. Replies have the
+// same shape:
+//
+//   host -> fob  '!' 'B' <button> <state> <sum>            "!B11" = lock, "!B21" = unlock
+//   fob -> host  '!' 'A' <result> <seq hi> <seq lo> <sum>  'L'/'U' armed, 'B' busy (still
+//                                                          pressed, or the last press not
+//                                                          logged yet: send again),
+//                                                          'N' nothing to do, 'E' bad packet
+//                '!' 'D' <'L'|'U'> <seq hi> <seq lo> <sum> pulse released
+//
+// <sum> = ~(sum of the bytes before it), as the app computes it. <seq> is
+// the press number of the BLE acknowledgements.
+//
+// A frame is a burst of bytes followed by line idle. RX runs on EasyDMA into
+// one of two buffers; every received byte restarts TIMER2 through PPI, and
+// when it runs to WIRED_IDLE_US, PPI stops the receiver. Interrupts come
+// only at the end of a frame (ENDRX, RXTO); the handler hands the bytes to a
+// task that dispatches them through dispatchCommand(). Between frames the
+// CPU does nothing.
+//
+// The receiver keeps the high-frequency clock running, so the port is off
+// by default ("wired on"): meant for installs powered by the car.
+#define WIRED_BAUD          115200
+#define WIRED_BAUD_REG      UARTE_BAUDRATE_BAUDRATE_Baud115200    // must match WIRED_BAUD
+#define WIRED_IDLE_US       200     // end of frame: ~2 character times at WIRED_BAUD
+#define WIRED_FRAME_MAX     64      // RX buffer; a burst that fills it is dropped
+#define WIRED_QUEUE_DEPTH   4       // frames between the interrupt and the task
+#define WIRED_PPI_CH_BASE   12      // PPI channels 12-14 (actuation has 10-11)
+#define WIRED_IRQ_PRIO      3       // application priority, may use FreeRTOS FromISR calls
+#define WIRED_TASK_STACK    512     // words
+#define WIRED_TX_TIMEOUT_MS 20      // for the previous frame to go out
+#define WIRED_TEST_FRAMES   32      // per loopback phase
+
+void wiredPortBegin();                  // after actuationBegin() and configLoad()
+void wiredPortPoll();                   // from loop(): starts/stops with config.wired_port
+void wiredPortEnable(bool on);          // persisted
+
+// Last command pressed over the wire, for loop() to log; false if none
+bool wiredPortTake(char* cmd, uint8_t size, CmdResult* result);
+void wiredPortReleased(ActChannel ch);  // from loop(), after actuationPoll()
+
+// TX jumpered to RX: round-trip latency of short frames and throughput of
+// full ones, through the same RX path as commands
+void wiredPortLoopback(Print& out);
+void wiredPortPrintStats(Print& out);
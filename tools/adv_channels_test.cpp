@@ -0,0 +1,95 @@
+/*
+ * Host test for the advertising channel mask decision (src/adv_channels.h)
+ *
+ * Runs advChannelDecide() through the cases it has to get right: no
+ * survey, a quiet band, one channel covered by Wi-Fi, a busy band with no
+ * clear loser, a dropped channel coming back quiet or on the re-probe
+ * timer, and a sweep over every busy share combination in 5 % steps that
+ * checks the mask is never empty and always holds the least busy channel.
+ * Prints each failure and exits non-zero if there was one.
+ *
+ * Build:  g++ -O2 -std=c++17 -o adv_channels_test tools/adv_channels_test.cpp
+ * Usage:  adv_channels_test
+ */
+
+#include "../src/adv_channels.h"
+
+#include <cstdio>
+
+static int failures = 0;
+
+static void expectMask(const char* what, uint8_t got, uint8_t want) {
+  if (got == want) return;
+  printf("FAIL %s: mask 0x%X, expected 0x%X\n", what, got, want);
+  failures++;
+}
+
+// One survey on a fresh state
+static uint8_t decideOnce(uint8_t b37, uint8_t b38, uint8_t b39, uint32_t now_s = 1000) {
+  AdvChannelState st;
+  advChannelInit(&st);
+  const uint8_t busy[ADV_CHANNELS] = { b37, b38, b39 };
+  return advChannelDecide(&st, busy, true, now_s);
+}
+
+static void testSingleSurvey() {
+  AdvChannelState st;
+  advChannelInit(&st);
+  const uint8_t busy[ADV_CHANNELS] = { 90, 90, 0 };
+  expectMask("no survey: all channels", advChannelDecide(&st, busy, false, 1000), ADV_CH_ALL);
+
+  expectMask("quiet band", decideOnce(0, 5, 10), ADV_CH_ALL);
+  expectMask("38 covered", decideOnce(5, 60, 5), 0x05);
+  expectMask("37 and 39 covered", decideOnce(70, 10, 50), 0x02);
+  expectMask("busy, not by the margin", decideOnce(40, 30, 30), ADV_CH_ALL);
+  expectMask("all equally busy", decideOnce(80, 80, 80), ADV_CH_ALL);
+  expectMask("at the thresholds", decideOnce(ADV_CH_BAD_PCT, 0, ADV_CH_BAD_PCT - 1), 0x06);
+  expectMask("just under the margin", decideOnce(ADV_CH_BAD_PCT + ADV_CH_MARGIN_PCT - 1, ADV_CH_BAD_PCT, 90), 0x03);
+  expectMask("tie for best keeps both", decideOnce(90, 10, 10), 0x06);
+}
+
+static void testComeBack() {
+  AdvChannelState st;
+  advChannelInit(&st);
+  const uint8_t covered[ADV_CHANNELS] = { 5, 60, 5 };
+  const uint8_t still[ADV_CHANNELS] = { 5, 25, 5 };     // below "bad", above "good"
+  const uint8_t quiet[ADV_CHANNELS] = { 5, ADV_CH_GOOD_PCT, 5 };
+
+  expectMask("dropped at t=100", advChannelDecide(&st, covered, true, 100), 0x05);
+  expectMask("not back while above good", advChannelDecide(&st, still, true, 700), 0x05);
+  expectMask("back once quiet", advChannelDecide(&st, quiet, true, 1300), ADV_CH_ALL);
+
+  expectMask("dropped again at t=2000", advChannelDecide(&st, covered, true, 2000), 0x05);
+  expectMask("still out before the re-probe", advChannelDecide(&st, covered, true, 2000 + ADV_CH_REPROBE_S - 1), 0x05);
+  expectMask("re-probed after an hour", advChannelDecide(&st, covered, true, 2000 + ADV_CH_REPROBE_S), ADV_CH_ALL);
+  expectMask("dropped after the trial", advChannelDecide(&st, covered, true, 2600 + ADV_CH_REPROBE_S), 0x05);
+
+  expectMask("stale survey restores all", advChannelDecide(&st, covered, false, 9000), ADV_CH_ALL);
+}
+
+static void testInvariants() {
+  for (uint8_t a = 0; a <= 100; a += 5) {
+    for (uint8_t b = 0; b <= 100; b += 5) {
+      for (uint8_t c = 0; c <= 100; c += 5) {
+        const uint8_t busy[ADV_CHANNELS] = { a, b, c };
+        uint8_t best = 0;
+        for (uint8_t i = 1; i < ADV_CHANNELS; i++) {
+          if (busy[i] < busy[best]) best = i;
+        }
+        uint8_t mask = decideOnce(a, b, c);
+        if (mask == 0 || (mask & ~ADV_CH_ALL) || !(mask & (1 << best))) {
+          printf("FAIL busy %u/%u/%u: mask 0x%X\n", a, b, c, mask);
+          failures++;
+        }
+      }
+    }
+  }
+}
+
+int main() {
+  testSingleSurvey();
+  testComeBack();
+  testInvariants();
+  printf(failures ? "%d failure(s)\n" : "all passed\n", failures);
+  return failures ? 1 : 0;
+}
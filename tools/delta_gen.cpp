@@ -0,0 +1,298 @@
+/*
+ * Delta generator for firmware updates
+ *
+ * Diffs the image running on the unit against a new build and writes the
+ * delta that src/delta_update.cpp applies (format in journal_records.h):
+ * COPY ops for runs found anywhere in the old image, INSERT ops for the
+ * rest. Every 8-byte window of the old image is indexed; at each position
+ * of the new image the candidates for its next 8 bytes are extended
+ * forwards and the longest wins, the place right after the previous COPY
+ * first, since unchanged code usually follows unchanged code. Runs shorter
+ * than --min-match stay literal: a COPY costs 3-7 bytes.
+ *
+ * The delta is applied back to the old image in memory and compared with
+ * the new one before it is written. The report compares delta and full
+ * image sizes and their transfer times at --rate bytes/s (measure it with
+ * the device's "update" report after a first transfer).
+ *
+ * Images are flat binaries from the application start (0x26000), as
+ * objcopy makes them from the ELF of each build:
+ *   arm-none-eabi-objcopy -O binary .pio/build/nicenano/firmware.elf firmware.bin
+ * The old one must be exactly what the unit runs; the device checks its
+ * hash before writing anything.
+ *
+ * Build:  g++ -O2 -std=c++17 -o delta_gen tools/delta_gen.cpp
+ * Usage:  delta_gen [--rate B/s] [--min-match N] OLD.bin NEW.bin OUT.delta
+ */
+
+#include "../src/journal_records.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#define INDEX_BYTES     8             // window indexed in the old image
+#define MAX_CANDIDATES  256           // per position; repetitive data has many
+#define DEFAULT_RATE    8000          // B/s, a write-without-response stream at 7.5 ms intervals
+#define DEFAULT_MIN     12
+
+typedef std::vector<uint8_t> Bytes;
+
+// ---------------------------------------------------------------------------
+// SHA-256 (FIPS 180-4), matches the CC310 on the device
+
+static const uint32_t K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t ror(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+static void sha256Block(uint32_t h[8], const uint8_t* p) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) w[i] = (p[4 * i] << 24) | (p[4 * i + 1] << 16) | (p[4 * i + 2] << 8) | p[4 * i + 3];
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = k + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+    uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    k = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+  }
+  h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void sha256(const Bytes& data, uint8_t out[32]) {
+  uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+  size_t full = data.size() / 64 * 64;
+  for (size_t i = 0; i < full; i += 64) sha256Block(h, &data[i]);
+
+  uint8_t tail[128] = {};
+  size_t rest = data.size() - full;
+  memcpy(tail, data.data() + full, rest);
+  tail[rest] = 0x80;
+  size_t blocks = rest + 9 > 64 ? 2 : 1;
+  uint64_t bits = (uint64_t) data.size() * 8;
+  for (int i = 0; i < 8; i++) tail[blocks * 64 - 1 - i] = (uint8_t) (bits >> (8 * i));
+  for (size_t b = 0; b < blocks; b++) sha256Block(h, tail + 64 * b);
+
+  for (int i = 0; i < 8; i++) {
+    out[4 * i] = h[i] >> 24; out[4 * i + 1] = h[i] >> 16; out[4 * i + 2] = h[i] >> 8; out[4 * i + 3] = h[i];
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Encoding
+
+struct DeltaWriter {
+  Bytes out;
+  size_t copies = 0, copy_bytes = 0;
+  size_t inserts = 0, insert_bytes = 0;
+
+  void varint(uint32_t v) {
+    while (v >= 0x80) {
+      out.push_back((uint8_t) (v | 0x80));
+      v >>= 7;
+    }
+    out.push_back((uint8_t) v);
+  }
+  void copy(uint32_t src, uint32_t len) {
+    out.push_back(DELTA_COPY);
+    varint(src);
+    varint(len);
+    copies++;
+    copy_bytes += len;
+  }
+  void insert(const uint8_t* p, uint32_t len) {
+    if (len == 0) return;
+    out.push_back(DELTA_INSERT);
+    varint(len);
+    out.insert(out.end(), p, p + len);
+    inserts++;
+    insert_bytes += len;
+  }
+};
+
+static uint64_t key(const uint8_t* p) {
+  uint64_t k;
+  memcpy(&k, p, sizeof(k));
+  return k;
+}
+
+// ---------------------------------------------------------------------------
+// Diff
+
+static void diff(const Bytes& old_img, const Bytes& new_img, size_t min_match, DeltaWriter& w) {
+  // (window, offset), sorted: equal_range gives the candidates
+  std::vector<std::pair<uint64_t, uint32_t>> index;
+  if (old_img.size() >= INDEX_BYTES) {
+    index.reserve(old_img.size() - INDEX_BYTES + 1);
+    for (size_t i = 0; i + INDEX_BYTES <= old_img.size(); i++) index.emplace_back(key(&old_img[i]), (uint32_t) i);
+  }
+  std::sort(index.begin(), index.end());
+
+  auto extend = [&](size_t src, size_t dst) {
+    size_t n = 0;
+    while (src + n < old_img.size() && dst + n < new_img.size() && old_img[src + n] == new_img[dst + n]) n++;
+    return n;
+  };
+
+  size_t pos = 0;
+  size_t literal = 0;           // start of the pending INSERT
+  size_t next_src = 0;          // old offset right after the previous COPY
+  while (pos < new_img.size()) {
+    size_t best_len = extend(next_src, pos);
+    size_t best_src = next_src;
+
+    if (best_len < min_match && pos + INDEX_BYTES <= new_img.size()) {
+      uint64_t k = key(&new_img[pos]);
+      auto range = std::equal_range(index.begin(), index.end(), std::make_pair(k, (uint32_t) 0),
+        [](const std::pair<uint64_t, uint32_t>& a, const std::pair<uint64_t, uint32_t>& b) { return a.first < b.first; });
+      size_t tried = 0;
+      for (auto it = range.first; it != range.second && tried < MAX_CANDIDATES; ++it, tried++) {
+        size_t n = extend(it->second, pos);
+        if (n > best_len) {
+          best_len = n;
+          best_src = it->second;
+        }
+      }
+    }
+
+    if (best_len >= min_match) {
+      w.insert(&new_img[literal], (uint32_t) (pos - literal));
+      w.copy((uint32_t) best_src, (uint32_t) best_len);
+      pos += best_len;
+      literal = pos;
+      next_src = best_src + best_len;
+    }
+    else {
+      pos++;
+    }
+  }
+  w.insert(&new_img[literal], (uint32_t) (pos - literal));
+  w.out.push_back(DELTA_END);
+}
+
+// Same checks as the device, minus flash
+static bool apply(const Bytes& old_img, const Bytes& delta, Bytes& out) {
+  size_t p = sizeof(DeltaHeader);
+  auto varint = [&](uint32_t& v) {
+    v = 0;
+    for (int shift = 0; shift <= 28; shift += 7) {
+      if (p >= delta.size()) return false;
+      uint8_t b = delta[p++];
+      v |= (uint32_t) (b & 0x7F) << shift;
+      if (!(b & 0x80)) return true;
+    }
+    return false;
+  };
+  while (p < delta.size()) {
+    uint8_t op = delta[p++];
+    uint32_t src = 0, len = 0;
+    if (op == DELTA_END) return true;
+    if (op == DELTA_COPY) {
+      if (!varint(src) || !varint(len) || src + (uint64_t) len > old_img.size()) return false;
+      out.insert(out.end(), old_img.begin() + src, old_img.begin() + src + len);
+    }
+    else if (op == DELTA_INSERT) {
+      if (!varint(len) || p + len > delta.size()) return false;
+      out.insert(out.end(), delta.begin() + p, delta.begin() + p + len);
+      p += len;
+    }
+    else {
+      return false;
+    }
+  }
+  return false;
+}
+
+// ---------------------------------------------------------------------------
+
+static bool readFile(const char* path, Bytes& data) {
+  FILE* f = fopen(path, "rb");
+  if (!f) return false;
+  uint8_t buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) data.insert(data.end(), buf, buf + n);
+  bool ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: delta_gen [--rate B/s] [--min-match N] OLD.bin NEW.bin OUT.delta\n");
+}
+
+int main(int argc, char** argv) {
+  double rate = DEFAULT_RATE;
+  size_t min_match = DEFAULT_MIN;
+  std::vector<const char*> paths;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--rate") && i + 1 < argc)           rate = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--min-match") && i + 1 < argc) min_match = atoi(argv[++i]);
+    else if (argv[i][0] == '-')                               { usage(); return 2; }
+    else paths.push_back(argv[i]);
+  }
+  if (paths.size() != 3 || rate <= 0 || min_match < 4) {
+    usage();
+    return 2;
+  }
+
+  Bytes old_img, new_img;
+  if (!readFile(paths[0], old_img) || !readFile(paths[1], new_img)) {
+    fprintf(stderr, "can't read %s\n", old_img.empty() ? paths[0] : paths[1]);
+    return 1;
+  }
+  if (new_img.empty() || new_img.size() > DELTA_IMAGE_MAX) {
+    fprintf(stderr, "new image is %zu bytes, the bank holds %u\n", new_img.size(), DELTA_IMAGE_MAX);
+    return 1;
+  }
+
+  DeltaHeader h = {};
+  h.magic = DELTA_MAGIC;
+  h.version = DELTA_VERSION;
+  h.header_size = sizeof(DeltaHeader);
+  h.old_size = (uint32_t) old_img.size();
+  h.new_size = (uint32_t) new_img.size();
+  sha256(old_img, h.old_sha256);
+  sha256(new_img, h.new_sha256);
+
+  DeltaWriter w;
+  w.out.resize(sizeof(h));
+  memcpy(w.out.data(), &h, sizeof(h));
+  diff(old_img, new_img, min_match, w);
+
+  Bytes check;
+  if (!apply(old_img, w.out, check) || check != new_img) {
+    fprintf(stderr, "internal error: delta doesn't rebuild the new image\n");
+    return 1;
+  }
+
+  FILE* f = fopen(paths[2], "wb");
+  if (!f || fwrite(w.out.data(), 1, w.out.size(), f) != w.out.size() || fclose(f) != 0) {
+    fprintf(stderr, "can't write %s\n", paths[2]);
+    return 1;
+  }
+
+  printf("old image     %8zu B\n", old_img.size());
+  printf("new image     %8zu B\n", new_img.size());
+  printf("delta         %8zu B  (%.1f%% of the new image)\n", w.out.size(), 100.0 * w.out.size() / new_img.size());
+  printf("  copy        %8zu B in %zu ops\n", w.copy_bytes, w.copies);
+  printf("  insert      %8zu B in %zu ops\n", w.insert_bytes, w.inserts);
+  printf("transfer at %.0f B/s: delta %.1f s, full image %.1f s\n",
+         rate, w.out.size() / rate, new_img.size() / rate);
+  return 0;
+}
@@ -0,0 +1,437 @@
+/*
+ * Journal / trace / crash dump analyzer
+ *
+ * Reads JOURNAL.BIN, TRACE.BIN and CRASH.BIN files pulled off units (USB
+ * export), using the firmware's own record definitions, and prints one
+ * summary per unit (FICR device ID from the file header): presses,
+ * connects, disconnect reasons, evictions, crashes, command latency
+ * percentiles and a battery curve.
+ *
+ * Files are memory-mapped and decoded in one pass each; several files are
+ * spread over worker threads and the per-unit results merged at the end.
+ *
+ * Build:  g++ -O2 -std=c++17 -pthread -o journal_analyzer tools/journal_analyzer.cpp
+ * Usage:  journal_analyzer [--csv | --json] [--battery] [-j threads] FILE...
+ */
+
+#include "../src/journal_records.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define CPU_HZ          64000000u
+#define LATENCY_MAX_US  20000         // histogram range, 1 us buckets; above goes to the last one
+
+// ---------------------------------------------------------------------------
+// Read-only file mapping
+
+class MappedFile {
+public:
+  explicit MappedFile(const char* path) {
+#ifdef _WIN32
+    file_ = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                        FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file_ == INVALID_HANDLE_VALUE) return;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0) return;
+    map_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!map_) return;
+    data_ = (const uint8_t*) MapViewOfFile(map_, FILE_MAP_READ, 0, 0, 0);
+    if (data_) size_ = (size_t) size.QuadPart;
+#else
+    fd_ = open(path, O_RDONLY);
+    if (fd_ < 0) return;
+    struct stat st;
+    if (fstat(fd_, &st) != 0 || st.st_size == 0) return;
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (p == MAP_FAILED) return;
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    data_ = (const uint8_t*) p;
+    size_ = st.st_size;
+#endif
+  }
+
+  ~MappedFile() {
+#ifdef _WIN32
+    if (data_) UnmapViewOfFile(data_);
+    if (map_) CloseHandle(map_);
+    if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+#else
+    if (data_) munmap((void*) data_, size_);
+    if (fd_ >= 0) close(fd_);
+#endif
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+#ifdef _WIN32
+  HANDLE file_ = INVALID_HANDLE_VALUE;
+  HANDLE map_ = NULL;
+#else
+  int fd_ = -1;
+#endif
+};
+
+// ---------------------------------------------------------------------------
+// Aggregates, mergeable across files of the same unit
+
+struct BatteryBucket {
+  uint64_t mv_total = 0;
+  uint32_t soc_total = 0;
+  uint32_t samples = 0;
+};
+
+struct UnitStats {
+  uint64_t device_id = 0;
+  uint32_t files = 0;
+  uint64_t records = 0;
+  uint64_t bad_records = 0;
+  uint32_t boots = 0;
+  uint16_t first_boot = 0xFFFF;
+  uint16_t last_boot = 0;
+  uint64_t presses[2] = { 0, 0 };
+  uint64_t connects = 0;
+  uint64_t disconnects = 0;
+  uint64_t secured = 0;
+  uint64_t evictions = 0;
+  uint64_t gov_changes = 0;
+  uint64_t crashes = 0;
+  uint64_t faults = 0;
+  uint64_t reasons[256] = {};
+  uint64_t trace_context[3] = { 0, 0, 0 };
+  std::vector<uint64_t> latency_us;              // histogram, LATENCY_MAX_US + 1 buckets
+  std::vector<BatteryBucket> battery;            // by hour of uptime
+
+  void merge(const UnitStats& o) {
+    files += o.files;
+    records += o.records;
+    bad_records += o.bad_records;
+    boots += o.boots;
+    first_boot = std::min(first_boot, o.first_boot);
+    last_boot = std::max(last_boot, o.last_boot);
+    for (int i = 0; i < 2; i++) presses[i] += o.presses[i];
+    connects += o.connects;
+    disconnects += o.disconnects;
+    secured += o.secured;
+    evictions += o.evictions;
+    gov_changes += o.gov_changes;
+    crashes += o.crashes;
+    faults += o.faults;
+    for (int i = 0; i < 256; i++) reasons[i] += o.reasons[i];
+    for (int i = 0; i < 3; i++) trace_context[i] += o.trace_context[i];
+    if (!o.latency_us.empty()) {
+      latency_us.resize(LATENCY_MAX_US + 1);
+      for (size_t i = 0; i < o.latency_us.size(); i++) latency_us[i] += o.latency_us[i];
+    }
+    if (o.battery.size() > battery.size()) battery.resize(o.battery.size());
+    for (size_t i = 0; i < o.battery.size(); i++) {
+      battery[i].mv_total += o.battery[i].mv_total;
+      battery[i].soc_total += o.battery[i].soc_total;
+      battery[i].samples += o.battery[i].samples;
+    }
+  }
+
+  uint64_t latencyCount() const {
+    uint64_t n = 0;
+    for (uint64_t c : latency_us) n += c;
+    return n;
+  }
+
+  // Upper edge of the bucket holding the p-th percentile, in us
+  uint32_t latencyPercentile(double p) const {
+    uint64_t n = latencyCount();
+    if (n == 0) return 0;
+    uint64_t rank = (uint64_t) (p / 100.0 * (n - 1)) + 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < latency_us.size(); i++) {
+      seen += latency_us[i];
+      if (seen >= rank) return (uint32_t) i;
+    }
+    return LATENCY_MAX_US;
+  }
+
+  uint32_t latencyMax() const {
+    for (size_t i = latency_us.size(); i > 0; i--) {
+      if (latency_us[i - 1]) return (uint32_t) (i - 1);
+    }
+    return 0;
+  }
+};
+
+// ---------------------------------------------------------------------------
+// Decoding
+
+struct FileResult {
+  std::string path;
+  std::string error;
+  UnitStats stats;
+};
+
+// Records may grow in later firmware; copy the part this tool knows
+template <typename T>
+static T recordAt(const uint8_t* p, uint16_t record_size) {
+  T r;
+  memset(&r, 0, sizeof(r));
+  memcpy(&r, p, std::min<size_t>(sizeof(r), record_size));
+  return r;
+}
+
+static void decodeJournal(const uint8_t* p, size_t n, uint16_t rs, UnitStats& s) {
+  uint16_t prev_boot = 0;
+  for (size_t i = 0; i < n; i++, p += rs) {
+    JournalRecord r = recordAt<JournalRecord>(p, rs);
+    s.records++;
+    if (r.boot != prev_boot) {
+      prev_boot = r.boot;
+      s.first_boot = std::min(s.first_boot, r.boot);
+      s.last_boot = std::max(s.last_boot, r.boot);
+    }
+
+    switch (r.type) {
+      case JR_BOOT:       s.boots++; break;
+      case JR_PRESS:      if (r.a < 2) s.presses[r.a]++; else s.bad_records++; break;
+      case JR_CONNECT:    s.connects++; break;
+      case JR_DISCONNECT: s.disconnects++; s.reasons[r.a & 0xFF]++; break;
+      case JR_SECURED:    s.secured++; break;
+      case JR_EVICT:      s.evictions++; break;
+      case JR_GOV_LEVEL:  s.gov_changes++; break;
+      case JR_USB:
+      case JR_CONN_PARAMS:
+      case JR_DONGLE:     break;      // for tools/power_profile_analyzer.cpp
+      case JR_INPUT:
+      case JR_UPDATE:
+      case JR_STATE:
+      case JR_POWER_LOW:  break;
+      case JR_BATTERY: {
+        if (r.a == 0) break;          // no valid reading yet (on USB)
+        size_t hour = r.uptime_ms / 3600000u;
+        if (hour >= s.battery.size()) s.battery.resize(hour + 1);
+        s.battery[hour].mv_total += r.a;
+        s.battery[hour].soc_total += r.b;
+        s.battery[hour].samples++;
+        break;
+      }
+      default:            s.bad_records++; break;
+    }
+  }
+}
+
+static void decodeTrace(const uint8_t* p, size_t n, uint16_t rs, UnitStats& s) {
+  s.latency_us.resize(LATENCY_MAX_US + 1);
+  for (size_t i = 0; i < n; i++, p += rs) {
+    TraceRecord r = recordAt<TraceRecord>(p, rs);
+    s.records++;
+    uint32_t us = r.cycles / (CPU_HZ / 1000000u);
+    s.latency_us[std::min<uint32_t>(us, LATENCY_MAX_US)]++;
+    if (r.context < 3) s.trace_context[r.context]++;
+    else s.bad_records++;
+  }
+}
+
+static void decodeCrash(const uint8_t* p, size_t n, uint16_t rs, UnitStats& s) {
+  for (size_t i = 0; i < n; i++, p += rs) {
+    CrashRecord r = recordAt<CrashRecord>(p, rs);
+    s.records++;
+    s.crashes++;
+    if (r.fault) s.faults++;
+  }
+}
+
+static void analyzeFile(FileResult& out) {
+  MappedFile f(out.path.c_str());
+  if (!f.data()) {
+    out.error = "can't map file";
+    return;
+  }
+  if (f.size() < sizeof(ExportHeader)) {
+    out.error = "too short";
+    return;
+  }
+
+  ExportHeader h;
+  memcpy(&h, f.data(), sizeof(h));
+  if (h.magic != EXPORT_MAGIC || h.record_size == 0) {
+    out.error = "not an export file";
+    return;
+  }
+
+  UnitStats& s = out.stats;
+  s.device_id = ((uint64_t) h.device_id[1] << 32) | h.device_id[0];
+  s.files = 1;
+
+  const uint8_t* p = f.data() + sizeof(h);
+  size_t n = (f.size() - sizeof(h)) / h.record_size;
+  switch (h.kind) {
+    case EXPORT_JOURNAL: decodeJournal(p, n, h.record_size, s); break;
+    case EXPORT_TRACE:   decodeTrace(p, n, h.record_size, s); break;
+    case EXPORT_CRASH:   decodeCrash(p, n, h.record_size, s); break;
+    default:             out.error = "unknown kind"; break;
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Output
+
+static std::string reasonList(const UnitStats& s, const char* sep, const char* kv, bool quote) {
+  std::string out;
+  char buf[32];
+  for (int i = 0; i < 256; i++) {
+    if (!s.reasons[i]) continue;
+    snprintf(buf, sizeof(buf), "%s%s0x%02X%s%s%llu", out.empty() ? "" : sep,
+             quote ? "\"" : "", i, quote ? "\"" : "", kv, (unsigned long long) s.reasons[i]);
+    out += buf;
+  }
+  return out;
+}
+
+static void printCsv(const std::vector<UnitStats>& units, bool battery) {
+  if (battery) {
+    printf("device_id,uptime_h,avg_mv,avg_soc,samples\n");
+    for (const UnitStats& s : units) {
+      for (size_t h = 0; h < s.battery.size(); h++) {
+        const BatteryBucket& b = s.battery[h];
+        if (!b.samples) continue;
+        printf("%016llX,%zu,%llu,%u,%u\n", (unsigned long long) s.device_id, h,
+               (unsigned long long) (b.mv_total / b.samples), b.soc_total / b.samples, b.samples);
+      }
+    }
+    return;
+  }
+
+  printf("device_id,files,records,bad_records,boots,first_boot,last_boot,"
+         "presses_lock,presses_unlock,connects,disconnects,secured,evictions,gov_changes,"
+         "crashes,faults,latency_n,latency_p50_us,latency_p90_us,latency_p99_us,latency_max_us,"
+         "disconnect_reasons\n");
+  for (const UnitStats& s : units) {
+    printf("%016llX,%u,%llu,%llu,%u,%u,%u,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,"
+           "%llu,%u,%u,%u,%u,%s\n",
+           (unsigned long long) s.device_id, s.files,
+           (unsigned long long) s.records, (unsigned long long) s.bad_records,
+           s.boots, s.first_boot == 0xFFFF ? 0 : s.first_boot, s.last_boot,
+           (unsigned long long) s.presses[0], (unsigned long long) s.presses[1],
+           (unsigned long long) s.connects, (unsigned long long) s.disconnects,
+           (unsigned long long) s.secured, (unsigned long long) s.evictions,
+           (unsigned long long) s.gov_changes,
+           (unsigned long long) s.crashes, (unsigned long long) s.faults,
+           (unsigned long long) s.latencyCount(), s.latencyPercentile(50),
+           s.latencyPercentile(90), s.latencyPercentile(99), s.latencyMax(),
+           reasonList(s, ";", ":", false).c_str());
+  }
+}
+
+static void printJson(const std::vector<UnitStats>& units, bool battery) {
+  printf("[\n");
+  for (size_t u = 0; u < units.size(); u++) {
+    const UnitStats& s = units[u];
+    printf("  {\"device_id\": \"%016llX\", \"files\": %u, \"records\": %llu, \"bad_records\": %llu,\n",
+           (unsigned long long) s.device_id, s.files,
+           (unsigned long long) s.records, (unsigned long long) s.bad_records);
+    printf("   \"boots\": %u, \"presses\": {\"lock\": %llu, \"unlock\": %llu},\n",
+           s.boots, (unsigned long long) s.presses[0], (unsigned long long) s.presses[1]);
+    printf("   \"connects\": %llu, \"disconnects\": %llu, \"secured\": %llu, \"evictions\": %llu,"
+           " \"gov_changes\": %llu, \"crashes\": %llu, \"faults\": %llu,\n",
+           (unsigned long long) s.connects, (unsigned long long) s.disconnects,
+           (unsigned long long) s.secured, (unsigned long long) s.evictions,
+           (unsigned long long) s.gov_changes,
+           (unsigned long long) s.crashes, (unsigned long long) s.faults);
+    printf("   \"latency_us\": {\"n\": %llu, \"p50\": %u, \"p90\": %u, \"p99\": %u, \"max\": %u},\n",
+           (unsigned long long) s.latencyCount(), s.latencyPercentile(50),
+           s.latencyPercentile(90), s.latencyPercentile(99), s.latencyMax());
+    printf("   \"disconnect_reasons\": {%s}", reasonList(s, ", ", ": ", true).c_str());
+    if (battery) {
+      printf(",\n   \"battery\": [");
+      bool first = true;
+      for (size_t h = 0; h < s.battery.size(); h++) {
+        const BatteryBucket& b = s.battery[h];
+        if (!b.samples) continue;
+        printf("%s{\"uptime_h\": %zu, \"mv\": %llu, \"soc\": %u}", first ? "" : ", ", h,
+               (unsigned long long) (b.mv_total / b.samples), b.soc_total / b.samples);
+        first = false;
+      }
+      printf("]");
+    }
+    printf("}%s\n", u + 1 < units.size() ? "," : "");
+  }
+  printf("]\n");
+}
+
+static void usage() {
+  fprintf(stderr, "usage: journal_analyzer [--csv | --json] [--battery] [-j threads] FILE...\n");
+}
+
+int main(int argc, char** argv) {
+  bool json = false;
+  bool battery = false;
+  unsigned threads = std::thread::hardware_concurrency();
+  std::vector<FileResult> results;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--json"))           json = true;
+    else if (!strcmp(argv[i], "--csv"))       json = false;
+    else if (!strcmp(argv[i], "--battery"))   battery = true;
+    else if (!strcmp(argv[i], "-j") && i + 1 < argc) threads = atoi(argv[++i]);
+    else if (argv[i][0] == '-')               { usage(); return 2; }
+    else {
+      results.emplace_back();
+      results.back().path = argv[i];
+    }
+  }
+  if (results.empty()) {
+    usage();
+    return 2;
+  }
+  if (threads == 0) threads = 1;
+  if (threads > results.size()) threads = results.size();
+
+  // Workers pull the next file until none are left
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; t++) {
+    workers.emplace_back([&]() {
+      for (size_t i; (i = next++) < results.size(); ) analyzeFile(results[i]);
+    });
+  }
+  for (std::thread& w : workers) w.join();
+
+  std::map<uint64_t, UnitStats> units;
+  int failed = 0;
+  for (const FileResult& r : results) {
+    if (!r.error.empty()) {
+      fprintf(stderr, "%s: %s\n", r.path.c_str(), r.error.c_str());
+      failed++;
+      continue;
+    }
+    UnitStats& u = units[r.stats.device_id];
+    u.device_id = r.stats.device_id;
+    u.merge(r.stats);
+  }
+
+  std::vector<UnitStats> sorted;
+  for (auto& kv : units) sorted.push_back(std::move(kv.second));
+  if (json) printJson(sorted, battery);
+  else printCsv(sorted, battery);
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,712 @@
+/*
+ * Current-capture analyzer: fits per-state energy costs
+ *
+ * Reads a power-profiler CSV capture (Nordic PPK2 export or any
+ * "time,current[,digital]" CSV with units in the header) together with the
+ * unit's JOURNAL.BIN, splits the capture into device states from the
+ * journal (USB power, governor level, connected or not, connection
+ * interval, dongle listen period) and into lock/unlock press windows, and
+ * reports the average current per state and the extra charge per press.
+ * Where the same state was captured with the dongle link listening and
+ * without, the difference is reported as the dongle's measured added
+ * current. --calib writes the result as CALIB.BIN for the firmware's
+ * energy governor.
+ *
+ * Time alignment: capture time + offset = journal uptime. Either give the
+ * offset, or wire the LOCK/UNLOCK output to a profiler digital input and
+ * use --sync Dn: its first rising edge is matched to the boot's first
+ * press. Press windows open PRESS_LEAD_MS before the journaled time.
+ *
+ * The capture is memory-mapped and parsed once, in chunks shared out to
+ * worker threads; each sample is only added to its state's or press's sum,
+ * so multi-hour 100 kS/s captures need no more memory than the journal.
+ *
+ * Build:  g++ -O2 -std=c++17 -pthread -o power_profile_analyzer tools/power_profile_analyzer.cpp
+ * Usage:  power_profile_analyzer --journal JOURNAL.BIN (--offset-ms MS | --sync Dn)
+ *           [--boot N] [--press-ms MS] [--json] [--calib CALIB.BIN] [-j threads] CAPTURE.csv
+ */
+
+#include "../src/journal_records.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define CHUNK_BYTES     (32u << 20)   // capture bytes per work item
+#define PRESS_MS        400           // PULSE_MS (300) + LED and ack traffic
+#define PRESS_LEAD_MS   20            // presses are journaled from loop(), after the pulse started
+#define LEVEL_NAMES     { "performance", "balanced", "saver", "minimum" }
+
+// energy_governor.cpp levels[]: which levels light the LED during a press
+static const bool level_led[CALIB_LEVELS] = { true, true, false, false };
+
+// ---------------------------------------------------------------------------
+// Read-only file mapping
+
+class MappedFile {
+public:
+  explicit MappedFile(const char* path) {
+#ifdef _WIN32
+    file_ = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                        FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file_ == INVALID_HANDLE_VALUE) return;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0) return;
+    map_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!map_) return;
+    data_ = (const uint8_t*) MapViewOfFile(map_, FILE_MAP_READ, 0, 0, 0);
+    if (data_) size_ = (size_t) size.QuadPart;
+#else
+    fd_ = open(path, O_RDONLY);
+    if (fd_ < 0) return;
+    struct stat st;
+    if (fstat(fd_, &st) != 0 || st.st_size == 0) return;
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (p == MAP_FAILED) return;
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    data_ = (const uint8_t*) p;
+    size_ = st.st_size;
+#endif
+  }
+
+  ~MappedFile() {
+#ifdef _WIN32
+    if (data_) UnmapViewOfFile(data_);
+    if (map_) CloseHandle(map_);
+    if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+#else
+    if (data_) munmap((void*) data_, size_);
+    if (fd_ >= 0) close(fd_);
+#endif
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+#ifdef _WIN32
+  HANDLE file_ = INVALID_HANDLE_VALUE;
+  HANDLE map_ = NULL;
+#else
+  int fd_ = -1;
+#endif
+};
+
+// ---------------------------------------------------------------------------
+// Device states from the journal
+
+struct StateKey {
+  uint8_t  usb;
+  uint8_t  connected;
+  uint8_t  level;           // GovLevel
+  uint16_t interval;        // 1.25 ms units, 0 when not connected
+  uint16_t dongle;          // listen period ms, 0 when not listening
+
+  bool operator<(const StateKey& o) const {
+    if (usb != o.usb) return usb < o.usb;
+    if (connected != o.connected) return connected < o.connected;
+    if (level != o.level) return level < o.level;
+    if (interval != o.interval) return interval < o.interval;
+    return dongle < o.dongle;
+  }
+};
+
+struct Segment {            // from start_ms until the next segment
+  double   start_ms;        // journal uptime
+  uint16_t state;
+};
+
+struct Press {
+  double   start_ms;        // journal uptime
+  uint16_t state;
+  bool     led;
+};
+
+struct Timeline {
+  std::vector<StateKey> states;
+  std::vector<Segment> segments;
+  std::vector<Press> presses;
+  double first_press_uptime_ms = -1;
+};
+
+static std::string stateName(const StateKey& k) {
+  static const char* const names[CALIB_LEVELS] = LEVEL_NAMES;
+  if (k.usb) return "usb";
+  std::string s = k.connected ? "conn/" : "adv/";
+  s += k.level < CALIB_LEVELS ? names[k.level] : "?";
+  if (k.connected && k.interval) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "/%.2fms", k.interval * 1.25);
+    s += buf;
+  }
+  if (k.dongle) s += "/dongle" + std::to_string(k.dongle) + "ms";
+  return s;
+}
+
+// Walks one boot's records (the last one by default)
+static bool buildTimeline(const char* path, int boot, Timeline& tl, std::string& error) {
+  MappedFile f(path);
+  if (!f.data()) { error = "can't read"; return false; }
+  if (f.size() < sizeof(ExportHeader)) { error = "too short"; return false; }
+
+  ExportHeader h;
+  memcpy(&h, f.data(), sizeof(h));
+  if (h.magic != EXPORT_MAGIC || h.kind != EXPORT_JOURNAL || h.record_size < sizeof(JournalRecord)) {
+    error = "not a JOURNAL.BIN export";
+    return false;
+  }
+
+  size_t n = (f.size() - sizeof(h)) / h.record_size;
+  std::vector<JournalRecord> records;
+  int last_boot = -1;
+  for (size_t i = 0; i < n; i++) {
+    JournalRecord r;
+    memcpy(&r, f.data() + sizeof(h) + i * h.record_size, sizeof(r));
+    records.push_back(r);
+    last_boot = r.boot;
+  }
+  if (boot < 0) boot = last_boot;
+
+  StateKey cur = { 0, 0, 0, 0, 0 };
+  uint8_t links = 0;
+  uint16_t last_interval = 0;       // JR_CONN_PARAMS may come before JR_CONNECT
+  std::map<StateKey, uint16_t> ids;
+  auto idOf = [&](const StateKey& k) {
+    auto it = ids.find(k);
+    if (it != ids.end()) return it->second;
+    uint16_t id = tl.states.size();
+    tl.states.push_back(k);
+    ids[k] = id;
+    return id;
+  };
+
+  bool found = false;
+  for (const JournalRecord& r : records) {
+    if (r.boot != boot) continue;
+    if (!found) {
+      tl.segments.push_back({ (double) r.uptime_ms, idOf(cur) });
+      found = true;
+    }
+
+    StateKey next = cur;
+    switch (r.type) {
+      case JR_USB:        next.usb = r.a != 0; break;
+      case JR_GOV_LEVEL:  next.level = r.a < CALIB_LEVELS ? r.a : CALIB_LEVELS - 1; break;
+      case JR_CONNECT:    links++; next.connected = 1; next.interval = last_interval; break;
+      case JR_DISCONNECT:
+        if (links) links--;
+        if (!links) { next.connected = 0; next.interval = 0; }
+        break;
+      case JR_CONN_PARAMS: last_interval = r.a; next.interval = r.a; break;
+      case JR_DONGLE:     next.dongle = r.a; break;
+      case JR_PRESS:
+        if (tl.first_press_uptime_ms < 0) tl.first_press_uptime_ms = r.uptime_ms - PRESS_LEAD_MS;
+        tl.presses.push_back({ (double) r.uptime_ms - PRESS_LEAD_MS, idOf(cur), level_led[cur.level] });
+        break;
+      default: break;
+    }
+    if (next.connected == 0) next.interval = 0;
+    if (next < cur || cur < next) {
+      cur = next;
+      uint16_t id = idOf(cur);
+      if (tl.segments.back().state != id) tl.segments.push_back({ (double) r.uptime_ms, id });
+    }
+  }
+  if (!found) { error = "no records for that boot"; return false; }
+  return true;
+}
+
+// ---------------------------------------------------------------------------
+// Capture parsing
+
+struct CsvLayout {
+  int    time_col = -1;
+  int    current_col = -1;
+  int    digital_col = -1;      // "D0-D7" bit string, char i = Di
+  int    digital_first = -1;    // or separate D0..D7 columns
+  double time_to_ms = 1;
+  double current_to_ua = 1;
+};
+
+static double unitScale(const std::string& name, const char* const units[], const double scales[], int n) {
+  size_t open = name.find('(');
+  if (open == std::string::npos) return 0;
+  std::string unit = name.substr(open + 1, name.find(')') - open - 1);
+  for (int i = 0; i < n; i++) {
+    if (unit == units[i]) return scales[i];
+  }
+  return 0;
+}
+
+static bool parseHeader(const char* p, const char* end, CsvLayout& l, std::string& error) {
+  static const char* const time_units[] = { "ms", "s", "us" };
+  static const double time_scales[] = { 1, 1000, 0.001 };
+  static const char* const cur_units[] = { "uA", "mA", "nA", "A" };
+  static const double cur_scales[] = { 1, 1000, 0.001, 1000000 };
+
+  int col = 0;
+  std::string name;
+  for (;; p++) {
+    if (p == end || *p == ',' || *p == '\n' || *p == '\r') {
+      std::string lower = name;
+      for (char& c : lower) c = tolower(c);
+      if (lower.compare(0, 4, "time") == 0) {
+        l.time_col = col;
+        l.time_to_ms = unitScale(name, time_units, time_scales, 3);
+      }
+      else if (lower.compare(0, 7, "current") == 0) {
+        l.current_col = col;
+        l.current_to_ua = unitScale(name, cur_units, cur_scales, 4);
+      }
+      else if (name == "D0-D7")   l.digital_col = col;
+      else if (name == "D0")      l.digital_first = col;
+      name.clear();
+      col++;
+      if (p == end || *p != ',') break;
+    }
+    else if (*p != '"') {
+      name += *p;
+    }
+  }
+
+  if (l.time_col < 0 || l.current_col < 0) { error = "no time/current columns in header"; return false; }
+  if (l.time_to_ms == 0 || l.current_to_ua == 0) { error = "unknown time/current unit in header"; return false; }
+  return true;
+}
+
+// Plain decimals with optional sign and exponent; strtod is several times slower
+static const char* parseNumber(const char* p, const char* end, double& out) {
+  bool neg = false;
+  if (p < end && (*p == '-' || *p == '+')) neg = *p++ == '-';
+  double v = 0;
+  while (p < end && *p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+  if (p < end && *p == '.') {
+    double scale = 0.1;
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++, scale *= 0.1) v += (*p - '0') * scale;
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    const char* q = p + 1;
+    bool eneg = false;
+    if (q < end && (*q == '-' || *q == '+')) eneg = *q++ == '-';
+    int e = 0;
+    while (q < end && *q >= '0' && *q <= '9') e = e * 10 + (*q++ - '0');
+    v *= pow(10.0, eneg ? -e : e);
+    p = q;
+  }
+  out = neg ? -v : v;
+  return p;
+}
+
+struct Sample {
+  double time_ms;
+  double current_ua;
+  uint8_t digital;
+};
+
+// One line; false for anything that isn't a sample (blank, repeated header)
+static bool parseLine(const char* p, const char* end, const CsvLayout& l, Sample& s) {
+  s.digital = 0;
+  bool have_time = false, have_current = false;
+  for (int col = 0; p < end; col++) {
+    if (col == l.time_col)          { p = parseNumber(p, end, s.time_ms); have_time = true; }
+    else if (col == l.current_col)  { p = parseNumber(p, end, s.current_ua); have_current = true; }
+    else if (col == l.digital_col) {
+      for (int bit = 0; p < end && (*p == '0' || *p == '1'); p++, bit++) {
+        if (*p == '1' && bit < 8) s.digital |= 1 << bit;
+      }
+    }
+    else if (l.digital_first >= 0 && col >= l.digital_first && col < l.digital_first + 8) {
+      if (p < end && *p == '1') s.digital |= 1 << (col - l.digital_first);
+    }
+    while (p < end && *p != ',') p++;
+    if (p < end) p++;
+  }
+  if (!have_time || !have_current) return false;
+  s.time_ms *= l.time_to_ms;
+  s.current_ua *= l.current_to_ua;
+  return true;
+}
+
+static const char* nextLine(const char* p, const char* end) {
+  const char* nl = (const char*) memchr(p, '\n', end - p);
+  return nl ? nl + 1 : end;
+}
+
+static const char* lineEnd(const char* p, const char* end) {
+  const char* nl = (const char*) memchr(p, '\n', end - p);
+  if (!nl) nl = end;
+  if (nl > p && nl[-1] == '\r') nl--;
+  return nl;
+}
+
+// ---------------------------------------------------------------------------
+// Accumulation
+
+struct Acc {
+  uint64_t n = 0;
+  double   sum_ua = 0;
+};
+
+struct ChunkResult {
+  std::vector<Acc> states;
+  std::vector<Acc> presses;
+  Acc unassigned;           // before the boot's first record
+  uint64_t samples = 0;
+  uint64_t bad_lines = 0;
+  double first_ms = INFINITY;
+  double last_ms = -INFINITY;
+};
+
+static void analyzeChunk(const char* p, const char* end, const CsvLayout& l, const Timeline& tl,
+                         double offset_ms, double press_ms, ChunkResult& r) {
+  r.states.resize(tl.states.size());
+  r.presses.resize(tl.presses.size());
+
+  size_t seg = 0, press = 0;
+  bool positioned = false;
+
+  for (; p < end; p = nextLine(p, end)) {
+    Sample s;
+    if (!parseLine(p, lineEnd(p, end), l, s)) { r.bad_lines++; continue; }
+    r.samples++;
+    r.first_ms = std::min(r.first_ms, s.time_ms);
+    r.last_ms = std::max(r.last_ms, s.time_ms);
+
+    double t = s.time_ms + offset_ms;      // journal uptime
+    if (!positioned) {
+      // Chunks start anywhere; after this, time only moves forward
+      auto segIt = std::upper_bound(tl.segments.begin(), tl.segments.end(), t,
+                                    [](double v, const Segment& g) { return v < g.start_ms; });
+      seg = segIt == tl.segments.begin() ? 0 : segIt - tl.segments.begin() - 1;
+      auto prIt = std::lower_bound(tl.presses.begin(), tl.presses.end(), t - press_ms,
+                                   [](const Press& x, double v) { return x.start_ms < v; });
+      press = prIt - tl.presses.begin();
+      positioned = true;
+    }
+    while (seg + 1 < tl.segments.size() && tl.segments[seg + 1].start_ms <= t) seg++;
+    while (press < tl.presses.size() && tl.presses[press].start_ms + press_ms <= t) press++;
+
+    if (t < tl.segments[0].start_ms) {
+      r.unassigned.n++;
+      r.unassigned.sum_ua += s.current_ua;
+    }
+    else if (press < tl.presses.size() && tl.presses[press].start_ms <= t) {
+      r.presses[press].n++;
+      r.presses[press].sum_ua += s.current_ua;
+    }
+    else {
+      Acc& a = r.states[tl.segments[seg].state];
+      a.n++;
+      a.sum_ua += s.current_ua;
+    }
+  }
+}
+
+// First rising edge on a digital channel, in capture time; <0 if none
+static double firstEdge(const char* p, const char* end, const CsvLayout& l, int channel) {
+  bool prev = true;           // a line already high at the start isn't an edge
+  bool first = true;
+  for (; p < end; p = nextLine(p, end)) {
+    Sample s;
+    if (!parseLine(p, lineEnd(p, end), l, s)) continue;
+    bool high = s.digital & (1 << channel);
+    if (high && !prev && !first) return s.time_ms;
+    prev = high;
+    first = false;
+  }
+  return -1;
+}
+
+// ---------------------------------------------------------------------------
+// Fit and output
+
+struct StateResult {
+  std::string name;
+  StateKey key;
+  double seconds;
+  double avg_ua;
+  uint64_t samples;
+};
+
+struct DongleResult {       // a state with the dongle listening vs. the same without
+  std::string name;
+  double added_ua;
+  double seconds;           // the shorter of the two
+};
+
+struct Fit {
+  std::vector<StateResult> states;
+  std::vector<DongleResult> dongle;
+  uint32_t presses_plain = 0, presses_led = 0;
+  double excess_plain_uc = 0, excess_led_uc = 0;   // mean per press
+  double capture_s = 0;
+  double unassigned_s = 0;
+  uint64_t samples = 0, bad_lines = 0;
+};
+
+static Fit fit(const Timeline& tl, const ChunkResult& total, double press_ms) {
+  Fit f;
+  f.samples = total.samples;
+  f.bad_lines = total.bad_lines;
+  double period_s = total.samples > 1 ? (total.last_ms - total.first_ms) / 1000 / (total.samples - 1) : 0;
+  f.capture_s = period_s * total.samples;
+  f.unassigned_s = period_s * total.unassigned.n;
+
+  std::vector<double> avg(tl.states.size(), 0);
+  for (size_t i = 0; i < tl.states.size(); i++) {
+    const Acc& a = total.states[i];
+    if (!a.n) continue;
+    avg[i] = a.sum_ua / a.n;
+    f.states.push_back({ stateName(tl.states[i]), tl.states[i], a.n * period_s, avg[i], a.n });
+  }
+  std::sort(f.states.begin(), f.states.end(),
+            [](const StateResult& a, const StateResult& b) { return a.key < b.key; });
+
+  for (const StateResult& on : f.states) {
+    if (!on.key.dongle) continue;
+    StateKey off_key = on.key;
+    off_key.dongle = 0;
+    for (const StateResult& off : f.states) {
+      if (off.key < off_key || off_key < off.key) continue;
+      f.dongle.push_back({ on.name, on.avg_ua - off.avg_ua, std::min(on.seconds, off.seconds) });
+    }
+  }
+
+  // Charge above the state the press happened in, over the press window
+  double sum_plain = 0, sum_led = 0;
+  for (size_t i = 0; i < tl.presses.size(); i++) {
+    const Acc& a = total.presses[i];
+    if (!a.n || !total.states[tl.presses[i].state].n) continue;
+    double excess_uc = (a.sum_ua / a.n - avg[tl.presses[i].state]) * press_ms / 1000;
+    if (tl.presses[i].led) { sum_led += excess_uc; f.presses_led++; }
+    else                   { sum_plain += excess_uc; f.presses_plain++; }
+  }
+  if (f.presses_plain) f.excess_plain_uc = sum_plain / f.presses_plain;
+  if (f.presses_led) f.excess_led_uc = sum_led / f.presses_led;
+  return f;
+}
+
+static EnergyCalib calibFrom(const Fit& f) {
+  EnergyCalib c;
+  memset(&c, 0, sizeof(c));
+  c.magic = CALIB_MAGIC;
+  c.version = CALIB_VERSION;
+  c.levels = CALIB_LEVELS;
+  c.size = sizeof(c);
+  c.capture_s = (uint32_t) f.capture_s;
+
+  // Connected: time-weighted over whatever intervals the phones picked
+  double adv_s[CALIB_LEVELS] = {}, adv_q[CALIB_LEVELS] = {};
+  double conn_s[CALIB_LEVELS] = {}, conn_q[CALIB_LEVELS] = {};
+  for (const StateResult& s : f.states) {
+    if (s.key.usb || s.key.dongle || s.key.level >= CALIB_LEVELS) continue;   // dongle comes on top
+    double* secs = s.key.connected ? conn_s : adv_s;
+    double* q = s.key.connected ? conn_q : adv_q;
+    secs[s.key.level] += s.seconds;
+    q[s.key.level] += s.seconds * s.avg_ua;
+  }
+  for (int i = 0; i < CALIB_LEVELS; i++) {
+    if (adv_s[i] > 0) c.adv_ua[i] = (uint32_t) lround(std::max(1.0, adv_q[i] / adv_s[i]));
+    if (conn_s[i] > 0) c.conn_ua[i] = (uint32_t) lround(std::max(1.0, conn_q[i] / conn_s[i]));
+  }
+
+  // With only LED-on presses captured, the LED can't be told apart
+  if (f.presses_plain) {
+    c.press_uc = (uint32_t) lround(std::max(1.0, f.excess_plain_uc));
+    if (f.presses_led) c.led_uc = (uint32_t) lround(std::max(0.0, f.excess_led_uc - f.excess_plain_uc));
+  }
+  else if (f.presses_led) {
+    c.press_uc = (uint32_t) lround(std::max(1.0, f.excess_led_uc));
+  }
+  return c;
+}
+
+static void printCsv(const Fit& f) {
+  printf("state,seconds,avg_ua,charge_mc,samples\n");
+  for (const StateResult& s : f.states) {
+    printf("%s,%.3f,%.1f,%.3f,%llu\n", s.name.c_str(), s.seconds, s.avg_ua,
+           s.avg_ua * s.seconds / 1000, (unsigned long long) s.samples);
+  }
+  printf("\nevent,count,excess_uc\n");
+  printf("press,%u,%.1f\n", f.presses_plain, f.excess_plain_uc);
+  printf("press_led,%u,%.1f\n", f.presses_led, f.excess_led_uc);
+  if (f.dongle.empty()) return;
+  printf("\ndongle added,seconds,added_ua\n");
+  for (const DongleResult& d : f.dongle) printf("%s,%.3f,%.1f\n", d.name.c_str(), d.seconds, d.added_ua);
+}
+
+static void printJson(const Fit& f) {
+  printf("{\"capture_s\": %.3f, \"unassigned_s\": %.3f, \"samples\": %llu, \"bad_lines\": %llu,\n",
+         f.capture_s, f.unassigned_s, (unsigned long long) f.samples, (unsigned long long) f.bad_lines);
+  printf(" \"states\": [\n");
+  for (size_t i = 0; i < f.states.size(); i++) {
+    const StateResult& s = f.states[i];
+    printf("  {\"state\": \"%s\", \"seconds\": %.3f, \"avg_ua\": %.1f, \"charge_mc\": %.3f, \"samples\": %llu}%s\n",
+           s.name.c_str(), s.seconds, s.avg_ua, s.avg_ua * s.seconds / 1000,
+           (unsigned long long) s.samples, i + 1 < f.states.size() ? "," : "");
+  }
+  printf(" ],\n \"dongle_added\": [\n");
+  for (size_t i = 0; i < f.dongle.size(); i++) {
+    const DongleResult& d = f.dongle[i];
+    printf("  {\"state\": \"%s\", \"seconds\": %.3f, \"added_ua\": %.1f}%s\n",
+           d.name.c_str(), d.seconds, d.added_ua, i + 1 < f.dongle.size() ? "," : "");
+  }
+  printf(" ],\n \"events\": {\"press\": {\"count\": %u, \"excess_uc\": %.1f}, "
+         "\"press_led\": {\"count\": %u, \"excess_uc\": %.1f}}}\n",
+         f.presses_plain, f.excess_plain_uc, f.presses_led, f.excess_led_uc);
+}
+
+static void usage() {
+  fprintf(stderr, "usage: power_profile_analyzer --journal JOURNAL.BIN (--offset-ms MS | --sync Dn)\n"
+                  "         [--boot N] [--press-ms MS] [--json] [--calib CALIB.BIN] [-j threads] CAPTURE.csv\n");
+}
+
+int main(int argc, char** argv) {
+  const char* journal = nullptr;
+  const char* capture = nullptr;
+  const char* calib_path = nullptr;
+  bool json = false;
+  bool have_offset = false;
+  double offset_ms = 0;
+  double press_ms = PRESS_MS;
+  int sync = -1;
+  int boot = -1;
+  unsigned threads = std::thread::hardware_concurrency();
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--json"))                               json = true;
+    else if (!strcmp(argv[i], "--csv"))                           json = false;
+    else if (!strcmp(argv[i], "--journal") && i + 1 < argc)       journal = argv[++i];
+    else if (!strcmp(argv[i], "--calib") && i + 1 < argc)         calib_path = argv[++i];
+    else if (!strcmp(argv[i], "--boot") && i + 1 < argc)          boot = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--press-ms") && i + 1 < argc)      press_ms = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--offset-ms") && i + 1 < argc)     { offset_ms = atof(argv[++i]); have_offset = true; }
+    else if (!strcmp(argv[i], "--sync") && i + 1 < argc && argv[i + 1][0] == 'D') sync = atoi(argv[++i] + 1);
+    else if (!strcmp(argv[i], "-j") && i + 1 < argc)              threads = atoi(argv[++i]);
+    else if (argv[i][0] == '-' || capture)                        { usage(); return 2; }
+    else                                                          capture = argv[i];
+  }
+  if (!journal || !capture || have_offset == (sync >= 0) || sync > 7 || press_ms <= 0) {
+    usage();
+    return 2;
+  }
+  if (threads == 0) threads = 1;
+
+  Timeline tl;
+  std::string error;
+  if (!buildTimeline(journal, boot, tl, error)) {
+    fprintf(stderr, "%s: %s\n", journal, error.c_str());
+    return 1;
+  }
+
+  MappedFile f(capture);
+  if (!f.data()) {
+    fprintf(stderr, "%s: can't read\n", capture);
+    return 1;
+  }
+  const char* begin = (const char*) f.data();
+  const char* end = begin + f.size();
+
+  CsvLayout layout;
+  if (!parseHeader(begin, lineEnd(begin, end), layout, error)) {
+    fprintf(stderr, "%s: %s\n", capture, error.c_str());
+    return 1;
+  }
+  const char* body = nextLine(begin, end);
+
+  if (sync >= 0) {
+    if (layout.digital_col < 0 && layout.digital_first < 0) {
+      fprintf(stderr, "%s: no digital channels for --sync\n", capture);
+      return 1;
+    }
+    double edge = firstEdge(body, end, layout, sync);
+    if (edge < 0 || tl.first_press_uptime_ms < 0) {
+      fprintf(stderr, "--sync: no rising edge on D%d or no press in the journal\n", sync);
+      return 1;
+    }
+    offset_ms = tl.first_press_uptime_ms - edge;
+  }
+
+  // Line-aligned chunks; samples are moved to journal time with the offset
+  std::vector<std::pair<const char*, const char*>> chunks;
+  for (const char* p = body; p < end; ) {
+    const char* q = p + std::min<size_t>(CHUNK_BYTES, end - p);
+    if (q < end) q = nextLine(q, end);
+    chunks.emplace_back(p, q);
+    p = q;
+  }
+  std::vector<ChunkResult> results(chunks.size());
+  if (threads > chunks.size()) threads = std::max<size_t>(1, chunks.size());
+
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; t++) {
+    workers.emplace_back([&]() {
+      for (size_t i; (i = next++) < chunks.size(); ) {
+        analyzeChunk(chunks[i].first, chunks[i].second, layout, tl, offset_ms, press_ms, results[i]);
+      }
+    });
+  }
+  for (std::thread& w : workers) w.join();
+
+  ChunkResult total;
+  total.states.resize(tl.states.size());
+  total.presses.resize(tl.presses.size());
+  for (const ChunkResult& r : results) {
+    for (size_t i = 0; i < r.states.size(); i++) {
+      total.states[i].n += r.states[i].n;
+      total.states[i].sum_ua += r.states[i].sum_ua;
+    }
+    for (size_t i = 0; i < r.presses.size(); i++) {
+      total.presses[i].n += r.presses[i].n;
+      total.presses[i].sum_ua += r.presses[i].sum_ua;
+    }
+    total.unassigned.n += r.unassigned.n;
+    total.unassigned.sum_ua += r.unassigned.sum_ua;
+    total.samples += r.samples;
+    total.bad_lines += r.bad_lines;
+    total.first_ms = std::min(total.first_ms, r.first_ms);
+    total.last_ms = std::max(total.last_ms, r.last_ms);
+  }
+  if (!total.samples) {
+    fprintf(stderr, "%s: no samples\n", capture);
+    return 1;
+  }
+
+  Fit result = fit(tl, total, press_ms);
+  if (json) printJson(result);
+  else printCsv(result);
+
+  if (calib_path) {
+    EnergyCalib c = calibFrom(result);
+    FILE* out = fopen(calib_path, "wb");
+    if (!out || fwrite(&c, sizeof(c), 1, out) != 1) {
+      fprintf(stderr, "%s: can't write\n", calib_path);
+      if (out) fclose(out);
+      return 1;
+    }
+    fclose(out);
+  }
+  return 0;
+}